@@ -37,6 +37,7 @@
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_blas.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "cell.h"
 #include "cell-utils.h"
@@ -1522,17 +1523,22 @@ int compare_permuted_cell_parameters_and_orientation(UnitCell *cell,
 	for ( i[8]=-1; i[8]<=+1; i[8]++ ) {
 
 		UnitCell *nc;
+		IntegerMatrix3 m3;
 		int j, k;
 		int l = 0;
 		signed int det;
 
 		for ( j=0; j<3; j++ )
 			for ( k=0; k<3; k++ )
-				intmat_set(m, j, k, i[l++]);
+				intmat3_set(&m3, j, k, i[l++]);
 
-		det = intmat_det(m);
+		det = intmat3_det(m3);
 		if ( (det != +1) && (det != -1) ) continue;
 
+		for ( j=0; j<3; j++ )
+			for ( k=0; k<3; k++ )
+				intmat_set(m, j, k, intmat3_get(m3, j, k));
+
 		nc = cell_transform_intmat(cell, m);
 
 		if ( compare_cell_parameters_and_orientation(nc, reference,
@@ -1705,8 +1711,10 @@ int compare_derivative_cell_parameters(UnitCell *cell_in, UnitCell *reference_in
 	UnitCell *cell;
 	UnitCell *reference;
 	IntegerMatrix *CBint;
-	RationalMatrix *CiA;
-	RationalMatrix *CB;
+	RationalMatrix *CiAheap;
+	IntegerMatrix3 CBint3;
+	RationalMatrix3 CiA;
+	RationalMatrix3 CB;
 	RationalMatrix *M;
 	double a, b, c, al, be, ga;
 	double av[3], bv[3], cv[3];
@@ -1715,18 +1723,22 @@ int compare_derivative_cell_parameters(UnitCell *cell_in, UnitCell *reference_in
 	Rational *cand_c;
 	int ncand_a, ncand_b, ncand_c;
 	int ia, ib;
-	RationalMatrix *CiAMCB = NULL;
+	RationalMatrix3 CiAMCB;
+	int found = 0;
 	double min_dist = +INFINITY;
 
 	/* Actually compare against primitive version of reference */
 	reference = uncenter_cell(reference_in, &CBint, NULL);
 	if ( reference == NULL ) return 0;
-	CB = rtnl_mtx_from_intmat(CBint);
+	intmat3_from_intmat(CBint, &CBint3);
+	CB = rtnl_mtx3_from_intmat3(CBint3);
 	intmat_free(CBint);
 
 	/* Actually compare primitive version of cell */
-	cell = uncenter_cell(cell_in, NULL, &CiA);
+	cell = uncenter_cell(cell_in, NULL, &CiAheap);
 	if ( cell == NULL ) return 0;
+	rtnl_mtx3_from_rtnl_mtx(CiAheap, &CiA);
+	rtnl_mtx_free(CiAheap);
 
 	/* Get target parameters */
 	cell_get_parameters(reference, &a, &b, &c, &al, &be, &ga);
@@ -1743,8 +1755,6 @@ int compare_derivative_cell_parameters(UnitCell *cell_in, UnitCell *reference_in
 		*pmb = NULL;
 		cell_free(cell);
 		cell_free(reference);
-		rtnl_mtx_free(CB);
-		rtnl_mtx_free(CiA);
 		return 0;
 	}
 
@@ -1756,7 +1766,6 @@ int compare_derivative_cell_parameters(UnitCell *cell_in, UnitCell *reference_in
 			double at, bt, ct, alt, bet, gat;
 			double dist;
 			int ic = 0;
-			RationalMatrix *MCB;
 
 			/* Form the matrix using the first candidate for c */
 			rtnl_mtx_set(M, 0, 0, cand_a[3*ia+0]);
@@ -1810,10 +1819,18 @@ int compare_derivative_cell_parameters(UnitCell *cell_in, UnitCell *reference_in
 
 				dist = g6_distance(test, reference);
 				if ( dist < min_dist ) {
+					RationalMatrix3 M3, MCB;
 					min_dist = dist;
-					MCB = rtnlmtx_times_rtnlmtx(M, CB);
-					CiAMCB = rtnlmtx_times_rtnlmtx(CiA, MCB);
-					rtnl_mtx_free(MCB);
+					rtnl_mtx3_from_rtnl_mtx(M, &M3);
+					if ( rtnl_mtx3_times_rtnl_mtx3(&M3, &CB, &MCB)
+					  || rtnl_mtx3_times_rtnl_mtx3(&CiA, &MCB,
+					                               &CiAMCB) )
+					{
+						ERROR("Overflow in cell "
+						      "transformation.\n");
+					} else {
+						found = 1;
+					}
 				}
 
 				cell_free(test);
@@ -1827,13 +1844,13 @@ int compare_derivative_cell_parameters(UnitCell *cell_in, UnitCell *reference_in
 	free(cand_b);
 	free(cand_c);
 
-	if ( CiAMCB == NULL ) {
+	if ( !found ) {
 		*pmb = NULL;
 		return 0;
 	}
 
 	/* Solution found */
-	*pmb = CiAMCB;
+	*pmb = rtnl_mtx_from_rtnl_mtx3(&CiAMCB);
 	return 1;
 }
 
@@ -1941,19 +1958,12 @@ static void debug_lattice(struct g6 g, double eps, int step)
 }
 
 
-static void mult_in_place(IntegerMatrix *T, IntegerMatrix *M)
+static void mult_in_place(IntegerMatrix3 *T, IntegerMatrix3 M)
 {
-	int i, j;
-	IntegerMatrix *tmp = intmat_times_intmat(T, M);
-	assert(intmat_det(M) == 1);
-	assert(intmat_det(T) == 1);
-	assert(intmat_det(tmp) == 1);
-	for ( i=0; i<3; i++ ) {
-		for ( j=0; j<3; j++ ) {
-			intmat_set(T, i, j, intmat_get(tmp, i, j));
-		}
-	}
-	intmat_free(tmp);
+	assert(intmat3_det(M) == 1);
+	assert(intmat3_det(*T) == 1);
+	*T = intmat3_times_intmat3(*T, M);
+	assert(intmat3_det(*T) == 1);
 }
 
 
@@ -1970,16 +1980,15 @@ static double g6_volume(struct g6 g)
  * re-calculate the G6 vector, if required. */
 IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 {
-	IntegerMatrix *T;
-	IntegerMatrix *M;
+	IntegerMatrix3 T;
+	IntegerMatrix3 M;
 	int finished;
 	double eps;
 
 	eps = pow(g6_volume(g), 1.0/3.0) * epsrel;
 	eps = eps*eps;
 
-	T = intmat_identity(3);
-	M = intmat_new(3, 3);
+	T = intmat3_identity();
 
 	debug_lattice(g, eps, 0);
 
@@ -1998,11 +2007,11 @@ IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 				temp = g.A; g.A = g.B;  g.B = temp;
 				temp = g.D; g.D = g.E;  g.E = temp;
 
-				intmat_zero(M);
-				intmat_set(M, 1, 0, -1);
-				intmat_set(M, 0, 1, -1);
-				intmat_set(M, 2, 2, -1);
-				mult_in_place(T, M);
+				M = intmat3_zero();
+				intmat3_set(&M, 1, 0, -1);
+				intmat3_set(&M, 0, 1, -1);
+				intmat3_set(&M, 2, 2, -1);
+				mult_in_place(&T, M);
 
 				debug_lattice(g, eps, 1);
 
@@ -2016,11 +2025,11 @@ IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 				temp = g.B; g.B = g.C;  g.C = temp;
 				temp = g.E; g.E = g.F;  g.F = temp;
 
-				intmat_zero(M);
-				intmat_set(M, 0, 0, -1);
-				intmat_set(M, 1, 2, -1);
-				intmat_set(M, 2, 1, -1);
-				mult_in_place(T, M);
+				M = intmat3_zero();
+				intmat3_set(&M, 0, 0, -1);
+				intmat3_set(&M, 1, 2, -1);
+				intmat3_set(&M, 2, 1, -1);
+				mult_in_place(&T, M);
 
 				debug_lattice(g, eps, 2);
 
@@ -2034,13 +2043,13 @@ IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 
 		if ( DEF_positive(g, eps) ) {
 
-			intmat_zero(M);
-			intmat_set(M, 0, 0, LT(g.D, 0.0) ? -1 : 1);
-			intmat_set(M, 1, 1, LT(g.E, 0.0) ? -1 : 1);
-			intmat_set(M, 2, 2, LT(g.F, 0.0) ? -1 : 1);
-			mult_in_place(T, M);
+			M = intmat3_zero();
+			intmat3_set(&M, 0, 0, LT(g.D, 0.0) ? -1 : 1);
+			intmat3_set(&M, 1, 1, LT(g.E, 0.0) ? -1 : 1);
+			intmat3_set(&M, 2, 2, LT(g.F, 0.0) ? -1 : 1);
+			mult_in_place(&T, M);
 
-			assert(intmat_det(M) == 1);
+			assert(intmat3_det(M) == 1);
 			g.D = fabs(g.D);
 			g.E = fabs(g.E);
 			g.F = fabs(g.F);
@@ -2074,11 +2083,11 @@ IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 				}
 				ijk[z] = -1;
 			}
-			intmat_zero(M);
-			intmat_set(M, 0, 0, ijk[0]);
-			intmat_set(M, 1, 1, ijk[1]);
-			intmat_set(M, 2, 2, ijk[2]);
-			mult_in_place(T, M);
+			M = intmat3_zero();
+			intmat3_set(&M, 0, 0, ijk[0]);
+			intmat3_set(&M, 1, 1, ijk[1]);
+			intmat3_set(&M, 2, 2, ijk[2]);
+			mult_in_place(&T, M);
 
 			g.D = -fabs(g.D);
 			g.E = -fabs(g.E);
@@ -2094,12 +2103,12 @@ IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 		{
 			signed int s = g.D > 0.0  ? 1 : -1;
 
-			intmat_zero(M);
-			intmat_set(M, 0, 0, 1);
-			intmat_set(M, 1, 1, 1);
-			intmat_set(M, 2, 2, 1);
-			intmat_set(M, 1, 2, -s);
-			mult_in_place(T, M);
+			M = intmat3_zero();
+			intmat3_set(&M, 0, 0, 1);
+			intmat3_set(&M, 1, 1, 1);
+			intmat3_set(&M, 2, 2, 1);
+			intmat3_set(&M, 1, 2, -s);
+			mult_in_place(&T, M);
 
 			g.C = g.B + g.C -s*g.D;
 			g.D = -2*s*g.B + g.D;
@@ -2113,12 +2122,12 @@ IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 		{
 			signed int s = g.E > 0.0  ? 1 : -1;
 
-			intmat_zero(M);
-			intmat_set(M, 0, 0, 1);
-			intmat_set(M, 1, 1, 1);
-			intmat_set(M, 2, 2, 1);
-			intmat_set(M, 0, 2, -s);
-			mult_in_place(T, M);
+			M = intmat3_zero();
+			intmat3_set(&M, 0, 0, 1);
+			intmat3_set(&M, 1, 1, 1);
+			intmat3_set(&M, 2, 2, 1);
+			intmat3_set(&M, 0, 2, -s);
+			mult_in_place(&T, M);
 
 			g.C = g.A + g.C -s*g.E;
 			g.D = g.D - s*g.F;
@@ -2132,12 +2141,12 @@ IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 		{
 			signed int s = g.F > 0.0  ? 1 : -1;
 
-			intmat_zero(M);
-			intmat_set(M, 0, 0, 1);
-			intmat_set(M, 1, 1, 1);
-			intmat_set(M, 2, 2, 1);
-			intmat_set(M, 0, 1, -s);
-			mult_in_place(T, M);
+			M = intmat3_zero();
+			intmat3_set(&M, 0, 0, 1);
+			intmat3_set(&M, 1, 1, 1);
+			intmat3_set(&M, 2, 2, 1);
+			intmat3_set(&M, 0, 1, -s);
+			mult_in_place(&T, M);
 
 			g.B = g.A + g.B -s*g.F;
 			g.D = g.D - s*g.E;
@@ -2149,12 +2158,12 @@ IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 		         || ( (EQ(g.A+g.B+g.D+g.E+g.F, 0.0)
 		               && GT(2.0*g.A + 2.0*g.E + g.F, 0.0)) ) )
 		{
-			intmat_zero(M);
-			intmat_set(M, 0, 0, 1);
-			intmat_set(M, 1, 1, 1);
-			intmat_set(M, 2, 2, 1);
-			intmat_set(M, 1, 2, 1);
-			mult_in_place(T, M);
+			M = intmat3_zero();
+			intmat3_set(&M, 0, 0, 1);
+			intmat3_set(&M, 1, 1, 1);
+			intmat3_set(&M, 2, 2, 1);
+			intmat3_set(&M, 1, 2, 1);
+			mult_in_place(&T, M);
 
 			g.C = g.A+g.B+g.C+g.D+g.E+g.F;
 			g.D = 2.0*g.B + g.D + g.F;
@@ -2173,21 +2182,7 @@ IntegerMatrix *reduce_g6(struct g6 g, double epsrel)
 	assert(is_burger(g, eps));
 	assert(is_niggli(g, eps));
 
-	intmat_free(M);
-	return T;
-}
-
-
-static double cell_diff(UnitCell *cell, double a, double b, double c,
-                        double al, double be, double ga)
-{
-	double ta, tb, tc, tal, tbe, tga;
-	double diff = 0.0;
-	cell_get_parameters(cell, &ta, &tb, &tc, &tal, &tbe, &tga);
-	diff += fabs(a - ta);
-	diff += fabs(b - tb);
-	diff += fabs(c - tc);
-	return diff;
+	return intmat_from_intmat3(T);
 }
 
 
@@ -2203,90 +2198,253 @@ static int random_int(int max)
 }
 
 
-static IntegerMatrix *check_permutations(UnitCell *cell_reduced, UnitCell *reference,
-                                         RationalMatrix *CiARA, IntegerMatrix *RiBCB,
-                                         const double *tols)
-{
-	IntegerMatrix *m;
-	int i[9];
-	double a, b, c, al, be, ga;
-	double min_dist = +INFINITY;
-	int s, sel;
-	IntegerMatrix *best_m[24];
-	int n_best = 0;
+/* Number of 3x3 matrices with elements -1, 0 or +1 and determinant +1 */
+#define N_UNIMODULAR (3480)
 
-	m = intmat_new(3, 3);
-	cell_get_parameters(reference, &a, &b, &c, &al, &be, &ga);
+static IntegerMatrix3 unimodular[N_UNIMODULAR];
+static pthread_once_t unimodular_once = PTHREAD_ONCE_INIT;
 
-	for ( i[0]=-1; i[0]<=+1; i[0]++ ) {
-	for ( i[1]=-1; i[1]<=+1; i[1]++ ) {
-	for ( i[2]=-1; i[2]<=+1; i[2]++ ) {
-	for ( i[3]=-1; i[3]<=+1; i[3]++ ) {
-	for ( i[4]=-1; i[4]<=+1; i[4]++ ) {
-	for ( i[5]=-1; i[5]<=+1; i[5]++ ) {
-	for ( i[6]=-1; i[6]<=+1; i[6]++ ) {
-	for ( i[7]=-1; i[7]<=+1; i[7]++ ) {
-	for ( i[8]=-1; i[8]<=+1; i[8]++ ) {
 
-		UnitCell *nc;
-		int j, k;
-		int l = 0;
+/* Fills in the table of matrices to be tried by check_permutations(), in the
+ * same order as nine nested loops from -1 to +1 */
+static void make_unimodular_table(void)
+{
+	int n = 0;
+	int v;
+
+	for ( v=0; v<19683; v++ ) {
+
+		int i[9];
+		int j, r;
 		signed int det;
-		UnitCell *tmp;
 
-		for ( j=0; j<3; j++ )
-			for ( k=0; k<3; k++ )
-				intmat_set(m, j, k, i[l++]);
+		r = v;
+		for ( j=8; j>=0; j-- ) {
+			i[j] = (r % 3) - 1;
+			r /= 3;
+		}
 
-		det = intmat_det(m);
+		det = i[0]*(i[4]*i[8] - i[5]*i[7])
+		    - i[1]*(i[3]*i[8] - i[5]*i[6])
+		    + i[2]*(i[3]*i[7] - i[4]*i[6]);
 		if ( det != +1 ) continue;
 
-		tmp = cell_transform_intmat(cell_reduced, m);
-		nc = cell_transform_intmat(tmp, RiBCB);
-		cell_free(tmp);
+		assert(n < N_UNIMODULAR);
+		for ( j=0; j<9; j++ ) intmat3_set(&unimodular[n], j/3, j%3, i[j]);
+		n++;
 
-		if ( compare_cell_parameters(nc, reference, tols) ) {
-			double dist = cell_diff(nc, a, b, c, al, be, ga);
-			if ( dist < min_dist ) {
+	}
 
-				/* If the new solution is significantly better,
-				 * dump all the previous ones */
-				for ( s=0; s<n_best; s++ ) {
-					intmat_free(best_m[s]);
-				}
-				min_dist = dist;
-				best_m[0] = intmat_copy(m);
-				n_best = 1;
-
-			} else if ( dist == min_dist ) {
-
-				if ( n_best == 24 ) {
-					ERROR("WARNING: Too many equivalent "
-					      "reindexed lattices\n");
-				} else {
-					/* If the new solution is the same as the
-					* previous one, add it to the list */
-					best_m[n_best++] = intmat_copy(m);
-				}
+	assert(n == N_UNIMODULAR);
+}
 
-			}
-		}
 
-		cell_free(nc);
+/**
+ * Opaque data structure representing a reference cell which has been prepared
+ * for comparison with many other cells.
+ */
+struct _preparedreference
+{
+	UnitCell *reference;
+	double a, b, c, al, be, ga;
+	IntegerMatrix *RiBCB;
+	IntegerMatrix3 RiBCB3;
+};
 
+
+/**
+ * \param reference: A UnitCell
+ *
+ * Does the part of the work of \ref compare_reindexed_cell_parameters which
+ * depends only on the reference cell, i.e. un-centering and reducing it.  Use
+ * this if many cells will be compared with the same reference cell.
+ *
+ * \returns A newly allocated \ref PreparedReference, or NULL on error.
+ */
+PreparedReference *prepare_reference_cell(UnitCell *reference)
+{
+	PreparedReference *ref;
+	UnitCell *uncentered;
+	IntegerMatrix *CB;
+	IntegerMatrix *RB;
+	IntegerMatrix *RiB;
+
+	pthread_once(&unimodular_once, make_unimodular_table);
+
+	ref = malloc(sizeof(struct _preparedreference));
+	if ( ref == NULL ) return NULL;
+
+	/* Un-center, then convert to reduced basis (stably) */
+	uncentered = uncenter_cell(reference, &CB, NULL);
+	if ( uncentered == NULL ) {
+		free(ref);
+		return NULL;
 	}
+	RB = reduce_g6(cell_get_G6(uncentered), 1e-5);
+	cell_free(uncentered);
+
+	RiB = intmat_inverse(RB);
+	ref->RiBCB = intmat_times_intmat(RiB, CB);
+	intmat_free(RiB);
+	intmat_free(RB);
+	intmat_free(CB);
+
+	intmat3_from_intmat(ref->RiBCB, &ref->RiBCB3);
+
+	ref->reference = cell_new_from_cell(reference);
+	cell_get_parameters(reference, &ref->a, &ref->b, &ref->c,
+	                    &ref->al, &ref->be, &ref->ga);
+
+	return ref;
+}
+
+
+/**
+ * \param ref: A \ref PreparedReference
+ *
+ * Frees \p ref.
+ */
+void prepared_reference_free(PreparedReference *ref)
+{
+	if ( ref == NULL ) return;
+	cell_free(ref->reference);
+	intmat_free(ref->RiBCB);
+	free(ref);
+}
+
+
+/**
+ * \param ref: A \ref PreparedReference
+ *
+ * \returns The reference cell from which \p ref was prepared.  The cell
+ * belongs to \p ref, and must not be freed or modified.
+ */
+UnitCell *prepared_reference_cell(PreparedReference *ref)
+{
+	return ref->reference;
+}
+
+
+static void metric_tensor(UnitCell *cell, double G[3][3])
+{
+	double v[3][3];
+	int i, j;
+
+	cell_get_cartesian(cell, &v[0][0], &v[0][1], &v[0][2],
+	                         &v[1][0], &v[1][1], &v[1][2],
+	                         &v[2][0], &v[2][1], &v[2][2]);
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			G[i][j] = v[i][0]*v[j][0] + v[i][1]*v[j][1]
+			        + v[i][2]*v[j][2];
+		}
 	}
-	}
-	}
-	}
-	}
-	}
-	}
+}
+
+
+static double metric_angle(double G[3][3], int i, int j)
+{
+	double cosine = G[i][j] / sqrt(G[i][i]*G[j][j]);
+	if ( cosine > 1.0 ) cosine = 1.0;
+	if ( cosine < -1.0 ) cosine = -1.0;
+	return acos(cosine);
+}
+
+
+/* Checks the cell with metric tensor G, transformed by unimodular matrix 'm'
+ * and then by RiBCB, against the reference.  Equivalent to transforming the
+ * cell (twice) and calling compare_cell_parameters(), apart from the
+ * centering, but without making any new UnitCells.  Returns 1 if the cell
+ * matches, and puts the total absolute error in axis lengths in *pdist */
+static int check_candidate(double G[3][3], IntegerMatrix3 m,
+                           PreparedReference *ref, const double *tols,
+                           double *pdist)
+{
+	IntegerMatrix3 Q;
+	double Gn[3][3];
+	double a, b, c;
+	int i, j, k, l;
+
+	Q = intmat3_times_intmat3(m, ref->RiBCB3);
+
+	/* Metric tensor of new cell: transpose(Q).G.Q */
+	for ( i=0; i<3; i++ ) {
+		for ( j=i; j<3; j++ ) {
+			double t = 0.0;
+			for ( k=0; k<3; k++ ) {
+				for ( l=0; l<3; l++ ) {
+					t += intmat3_get(Q, k, i) * G[k][l]
+					   * intmat3_get(Q, l, j);
+				}
+			}
+			Gn[i][j] = t;
+			Gn[j][i] = t;
+		}
 	}
 
-	intmat_free(m);
+	a = sqrt(Gn[0][0]);
+	b = sqrt(Gn[1][1]);
+	c = sqrt(Gn[2][2]);
+
+	/* within_tolerance() takes a percentage */
+	if ( !within_tolerance(a, ref->a, tols[0]*100.0) ) return 0;
+	if ( !within_tolerance(b, ref->b, tols[1]*100.0) ) return 0;
+	if ( !within_tolerance(c, ref->c, tols[2]*100.0) ) return 0;
+	if ( fabs(metric_angle(Gn, 1, 2) - ref->al) > tols[3] ) return 0;
+	if ( fabs(metric_angle(Gn, 0, 2) - ref->be) > tols[4] ) return 0;
+	if ( fabs(metric_angle(Gn, 0, 1) - ref->ga) > tols[5] ) return 0;
+
+	*pdist = fabs(ref->a - a) + fabs(ref->b - b) + fabs(ref->c - c);
+	return 1;
+}
+
+
+/* Returns the index in unimodular[] of the best matrix, or -1 if none of
+ * them work */
+static int check_permutations(UnitCell *cell_reduced, PreparedReference *ref,
+                              const RationalMatrix3 *CiARA, const double *tols)
+{
+	double G[3][3];
+	double min_dist = +INFINITY;
+	int s, sel;
+	int best[24];
+	int n_best = 0;
 
-	if ( n_best == 0 ) return NULL;
+	metric_tensor(cell_reduced, G);
+
+	for ( s=0; s<N_UNIMODULAR; s++ ) {
+
+		double dist;
+
+		if ( !check_candidate(G, unimodular[s], ref, tols, &dist) ) {
+			continue;
+		}
+
+		if ( dist < min_dist ) {
+
+			/* If the new solution is significantly better,
+			 * dump all the previous ones */
+			min_dist = dist;
+			best[0] = s;
+			n_best = 1;
+
+		} else if ( dist == min_dist ) {
+
+			if ( n_best == 24 ) {
+				ERROR("WARNING: Too many equivalent "
+				      "reindexed lattices\n");
+			} else {
+				/* If the new solution is the same as the
+				* previous one, add it to the list */
+				best[n_best++] = s;
+			}
+
+		}
+
+	}
+
+	if ( n_best == 0 ) return -1;
 
 	sel = n_best;
 	if ( n_best == 1 ) {
@@ -2300,15 +2458,14 @@ static IntegerMatrix *check_permutations(UnitCell *cell_reduced, UnitCell *refer
 		 * original cell, choose that one */
 
 		for ( s=0; s<n_best; s++ ) {
-			RationalMatrix *tmp;
-			RationalMatrix *comb;
-			tmp = rtnlmtx_times_intmat(CiARA, best_m[s]);
-			comb = rtnlmtx_times_intmat(tmp, RiBCB);
-			if ( rtnl_mtx_is_identity(comb) ) {
+			RationalMatrix3 comb;
+			if ( rtnl_mtx3_times_intmat3(CiARA, unimodular[best[s]],
+			                             &comb) ) continue;
+			if ( rtnl_mtx3_times_intmat3(&comb, ref->RiBCB3,
+			                             &comb) ) continue;
+			if ( rtnl_mtx3_is_identity(&comb) ) {
 				sel = s;
 			}
-			rtnl_mtx_free(tmp);
-			rtnl_mtx_free(comb);
 		}
 
 	}
@@ -2319,12 +2476,94 @@ static IntegerMatrix *check_permutations(UnitCell *cell_reduced, UnitCell *refer
 		sel = random_int(n_best);
 	}
 
-	/* Free all the others */
-	for ( s=0; s<n_best; s++ ) {
-		if ( s != sel ) intmat_free(best_m[s]);
+	return best[sel];
+}
+
+
+/**
+ * \param cell_in: A UnitCell
+ * \param ref: A \ref PreparedReference
+ * \param tols: Pointer to tolerances for a,b,c (fractional), al,be,ga (radians)
+ * \param pmb: Place to store pointer to matrix, or NULL if not needed
+ *
+ * Does the same as \ref compare_reindexed_cell_parameters, using a reference
+ * cell which has been prepared using \ref prepare_reference_cell.
+ *
+ * \returns A newly allocated UnitCell, or NULL.
+ *
+ */
+UnitCell *compare_reindexed_cell_parameters_prepared(UnitCell *cell_in,
+                                                     PreparedReference *ref,
+                                                     const double *tols,
+                                                     RationalMatrix **pmb)
+{
+	UnitCell *cell;
+	RationalMatrix *CiAheap;
+	RationalMatrix3 CiA;
+	IntegerMatrix *RA;
+	IntegerMatrix3 RA3;
+	RationalMatrix3 CiARA;
+	int p;
+	UnitCell *cell_reduced;
+	UnitCell *match;
+	UnitCell *tmp;
+	int cen_ok;
+
+	cell = uncenter_cell(cell_in, NULL, &CiAheap);
+	if ( cell == NULL ) return NULL;
+	rtnl_mtx3_from_rtnl_mtx(CiAheap, &CiA);
+	rtnl_mtx_free(CiAheap);
+
+	/* Convert to reduced basis (stably) */
+	RA = reduce_g6(cell_get_G6(cell), 1e-5);
+	cell_reduced = cell_transform_intmat(cell, RA);
+	intmat3_from_intmat(RA, &RA3);
+	intmat_free(RA);
+	cell_free(cell);
+
+	/* The centering of the candidate cells does not depend on the
+	 * permutation, so check it just once */
+	tmp = cell_transform_intmat(cell_reduced, ref->RiBCB);
+	cen_ok = centering_equivalent(cell_get_centering(tmp),
+	                              cell_get_centering(ref->reference));
+	cell_free(tmp);
+
+	/* Within tolerance? */
+	p = -1;
+	if ( cen_ok && !rtnl_mtx3_times_intmat3(&CiA, RA3, &CiARA) ) {
+		p = check_permutations(cell_reduced, ref, &CiARA, tols);
+	}
+
+	match = NULL;
+	if ( p >= 0 ) {
+
+		RationalMatrix3 comb3;
+
+		/* Calculate combined matrix: CiA.RA.P.RiB.CB */
+		if ( rtnl_mtx3_times_intmat3(&CiARA, unimodular[p], &comb3)
+		  || rtnl_mtx3_times_intmat3(&comb3, ref->RiBCB3, &comb3) )
+		{
+			ERROR("Overflow in cell transformation.\n");
+
+		} else {
+
+			RationalMatrix *comb = rtnl_mtx_from_rtnl_mtx3(&comb3);
+
+			match = cell_transform_rational(cell_in, comb);
+
+			if ( pmb != NULL ) {
+				*pmb = comb;
+			} else {
+				rtnl_mtx_free(comb);
+			}
+
+		}
+
 	}
 
-	return best_m[sel];
+	cell_free(cell_reduced);
+
+	return match;
 }
 
 
@@ -2354,7 +2593,9 @@ static IntegerMatrix *check_permutations(UnitCell *cell_reduced, UnitCell *refer
  * e.g. the angles always being greater than 90 degrees.
  *
  * This is the right function to use for deciding if an indexing solution
- * matches a reference cell or not.
+ * matches a reference cell or not.  If many cells will be compared with the
+ * same reference, use \ref prepare_reference_cell and
+ * \ref compare_reindexed_cell_parameters_prepared instead.
  *
  * \returns A newly allocated UnitCell, or NULL.
  *
@@ -2364,94 +2605,14 @@ UnitCell *compare_reindexed_cell_parameters(UnitCell *cell_in,
                                             const double *tols,
                                             RationalMatrix **pmb)
 {
-	UnitCell *cell;
-	UnitCell *reference;
-	IntegerMatrix *CB;
-	RationalMatrix *CiA;
-	IntegerMatrix *RA;
-	IntegerMatrix *RB;
-	IntegerMatrix *RiB;
-	IntegerMatrix *P;
-	RationalMatrix *CiARA;
-	IntegerMatrix *RiBCB;
-	UnitCell *cell_reduced;
-	UnitCell *reference_reduced;
+	PreparedReference *ref;
 	UnitCell *match;
-	struct g6 g6cell;
-	struct g6 g6ref;
-
-	//STATUS("The input cell:\n");
-	//cell_print(cell_in);
 
-	//STATUS("The reference cell:\n");
-	//cell_print(reference_in);
-
-	/* Un-center both cells */
-	reference = uncenter_cell(reference_in, &CB, NULL);
-	if ( reference == NULL ) return NULL;
-
-	cell = uncenter_cell(cell_in, NULL, &CiA);
-	if ( cell == NULL ) return NULL;
-
-	/* Calculate G6 components for both */
-	g6cell = cell_get_G6(cell);
-	g6ref = cell_get_G6(reference);
-
-	/* Convert both to reduced basis (stably) */
-	RA = reduce_g6(g6cell, 1e-5);
-	//STATUS("------------------------------------------\n");
-	RB = reduce_g6(g6ref, 1e-5);
-
-	cell_reduced = cell_transform_intmat(cell, RA);
-
-	//STATUS("Reduced cell:\n");
-	//cell_print(cell_reduced);
-	//STATUS("Reduced reference:\n");
-	reference_reduced = cell_transform_intmat(reference, RB);
-	//cell_print(reference_reduced);
-
-	/* The primitive (non-reduced) cells are no longer needed */
-	cell_free(reference);
-	cell_free(cell);
-
-	/* Within tolerance? */
-	RiB = intmat_inverse(RB);
-	RiBCB = intmat_times_intmat(RiB, CB);
-	intmat_free(RiB);
-	CiARA = rtnlmtx_times_intmat(CiA, RA);
-	P = check_permutations(cell_reduced, reference_in, CiARA, RiBCB, tols);
-	if ( P != NULL ) {
-
-		RationalMatrix *tmp;
-		RationalMatrix *comb;
-
-		//STATUS("The best permutation matrix:\n");
-		//intmat_print(P);
-
-		/* Calculate combined matrix: CiA.RA.P.RiB.CB */
-		tmp = rtnlmtx_times_intmat(CiARA, P);
-		comb = rtnlmtx_times_intmat(tmp, RiBCB);
-		rtnl_mtx_free(tmp);
-
-		match = cell_transform_rational(cell_in, comb);
-		//STATUS("Original cell transformed to look like reference:\n");
-		//cell_print(match);
-
-		if ( pmb != NULL ) *pmb = comb;
-
-	} else {
-		match = NULL;
-	}
-
-	rtnl_mtx_free(CiARA);
-	rtnl_mtx_free(CiA);
-	intmat_free(RiBCB);
-	intmat_free(RA);
-	intmat_free(RB);
-	intmat_free(CB);
-	intmat_free(P);
-	cell_free(reference_reduced);
-	cell_free(cell_reduced);
+	ref = prepare_reference_cell(reference_in);
+	if ( ref == NULL ) return NULL;
 
+	match = compare_reindexed_cell_parameters_prepared(cell_in, ref,
+	                                                   tols, pmb);
+	prepared_reference_free(ref);
 	return match;
 }
@@ -44,6 +44,12 @@ extern "C" {
  * Unit cell utility functions.
  **/
 
+/**
+ * A reference cell which has been prepared for repeated use with
+ * \ref compare_reindexed_cell_parameters_prepared.
+ **/
+typedef struct _preparedreference PreparedReference;
+
 
 extern double resolution(UnitCell *cell,
                          signed int h, signed int k, signed int l);
@@ -102,6 +108,14 @@ extern UnitCell *compare_reindexed_cell_parameters(UnitCell *cell_in,
                                                    const double *tols,
                                                    RationalMatrix **pmb);
 
+extern PreparedReference *prepare_reference_cell(UnitCell *reference);
+extern void prepared_reference_free(PreparedReference *ref);
+extern UnitCell *prepared_reference_cell(PreparedReference *ref);
+extern UnitCell *compare_reindexed_cell_parameters_prepared(UnitCell *cell_in,
+                                                   PreparedReference *ref,
+                                                   const double *tols,
+                                                   RationalMatrix **pmb);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1033,6 +1033,242 @@ static int try_guess_panel(struct dt_badregion *bad, DataTemplate *dt)
 }
 
 
+static int separate_value_and_units(const char *from,
+                                    char **pvalue,
+                                    char **punits)
+{
+	char *sp;
+	char *fromcpy;
+	char *unitscpy;
+
+	if ( from == NULL ) return 1;
+
+	fromcpy = strdup(from);
+	if ( fromcpy == NULL ) return 1;
+
+	sp = strchr(fromcpy, ' ');
+	if ( sp == NULL ) {
+		unitscpy = NULL;
+	} else {
+		unitscpy = strdup(sp+1);
+		sp[0] = '\0';
+	}
+
+	*pvalue = fromcpy;
+	*punits = unitscpy;
+	return 0;
+}
+
+
+/* default_scale is a value to be used if both of the following
+ * conditions are met:
+ *
+ *  1. The value is a reference to image headers/metadata,
+ *      rather than a literal number.
+ *  2. No units are specified in the number.
+ *
+ * This is totally horrible.  Sorry.  Blame history.
+ */
+static void parse_length(struct dt_length *len, const char *from,
+                         double default_scale)
+{
+	char *value_str;
+	char *units;
+	double scale;
+
+	len->from = strdup(from);
+	len->header = NULL;
+	len->value = NAN;
+	len->scale = 1.0;
+	len->default_scale = default_scale;
+	len->invalid = 1;
+
+	if ( separate_value_and_units(from, &value_str, &units) ) return;
+
+	if ( units == NULL ) {
+		scale = default_scale;
+	} else if ( strcmp(units, "mm") == 0 ) {
+		scale = 1e-3;
+	} else if ( strcmp(units, "m") == 0 ) {
+		scale = 1.0;
+	} else {
+		ERROR("Invalid length unit '%s'\n", units);
+		free(value_str);
+		free(units);
+		return;
+	}
+
+	if ( convert_float(value_str, &len->value) == 0 ) {
+
+		/* Literal value.  Without units, it's already in metres */
+		if ( units != NULL ) len->value *= scale;
+		free(value_str);
+
+	} else {
+
+		/* Value to be read from headers */
+		len->header = value_str;
+		len->scale = scale;
+
+	}
+
+	free(units);
+	len->invalid = 0;
+}
+
+
+/* Returns the index of the pre-parsed version of 'from' in dt->lengths,
+ * adding it if necessary, or -1 if 'from' is NULL */
+static int add_length(DataTemplate *dt, const char *from,
+                      double default_scale)
+{
+	int i;
+	struct dt_length *lengths_new;
+
+	if ( from == NULL ) return -1;
+
+	for ( i=0; i<dt->n_lengths; i++ ) {
+		if ( (strcmp(dt->lengths[i].from, from) == 0)
+		  && (dt->lengths[i].default_scale == default_scale) )
+		{
+			return i;
+		}
+	}
+
+	lengths_new = realloc(dt->lengths,
+	                      (dt->n_lengths+1)*sizeof(struct dt_length));
+	if ( lengths_new == NULL ) return -1;
+	dt->lengths = lengths_new;
+
+	parse_length(&dt->lengths[dt->n_lengths], from, default_scale);
+	return dt->n_lengths++;
+}
+
+
+static int safe_strcmp(const char *a, const char *b)
+{
+	if ( (a==NULL) && (b==NULL) ) return 0;
+	if ( (a!=NULL) && (b!=NULL) ) return strcmp(a, b);
+	return 1;
+}
+
+
+static int all_panels_reference_same_clen(const DataTemplate *dtempl)
+{
+	int i;
+	char *first_val = NULL;
+	char *first_units = NULL;
+	int fail = 0;
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		struct panel_template *p = &dtempl->panels[i];
+		char *val;
+		char *units;
+		if ( separate_value_and_units(p->cnz_from, &val, &units) ) {
+			/* Parse error */
+			return 0;
+		}
+		if ( i == 0 ) {
+			first_val = val;
+			first_units = units;
+		} else {
+			if ( safe_strcmp(val, first_val) != 0 ) fail = 1;
+			if ( safe_strcmp(units, first_units) != 0 ) fail = 1;
+			free(val);
+			free(units);
+		}
+	}
+
+	free(first_val);
+	free(first_units);
+	return fail;
+}
+
+
+static int all_coffsets_small(const DataTemplate *dtempl)
+{
+	int i;
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		struct panel_template *p = &dtempl->panels[i];
+		if ( p->cnz_offset > 10.0*p->pixel_pitch ) return 0;
+	}
+
+	return 1;
+}
+
+
+static int all_panels_same_clen(const DataTemplate *dtempl)
+{
+	int i;
+	double total = 0.0;
+	double mean;
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		struct dt_length *len;
+		if ( dtempl->panels[i].cnz_length < 0 ) return 0;
+		len = &dtempl->lengths[dtempl->panels[i].cnz_length];
+		if ( len->invalid || (len->header != NULL) ) {
+			/* Can't get length because it used a header reference */
+			return 0;
+		}
+		total += len->value;
+	}
+
+	mean = total/dtempl->n_panels;
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		struct panel_template *p = &dtempl->panels[i];
+		double z = dtempl->lengths[p->cnz_length].value;
+		if ( fabs(z - mean) > 10.0*p->pixel_pitch ) return 0;
+	}
+
+	return 1;
+}
+
+
+static int all_panels_perpendicular_to_beam(const DataTemplate *dtempl)
+{
+	int i;
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		double z_diff;
+		struct panel_template *p = &dtempl->panels[i];
+		z_diff = p->fsz*PANEL_WIDTH(p) + p->ssz*PANEL_HEIGHT(p);
+		if ( z_diff > 10.0*p->pixel_pitch ) return 0;
+	}
+	return 1;
+}
+
+
+static int detector_flat(const DataTemplate *dtempl)
+{
+	return all_panels_perpendicular_to_beam(dtempl)
+	    && ( (all_panels_reference_same_clen(dtempl) && all_coffsets_small(dtempl))
+	          || all_panels_same_clen(dtempl) );
+}
+
+
+/* Work out everything about the geometry which doesn't depend on the frame,
+ * so that create_detgeom() only has to look up each header once */
+static void compile_geometry(DataTemplate *dt)
+{
+	int i;
+
+	dt->lengths = NULL;
+	dt->n_lengths = 0;
+
+	for ( i=0; i<dt->n_panels; i++ ) {
+		struct panel_template *p = &dt->panels[i];
+		p->cnz_length = add_length(dt, p->cnz_from, 1e-3);
+	}
+
+	dt->shift_x_length = add_length(dt, dt->shift_x_from, 1.0);
+	dt->shift_y_length = add_length(dt, dt->shift_y_from, 1.0);
+
+	dt->flat = detector_flat(dt);
+}
+
+
 DataTemplate *data_template_new_from_string(const char *string_in)
 {
 	DataTemplate *dt;
@@ -1473,6 +1709,8 @@ DataTemplate *data_template_new_from_string(const char *string_in)
 
 	if ( reject ) return NULL;
 
+	compile_geometry(dt);
+
 	return dt;
 }
 
@@ -1523,6 +1761,12 @@ void data_template_free(DataTemplate *dt)
 		free(dt->headers_to_copy[i]);
 	}
 
+	for ( i=0; i<dt->n_lengths; i++ ) {
+		free(dt->lengths[i].from);
+		free(dt->lengths[i].header);
+	}
+	free(dt->lengths);
+
 	free(dt->wavelength_from);
 	free(dt->peak_list);
 
@@ -1737,226 +1981,49 @@ double data_template_get_wavelength_if_possible(const DataTemplate *dt)
 }
 
 
-static int separate_value_and_units(const char *from,
-                                    char **pvalue,
-                                    char **punits)
+struct length_value
 {
-	char *sp;
-	char *fromcpy;
-	char *unitscpy;
-
-	if ( from == NULL ) return 1;
-
-	fromcpy = strdup(from);
-	if ( fromcpy == NULL ) return 1;
-
-	sp = strchr(fromcpy, ' ');
-	if ( sp == NULL ) {
-		unitscpy = NULL;
-	} else {
-		unitscpy = strdup(sp+1);
-		sp[0] = '\0';
-	}
-
-	*pvalue = fromcpy;
-	*punits = unitscpy;
-	return 0;
-}
-
-
-/* default_scale is a value to be used if both of the following
- * conditions are met:
- *
- *  1. The value is a reference to image headers/metadata,
- *      rather than a literal number.
- *  2. No units are specified in the number.
- *
- * This is totally horrible.  Sorry.  Blame history.
- */
-static int im_get_length(struct image *image, const char *from,
-                         double default_scale, double *pval)
-{
-	char *value_str;
-	char *units;
-
-	if ( from == NULL ) return 1;
-
-	if ( separate_value_and_units(from, &value_str, &units) ) return 1;
-
-	if ( units == NULL ) {
-
-		/* No units given */
-
-		if ( convert_float(value_str, pval) == 0 ) {
-
-			/* Literal value with no units */
-			free(value_str);
-			return 0;
-
-		} else {
-
-			int r;
-			r = image_read_header_float(image, value_str, pval);
-			free(value_str);
-
-			if ( r == 0 ) {
-				/* Value read from headers with no units */
-				*pval *= default_scale;
-				return 0;
-			} else {
-				/* Failed to read value from headers */
-				return 1;
-			}
-		}
-
-	} else {
-
-		/* Units are specified */
-
-		double scale;
-
-		if ( strcmp(units, "mm") == 0 ) {
-			scale = 1e-3;
-		} else if ( strcmp(units, "m") == 0 ) {
-			scale = 1.0;
-		} else {
-			ERROR("Invalid length unit '%s'\n", units);
-			free(value_str);
-			free(units);
-			return 1;
-		}
-
-		if ( convert_float(value_str, pval) == 0 ) {
-
-			/* Literal value, units specified */
-			free(value_str);
-			free(units);
-			*pval *= scale;
-			return 0;
-
-		} else {
-
-			int r;
-			r = image_read_header_float(image, value_str, pval);
-			free(value_str);
-
-			if ( r == 0 ) {
-				/* Value read from headers, units specified */
-				*pval *= scale;
-				return 0;
-			} else {
-				/* Failed to read value from headers */
-				return 1;
-			}
-		}
-	}
-}
-
-
-static int safe_strcmp(const char *a, const char *b)
-{
-	if ( (a==NULL) && (b==NULL) ) return 0;
-	if ( (a!=NULL) && (b!=NULL) ) return strcmp(a, b);
-	return 1;
-}
-
-
-static int all_panels_reference_same_clen(const DataTemplate *dtempl)
-{
-	int i;
-	char *first_val = NULL;
-	char *first_units = NULL;
-	int fail = 0;
-
-	for ( i=0; i<dtempl->n_panels; i++ ) {
-		struct panel_template *p = &dtempl->panels[i];
-		char *val;
-		char *units;
-		if ( separate_value_and_units(p->cnz_from, &val, &units) ) {
-			/* Parse error */
-			return 0;
-		}
-		if ( i == 0 ) {
-			first_val = val;
-			first_units = units;
-		} else {
-			if ( safe_strcmp(val, first_val) != 0 ) fail = 1;
-			if ( safe_strcmp(units, first_units) != 0 ) fail = 1;
-			free(val);
-			free(units);
-		}
-	}
-
-	free(first_val);
-	free(first_units);
-	return fail;
-}
+	double value;
+	int ok;
+};
 
 
-static int all_coffsets_small(const DataTemplate *dtempl)
+/* Evaluate all the distinct lengths for this frame, reading each header
+ * only once.  Note that a header value of NaN counts as a value, not as a
+ * failure to read the header. */
+static void evaluate_lengths(struct image *image, const DataTemplate *dtempl,
+                             struct length_value *vals)
 {
 	int i;
 
-	for ( i=0; i<dtempl->n_panels; i++ ) {
-		struct panel_template *p = &dtempl->panels[i];
-		if ( p->cnz_offset > 10.0*p->pixel_pitch ) return 0;
-	}
-
-	return 1;
-}
+	for ( i=0; i<dtempl->n_lengths; i++ ) {
 
+		struct dt_length *len = &dtempl->lengths[i];
 
-static int all_panels_same_clen(const DataTemplate *dtempl)
-{
-	int i;
-	double *zvals;
-	double total = 0.0;
-	double mean;
+		vals[i].ok = 0;
+		if ( len->invalid ) continue;
 
-	zvals = malloc(sizeof(double)*dtempl->n_panels);
-	if ( zvals == NULL ) return 0;
-
-	for ( i=0; i<dtempl->n_panels; i++ ) {
-		struct panel_template *p = &dtempl->panels[i];
-		if ( im_get_length(NULL, p->cnz_from, 1e-3, &zvals[i]) ) {
-			/* Can't get length because it used a header reference */
-			free(zvals);
-			return 0;
+		if ( len->header == NULL ) {
+			vals[i].value = len->value;
+			vals[i].ok = 1;
+		} else if ( image_read_header_float(image, len->header,
+		                                    &vals[i].value) == 0 )
+		{
+			vals[i].value *= len->scale;
+			vals[i].ok = 1;
 		}
-		total += zvals[i];
-	}
-
-	mean = total/dtempl->n_panels;
-	for ( i=0; i<dtempl->n_panels; i++ ) {
-		struct panel_template *p = &dtempl->panels[i];
-		if ( fabs(zvals[i] - mean) > 10.0*p->pixel_pitch ) return 0;
-	}
-
-	free(zvals);
-
-	return 1;
-}
-
 
-static int all_panels_perpendicular_to_beam(const DataTemplate *dtempl)
-{
-	int i;
-
-	for ( i=0; i<dtempl->n_panels; i++ ) {
-		double z_diff;
-		struct panel_template *p = &dtempl->panels[i];
-		z_diff = p->fsz*PANEL_WIDTH(p) + p->ssz*PANEL_HEIGHT(p);
-		if ( z_diff > 10.0*p->pixel_pitch ) return 0;
 	}
-	return 1;
 }
 
 
-static int detector_flat(const DataTemplate *dtempl)
+static int get_length(const struct length_value *vals, int idx,
+                      double *pval)
 {
-	return all_panels_perpendicular_to_beam(dtempl)
-	    && ( (all_panels_reference_same_clen(dtempl) && all_coffsets_small(dtempl))
-	          || all_panels_same_clen(dtempl) );
+	if ( idx < 0 ) return 1;
+	if ( !vals[idx].ok ) return 1;
+	*pval = vals[idx].value;
+	return 0;
 }
 
 
@@ -1965,6 +2032,8 @@ struct detgeom *create_detgeom(struct image *image,
                                int two_d_only)
 {
 	struct detgeom *detgeom;
+	struct length_value *lengths;
+	double shift_x, shift_y;
 	int i;
 
 	if ( dtempl == NULL ) {
@@ -1972,28 +2041,54 @@ struct detgeom *create_detgeom(struct image *image,
 		return NULL;
 	}
 
+	if ( two_d_only ) {
+		if ( !dtempl->flat ) return NULL;
+		if ( dtempl->shift_x_from != NULL ) return NULL;
+		if ( dtempl->shift_y_from != NULL ) return NULL;
+	}
+
+	lengths = malloc(dtempl->n_lengths*sizeof(struct length_value));
+	if ( (lengths == NULL) && (dtempl->n_lengths > 0) ) return NULL;
+	evaluate_lengths(image, dtempl, lengths);
+
+	/* Overall shift (already in m) */
+	if ( dtempl->shift_x_from != NULL ) {
+		if ( get_length(lengths, dtempl->shift_x_length, &shift_x) ) {
+			ERROR("Failed to read length from '%s'\n",
+			      dtempl->shift_x_from);
+			free(lengths);
+			return NULL;
+		}
+		if ( get_length(lengths, dtempl->shift_y_length, &shift_y) ) {
+			ERROR("Failed to read length from '%s'\n",
+			      dtempl->shift_y_from);
+			free(lengths);
+			return NULL;
+		}
+	} else {
+		shift_x = 0.0;
+		shift_y = 0.0;
+	}
+
 	detgeom = malloc(sizeof(struct detgeom));
-	if ( detgeom == NULL ) return NULL;
+	if ( detgeom == NULL ) {
+		free(lengths);
+		return NULL;
+	}
 
 	detgeom->panels = malloc(dtempl->n_panels*sizeof(struct detgeom_panel));
 	if ( detgeom->panels == NULL ) {
 		free(detgeom);
+		free(lengths);
 		return NULL;
 	}
 
 	detgeom->n_panels = dtempl->n_panels;
 
-	if ( two_d_only ) {
-		if ( !detector_flat(dtempl) ) return NULL;
-		if ( dtempl->shift_x_from != NULL ) return NULL;
-		if ( dtempl->shift_y_from != NULL ) return NULL;
-	}
-
 	for ( i=0; i<dtempl->n_panels; i++ ) {
 
 		struct detgeom_panel *p = &detgeom->panels[i];
 		struct panel_template *tmpl = &dtempl->panels[i];
-		double shift_x, shift_y;
 
 		p->name = safe_strdup(tmpl->name);
 
@@ -2003,12 +2098,13 @@ struct detgeom *create_detgeom(struct image *image,
 		p->cnx = tmpl->cnx;
 		p->cny = tmpl->cny;
 
-		if ( im_get_length(image, tmpl->cnz_from, 1e-3, &p->cnz) )
+		if ( get_length(lengths, tmpl->cnz_length, &p->cnz) )
 		{
 			if ( two_d_only ) {
 				p->cnz = NAN;
 			} else {
 				ERROR("Failed to read length from '%s'\n", tmpl->cnz_from);
+				free(lengths);
 				return NULL;
 			}
 		}
@@ -2018,23 +2114,7 @@ struct detgeom *create_detgeom(struct image *image,
 		p->cnz += tmpl->cnz_offset;
 		p->cnz /= p->pixel_pitch;
 
-		/* Apply overall shift (already in m) */
-		if ( dtempl->shift_x_from != NULL ) {
-			if ( im_get_length(image, dtempl->shift_x_from, 1.0, &shift_x) ) {
-				ERROR("Failed to read length from '%s'\n",
-				      dtempl->shift_x_from);
-				return NULL;
-			}
-			if ( im_get_length(image, dtempl->shift_y_from, 1.0, &shift_y) ) {
-				ERROR("Failed to read length from '%s'\n",
-				      dtempl->shift_y_from);
-				return NULL;
-			}
-		} else {
-			shift_x = 0.0;
-			shift_y = 0.0;
-		}
-
+		/* A NaN shift from the headers is ignored */
 		if ( !isnan(shift_x) ) {
 			p->cnx += shift_x / p->pixel_pitch;
 		}
@@ -2080,6 +2160,7 @@ struct detgeom *create_detgeom(struct image *image,
 
 	}
 
+	free(lengths);
 	return detgeom;
 }
 
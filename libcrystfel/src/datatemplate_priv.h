@@ -125,6 +125,9 @@ struct panel_template
 	/** The offset to be applied from clen */
 	double cnz_offset;
 
+	/** Index of cnz_from in the table of pre-parsed lengths */
+	int cnz_length;
+
 	/** Mask definitions */
 	struct mask_template masks[MAX_MASKS];
 
@@ -184,6 +187,30 @@ struct panel_template
 #define PANEL_HEIGHT(p) ((p)->orig_max_ss - (p)->orig_min_ss + 1)
 
 
+/* A length which is either a literal value or a reference to a header,
+ * pre-parsed from a string such as "/LCLS/detector_1/EncoderValue mm" */
+struct dt_length
+{
+	/** Original string, as given in the geometry file */
+	char *from;
+
+	/** Location of header value, or NULL for a literal value */
+	char *header;
+
+	/** Literal value in metres (if header is NULL) */
+	double value;
+
+	/** Factor to convert the header value to metres */
+	double scale;
+
+	/** Scale factor to use if no units are given for a header value */
+	double default_scale;
+
+	/** Non-zero if the string could not be parsed */
+	int invalid;
+};
+
+
 struct dt_badregion
 {
 	char name[1024];
@@ -233,6 +260,17 @@ struct _datatemplate
 
 	char                      *headers_to_copy[MAX_COPY_HEADERS];
 	int                        n_headers_to_copy;
+
+	/* Distinct length expressions (camera lengths and detector shifts),
+	 * parsed once when the template is loaded.  Each one is evaluated
+	 * only once per frame by create_detgeom(). */
+	struct dt_length          *lengths;
+	int                        n_lengths;
+	int                        shift_x_length;
+	int                        shift_y_length;
+
+	/* Result of detector_flat(), which does not depend on the frame */
+	int                        flat;
 };
 
 extern double convert_to_m(double val, int units);
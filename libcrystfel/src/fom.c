@@ -40,6 +40,7 @@
 #include "cell-utils.h"
 #include "reflist.h"
 #include "reflist-utils.h"
+#include "thread-pool.h"
 
 /**
  * \file fom.h
@@ -73,6 +74,42 @@ struct fom_context
 };
 
 
+/**
+ * \param fctx: A %fom_context structure
+ *
+ * Frees a %fom_context structure returned by fom_calculate().
+ */
+void fom_context_free(struct fom_context *fctx)
+{
+	int i;
+
+	if ( fctx == NULL ) return;
+
+	free(fctx->cts);
+	free(fctx->num2);
+	free(fctx->den2);
+	free(fctx->num);
+	free(fctx->den);
+	free(fctx->n_meas);
+	if ( fctx->vec1 != NULL ) {
+		for ( i=0; i<fctx->nshells; i++ ) {
+			free(fctx->vec1[i]);
+		}
+		free(fctx->vec1);
+	}
+	if ( fctx->vec2 != NULL ) {
+		for ( i=0; i<fctx->nshells; i++ ) {
+			free(fctx->vec2[i]);
+		}
+		free(fctx->vec2);
+	}
+	free(fctx->n);
+	free(fctx->n_within);
+	free(fctx->possible);
+	free(fctx);
+}
+
+
 static struct fom_context *init_fom(enum fom_type fom, int nmax, int nshells)
 {
 	struct fom_context *fctx;
@@ -133,7 +170,7 @@ static struct fom_context *init_fom(enum fom_type fom, int nmax, int nshells)
 		break;
 
 		case FOM_COMPLETENESS :
-		/* Uses 'cts' and 'possible' only - see calculate_possible() */
+		/* Uses 'cts' and 'possible' only - see count_possible() */
 		break;
 
 		case FOM_NUM_MEASUREMENTS :
@@ -180,26 +217,7 @@ static struct fom_context *init_fom(enum fom_type fom, int nmax, int nshells)
 	return fctx;
 
 out:
-	free(fctx->num2);
-	free(fctx->den2);
-	free(fctx->num);
-	free(fctx->den);
-	free(fctx->n_meas);
-	if ( fctx->vec1 != NULL ) {
-		for ( i=0; i<nshells; i++ ) {
-			free(fctx->vec1[i]);
-		}
-		free(fctx->vec1);
-	}
-	if ( fctx->vec2 != NULL ) {
-		for ( i=0; i<nshells; i++ ) {
-			free(fctx->vec2[i]);
-		}
-		free(fctx->vec2);
-	}
-	free(fctx->n);
-	free(fctx->n_within);
-	free(fctx);
+	fom_context_free(fctx);
 	return NULL;
 }
 
@@ -653,6 +671,20 @@ struct fom_shells *fom_make_resolution_shells(double rmin, double rmax,
 }
 
 
+/**
+ * \param s: A %fom_shells structure
+ *
+ * Frees a %fom_shells structure returned by fom_make_resolution_shells().
+ */
+void fom_shells_free(struct fom_shells *s)
+{
+	if ( s == NULL ) return;
+	free(s->rmins);
+	free(s->rmaxs);
+	free(s);
+}
+
+
 /**
  * \param s: A %fom_shells structure
  * \param i: The shell number
@@ -796,49 +828,120 @@ static int wilson_scale(RefList *list1, RefList *list2, UnitCell *cell)
 }
 
 
-static int calculate_possible(struct fom_context *fctx,
-                              struct fom_shells *shells,
-                              UnitCell *cell,
-                              const SymOpList *sym)
+struct possible_args
 {
-	RefList *counted;
+	struct fom_shells *shells;
+	UnitCell *cell;
+	const SymOpList *sym;
 	int hmax, kmax, lmax;
-	double ax, ay, az;
-	double bx, by, bz;
-	double cx, cy, cz;
-	signed int h, k, l;
+	signed int next_h;
+	long int *possible;
+};
 
-	fctx->possible = calloc(fctx->nshells, sizeof(long int));
-	if ( fctx->possible == NULL ) return 1;
 
-	counted = reflist_new();
-	if ( counted == NULL ) {
-		free(fctx->possible);
-		return 1;
+struct possible_task
+{
+	struct possible_args *args;
+	signed int h;
+	long int *possible;
+};
+
+
+static int in_search_box(struct possible_args *args,
+                         signed int h, signed int k, signed int l)
+{
+	return (abs(h) <= args->hmax) && (abs(k) <= args->kmax)
+	    && (abs(l) <= args->lmax);
+}
+
+
+static int search_order_before(signed int h1, signed int k1, signed int l1,
+                               signed int h2, signed int k2, signed int l2)
+{
+	if ( h1 != h2 ) return h1 < h2;
+	if ( k1 != k2 ) return k1 < k2;
+	return l1 < l2;
+}
+
+
+/* Every reflection in the search box leads to its asymmetric version, but
+ * each asymmetric reflection must only be counted once.  It's counted when
+ * the search reaches the asymmetric reflection itself, or (if that is outside
+ * the box or forbidden) the first equivalent which is not.  Unlike keeping a
+ * list of counted reflections, this works independently for each thread. */
+static int count_here(struct possible_args *args,
+                      signed int h, signed int k, signed int l,
+                      signed int hs, signed int ks, signed int ls)
+{
+	int n, j;
+
+	if ( in_search_box(args, hs, ks, ls)
+	  && !forbidden_reflection(args->cell, hs, ks, ls) )
+	{
+		return (h == hs) && (k == ks) && (l == ls);
 	}
 
-	cell_get_cartesian(cell, &ax, &ay, &az,
-	                         &bx, &by, &bz,
-	                         &cx, &cy, &cz);
-	hmax = shells->rmaxs[fctx->nshells-1] * modulus(ax, ay, az);
-	kmax = shells->rmaxs[fctx->nshells-1] * modulus(bx, by, bz);
-	lmax = shells->rmaxs[fctx->nshells-1] * modulus(cx, cy, cz);
-	for ( h=-hmax; h<=hmax; h++ ) {
-	for ( k=-kmax; k<=kmax; k++ ) {
-	for ( l=-lmax; l<=lmax; l++ ) {
+	n = num_equivs(args->sym, NULL);
+	for ( j=0; j<n; j++ ) {
+
+		signed int he, ke, le;
+
+		get_equiv(args->sym, NULL, j, hs, ks, ls, &he, &ke, &le);
+		if ( !in_search_box(args, he, ke, le) ) continue;
+		if ( forbidden_reflection(args->cell, he, ke, le) ) continue;
+		if ( search_order_before(he, ke, le, h, k, l) ) return 0;
+
+	}
+
+	return 1;
+}
+
+
+static void *get_possible_task(void *vp)
+{
+	struct possible_args *args = vp;
+	struct possible_task *task;
+
+	if ( args->next_h > args->hmax ) return NULL;
+
+	task = malloc(sizeof(struct possible_task));
+	if ( task == NULL ) return NULL;
+
+	task->possible = calloc(args->shells->nshells, sizeof(long int));
+	if ( task->possible == NULL ) {
+		free(task);
+		return NULL;
+	}
+
+	task->args = args;
+	task->h = args->next_h++;
+	return task;
+}
+
+
+static void count_possible_slice(void *vp, int cookie)
+{
+	struct possible_task *task = vp;
+	struct possible_args *args = task->args;
+	struct fom_shells *shells = args->shells;
+	signed int h, k, l;
+
+	h = task->h;
+	for ( k=-args->kmax; k<=args->kmax; k++ ) {
+	for ( l=-args->lmax; l<=args->lmax; l++ ) {
 
 		double d;
 		signed int hs, ks, ls;
 		int bin;
 		int i;
 
-		get_asymm(sym, h, k, l, &hs, &ks, &ls);
-		d = 2.0 * resolution(cell, hs, ks, ls);
+		get_asymm(args->sym, h, k, l, &hs, &ks, &ls);
+		d = 2.0 * resolution(args->cell, hs, ks, ls);
 
-		if ( forbidden_reflection(cell, h, k, l) ) continue;
+		if ( forbidden_reflection(args->cell, h, k, l) ) continue;
 
 		bin = -1;
-		for ( i=0; i<fctx->nshells; i++ ) {
+		for ( i=0; i<shells->nshells; i++ ) {
 			if ( (d>shells->rmins[i]) && (d<=shells->rmaxs[i]) ) {
 				bin = i;
 				break;
@@ -846,17 +949,65 @@ static int calculate_possible(struct fom_context *fctx,
 		}
 		if ( bin == -1 ) continue;
 
-		if ( find_refl(counted, hs, ks, ls) != NULL ) continue;
-		add_refl(counted, hs, ks, ls);
+		if ( !count_here(args, h, k, l, hs, ks, ls) ) continue;
 
-		fctx->possible[bin]++;
+		task->possible[bin]++;
 
 	}
 	}
+}
+
+
+static void finalise_possible_task(void *vp, void *vtask)
+{
+	struct possible_args *args = vp;
+	struct possible_task *task = vtask;
+	int i;
+
+	for ( i=0; i<args->shells->nshells; i++ ) {
+		args->possible[i] += task->possible[i];
 	}
-	reflist_free(counted);
+	free(task->possible);
+	free(task);
+}
 
-	return 0;
+
+static long int *count_possible(struct fom_shells *shells, UnitCell *cell,
+                                const SymOpList *sym, int n_threads)
+{
+	struct possible_args args;
+	double ax, ay, az;
+	double bx, by, bz;
+	double cx, cy, cz;
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
+
+	args.possible = calloc(shells->nshells, sizeof(long int));
+	if ( args.possible == NULL ) return NULL;
+
+	cell_get_cartesian(cell, &ax, &ay, &az,
+	                         &bx, &by, &bz,
+	                         &cx, &cy, &cz);
+
+	/* Make sure the reciprocal axes are worked out before the threads
+	 * start calling resolution() */
+	cell_get_reciprocal(cell, &asx, &asy, &asz,
+	                          &bsx, &bsy, &bsz,
+	                          &csx, &csy, &csz);
+
+	args.shells = shells;
+	args.cell = cell;
+	args.sym = sym;
+	args.hmax = shells->rmaxs[shells->nshells-1] * modulus(ax, ay, az);
+	args.kmax = shells->rmaxs[shells->nshells-1] * modulus(bx, by, bz);
+	args.lmax = shells->rmaxs[shells->nshells-1] * modulus(cx, cy, cz);
+	args.next_h = -args.hmax;
+
+	run_threads(n_threads, count_possible_slice, get_possible_task,
+	            finalise_possible_task, &args, 0, 0, 0, 0);
+
+	return args.possible;
 }
 
 
@@ -1084,13 +1235,168 @@ struct fom_context *fom_calculate(RefList *list1, RefList *list2, UnitCell *cell
 	}
 
 	if ( fom == FOM_COMPLETENESS ) {
-		calculate_possible(fctx, shells, cell, sym);
+		fctx->possible = count_possible(shells, cell, sym, 1);
 	}
 
 	return fctx;
 }
 
 
+struct bin_args
+{
+	Reflection **refls;
+	int *bins;
+	int n;
+	struct fom_shells *shells;
+	UnitCell *cell;
+};
+
+
+static void find_bins(void *vp, int start, int end)
+{
+	struct bin_args *args = vp;
+	int i;
+
+	for ( i=start; i<end; i++ ) {
+		args->bins[i] = get_bin(args->shells, args->refls[i],
+		                        args->cell);
+	}
+}
+
+
+/**
+ * \param list: A %RefList
+ * \param cell: A %UnitCell
+ * \param shells: A %fom_shells structure
+ * \param foms: The figures of merit to calculate
+ * \param n_foms: The number of figures of merit in \p foms
+ * \param sym: The symmetry of \p list
+ * \param n_threads: The number of threads to use
+ * \param fctxs: Place to store the \p n_foms %fom_context structures
+ *
+ * Calculates several figures of merit for one reflection list, giving the same
+ * results as calling fom_calculate() for each of them.  The resolution shell
+ * of each reflection is found only once, and the numbers of possible
+ * reflections are counted only once, using \p n_threads threads.
+ *
+ * Only figures of merit which do not involve comparison (see
+ * fom_is_comparison()) can be calculated like this.
+ *
+ * \returns zero on success, non-zero on error.
+ */
+int fom_calculate_multi(RefList *list, UnitCell *cell,
+                        struct fom_shells *shells,
+                        const enum fom_type *foms, int n_foms,
+                        const SymOpList *sym, int n_threads,
+                        struct fom_context **fctxs)
+{
+	struct bin_args args;
+	Reflection *refl;
+	RefListIterator *iter;
+	long int *possible = NULL;
+	long int *n_rej;
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
+	int i, j;
+
+	for ( j=0; j<n_foms; j++ ) {
+		if ( fom_is_comparison(foms[j]) ) {
+			ERROR("%s needs two reflection lists.\n",
+			      fom_name(foms[j]));
+			return 1;
+		}
+	}
+
+	args.n = num_reflections(list);
+	args.refls = malloc(args.n*sizeof(Reflection *));
+	args.bins = malloc(args.n*sizeof(int));
+	n_rej = calloc(n_foms, sizeof(long int));
+	if ( (args.refls == NULL) || (args.bins == NULL) || (n_rej == NULL) ) {
+		ERROR("Couldn't allocate memory for resolution shells.\n");
+		free(args.refls);
+		free(args.bins);
+		free(n_rej);
+		return 1;
+	}
+
+	i = 0;
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		args.refls[i++] = refl;
+	}
+
+	/* Make sure the reciprocal axes are worked out before the threads
+	 * start calling resolution() */
+	cell_get_reciprocal(cell, &asx, &asy, &asz,
+	                          &bsx, &bsy, &bsz,
+	                          &csx, &csy, &csz);
+
+	args.shells = shells;
+	args.cell = cell;
+	run_blocks(n_threads, args.n, 4096, find_bins, &args);
+
+	for ( j=0; j<n_foms; j++ ) {
+		fctxs[j] = init_fom(foms[j], args.n, shells->nshells);
+		if ( fctxs[j] == NULL ) {
+			ERROR("Couldn't allocate memory for resolution "
+			      "shells.\n");
+			while ( j-- ) fom_context_free(fctxs[j]);
+			free(args.refls);
+			free(args.bins);
+			free(n_rej);
+			return 1;
+		}
+	}
+
+	/* Adding up in the same order as fom_calculate() gives exactly the
+	 * same results */
+	for ( i=0; i<args.n; i++ ) {
+		for ( j=0; j<n_foms; j++ ) {
+			n_rej[j] += add_to_fom(fctxs[j], args.refls[i], NULL,
+			                       NULL, NULL, args.bins[i]);
+		}
+	}
+
+	for ( j=0; j<n_foms; j++ ) {
+
+		if ( n_rej[j] ) {
+			if ( foms[j] == FOM_SNR ) {
+				ERROR("WARNING: %li reflections had infinite "
+				      "or invalid values of I/sigma(I).\n",
+				      n_rej[j]);
+			} else {
+				ERROR("WARNING: %li reflections rejected by "
+				      "add_to_fom\n", n_rej[j]);
+			}
+		}
+
+		if ( foms[j] == FOM_COMPLETENESS ) {
+			if ( possible == NULL ) {
+				possible = count_possible(shells, cell, sym,
+				                          n_threads);
+				fctxs[j]->possible = possible;
+			} else {
+				fctxs[j]->possible = malloc(shells->nshells
+				                            *sizeof(long int));
+				if ( fctxs[j]->possible != NULL ) {
+					memcpy(fctxs[j]->possible, possible,
+					       shells->nshells*sizeof(long int));
+				}
+			}
+		}
+
+	}
+
+	free(args.refls);
+	free(args.bins);
+	free(n_rej);
+	return 0;
+}
+
+
 /**
  * \param list1: The first input %RefList
  * \param list2: The second input %RefList
@@ -119,9 +119,17 @@ extern struct fom_context *fom_calculate(RefList *list1, RefList *list2,
                                          enum fom_type fom, int noscale,
                                          const SymOpList *sym);
 
+extern int fom_calculate_multi(RefList *list, UnitCell *cell,
+                               struct fom_shells *shells,
+                               const enum fom_type *foms, int n_foms,
+                               const SymOpList *sym, int n_threads,
+                               struct fom_context **fctxs);
+
 extern struct fom_shells *fom_make_resolution_shells(double rmin, double rmax,
                                                      int nshells);
 
+extern void fom_shells_free(struct fom_shells *s);
+
 extern double fom_shell_centre(struct fom_shells *s, int i);
 
 extern double fom_overall_value(struct fom_context *fctx);
@@ -133,6 +141,8 @@ extern int fom_shell_num_reflections(struct fom_context *fctx, int i);
 extern int fom_overall_num_possible(struct fom_context *fctx);
 extern int fom_shell_num_possible(struct fom_context *fctx, int i);
 
+extern void fom_context_free(struct fom_context *fctx);
+
 extern int fom_is_anomalous(enum fom_type f);
 extern int fom_is_comparison(enum fom_type f);
 
@@ -34,6 +34,8 @@
 #include <math.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #ifdef HAVE_HDF5
 #include <hdf5.h>
 #include <hdf5_hl.h>
@@ -43,6 +45,7 @@
 #include "utils.h"
 #include "detgeom.h"
 #include "profile.h"
+#include "uthash.h"
 
 #include "datatemplate.h"
 #include "datatemplate_priv.h"
@@ -337,7 +340,10 @@ static void close_hdf5(hid_t fh)
         int n_ids, i;
         hid_t ids[2048];
 
-        n_ids = H5Fget_obj_ids(fh, H5F_OBJ_ALL, 2048, ids);
+        /* Only the objects opened through this file ID, not the ones
+         * opened through another ID for the same file (e.g. the CXI peak
+         * table, see below) */
+        n_ids = H5Fget_obj_ids(fh, H5F_OBJ_ALL | H5F_OBJ_LOCAL, 2048, ids);
 
         for ( i=0; i<n_ids; i++ ) {
 
@@ -362,6 +368,40 @@ static void close_hdf5(hid_t fh)
 
 
 
+/* Somewhere to put integer data instead, if it can be held exactly in the
+ * compact storage type (see image_make_compact_data) */
+struct compact_target
+{
+	PixelStorageType type;
+	void *data;
+	int used;
+};
+
+
+static int fits_compact_type(hid_t type, PixelStorageType ctype)
+{
+	size_t size;
+	int is_signed;
+
+	if ( H5Tget_class(type) != H5T_INTEGER ) return 0;
+
+	size = H5Tget_size(type);
+	is_signed = (H5Tget_sign(type) != H5T_SGN_NONE);
+
+	switch ( ctype ) {
+
+		case PIXEL_STORAGE_UINT16:
+		return !is_signed && (size <= 2);
+
+		case PIXEL_STORAGE_INT32:
+		return is_signed ? (size <= 4) : (size <= 2);
+
+		default:
+		return 0;
+	}
+}
+
+
 static int load_hdf5_hyperslab(struct panel_template *p,
                                hid_t fh,
                                const char *event,
@@ -369,7 +409,8 @@ static int load_hdf5_hyperslab(struct panel_template *p,
                                hid_t el_type, size_t el_size,
                                int skip_placeholders_ok,
                                const char *path_spec,
-                               hid_t *orig_type)
+                               hid_t *orig_type,
+                               struct compact_target *compact)
 {
 	int total_dt_dims;
 	int plh_dt_dims;
@@ -511,8 +552,21 @@ static int load_hdf5_hyperslab(struct panel_template *p,
 	dims[1] = p->orig_max_fs - p->orig_min_fs + 1;
 	memspace = H5Screate_simple(2, dims, NULL);
 
+	if ( compact != NULL ) {
+		hid_t type = H5Dget_type(dh);
+		compact->used = fits_compact_type(type, compact->type);
+		H5Tclose(type);
+	}
+
 	profile_start("H5Dread");
-	r = H5Dread(dh, el_type, memspace, dataspace, H5P_DEFAULT, data);
+	if ( (compact != NULL) && compact->used ) {
+		r = H5Dread(dh, (compact->type == PIXEL_STORAGE_UINT16)
+		                 ? H5T_NATIVE_UINT16 : H5T_NATIVE_INT32,
+		            memspace, dataspace, H5P_DEFAULT, compact->data);
+	} else {
+		r = H5Dread(dh, el_type, memspace, dataspace, H5P_DEFAULT,
+		            data);
+	}
 	profile_end("H5Dread");
 	if ( r < 0 ) {
 		ERROR("Couldn't read data for panel %s\n",
@@ -583,11 +637,38 @@ static hid_t open_hdf5(struct image *image)
 }
 
 
+static void convert_compact_panel(const struct compact_target *ct, float *dp,
+                                  long int n)
+{
+	long int j;
+
+	if ( ct->type == PIXEL_STORAGE_UINT16 ) {
+		const uint16_t *d = ct->data;
+		for ( j=0; j<n; j++ ) dp[j] = d[j];
+	} else {
+		const int32_t *d = ct->data;
+		for ( j=0; j<n; j++ ) dp[j] = d[j];
+	}
+}
+
+
+static void free_compact_panels(void **compact, int n)
+{
+	int i;
+	if ( compact == NULL ) return;
+	for ( i=0; i<n; i++ ) free(compact[i]);
+	free(compact);
+}
+
+
 int image_hdf5_read(struct image *image,
-                    const DataTemplate *dtempl)
+                    const DataTemplate *dtempl,
+                    PixelStorageType compact_type)
 {
 	int i;
 	hid_t fh;
+	void **compact = NULL;
+	int all_compact = 1;
 
 	if ( image->ev == NULL ) {
 		image->ev = "//";
@@ -601,27 +682,58 @@ int image_hdf5_read(struct image *image,
 		return 1;
 	}
 
+	if ( compact_type != PIXEL_STORAGE_FLOAT ) {
+		compact = calloc(dtempl->n_panels, sizeof(void *));
+	}
+
 	for ( i=0; i<dtempl->n_panels; i++ ) {
 		long int j;
 		struct panel_template *p = &dtempl->panels[i];
+		long int n = PANEL_WIDTH(p)*PANEL_HEIGHT(p);
 		hid_t orig_type;
+		struct compact_target ct;
+		struct compact_target *pct = NULL;
+
+		/* Integer data is read straight into the compact type, if
+		 * possible, and the float values made from that. */
+		if ( (compact != NULL) && all_compact ) {
+			ct.type = compact_type;
+			ct.data = malloc(n*((compact_type == PIXEL_STORAGE_UINT16)
+			                    ? sizeof(uint16_t) : sizeof(int32_t)));
+			ct.used = 0;
+			if ( ct.data != NULL ) pct = &ct;
+		}
+
 		profile_start("load-hdf5-hyperslab");
 		if ( load_hdf5_hyperslab(p, fh,
 		                         image->ev, image->dp[i],
 		                         H5T_NATIVE_FLOAT,
 		                         sizeof(float), 0,
 		                         dtempl->panels[i].data,
-		                         &orig_type) )
+		                         &orig_type, pct) )
 		{
 			ERROR("Failed to load panel data\n");
 			profile_end("load-hdf5-hyperslab");
+			if ( pct != NULL ) free(ct.data);
+			free_compact_panels(compact, dtempl->n_panels);
 			close_hdf5(fh);
 			return 1;
 		}
 		profile_end("load-hdf5-hyperslab");
+
+		if ( (pct != NULL) && ct.used ) {
+			profile_start("convert-compact");
+			convert_compact_panel(&ct, image->dp[i], n);
+			profile_end("convert-compact");
+			compact[i] = ct.data;
+		} else {
+			if ( pct != NULL ) free(ct.data);
+			all_compact = 0;
+		}
+
 		if ( H5Tget_class(orig_type) == H5T_FLOAT ) {
 			profile_start("nan-inf");
-			for ( j=0; j<PANEL_WIDTH(p)*PANEL_HEIGHT(p); j++ ) {
+			for ( j=0; j<n; j++ ) {
 				if ( !isfinite(image->dp[i][j]) ) {
 					image->bad[i][j] = 1;
 				}
@@ -632,6 +744,17 @@ int image_hdf5_read(struct image *image,
 	}
 
 	close_hdf5(fh);
+
+	/* The compact copy is only any use if all the panels have one */
+	if ( (compact != NULL) && all_compact ) {
+		image_free_compact_data(image);
+		image->dp_compact = compact;
+		image->compact_type = compact_type;
+		image->compact_scale = 1.0;
+	} else {
+		free_compact_panels(compact, dtempl->n_panels);
+	}
+
 	return 0;
 }
 
@@ -649,7 +772,7 @@ int image_hdf5_read_satmap(struct panel_template *p,
 
 	if ( load_hdf5_hyperslab(p, fh, event,
 	                         map_data, H5T_NATIVE_FLOAT,
-	                         sizeof(float), 1, map_location, NULL) )
+	                         sizeof(float), 1, map_location, NULL, NULL) )
 	{
 		ERROR("Failed to load saturation map data\n");
 		return 1;
@@ -686,7 +809,7 @@ int image_hdf5_read_mask(struct panel_template *p,
 
 	if ( load_hdf5_hyperslab(p, fh, event,
 	                         mask, H5T_NATIVE_INT,
-	                         sizeof(int), 1, mask_location, NULL) )
+	                         sizeof(int), 1, mask_location, NULL, NULL) )
 	{
 		ERROR("Failed to load mask data\n");
 		free(mask);
@@ -765,6 +888,384 @@ static char *read_single_vlen_string(hid_t dh)
 }
 
 
+/* Number of consecutive events for which to read a header value in one go */
+#define HEADER_PREFETCH_BLOCK (1024)
+
+/* Maximum number of header blocks to keep in memory */
+#define HEADER_PREFETCH_MAX (256)
+
+/* Enough to tell whether a file has been replaced or modified */
+struct file_identity
+{
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+};
+
+
+/* Identity of a file when image_hdf5_check_header_prefetch() last looked at
+ * it.  Headers are only prefetched for files listed here. */
+struct prefetch_file
+{
+	char *filename;
+	struct file_identity id;
+	UT_hash_handle hh;
+};
+
+
+/* A block of values of one numerical header, for consecutive events in the
+ * same file, so that the file doesn't need to be opened for every frame just
+ * to get the header values */
+struct header_prefetch
+{
+	char *key;  /* Filename and dataset path, separated by newline */
+
+	/* Identity of the file when the values were read.  If the file is
+	 * replaced or modified, the values are read again. */
+	struct file_identity id;
+
+	HeaderCacheType type;
+	int constant;  /* Non-zero if the same value applies to all events */
+	hsize_t first;
+	hsize_t n;
+	double *vals_float;
+	int *vals_int;
+	UT_hash_handle hh;
+};
+
+static struct header_prefetch *header_prefetch = NULL;
+static struct prefetch_file *prefetch_files = NULL;
+static pthread_mutex_t header_prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int same_file_identity(const struct file_identity *a,
+                              const struct file_identity *b)
+{
+	return (a->dev == b->dev) && (a->ino == b->ino)
+	    && (a->mtime == b->mtime) && (a->size == b->size);
+}
+
+
+static void free_header_prefetch(struct header_prefetch *pf)
+{
+	free(pf->key);
+	free(pf->vals_float);
+	free(pf->vals_int);
+	free(pf);
+}
+
+
+static void clear_header_prefetch()
+{
+	struct header_prefetch *pf, *tmp;
+	HASH_ITER(hh, header_prefetch, pf, tmp) {
+		HASH_DEL(header_prefetch, pf);
+		free_header_prefetch(pf);
+	}
+}
+
+
+/* Record the current identity of 'filename', so that any headers prefetched
+ * from an older version of the file will be read again.  This should be
+ * called once for each frame, before its headers are read. */
+void image_hdf5_check_header_prefetch(const char *filename)
+{
+	struct prefetch_file *file;
+	struct stat st;
+	int r;
+
+	r = stat(filename, &st);
+
+	pthread_mutex_lock(&header_prefetch_lock);
+
+	HASH_FIND_STR(prefetch_files, filename, file);
+
+	if ( r != 0 ) {
+		/* Can't tell if the file changes, so don't prefetch */
+		if ( file != NULL ) {
+			HASH_DEL(prefetch_files, file);
+			free(file->filename);
+			free(file);
+		}
+		pthread_mutex_unlock(&header_prefetch_lock);
+		return;
+	}
+
+	if ( file == NULL ) {
+		if ( HASH_COUNT(prefetch_files) >= HEADER_PREFETCH_MAX ) {
+			struct prefetch_file *tmp;
+			HASH_ITER(hh, prefetch_files, file, tmp) {
+				HASH_DEL(prefetch_files, file);
+				free(file->filename);
+				free(file);
+			}
+			clear_header_prefetch();
+		}
+		file = malloc(sizeof(struct prefetch_file));
+		if ( file == NULL ) {
+			pthread_mutex_unlock(&header_prefetch_lock);
+			return;
+		}
+		file->filename = strdup(filename);
+		if ( file->filename == NULL ) {
+			free(file);
+			pthread_mutex_unlock(&header_prefetch_lock);
+			return;
+		}
+		HASH_ADD_KEYPTR(hh, prefetch_files, file->filename,
+		                strlen(file->filename), file);
+	}
+
+	file->id.dev = st.st_dev;
+	file->id.ino = st.st_ino;
+	file->id.mtime = st.st_mtime;
+	file->id.size = st.st_size;
+
+	pthread_mutex_unlock(&header_prefetch_lock);
+}
+
+
+/* Read a block of values of a numerical header, starting with the value for
+ * event index 'idx'.  Returns non-zero if the header isn't suitable for
+ * prefetching, in which case it should be read the normal way. */
+static int read_header_block(struct header_prefetch *pf, const char *filename,
+                             const char *path, int idx)
+{
+	hid_t fh, dh, type, sh, ms;
+	H5T_class_t class;
+	hsize_t size[64];
+	hsize_t f_offset[64];
+	hsize_t f_count[64];
+	hsize_t n;
+	int ndims;
+	int vdim = -1;
+	int i;
+	herr_t r;
+
+	/* Failures here are not reported, because the normal code path
+	 * will try again and report the error properly */
+	if ( access(filename, R_OK) == -1 ) return 1;
+	fh = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+	if ( fh < 0 ) return 1;
+
+	if ( H5LTpath_valid(fh, path, 1) <= 0 ) {
+		close_hdf5(fh);
+		return 1;
+	}
+
+	dh = H5Dopen2(fh, path, H5P_DEFAULT);
+	if ( dh < 0 ) {
+		close_hdf5(fh);
+		return 1;
+	}
+
+	type = H5Dget_type(dh);
+	class = H5Tget_class(type);
+	H5Tclose(type);
+	if ( (class != H5T_FLOAT) && (class != H5T_INTEGER) ) {
+		close_hdf5(fh);
+		return 1;
+	}
+
+	sh = H5Dget_space(dh);
+	ndims = H5Sget_simple_extent_ndims(sh);
+	if ( (ndims < 0) || (ndims > 64) ) {
+		close_hdf5(fh);
+		return 1;
+	}
+	H5Sget_simple_extent_dims(sh, size, NULL);
+
+	/* Only one dimension may vary with the event */
+	for ( i=0; i<ndims; i++ ) {
+		if ( size[i] != 1 ) {
+			if ( vdim != -1 ) {
+				close_hdf5(fh);
+				return 1;
+			}
+			vdim = i;
+		}
+	}
+
+	if ( vdim == -1 ) {
+
+		/* Scalar, or array with all dimensions 1 */
+		pf->constant = 1;
+		pf->first = 0;
+		n = 1;
+		for ( i=0; i<ndims; i++ ) {
+			f_offset[i] = 0;
+			f_count[i] = 1;
+		}
+
+	} else {
+
+		if ( (idx < 0) || (size[vdim] <= idx) ) {
+			close_hdf5(fh);
+			return 1;
+		}
+
+		n = size[vdim] - idx;
+		if ( n > HEADER_PREFETCH_BLOCK ) n = HEADER_PREFETCH_BLOCK;
+
+		pf->constant = 0;
+		pf->first = idx;
+		for ( i=0; i<ndims; i++ ) {
+			f_offset[i] = 0;
+			f_count[i] = 1;
+		}
+		f_offset[vdim] = idx;
+		f_count[vdim] = n;
+
+	}
+
+	if ( (ndims > 0) && (H5Sselect_hyperslab(sh, H5S_SELECT_SET, f_offset,
+	                                         NULL, f_count, NULL) < 0) )
+	{
+		close_hdf5(fh);
+		return 1;
+	}
+
+	ms = H5Screate_simple(1, &n, NULL);
+
+	free(pf->vals_float);
+	free(pf->vals_int);
+	pf->vals_float = NULL;
+	pf->vals_int = NULL;
+	pf->n = 0;
+
+	if ( class == H5T_FLOAT ) {
+		pf->type = HEADER_FLOAT;
+		pf->vals_float = malloc(n*sizeof(double));
+		if ( pf->vals_float == NULL ) {
+			close_hdf5(fh);
+			return 1;
+		}
+		r = H5Dread(dh, H5T_NATIVE_DOUBLE, ms, sh, H5P_DEFAULT,
+		            pf->vals_float);
+	} else {
+		pf->type = HEADER_INT;
+		pf->vals_int = malloc(n*sizeof(int));
+		if ( pf->vals_int == NULL ) {
+			close_hdf5(fh);
+			return 1;
+		}
+		r = H5Dread(dh, H5T_NATIVE_INT, ms, sh, H5P_DEFAULT,
+		            pf->vals_int);
+	}
+
+	close_hdf5(fh);
+	if ( r < 0 ) return 1;
+
+	pf->n = n;
+	return 0;
+}
+
+
+/* Get a header value from the prefetched blocks, reading a new block if
+ * necessary.  Returns non-zero if the value should be read the normal way. */
+static int prefetched_header_to_cache(struct image *image, const char *name)
+{
+	char *subst_name;
+	char *key;
+	size_t len;
+	int *dim_vals;
+	int n_dim_vals;
+	int idx;
+	struct header_prefetch *pf;
+	struct prefetch_file *file;
+	int r = 0;
+
+	/* Only for files, not in-memory data */
+	if ( image->data_block != NULL ) return 1;
+	if ( image->filename == NULL ) return 1;
+
+	dim_vals = read_dim_parts(image->ev, &n_dim_vals);
+	if ( dim_vals == NULL ) return 1;
+	idx = (n_dim_vals > 0) ? dim_vals[0] : -1;
+	free(dim_vals);
+
+	subst_name = substitute_path(image->ev, name, 1);
+	if ( subst_name == NULL ) return 1;
+
+	len = strlen(image->filename) + strlen(subst_name) + 2;
+	key = malloc(len);
+	if ( key == NULL ) {
+		free(subst_name);
+		return 1;
+	}
+	snprintf(key, len, "%s\n%s", image->filename, subst_name);
+
+	pthread_mutex_lock(&header_prefetch_lock);
+
+	HASH_FIND_STR(prefetch_files, image->filename, file);
+	if ( file == NULL ) {
+		pthread_mutex_unlock(&header_prefetch_lock);
+		free(key);
+		free(subst_name);
+		return 1;
+	}
+
+	HASH_FIND_STR(header_prefetch, key, pf);
+
+	if ( (pf == NULL)
+	  || !same_file_identity(&pf->id, &file->id)
+	  || (!pf->constant && ((idx < 0) || (idx < pf->first)
+	                        || (idx >= pf->first+pf->n))) )
+	{
+		int new_pf = 0;
+
+		if ( pf == NULL ) {
+			if ( HASH_COUNT(header_prefetch) >= HEADER_PREFETCH_MAX ) {
+				clear_header_prefetch();
+			}
+			pf = calloc(1, sizeof(struct header_prefetch));
+			if ( pf == NULL ) {
+				pthread_mutex_unlock(&header_prefetch_lock);
+				free(key);
+				free(subst_name);
+				return 1;
+			}
+			pf->key = key;
+			key = NULL;
+			new_pf = 1;
+		}
+
+		profile_start("prefetch-headers");
+		r = read_header_block(pf, image->filename, subst_name, idx);
+		profile_end("prefetch-headers");
+		pf->id = file->id;
+
+		if ( new_pf ) {
+			if ( r == 0 ) {
+				HASH_ADD_KEYPTR(hh, header_prefetch, pf->key,
+				                strlen(pf->key), pf);
+			} else {
+				free_header_prefetch(pf);
+			}
+		} else if ( r != 0 ) {
+			HASH_DEL(header_prefetch, pf);
+			free_header_prefetch(pf);
+		}
+	}
+
+	if ( r == 0 ) {
+		hsize_t i = pf->constant ? 0 : idx - pf->first;
+		if ( pf->type == HEADER_FLOAT ) {
+			image_cache_header_float(image, name, pf->vals_float[i]);
+		} else {
+			image_cache_header_int(image, name, pf->vals_int[i]);
+		}
+	}
+
+	pthread_mutex_unlock(&header_prefetch_lock);
+
+	free(key);
+	free(subst_name);
+	return r;
+}
+
+
 int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 {
 	hid_t dh;
@@ -788,6 +1289,8 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 	int n_dim_vals;
 	int dim_val_pos;
 
+	if ( prefetched_header_to_cache(image, name) == 0 ) return 0;
+
 	fh = open_hdf5(image);
 	if ( fh < 0 ) {
 		ERROR("Couldn't open file (header): %s\n", image->filename);
@@ -1095,196 +1598,257 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 }
 
 
-static int read_peak_count(hid_t fh, char *path, int line,
-                           int *num_peaks)
+/* Number of consecutive events for which to read CXI peak lists in one go */
+#define PEAK_PREFETCH_BLOCK (64)
+
+/* CXI-style peak lists for a block of consecutive events in one file.  The
+ * file and datasets are kept open until peaks are needed from another file
+ * (or another peak list location). */
+struct cxi_peak_table
 {
+	char *filename;
+	char *path;
+
+	hid_t fh;
+	hid_t dh_n;
+	hid_t dh_x;
+	hid_t dh_y;
+	hid_t dh_i;
+
+	/* Number of events in the file, and maximum number of peaks per
+	 * event (the arrays might be bigger than needed - Cheetah allocates
+	 * in blocks of 2048) */
+	hsize_t n_events;
+	hsize_t max_peaks;
+
+	/* The block of events currently in memory */
+	hsize_t first;
+	hsize_t n;
+	hsize_t width;
+	int *num_peaks;
+	float *x;
+	float *y;
+	float *i;
+};
+
+static struct cxi_peak_table cxi_peaks = { .fh = -1 };
+static pthread_mutex_t cxi_peaks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void close_cxi_peak_table(struct cxi_peak_table *pt)
+{
+	if ( pt->fh >= 0 ) close_hdf5(pt->fh);
+	pt->fh = -1;
+	free(pt->filename);
+	free(pt->path);
+	free(pt->num_peaks);
+	free(pt->x);
+	free(pt->y);
+	free(pt->i);
+	pt->filename = NULL;
+	pt->path = NULL;
+	pt->num_peaks = NULL;
+	pt->x = NULL;
+	pt->y = NULL;
+	pt->i = NULL;
+	pt->n = 0;
+}
 
-	hid_t dh, sh, mh;
-	hsize_t size[1];
-	hsize_t max_size[1];
-	hsize_t offset[1], count[1];
-	hsize_t m_offset[1], m_count[1], dimmh[1];
-	int tw, r;
+
+static hid_t open_peak_dataset(hid_t fh, const char *path, int ndims_expected,
+                               hsize_t *size)
+{
+	hid_t dh, sh;
+	hsize_t max_size[2];
 
 	dh = H5Dopen2(fh, path, H5P_DEFAULT);
 	if ( dh < 0 ) {
 		ERROR("Data block %s not found.\n", path);
-		return 1;
+		return -1;
 	}
 
 	sh = H5Dget_space(dh);
 	if ( sh < 0 ) {
 		H5Dclose(dh);
 		ERROR("Couldn't get dataspace for data.\n");
-		return 1;
+		return -1;
 	}
 
-	if ( H5Sget_simple_extent_ndims(sh) != 1 ) {
+	if ( H5Sget_simple_extent_ndims(sh) != ndims_expected ) {
 		ERROR("Data block %s has the wrong dimensionality (%i).\n",
 		      path, H5Sget_simple_extent_ndims(sh));
 		H5Sclose(sh);
 		H5Dclose(dh);
-		return 1;
+		return -1;
 	}
 
 	H5Sget_simple_extent_dims(sh, size, max_size);
+	H5Sclose(sh);
+	return dh;
+}
 
-	tw = size[0];
 
-	if ( line > tw-1 ) {
-		H5Sclose(sh);
-		H5Dclose(dh);
-		ERROR("Data block %s does not contain data for required event.\n",
-		      path);
+static int open_cxi_peak_table(struct cxi_peak_table *pt,
+                               const char *filename, const char *path)
+{
+	char path_n[1024];
+	char path_x[1024];
+	char path_y[1024];
+	char path_i[1024];
+	hsize_t size_n[1];
+	hsize_t size_x[2];
+	hsize_t size_y[2];
+	hsize_t size_i[2];
+
+	close_cxi_peak_table(pt);
+
+	snprintf(path_n, 1024, "%s/nPeaks", path);
+	snprintf(path_x, 1024, "%s/peakXPosRaw", path);
+	snprintf(path_y, 1024, "%s/peakYPosRaw", path);
+	snprintf(path_i, 1024, "%s/peakTotalIntensity", path);
+
+	pt->fh = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+	if ( pt->fh < 0 ) {
+		ERROR("Couldn't open file (peaks/cxi): %s\n", filename);
 		return 1;
 	}
 
-	offset[0] = line;
-	count[0] = 1;
-
-	r = H5Sselect_hyperslab(sh, H5S_SELECT_SET,
-	                        offset, NULL, count, NULL);
-	if ( r < 0 ) {
-		ERROR("Error selecting file dataspace "
-		      "for data block %s\n", path);
-		H5Dclose(dh);
-		H5Sclose(sh);
+	/* NB Datasets are closed along with the file by close_hdf5() */
+	pt->dh_n = open_peak_dataset(pt->fh, path_n, 1, size_n);
+	pt->dh_x = open_peak_dataset(pt->fh, path_x, 2, size_x);
+	pt->dh_y = open_peak_dataset(pt->fh, path_y, 2, size_y);
+	pt->dh_i = open_peak_dataset(pt->fh, path_i, 2, size_i);
+	if ( (pt->dh_n < 0) || (pt->dh_x < 0)
+	  || (pt->dh_y < 0) || (pt->dh_i < 0) )
+	{
+		close_cxi_peak_table(pt);
 		return 1;
 	}
 
-	m_offset[0] = 0;
-	m_count[0] = 1;
-	dimmh[0] = 1;
-	mh = H5Screate_simple(1, dimmh, NULL);
-	r = H5Sselect_hyperslab(mh, H5S_SELECT_SET,
-	                        m_offset, NULL, m_count, NULL);
+	pt->n_events = size_n[0];
+	if ( size_x[0] < pt->n_events ) pt->n_events = size_x[0];
+	if ( size_y[0] < pt->n_events ) pt->n_events = size_y[0];
+	if ( size_i[0] < pt->n_events ) pt->n_events = size_i[0];
+
+	pt->max_peaks = size_x[1];
+	if ( size_y[1] < pt->max_peaks ) pt->max_peaks = size_y[1];
+	if ( size_i[1] < pt->max_peaks ) pt->max_peaks = size_i[1];
+
+	pt->filename = strdup(filename);
+	pt->path = strdup(path);
+	pt->n = 0;
+	return 0;
+}
+
+
+static int read_peak_block(hid_t dh, hsize_t first, hsize_t n,
+                           hsize_t width, float *buf)
+{
+	hid_t sh, mh;
+	hsize_t offset[2], count[2];
+	herr_t r;
+
+	sh = H5Dget_space(dh);
+	offset[0] = first;
+	offset[1] = 0;
+	count[0] = n;
+	count[1] = width;
+	r = H5Sselect_hyperslab(sh, H5S_SELECT_SET, offset, NULL, count, NULL);
 	if ( r < 0 ) {
-		ERROR("Error selecting memory dataspace "
-		      "for data block %s\n", path);
-		H5Dclose(dh);
+		ERROR("Error selecting file dataspace for peak block\n");
 		H5Sclose(sh);
-		H5Sclose(mh);
 		return 1;
 	}
 
-	r = H5Dread(dh, H5T_NATIVE_INT, mh,
-	            sh, H5P_DEFAULT, num_peaks);
+	mh = H5Screate_simple(2, count, NULL);
+	r = H5Dread(dh, H5T_NATIVE_FLOAT, mh, sh, H5P_DEFAULT, buf);
+	H5Sclose(mh);
+	H5Sclose(sh);
 	if ( r < 0 ) {
-		ERROR("Couldn't read data for block %s, line %i\n", path, line);
-		H5Dclose(dh);
-		H5Sclose(sh);
-		H5Sclose(mh);
+		ERROR("Couldn't read peak block (events %lli to %lli)\n",
+		      first, first+n-1);
 		return 1;
 	}
 
-	H5Dclose(dh);
-	H5Sclose(sh);
-	H5Sclose(mh);
 	return 0;
 }
 
 
-static float *read_peak_line(hid_t fh, char *path, int line,
-                             int num_peaks)
+/* Read the peak counts and peak data for up to PEAK_PREFETCH_BLOCK
+ * consecutive events starting with 'line' */
+static int load_cxi_peak_block(struct cxi_peak_table *pt, hsize_t line)
 {
+	hid_t sh, mh;
+	hsize_t offset[1], count[1];
+	hsize_t n, width, k;
+	herr_t r;
 
-	hid_t dh, sh, mh;
-	hsize_t size[2];
-	hsize_t max_size[2];
-	hsize_t offset[2], count[2];
-	hsize_t m_offset[2], m_count[2], dimmh[2];
-	float *buf;
-	int tw, r;
+	n = pt->n_events - line;
+	if ( n > PEAK_PREFETCH_BLOCK ) n = PEAK_PREFETCH_BLOCK;
 
-	dh = H5Dopen2(fh, path, H5P_DEFAULT);
-	if ( dh < 0 ) {
-		ERROR("Data block (%s) not found.\n", path);
-		return NULL;
-	}
+	free(pt->num_peaks);
+	free(pt->x);
+	free(pt->y);
+	free(pt->i);
+	pt->x = NULL;
+	pt->y = NULL;
+	pt->i = NULL;
+	pt->n = 0;
 
-	sh = H5Dget_space(dh);
-	if ( sh < 0 ) {
-		H5Dclose(dh);
-		ERROR("Couldn't get dataspace for data.\n");
-		return NULL;
-	}
+	pt->num_peaks = malloc(n*sizeof(int));
+	if ( pt->num_peaks == NULL ) return 1;
 
-	if ( H5Sget_simple_extent_ndims(sh) != 2 ) {
-		ERROR("Data block %s has the wrong dimensionality (%i).\n",
-		      path, H5Sget_simple_extent_ndims(sh));
+	sh = H5Dget_space(pt->dh_n);
+	offset[0] = line;
+	count[0] = n;
+	r = H5Sselect_hyperslab(sh, H5S_SELECT_SET, offset, NULL, count, NULL);
+	if ( r < 0 ) {
+		ERROR("Error selecting file dataspace for peak counts\n");
 		H5Sclose(sh);
-		H5Dclose(dh);
-		return NULL;
+		return 1;
 	}
-
-	H5Sget_simple_extent_dims(sh, size, max_size);
-
-	tw = size[0];
-	if ( line > tw-1 ) {
-		H5Sclose(sh);
-		H5Dclose(dh);
-		ERROR("Data block %s does not contain data for required event.\n",
-		      path);
-		return NULL;
+	mh = H5Screate_simple(1, count, NULL);
+	r = H5Dread(pt->dh_n, H5T_NATIVE_INT, mh, sh, H5P_DEFAULT,
+	            pt->num_peaks);
+	H5Sclose(mh);
+	H5Sclose(sh);
+	if ( r < 0 ) {
+		ERROR("Couldn't read peak counts for %s, line %lli\n",
+		      pt->path, line);
+		return 1;
 	}
 
-	/* NB The array might be bigger - Cheetah allocates in blocks of 2048 */
-	if ( size[1] < num_peaks ) {
-		ERROR("Data block %s is too small for the specified number of "
-		      "peaks (has %i, expected %i)\n", path, size[1], num_peaks);
-		H5Sclose(sh);
-		H5Dclose(dh);
-		return NULL;
+	/* Only read as many columns as needed for this block */
+	width = 0;
+	for ( k=0; k<n; k++ ) {
+		if ( (pt->num_peaks[k] > 0) && (pt->num_peaks[k] > width) ) {
+			width = pt->num_peaks[k];
+		}
 	}
+	if ( width > pt->max_peaks ) width = pt->max_peaks;
 
-	offset[0] = line;
-	offset[1] = 0;
-	count[0] = 1;
-	count[1] = size[1];
+	if ( width > 0 ) {
 
-	r = H5Sselect_hyperslab(sh, H5S_SELECT_SET, offset, NULL, count, NULL);
-	if ( r < 0 ) {
-	    ERROR("Error selecting file dataspace "
-	          "for data block %s\n", path);
-	    H5Dclose(dh);
-	    H5Sclose(sh);
-	    return NULL;
-	}
+		pt->x = malloc(n*width*sizeof(float));
+		pt->y = malloc(n*width*sizeof(float));
+		pt->i = malloc(n*width*sizeof(float));
+		if ( (pt->x == NULL) || (pt->y == NULL) || (pt->i == NULL) ) {
+			return 1;
+		}
 
-	m_offset[0] = 0;
-	m_offset[1] = 0;
-	m_count[0] = 1;
-	m_count[1] = size[1];
-	dimmh[0] = 1;
-	dimmh[1] = size[1];
+		profile_start("read-peak-block");
+		r = read_peak_block(pt->dh_x, line, n, width, pt->x)
+		 || read_peak_block(pt->dh_y, line, n, width, pt->y)
+		 || read_peak_block(pt->dh_i, line, n, width, pt->i);
+		profile_end("read-peak-block");
+		if ( r ) return 1;
 
-	mh = H5Screate_simple(2, dimmh, NULL);
-	r = H5Sselect_hyperslab(mh, H5S_SELECT_SET,
-	                        m_offset, NULL, m_count, NULL);
-	if ( r < 0 ) {
-		ERROR("Error selecting memory dataspace "
-		      "for data block %s\n", path);
-		H5Dclose(dh);
-		H5Sclose(sh);
-		H5Sclose(mh);
-		return NULL;
 	}
 
-	buf = malloc(size[1]*sizeof(float));
-	if ( buf == NULL ) return NULL;
-	r = H5Dread(dh, H5T_NATIVE_FLOAT, mh, sh, H5P_DEFAULT, buf);
-	if ( r < 0 ) {
-		ERROR("Couldn't read data for block %s, line %i\n", path, line);
-		H5Dclose(dh);
-		H5Sclose(sh);
-		H5Sclose(mh);
-		return NULL;
-	}
-
-	H5Dclose(dh);
-	H5Sclose(sh);
-	H5Sclose(mh);
-	return buf;
+	pt->first = line;
+	pt->n = n;
+	pt->width = width;
+	return 0;
 }
 
 
@@ -1294,21 +1858,16 @@ ImageFeatureList *image_hdf5_read_peaks_cxi(const DataTemplate *dtempl,
                                             int half_pixel_shift)
 {
 	ImageFeatureList *features;
-	hid_t fh;
-	char path_n[1024];
-	char path_x[1024];
-	char path_y[1024];
-	char path_i[1024];
-	int r;
+	struct cxi_peak_table *pt = &cxi_peaks;
 	int pk;
 	char *subst_name;
 	int line;
 	int num_peaks;
+	int *dim_vals;
+	int n_dim_vals;
 	float *buf_x;
 	float *buf_y;
 	float *buf_i;
-	int *dim_vals;
-	int n_dim_vals;
 
 	double peak_offset = half_pixel_shift ? 0.5 : 0.0;
 
@@ -1320,62 +1879,83 @@ ImageFeatureList *image_hdf5_read_peaks_cxi(const DataTemplate *dtempl,
 
 	subst_name = substitute_path(event, dtempl->peak_list, 0);
 	if ( subst_name == NULL ) {
-		ERROR("Invalid peak path %s\n", subst_name);
+		ERROR("Invalid peak path %s\n", dtempl->peak_list);
 		return NULL;
 	}
 
 	dim_vals = read_dim_parts(event, &n_dim_vals);
 	if ( dim_vals == NULL ) {
-		ERROR("Couldn't parse event '%s'\n");
+		ERROR("Couldn't parse event '%s'\n", event);
+		free(subst_name);
 		return NULL;
 	}
 
 	if ( n_dim_vals < 1 ) {
 		ERROR("Not enough dimensions in event ID to use CXI "
 		      "peak lists (%i)\n", n_dim_vals);
+		free(subst_name);
+		free(dim_vals);
 		return NULL;
 	}
 
 	line = dim_vals[0];
 	free(dim_vals);
 
-	snprintf(path_n, 1024, "%s/nPeaks", subst_name);
-	snprintf(path_x, 1024, "%s/peakXPosRaw", subst_name);
-	snprintf(path_y, 1024, "%s/peakYPosRaw", subst_name);
-	snprintf(path_i, 1024, "%s/peakTotalIntensity", subst_name);
-
-	fh = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-	if ( fh < 0 ) {
-		ERROR("Couldn't open file (peaks/cxi): %s\n", filename);
-		return NULL;
-	}
+	pthread_mutex_lock(&cxi_peaks_lock);
 
-	r = read_peak_count(fh, path_n, line, &num_peaks);
-	if ( r != 0 ) {
-		close_hdf5(fh);
-		return NULL;
+	if ( (pt->fh < 0)
+	  || (strcmp(pt->filename, filename) != 0)
+	  || (strcmp(pt->path, subst_name) != 0) )
+	{
+		if ( open_cxi_peak_table(pt, filename, subst_name) ) {
+			pthread_mutex_unlock(&cxi_peaks_lock);
+			free(subst_name);
+			return NULL;
+		}
 	}
 
-	buf_x = read_peak_line(fh, path_x, line, num_peaks);
-	if ( buf_x == NULL ) {
-		close_hdf5(fh);
-		return NULL;
+	if ( (line < 0) || (line >= pt->n_events) ) {
+		/* The file might have grown since we opened it */
+		if ( open_cxi_peak_table(pt, filename, subst_name) == 0 ) {
+			if ( (line < 0) || (line >= pt->n_events) ) {
+				ERROR("Data block %s does not contain data for "
+				      "required event.\n", subst_name);
+				close_cxi_peak_table(pt);
+			}
+		}
+		if ( pt->fh < 0 ) {
+			pthread_mutex_unlock(&cxi_peaks_lock);
+			free(subst_name);
+			return NULL;
+		}
 	}
 
-	buf_y = read_peak_line(fh, path_y, line, num_peaks);
-	if ( buf_y == NULL ) {
-		close_hdf5(fh);
-		return NULL;
+	if ( (line < pt->first) || (line >= pt->first + pt->n) ) {
+		if ( load_cxi_peak_block(pt, line) ) {
+			close_cxi_peak_table(pt);
+			pthread_mutex_unlock(&cxi_peaks_lock);
+			free(subst_name);
+			return NULL;
+		}
 	}
 
-	buf_i = read_peak_line(fh, path_i, line, num_peaks);
-	if ( buf_i == NULL ) {
-		close_hdf5(fh);
+	num_peaks = pt->num_peaks[line - pt->first];
+	if ( (num_peaks > 0) && (num_peaks > pt->max_peaks) ) {
+		ERROR("Data block %s is too small for the specified number of "
+		      "peaks (has %lli, expected %i)\n", subst_name,
+		      pt->max_peaks, num_peaks);
+		pthread_mutex_unlock(&cxi_peaks_lock);
+		free(subst_name);
 		return NULL;
 	}
+	free(subst_name);
 
 	features = image_feature_list_new();
 
+	buf_x = pt->x + (line - pt->first)*pt->width;
+	buf_y = pt->y + (line - pt->first)*pt->width;
+	buf_i = pt->i + (line - pt->first)*pt->width;
+
 	for ( pk=0; pk<num_peaks; pk++ ) {
 
 		float fs, ss, val;
@@ -1397,7 +1977,7 @@ ImageFeatureList *image_hdf5_read_peaks_cxi(const DataTemplate *dtempl,
 
 	}
 
-	close_hdf5(fh);
+	pthread_mutex_unlock(&cxi_peaks_lock);
 
 	return features;
 }
@@ -37,8 +37,11 @@
 extern int image_hdf5_read_header_to_cache(struct image *image,
                                            const char *name);
 
+extern void image_hdf5_check_header_prefetch(const char *filename);
+
 extern int image_hdf5_read(struct image *image,
-                           const DataTemplate *dtempl);
+                           const DataTemplate *dtempl,
+                           PixelStorageType compact_type);
 
 extern int image_hdf5_read_mask(struct panel_template *p,
                                 const char *filename,
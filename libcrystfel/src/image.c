@@ -33,6 +33,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <fenv.h>
 
@@ -289,19 +290,73 @@ void free_all_crystals(struct image *image)
 }
 
 
-static struct header_cache_entry *find_cache_entry(struct image *image,
-                                                   const char *name)
+static unsigned int header_name_hash(const char *name)
+{
+	unsigned int h = 5381;
+	while ( *name != '\0' ) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h & (HEADER_CACHE_INDEX_SIZE-1);
+}
+
+
+static void index_cache_entry(struct image *image, int idx)
+{
+	unsigned int h = header_name_hash(image->header_cache[idx]->header_name);
+
+	while ( image->header_cache_index[h] != 0 ) {
+		h = (h+1) & (HEADER_CACHE_INDEX_SIZE-1);
+	}
+	image->header_cache_index[h] = idx+1;
+}
+
+
+/* Make sure the hash index matches the contents of the header cache.
+ * This is needed if the image structure was copied and the header cache
+ * emptied by setting n_cached_headers to zero. */
+static void check_cache_index(struct image *image)
 {
 	int i;
+
+	if ( image->n_indexed_headers == image->n_cached_headers ) return;
+
+	memset(image->header_cache_index, 0,
+	       HEADER_CACHE_INDEX_SIZE*sizeof(int));
 	for ( i=0; i<image->n_cached_headers; i++ ) {
-		if ( strcmp(name, image->header_cache[i]->header_name) == 0 ) {
-			return image->header_cache[i];
-		}
+		index_cache_entry(image, i);
+	}
+	image->n_indexed_headers = image->n_cached_headers;
+}
+
+
+static struct header_cache_entry *find_cache_entry(struct image *image,
+                                                   const char *name)
+{
+	unsigned int h;
+
+	check_cache_index(image);
+
+	h = header_name_hash(name);
+	while ( image->header_cache_index[h] != 0 ) {
+		struct header_cache_entry *ce;
+		ce = image->header_cache[image->header_cache_index[h]-1];
+		if ( strcmp(name, ce->header_name) == 0 ) return ce;
+		h = (h+1) & (HEADER_CACHE_INDEX_SIZE-1);
 	}
 	return NULL;
 }
 
 
+static void add_cache_entry(struct image *image, struct header_cache_entry *ce)
+{
+	check_cache_index(image);
+	image->header_cache[image->n_cached_headers] = ce;
+	index_cache_entry(image, image->n_cached_headers);
+	image->n_cached_headers++;
+	image->n_indexed_headers++;
+}
+
+
 void image_cache_header_int(struct image *image,
                             const char *header_name,
                             int header_val)
@@ -317,7 +372,7 @@ void image_cache_header_int(struct image *image,
 			ce->header_name = strdup(header_name);
 			ce->val_int = header_val;
 			ce->type = HEADER_INT;
-			image->header_cache[image->n_cached_headers++] = ce;
+			add_cache_entry(image, ce);
 		} else {
 			ERROR("Failed to add header cache entry.\n");
 		}
@@ -340,7 +395,7 @@ void image_cache_header_float(struct image *image,
 			ce->header_name = strdup(header_name);
 			ce->val_float = header_val;
 			ce->type = HEADER_FLOAT;
-			image->header_cache[image->n_cached_headers++] = ce;
+			add_cache_entry(image, ce);
 		} else {
 			ERROR("Failed to add header cache entry.\n");
 		}
@@ -368,7 +423,7 @@ void image_cache_header_str(struct image *image,
 			ce->header_name = strdup(header_name);
 			ce->val_str = strdup(header_val);
 			ce->type = HEADER_STR;
-			image->header_cache[image->n_cached_headers++] = ce;
+			add_cache_entry(image, ce);
 		} else {
 			ERROR("Failed to add header cache entry.\n");
 		}
@@ -568,8 +623,152 @@ int image_create_dp_bad_sat(struct image *image,
 }
 
 
+static uint16_t *compact_panel_uint16(const float *dp, const int *bad,
+                                      size_t nel, float scale)
+{
+	size_t i;
+	uint16_t *d = malloc(nel*sizeof(uint16_t));
+	if ( d == NULL ) return NULL;
+
+	for ( i=0; i<nel; i++ ) {
+
+		float v;
+		uint16_t raw;
+
+		if ( (bad != NULL) && bad[i] ) {
+			d[i] = 0;
+			continue;
+		}
+
+		v = dp[i] / scale;
+		if ( !((v >= 0.0) && (v <= 65535.0)) ) break;
+		raw = lrintf(v);
+		if ( scale * (float)raw != dp[i] ) break;
+		d[i] = raw;
+
+	}
+
+	if ( i < nel ) {
+		free(d);
+		return NULL;
+	}
+	return d;
+}
+
+
+static int32_t *compact_panel_int32(const float *dp, const int *bad,
+                                    size_t nel, float scale)
+{
+	size_t i;
+	int32_t *d = malloc(nel*sizeof(int32_t));
+	if ( d == NULL ) return NULL;
+
+	for ( i=0; i<nel; i++ ) {
+
+		float v;
+		int32_t raw;
+
+		if ( (bad != NULL) && bad[i] ) {
+			d[i] = 0;
+			continue;
+		}
+
+		v = dp[i] / scale;
+		if ( !((v >= -2147483648.0) && (v < 2147483648.0)) ) break;
+		raw = lrintf(v);
+		if ( scale * (float)raw != dp[i] ) break;
+		d[i] = raw;
+
+	}
+
+	if ( i < nel ) {
+		free(d);
+		return NULL;
+	}
+	return d;
+}
+
+
+void image_free_compact_data(struct image *image)
+{
+	int i;
+
+	if ( image->dp_compact == NULL ) return;
+
+	if ( image->detgeom != NULL ) {
+		for ( i=0; i<image->detgeom->n_panels; i++ ) {
+			free(image->dp_compact[i]);
+		}
+	}
+	free(image->dp_compact);
+	image->dp_compact = NULL;
+	image->compact_type = PIXEL_STORAGE_FLOAT;
+}
+
+
+/**
+ * \param image An \ref image structure, with image data
+ * \param type The storage type for the compact copy
+ * \param scale The value of one unit of the compact representation
+ *
+ * Creates a compact integer copy of the image data, which will be used by
+ * the peakfinder8 and ring integration routines instead of \p image->dp.
+ * The float data is left in place for everything else.  Any existing compact
+ * copy is discarded first, so PIXEL_STORAGE_FLOAT simply removes it.
+ *
+ * The copy is only made if every pixel not marked as bad can be represented
+ * exactly, i.e. if the data is already an integer multiple of \p scale and in
+ * range for \p type.  Otherwise, nothing is changed and all routines carry on
+ * using the float data.
+ *
+ * \returns zero if the compact copy was made, non-zero otherwise.
+ */
+int image_make_compact_data(struct image *image, PixelStorageType type,
+                            float scale)
+{
+	int i;
+
+	image_free_compact_data(image);
+
+	if ( type == PIXEL_STORAGE_FLOAT ) return 0;
+	if ( (image->dp == NULL) || (image->detgeom == NULL) ) return 1;
+	if ( !(scale > 0.0) || !isfinite(scale) ) return 1;
+
+	image->dp_compact = calloc(image->detgeom->n_panels, sizeof(void *));
+	if ( image->dp_compact == NULL ) return 1;
+
+	for ( i=0; i<image->detgeom->n_panels; i++ ) {
+
+		struct detgeom_panel *p = &image->detgeom->panels[i];
+		size_t nel = p->w * p->h;
+		const int *bad = (image->bad != NULL) ? image->bad[i] : NULL;
+
+		if ( type == PIXEL_STORAGE_UINT16 ) {
+			image->dp_compact[i] = compact_panel_uint16(image->dp[i],
+			                                            bad, nel,
+			                                            scale);
+		} else {
+			image->dp_compact[i] = compact_panel_int32(image->dp[i],
+			                                           bad, nel,
+			                                           scale);
+		}
+
+		if ( image->dp_compact[i] == NULL ) {
+			image_free_compact_data(image);
+			return 1;
+		}
+
+	}
+
+	image->compact_type = type;
+	image->compact_scale = scale;
+	return 0;
+}
+
+
 static int image_read_image_data(struct image *image,
-                                 const DataTemplate *dtempl)
+                                 const DataTemplate *dtempl,
+                                 PixelStorageType compact_type)
 {
 	if ( (image->data_block == NULL)
 	  && (!file_exists(image->filename)) )
@@ -587,7 +786,7 @@ static int image_read_image_data(struct image *image,
 
 		case DATA_SOURCE_TYPE_HDF5:
 		#ifdef HAVE_HDF5
-		return image_hdf5_read(image, dtempl);
+		return image_hdf5_read(image, dtempl, compact_type);
 		#else
 		return 1;
 		#endif
@@ -1092,18 +1291,29 @@ struct image *image_create_for_simulation(const DataTemplate *dtempl)
 
 
 static int do_image_read(struct image *image, const DataTemplate *dtempl,
-                         int no_image_data, int no_mask_data)
+                         int no_image_data, int no_mask_data,
+                         PixelStorageType compact_type)
 {
 	int i;
 	int r;
 
 	if ( image_create_dp_bad_sat(image, dtempl) ) return 1;
 
+	#ifdef HAVE_HDF5
+	/* Once per frame, so that prefetched header values don't need to
+	 * check the file every time */
+	if ( (image->data_source_type == DATA_SOURCE_TYPE_HDF5)
+	  && (image->data_block == NULL) )
+	{
+		image_hdf5_check_header_prefetch(image->filename);
+	}
+	#endif
+
 	/* Load the image data */
 	if ( !no_image_data ) {
 		int r;
 		profile_start("load-image-data");
-		r = image_read_image_data(image, dtempl);
+		r = image_read_image_data(image, dtempl, compact_type);
 		profile_end("load-image-data");
 		if ( r ) return r;
 	} else {
@@ -1150,11 +1360,30 @@ static int do_image_read(struct image *image, const DataTemplate *dtempl,
 }
 
 
-struct image *image_read(const DataTemplate *dtempl,
-                         const char *filename,
-                         const char *event,
-                         int no_image_data,
-                         int no_mask_data)
+/**
+ * \param dtempl A \ref DataTemplate
+ * \param filename The filename to read from
+ * \param event The event ID, or NULL for a single-frame file
+ * \param no_image_data Non-zero to skip loading the image data
+ * \param no_mask_data Non-zero to skip loading the bad pixel masks
+ * \param compact_type The storage type for a compact copy of the data
+ *
+ * As \ref image_read, but if the image data is stored as integers which fit
+ * into \p compact_type, it will be read straight into a compact copy of the
+ * data (see \ref image_make_compact_data) with a scale factor of 1, and the
+ * float data will be made from that.  This is cheaper than making the
+ * compact copy afterwards.  Otherwise, or if \p compact_type is
+ * PIXEL_STORAGE_FLOAT, there will be no compact copy.  Currently, only HDF5
+ * files can be read in this way.
+ *
+ * \returns the new \ref image structure, or NULL on error.
+ */
+struct image *image_read_compact(const DataTemplate *dtempl,
+                                 const char *filename,
+                                 const char *event,
+                                 int no_image_data,
+                                 int no_mask_data,
+                                 PixelStorageType compact_type)
 {
 	struct image *image;
 
@@ -1180,7 +1409,9 @@ struct image *image_read(const DataTemplate *dtempl,
 
 	image->data_source_type = file_type(image->filename);
 
-	if ( do_image_read(image, dtempl, no_image_data, no_mask_data) ) {
+	if ( do_image_read(image, dtempl, no_image_data, no_mask_data,
+	                   compact_type) )
+	{
 		image_free(image);
 		return NULL;
 	}
@@ -1189,6 +1420,17 @@ struct image *image_read(const DataTemplate *dtempl,
 }
 
 
+struct image *image_read(const DataTemplate *dtempl,
+                         const char *filename,
+                         const char *event,
+                         int no_image_data,
+                         int no_mask_data)
+{
+	return image_read_compact(dtempl, filename, event, no_image_data,
+	                          no_mask_data, PIXEL_STORAGE_FLOAT);
+}
+
+
 struct image *image_read_data_block(const DataTemplate *dtempl,
                                     void *data_block,
                                     size_t data_block_size,
@@ -1219,7 +1461,9 @@ struct image *image_read_data_block(const DataTemplate *dtempl,
 
 	image->data_source_type = type;
 
-	if ( do_image_read(image, dtempl, no_image_data, no_mask_data) ) {
+	if ( do_image_read(image, dtempl, no_image_data, no_mask_data,
+	                   PIXEL_STORAGE_FLOAT) )
+	{
 		image_free(image);
 		ERROR("Failed to load image\n");
 		return NULL;
@@ -1236,6 +1480,7 @@ void image_free(struct image *image)
 	if ( image == NULL ) return;
 	image_feature_list_free(image->features);
 	free_all_crystals(image);
+	image_free_compact_data(image);
 	spectrum_free(image->spectrum);
 	free(image->filename);
 	free(image->ev);
@@ -1277,6 +1522,9 @@ struct image *image_new()
 	image->dp = NULL;
 	image->bad = NULL;
 	image->sat = NULL;
+	image->compact_type = PIXEL_STORAGE_FLOAT;
+	image->dp_compact = NULL;
+	image->compact_scale = 1.0;
 	image->hit = 0;
 	image->crystals = NULL;
 	image->n_crystals = 0;
@@ -1290,6 +1538,9 @@ struct image *image_new()
 	image->data_source_type = DATA_SOURCE_TYPE_UNKNOWN;
 
 	image->n_cached_headers = 0;
+	image->n_indexed_headers = 0;
+	memset(image->header_cache_index, 0,
+	       HEADER_CACHE_INDEX_SIZE*sizeof(int));
 	image->id = 0;
 	image->serial = 0;
 	image->spectrum = NULL;
@@ -78,6 +78,10 @@ typedef struct _imagefeaturelist ImageFeatureList;
 
 #define HEADER_CACHE_SIZE (128)
 
+/* Size of hash table for header cache lookups (power of two, and at least
+ * twice HEADER_CACHE_SIZE to keep probe sequences short) */
+#define HEADER_CACHE_INDEX_SIZE (256)
+
 typedef enum
 {
 	HEADER_FLOAT,
@@ -108,6 +112,23 @@ typedef enum
 } DataSourceType;
 
 
+/**
+ * Storage types for the optional compact copy of the image data
+ * (see \ref image_make_compact_data).
+ */
+typedef enum
+{
+	/** No compact copy: only \p dp is used */
+	PIXEL_STORAGE_FLOAT,
+
+	/** Unsigned 16-bit integers, multiplied by \p compact_scale */
+	PIXEL_STORAGE_UINT16,
+
+	/** Signed 32-bit integers, multiplied by \p compact_scale */
+	PIXEL_STORAGE_INT32
+} PixelStorageType;
+
+
 struct image
 {
 	/** The image data, by panel */
@@ -119,6 +140,19 @@ struct image
 	/** The per-pixel saturation values, by panel */
 	float                   **sat;
 
+	/** The type of \p dp_compact, or PIXEL_STORAGE_FLOAT if there is no
+	 * compact copy of the image data */
+	PixelStorageType         compact_type;
+
+	/** Compact integer copy of \p dp, by panel.  For every pixel not
+	 * marked as bad, dp[pn][i] == compact_scale * dp_compact[pn][i]
+	 * (to within float precision).  The values of bad pixels are
+	 * undefined. */
+	void                   **dp_compact;
+
+	/** The scale factor for \p dp_compact */
+	float                    compact_scale;
+
 	/** Non-zero if the frame was determined to be a "hit" */
 	int                     hit;
 
@@ -155,6 +189,12 @@ struct image
 	struct header_cache_entry *header_cache[HEADER_CACHE_SIZE];
 	int                        n_cached_headers;
 
+	/** Hash table of indices into \p header_cache, plus one (zero means
+	 * an empty slot).  Rebuilt automatically if \p n_cached_headers is
+	 * changed behind its back. */
+	int                        header_cache_index[HEADER_CACHE_INDEX_SIZE];
+	int                        n_indexed_headers;
+
 	/** ID number of the worker processing handling this image */
 	int                     id;
 
@@ -223,6 +263,13 @@ extern struct image *image_read(const DataTemplate *dtempl,
                                 int no_image_data,
                                 int no_mask_data);
 
+extern struct image *image_read_compact(const DataTemplate *dtempl,
+                                        const char *filename,
+                                        const char *event,
+                                        int no_image_data,
+                                        int no_mask_data,
+                                        PixelStorageType compact_type);
+
 extern struct image *image_create_for_simulation(const DataTemplate *dtempl);
 extern struct image *image_read_data_block(const DataTemplate *dtempl,
                                            void *data_block,
@@ -266,6 +313,10 @@ extern int image_create_dp_bad_sat(struct image *image,
 extern int image_set_zero_data(struct image *image,
                                const DataTemplate *dtempl);
 
+extern int image_make_compact_data(struct image *image,
+                                   PixelStorageType type, float scale);
+extern void image_free_compact_data(struct image *image);
+
 extern int image_write(const struct image *image,
                        const DataTemplate *dtempl,
                        const char *filename);
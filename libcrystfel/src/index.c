@@ -69,6 +69,7 @@ struct _indexingprivate
 {
 	IndexingFlags flags;
 	UnitCell *target_cell;
+	PreparedReference *target_prepared;
 	double tolerance[6];
 	double wavelength_estimate;
 	int n_threads;
@@ -437,8 +438,10 @@ IndexingPrivate *setup_indexing(const char *method_list,
 
 	if ( cell != NULL ) {
 		ipriv->target_cell = cell_new_from_cell(cell);
+		ipriv->target_prepared = prepare_reference_cell(cell);
 	} else {
 		ipriv->target_cell = NULL;
+		ipriv->target_prepared = NULL;
 	}
 	for ( i=0; i<6; i++ ) ipriv->tolerance[i] = tols[i];
 
@@ -524,13 +527,14 @@ void cleanup_indexing(IndexingPrivate *ipriv)
 	free(ipriv->methods);
 	free(ipriv->engine_private);
 	cell_free(ipriv->target_cell);
+	prepared_reference_free(ipriv->target_prepared);
 	free(ipriv);
 }
 
 
 /* Return 0 for cell OK, 1 for cell incorrect */
 static int check_cell(IndexingFlags flags, Crystal *cr, UnitCell *target,
-                      double *tolerance)
+                      PreparedReference *prepared, double *tolerance)
 {
 	UnitCell *out;
 	RationalMatrix *rm;
@@ -544,8 +548,10 @@ static int check_cell(IndexingFlags flags, Crystal *cr, UnitCell *target,
 	if ( !right_handed(crystal_get_cell(cr)) ) {
 		STATUS("WARNING: unmatched cell is left handed\n");
 	}
-	out = compare_reindexed_cell_parameters(crystal_get_cell(cr), target,
-	                                        tolerance, &rm);
+	if ( prepared == NULL ) return 1;
+	out = compare_reindexed_cell_parameters_prepared(crystal_get_cell(cr),
+	                                                 prepared, tolerance,
+	                                                 &rm);
 
 	if ( out != NULL ) {
 
@@ -705,7 +711,7 @@ static int try_indexer(struct image *image, IndexingMethod indm,
 		/* Pre-refinement unit cell check if requested */
 		profile_start("prerefine-cell-check");
 		r = check_cell(ipriv->flags, cr, ipriv->target_cell,
-		               ipriv->tolerance);
+		               ipriv->target_prepared, ipriv->tolerance);
 		profile_end("prerefine-cell-check");
 		if ( r ) {
 			crystal_set_user_flag(cr, 1);
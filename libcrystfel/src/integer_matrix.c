@@ -167,6 +167,54 @@ signed int intmat_get(const IntegerMatrix *m, unsigned int i, unsigned int j)
 }
 
 
+/**
+ * \param m An \ref IntegerMatrix
+ * \param out Location to store the result
+ *
+ * Copies \p m into the value type \ref IntegerMatrix3.
+ *
+ * \returns Zero on success, or non-zero if \p m is not a 3x3 matrix.
+ **/
+int intmat3_from_intmat(const IntegerMatrix *m, IntegerMatrix3 *out)
+{
+	int i, j;
+
+	if ( (m->rows != 3) || (m->cols != 3) ) return 1;
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			out->v[i][j] = m->v[j + 3*i];
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * \param m An \ref IntegerMatrix3
+ *
+ * \returns A newly allocated \ref IntegerMatrix with the same contents as
+ * \p m, or NULL on error.
+ **/
+IntegerMatrix *intmat_from_intmat3(IntegerMatrix3 m)
+{
+	IntegerMatrix *n;
+	int i, j;
+
+	n = intmat_new(3, 3);
+	if ( n == NULL ) return NULL;
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			n->v[j + 3*i] = m.v[i][j];
+		}
+	}
+
+	return n;
+}
+
+
 /**
  * \param P An \ref IntegerMatrix
  * \param hkl An array of signed integers
@@ -193,6 +241,13 @@ signed int *transform_indices(const IntegerMatrix *P, const signed int *hkl)
 	ans = malloc(P->rows * sizeof(signed int));
 	if ( ans == NULL ) return NULL;
 
+	if ( (P->rows == 3) && (P->cols == 3) ) {
+		IntegerMatrix3 P3;
+		intmat3_from_intmat(P, &P3);
+		intmat3_transform_indices(P3, hkl, ans);
+		return ans;
+	}
+
 	for ( j=0; j<P->cols; j++ ) {
 
 		unsigned int i;
@@ -224,7 +279,14 @@ IntegerMatrix *intmat_times_intmat(const IntegerMatrix *a,
 
 	if ( a->cols != b->rows ) return NULL;
 
-	ans = intmat_new(a->rows, a->cols);
+	if ( (a->rows == 3) && (a->cols == 3) && (b->cols == 3) ) {
+		IntegerMatrix3 a3, b3;
+		intmat3_from_intmat(a, &a3);
+		intmat3_from_intmat(b, &b3);
+		return intmat_from_intmat3(intmat3_times_intmat3(a3, b3));
+	}
+
+	ans = intmat_new(a->rows, b->cols);
 	if ( ans == NULL ) return NULL;
 
 	for ( i=0; i<ans->rows; i++ ) {
@@ -315,6 +377,12 @@ signed int intmat_det(const IntegerMatrix *m)
 
 	assert(m->rows == m->cols);  /* Otherwise determinant doesn't exist */
 
+	if ( m->rows == 3 ) {
+		IntegerMatrix3 m3;
+		intmat3_from_intmat(m, &m3);
+		return intmat3_det(m3);
+	}
+
 	if ( m->rows == 2 ) {
 		return intmat_get(m, 0, 0)*intmat_get(m, 1, 1)
 		     - intmat_get(m, 0, 1)*intmat_get(m, 1, 0);
@@ -376,6 +444,13 @@ IntegerMatrix *intmat_inverse(const IntegerMatrix *m)
 		return NULL;
 	}
 
+	if ( m->rows == 3 ) {
+		IntegerMatrix3 m3, inv3;
+		intmat3_from_intmat(m, &m3);
+		intmat3_inverse(m3, &inv3);
+		return intmat_from_intmat3(inv3);
+	}
+
 	adjugateT = intmat_cofactors(m);
 	if ( adjugateT == NULL ) return NULL;
 
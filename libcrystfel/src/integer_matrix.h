@@ -39,6 +39,20 @@
  **/
 typedef struct _integermatrix IntegerMatrix;
 
+/**
+ * The \p IntegerMatrix3 is an opaque-ish data structure representing a 3x3
+ * integer matrix.
+ *
+ * Unlike \ref IntegerMatrix, it is a value type: it can be declared on the
+ * stack, assigned and returned from functions, and none of the operations on
+ * it need to allocate memory.  You shouldn't look at or set its contents,
+ * except by using the accessor functions.
+ **/
+typedef struct {
+	/* Private, don't modify */
+	signed int v[3][3];
+} IntegerMatrix3;
+
 #include "rational.h"
 
 #ifdef __cplusplus
@@ -91,6 +105,125 @@ extern int intmat_equals(const IntegerMatrix *a, const IntegerMatrix *b);
 /* Diagnostics */
 extern void intmat_print(const IntegerMatrix *m);
 
+/* Conversion to and from 3x3 value type */
+extern int intmat3_from_intmat(const IntegerMatrix *m, IntegerMatrix3 *out);
+extern IntegerMatrix *intmat_from_intmat3(IntegerMatrix3 m);
+
+
+static inline IntegerMatrix3 intmat3_zero(void)
+{
+	IntegerMatrix3 m = {{{0,0,0},{0,0,0},{0,0,0}}};
+	return m;
+}
+
+
+static inline IntegerMatrix3 intmat3_identity(void)
+{
+	IntegerMatrix3 m = {{{1,0,0},{0,1,0},{0,0,1}}};
+	return m;
+}
+
+
+static inline signed int intmat3_get(IntegerMatrix3 m,
+                                     unsigned int i, unsigned int j)
+{
+	return m.v[i][j];
+}
+
+
+static inline void intmat3_set(IntegerMatrix3 *m,
+                               unsigned int i, unsigned int j, signed int v)
+{
+	m->v[i][j] = v;
+}
+
+
+/* Same as intmat_times_intmat() */
+static inline IntegerMatrix3 intmat3_times_intmat3(IntegerMatrix3 a,
+                                                   IntegerMatrix3 b)
+{
+	IntegerMatrix3 ans;
+	int i, j;
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			ans.v[i][j] = a.v[i][0]*b.v[0][j]
+			            + a.v[i][1]*b.v[1][j]
+			            + a.v[i][2]*b.v[2][j];
+		}
+	}
+	return ans;
+}
+
+
+/* Same as transform_indices(), putting the answer in 'ans' */
+static inline void intmat3_transform_indices(IntegerMatrix3 P,
+                                             const signed int *hkl,
+                                             signed int *ans)
+{
+	int j;
+	for ( j=0; j<3; j++ ) {
+		ans[j] = P.v[0][j]*hkl[0] + P.v[1][j]*hkl[1] + P.v[2][j]*hkl[2];
+	}
+}
+
+
+static inline signed int intmat3_det(IntegerMatrix3 m)
+{
+	return m.v[0][0]*(m.v[1][1]*m.v[2][2] - m.v[1][2]*m.v[2][1])
+	     - m.v[0][1]*(m.v[1][0]*m.v[2][2] - m.v[1][2]*m.v[2][0])
+	     + m.v[0][2]*(m.v[1][0]*m.v[2][1] - m.v[1][1]*m.v[2][0]);
+}
+
+
+/* Same as intmat_inverse(), for a matrix whose determinant is +1 or -1.
+ * Returns non-zero (and leaves 'ans' alone) if that is not the case. */
+static inline int intmat3_inverse(IntegerMatrix3 m, IntegerMatrix3 *ans)
+{
+	signed int det = intmat3_det(m);
+	int i, j;
+
+	if ( (det != +1) && (det != -1) ) return 1;
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			/* Cofactor of element j,i */
+			int r0 = (i+1) % 3;
+			int r1 = (i+2) % 3;
+			int c0 = (j+1) % 3;
+			int c1 = (j+2) % 3;
+			signed int cof = m.v[c0][r0]*m.v[c1][r1]
+			               - m.v[c0][r1]*m.v[c1][r0];
+			ans->v[i][j] = cof * det;
+		}
+	}
+	return 0;
+}
+
+
+static inline int intmat3_equals(IntegerMatrix3 a, IntegerMatrix3 b)
+{
+	int i, j;
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			if ( a.v[i][j] != b.v[i][j] ) return 0;
+		}
+	}
+	return 1;
+}
+
+
+static inline int intmat3_is_identity(IntegerMatrix3 m)
+{
+	return intmat3_equals(m, intmat3_identity());
+}
+
+
+static inline int intmat3_is_inversion(IntegerMatrix3 m)
+{
+	IntegerMatrix3 inv = {{{-1,0,0},{0,-1,0},{0,0,-1}}};
+	return intmat3_equals(m, inv);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,6 +29,7 @@
 #include <libcrystfel-config.h>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
 #include <gsl/gsl_matrix.h>
@@ -174,6 +175,76 @@ static float boxi(struct intcontext *ic, struct peak_box *bx, int p, int q)
 }
 
 
+/* Sum of the raw values of the compact copy of the image data, over the
+ * pixels of the box with mask value 'v' */
+static int64_t compact_area_sum(struct intcontext *ic, struct peak_box *bx,
+                                enum boxmask_val v, int *pn)
+{
+	int p, q;
+	int64_t sum = 0;
+	int n = 0;
+	const int w = bx->p->w;
+
+	if ( ic->image->compact_type == PIXEL_STORAGE_UINT16 ) {
+		const uint16_t *d = ic->image->dp_compact[bx->pn];
+		for ( q=0; q<ic->w; q++ ) {
+		for ( p=0; p<ic->w; p++ ) {
+			if ( bx->bm[p + ic->w*q] != v ) continue;
+			sum += d[bx->cfs+p + w*(bx->css+q)];
+			n++;
+		}
+		}
+	} else {
+		const int32_t *d = ic->image->dp_compact[bx->pn];
+		for ( q=0; q<ic->w; q++ ) {
+		for ( p=0; p<ic->w; p++ ) {
+			if ( bx->bm[p + ic->w*q] != v ) continue;
+			sum += d[bx->cfs+p + w*(bx->css+q)];
+			n++;
+		}
+		}
+	}
+
+	if ( pn != NULL ) *pn = n;
+	return sum;
+}
+
+
+/* Sum of squared deviations from 'mean' (in raw units) of the compact copy of
+ * the image data, over the pixels of the box with mask value 'v' */
+static double compact_area_ssd(struct intcontext *ic, struct peak_box *bx,
+                               enum boxmask_val v, double mean)
+{
+	int p, q;
+	double ssd = 0.0;
+	const int w = bx->p->w;
+
+	if ( ic->image->compact_type == PIXEL_STORAGE_UINT16 ) {
+		const uint16_t *d = ic->image->dp_compact[bx->pn];
+		for ( q=0; q<ic->w; q++ ) {
+		for ( p=0; p<ic->w; p++ ) {
+			double dev;
+			if ( bx->bm[p + ic->w*q] != v ) continue;
+			dev = d[bx->cfs+p + w*(bx->css+q)] - mean;
+			ssd += dev*dev;
+		}
+		}
+	} else {
+		const int32_t *d = ic->image->dp_compact[bx->pn];
+		for ( q=0; q<ic->w; q++ ) {
+		for ( p=0; p<ic->w; p++ ) {
+			double dev;
+			if ( bx->bm[p + ic->w*q] != v ) continue;
+			dev = d[bx->cfs+p + w*(bx->css+q)] - mean;
+			ssd += dev*dev;
+		}
+		}
+	}
+
+	return ssd;
+}
+
+
 static void colour_on(enum boxmask_val b)
 {
 	switch ( b ) {
@@ -354,6 +425,14 @@ static void fit_bg(struct intcontext *ic, struct peak_box *bx)
 	}
 
 	/* else do a flat background */
+	if ( ic->image->compact_type != PIXEL_STORAGE_FLOAT ) {
+		int64_t raw = compact_area_sum(ic, bx, BM_BG, &n);
+		bx->a = 0.0;
+		bx->b = 0.0;
+		bx->c = ic->image->compact_scale * (double)raw / n;
+		return;
+	}
+
 	for ( p=0; p<ic->w; p++ ) {
 	for ( q=0; q<ic->w; q++ ) {
 		if ( bx->bm[p + ic->w*q] == BM_BG ) {
@@ -617,13 +696,18 @@ static double tentative_intensity(struct intcontext *ic, struct peak_box *bx)
 	int p, q;
 	double intensity = 0.0;
 
-	for ( p=0; p<ic->w; p++ ) {
-	for ( q=0; q<ic->w; q++ ) {
+	if ( ic->image->compact_type != PIXEL_STORAGE_FLOAT ) {
+		int64_t raw = compact_area_sum(ic, bx, BM_PK, NULL);
+		intensity = ic->image->compact_scale * (double)raw;
+	} else {
+		for ( p=0; p<ic->w; p++ ) {
+		for ( q=0; q<ic->w; q++ ) {
 
-		if ( bx->bm[p + ic->w*q] != BM_PK ) continue;
-		intensity += boxi(ic, bx, p, q);
+			if ( bx->bm[p + ic->w*q] != BM_PK ) continue;
+			intensity += boxi(ic, bx, p, q);
 
-	}
+		}
+		}
 	}
 
 	intensity -= bx->a * bx->pks_p;
@@ -1084,6 +1168,15 @@ static void mean_var_area(struct intcontext *ic, struct peak_box *bx,
 	int n = 0;
 	double mean;
 
+	if ( ic->image->compact_type != PIXEL_STORAGE_FLOAT ) {
+		double scale = ic->image->compact_scale;
+		double raw_mean;
+		raw_mean = (double)compact_area_sum(ic, bx, v, &n) / n;
+		*pmean = scale * raw_mean;
+		*pvar = scale * scale * compact_area_ssd(ic, bx, v, raw_mean) / n;
+		return;
+	}
+
 	for ( p=0; p<ic->w; p++ ) {
 	for ( q=0; q<ic->w; q++ ) {
 		if ( bx->bm[p + ic->w*q] != v ) continue;
@@ -34,6 +34,7 @@
 #include <float.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <profile.h>
 
 #include "peakfinder8.h"
@@ -619,6 +620,101 @@ static void fill_radial_bins_fast(float *data, int w, int h, int n_pixels,
 	}
 }
 
+/* As fill_radial_bins, but for the compact integer copy of the data.
+ * The floating point value of each pixel is reconstructed exactly, so the
+ * result is the same as fill_radial_bins with the float data. */
+static void fill_radial_bins_compact(void *data,
+                                     PixelStorageType type,
+                                     float scale,
+                                     int w,
+                                     int h,
+                                     float *r_map,
+                                     char *mask,
+                                     float *rthreshold,
+                                     float *lthreshold,
+                                     float *roffset,
+                                     float *rsigma,
+                                     int *rcount)
+{
+	int pidx;
+	int curr_r;
+	float value;
+
+	if ( type == PIXEL_STORAGE_UINT16 ) {
+		const uint16_t *d = data;
+		for ( pidx=0; pidx<w*h; pidx++ ) {
+			if ( mask[pidx] == 0 ) continue;
+			curr_r = (int)rint(r_map[pidx]);
+			value = scale * (float)d[pidx];
+			if ( value < rthreshold[curr_r]
+			  && value > lthreshold[curr_r] )
+			{
+				roffset[curr_r] += value;
+				rsigma[curr_r] += (value * value);
+				rcount[curr_r] += 1;
+			}
+		}
+	} else {
+		const int32_t *d = data;
+		for ( pidx=0; pidx<w*h; pidx++ ) {
+			if ( mask[pidx] == 0 ) continue;
+			curr_r = (int)rint(r_map[pidx]);
+			value = scale * (float)d[pidx];
+			if ( value < rthreshold[curr_r]
+			  && value > lthreshold[curr_r] )
+			{
+				roffset[curr_r] += value;
+				rsigma[curr_r] += (value * value);
+				rcount[curr_r] += 1;
+			}
+		}
+	}
+}
+
+
+static void fill_radial_bins_compact_fast(void *data,
+                                          PixelStorageType type,
+                                          float scale, int n_pixels,
+                                          int *pidx, int *radius, char *mask,
+                                          float *rthreshold, float *lthreshold,
+                                          float *roffset, float *rsigma,
+                                          int *rcount)
+{
+	int i;
+	int curr_r;
+	float value;
+
+	if ( type == PIXEL_STORAGE_UINT16 ) {
+		const uint16_t *d = data;
+		for ( i=0; i<n_pixels; i++ ) {
+			if ( mask[pidx[i]] == 0 ) continue;
+			curr_r = radius[i];
+			value = scale * (float)d[pidx[i]];
+			if ( value < rthreshold[curr_r]
+			  && value > lthreshold[curr_r] )
+			{
+				roffset[curr_r] += value;
+				rsigma[curr_r] += (value * value);
+				rcount[curr_r] += 1;
+			}
+		}
+	} else {
+		const int32_t *d = data;
+		for ( i=0; i<n_pixels; i++ ) {
+			if ( mask[pidx[i]] == 0 ) continue;
+			curr_r = radius[i];
+			value = scale * (float)d[pidx[i]];
+			if ( value < rthreshold[curr_r]
+			  && value > lthreshold[curr_r] )
+			{
+				roffset[curr_r] += value;
+				rsigma[curr_r] += (value * value);
+				rcount[curr_r] += 1;
+			}
+		}
+	}
+}
+
 static void compute_radial_stats(float *rthreshold,
                                  float *lthreshold,
                                  float *roffset,
@@ -1344,7 +1440,35 @@ int peakfinder8(struct image *img, int max_n_peaks,
 		}
 
 		for ( pi=0 ; pi<pfdata->num_panels ; pi++ ) {
-			if ( fast_mode ) {
+			if ( img->compact_type != PIXEL_STORAGE_FLOAT ) {
+				if ( fast_mode ) {
+					fill_radial_bins_compact_fast(img->dp_compact[pi],
+					                              img->compact_type,
+					                              img->compact_scale,
+					                              rspixels->n_pixels[pi],
+					                              rspixels->pidx[pi],
+					                              rspixels->radius[pi],
+					                              pfmask->masks[pi],
+					                              rstats->rthreshold,
+					                              rstats->lthreshold,
+					                              rstats->roffset,
+					                              rstats->rsigma,
+					                              rstats->rcount);
+				} else {
+					fill_radial_bins_compact(img->dp_compact[pi],
+					                         img->compact_type,
+					                         img->compact_scale,
+					                         pfdata->panel_w[pi],
+					                         pfdata->panel_h[pi],
+					                         rmaps->r_maps[pi],
+					                         pfmask->masks[pi],
+					                         rstats->rthreshold,
+					                         rstats->lthreshold,
+					                         rstats->roffset,
+					                         rstats->rsigma,
+					                         rstats->rcount);
+				}
+			} else if ( fast_mode ) {
 				fill_radial_bins_fast(pfdata->panel_data[pi],
 						      pfdata->panel_w[pi],
 						      pfdata->panel_h[pi],
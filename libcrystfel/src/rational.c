@@ -41,10 +41,10 @@
 /** \file rational.h */
 
 /* Euclidean algorithm for finding greatest common divisor */
-static signed int gcd(signed int a, signed int b)
+static signed long long int gcd(signed long long int a, signed long long int b)
 {
 	while ( b != 0 ) {
-		signed int t = b;
+		signed long long int t = b;
 		b = a % b;
 		a = t;
 	}
@@ -54,7 +54,7 @@ static signed int gcd(signed int a, signed int b)
 
 static void squish(Rational *rt)
 {
-	signed int g;
+	signed long long int g;
 
 	if ( rt->num == 0 ) {
 		rt->den = 1;
@@ -98,40 +98,94 @@ double rtnl_as_double(Rational r)
 }
 
 
-static void overflow(long long int c, long long int a, long long int b)
+static void overflow(Rational a, Rational b, char op)
 {
 	setlocale(LC_ALL, "");
 	ERROR("Overflow detected in rational number library.\n");
-	ERROR("%'lli < %'lli * %'lli\n", c, a, b);
+	ERROR("(%'lli/%'lli) %c (%'lli/%'lli)\n", a.num, a.den, op,
+	      b.num, b.den);
 	abort();
 }
 
 
-static void check_overflow(long long int c, long long int a, long long int b)
+static void mtx_overflow(void)
 {
-	if ( (a==0) || (b==0) ) {
-		if ( c != 0 ) overflow(c,a,b);
-	} else if ( (llabs(c) < llabs(a)) || (llabs(c) < llabs(b)) ) {
-		overflow(c,a,b);
+	ERROR("Overflow detected in rational matrix calculation.\n");
+	abort();
+}
+
+
+/**
+ * \param a A \ref Rational
+ * \param b A \ref Rational
+ * \param ans Location to store the result
+ *
+ * Multiplies \p a by \p b, and stores the result in \p ans.
+ *
+ * \returns Zero on success, or non-zero if the result could not be
+ * represented, in which case \p ans is left unchanged.
+ */
+int rtnl_mul_checked(Rational a, Rational b, Rational *ans)
+{
+	signed long long int g1, g2;
+	Rational r;
+
+	if ( (a.num == 0) || (b.num == 0) ) {
+		*ans = rtnl_zero();
+		return 0;
 	}
+
+	/* Cancel common factors first, to stay well away from overflow */
+	g1 = gcd(a.num, b.den);
+	g2 = gcd(b.num, a.den);
+	if ( __builtin_mul_overflow(a.num/g1, b.num/g2, &r.num) ) return 1;
+	if ( __builtin_mul_overflow(a.den/g2, b.den/g1, &r.den) ) return 1;
+
+	squish(&r);
+	*ans = r;
+	return 0;
 }
 
 
-Rational rtnl_mul(Rational a, Rational b)
+/**
+ * \param a A \ref Rational
+ * \param b A \ref Rational
+ * \param ans Location to store the result
+ *
+ * Adds \p a to \p b, and stores the result in \p ans.
+ *
+ * \returns Zero on success, or non-zero if the result could not be
+ * represented, in which case \p ans is left unchanged.
+ */
+int rtnl_add_checked(Rational a, Rational b, Rational *ans)
 {
+	signed long long int g, a_num, b_num;
 	Rational r;
-	r.num = a.num * b.num;
-	r.den = a.den * b.den;
-	check_overflow(r.num, a.num, b.num);
-	check_overflow(r.den, a.den, b.den);
+
+	/* Use the lowest common denominator */
+	g = gcd(a.den, b.den);
+	if ( __builtin_mul_overflow(a.num, b.den/g, &a_num) ) return 1;
+	if ( __builtin_mul_overflow(b.num, a.den/g, &b_num) ) return 1;
+	if ( __builtin_mul_overflow(a.den/g, b.den, &r.den) ) return 1;
+	if ( __builtin_add_overflow(a_num, b_num, &r.num) ) return 1;
+
 	squish(&r);
+	*ans = r;
+	return 0;
+}
+
+
+Rational rtnl_mul(Rational a, Rational b)
+{
+	Rational r;
+	if ( rtnl_mul_checked(a, b, &r) ) overflow(a, b, '*');
 	return r;
 }
 
 
 Rational rtnl_div(Rational a, Rational b)
 {
-	signed int t = b.num;
+	signed long long int t = b.num;
 	b.num = b.den;
 	b.den = t;
 	return rtnl_mul(a, b);
@@ -141,20 +195,7 @@ Rational rtnl_div(Rational a, Rational b)
 Rational rtnl_add(Rational a, Rational b)
 {
 	Rational r;
-	long long int common_den;
-	long long int a_num, b_num;
-
-	a_num = a.num * b.den;
-	b_num = b.num * a.den;
-	check_overflow(a_num, a.num, b.den);
-	check_overflow(b_num, b.num, a.den);
-
-	common_den = a.den * b.den;
-	check_overflow(common_den, a.den, b.den);
-
-	r.num = a_num + b_num;
-	r.den = common_den;
-	squish(&r);
+	if ( rtnl_add_checked(a, b, &r) ) overflow(a, b, '+');
 	return r;
 }
 
@@ -232,7 +273,7 @@ Rational *rtnl_list(signed int num_min, signed int num_max,
 			if ( (n>0) && (rtnl_cmp(list[n-1], r)==0) ) continue;
 
 			/* Can be reduced? */
-			if ( abs(gcd(num, den)) != 1 ) continue;
+			if ( llabs(gcd(num, den)) != 1 ) continue;
 
 			list[n++] = r;
 		}
@@ -377,6 +418,191 @@ void rtnl_mtx_free(RationalMatrix *mtx)
 }
 
 
+RationalMatrix3 rtnl_mtx3_identity(void)
+{
+	RationalMatrix3 m;
+	int i, j;
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			m.v[i][j] = (i == j) ? rtnl(1,1) : rtnl_zero();
+		}
+	}
+	return m;
+}
+
+
+Rational rtnl_mtx3_get(const RationalMatrix3 *m, int i, int j)
+{
+	return m->v[i][j];
+}
+
+
+void rtnl_mtx3_set(RationalMatrix3 *m, int i, int j, Rational v)
+{
+	m->v[i][j] = v;
+}
+
+
+RationalMatrix3 rtnl_mtx3_from_intmat3(IntegerMatrix3 m)
+{
+	RationalMatrix3 n;
+	int i, j;
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			n.v[i][j].num = intmat3_get(m, i, j);
+			n.v[i][j].den = 1;
+		}
+	}
+	return n;
+}
+
+
+/**
+ * \param m A \ref RationalMatrix
+ * \param out Location to store the result
+ *
+ * Copies \p m into the value type \ref RationalMatrix3.
+ *
+ * \returns Zero on success, or non-zero if \p m is not a 3x3 matrix.
+ */
+int rtnl_mtx3_from_rtnl_mtx(const RationalMatrix *m, RationalMatrix3 *out)
+{
+	int i, j;
+	if ( (m->rows != 3) || (m->cols != 3) ) return 1;
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			out->v[i][j] = m->v[j+3*i];
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * \param m A \ref RationalMatrix3
+ *
+ * \returns A newly allocated \ref RationalMatrix with the same contents as
+ * \p m, or NULL on error.
+ */
+RationalMatrix *rtnl_mtx_from_rtnl_mtx3(const RationalMatrix3 *m)
+{
+	RationalMatrix *n;
+	int i, j;
+
+	n = rtnl_mtx_new(3, 3);
+	if ( n == NULL ) return NULL;
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			n->v[j+3*i] = m->v[i][j];
+		}
+	}
+	return n;
+}
+
+
+/**
+ * \param a A \ref RationalMatrix3
+ * \param b A \ref RationalMatrix3
+ * \param ans Location to store the result
+ *
+ * Multiplies \p a by \p b.  \p ans may be the same as \p a or \p b.
+ *
+ * \returns Zero on success, or non-zero on overflow, in which case \p ans is
+ * left unchanged.
+ */
+int rtnl_mtx3_times_rtnl_mtx3(const RationalMatrix3 *a,
+                              const RationalMatrix3 *b,
+                              RationalMatrix3 *ans)
+{
+	RationalMatrix3 r;
+	int i, j, k;
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			Rational sum = rtnl_zero();
+			for ( k=0; k<3; k++ ) {
+				Rational add;
+				if ( rtnl_mul_checked(a->v[i][k], b->v[k][j],
+				                      &add) ) return 1;
+				if ( rtnl_add_checked(sum, add, &sum) ) return 1;
+			}
+			r.v[i][j] = sum;
+		}
+	}
+
+	*ans = r;
+	return 0;
+}
+
+
+/**
+ * \param a A \ref RationalMatrix3
+ * \param b An \ref IntegerMatrix3
+ * \param ans Location to store the result
+ *
+ * Multiplies \p a by \p b.  \p ans may be the same as \p a.
+ *
+ * \returns Zero on success, or non-zero on overflow, in which case \p ans is
+ * left unchanged.
+ */
+int rtnl_mtx3_times_intmat3(const RationalMatrix3 *a, IntegerMatrix3 b,
+                            RationalMatrix3 *ans)
+{
+	RationalMatrix3 bm = rtnl_mtx3_from_intmat3(b);
+	return rtnl_mtx3_times_rtnl_mtx3(a, &bm, ans);
+}
+
+
+/**
+ * \param m A \ref RationalMatrix3
+ * \param det Location to store the determinant of \p m
+ *
+ * \returns Zero on success, or non-zero on overflow, in which case \p det is
+ * left unchanged.
+ */
+int rtnl_mtx3_det(const RationalMatrix3 *m, Rational *det)
+{
+	Rational sum = rtnl_zero();
+	int j;
+
+	for ( j=0; j<3; j++ ) {
+
+		/* Cofactor of element 0,j */
+		int c0 = (j+1) % 3;
+		int c1 = (j+2) % 3;
+		Rational p, q, cof, add;
+
+		if ( rtnl_mul_checked(m->v[1][c0], m->v[2][c1], &p) ) return 1;
+		if ( rtnl_mul_checked(m->v[1][c1], m->v[2][c0], &q) ) return 1;
+		q.num = -q.num;
+		if ( rtnl_add_checked(p, q, &cof) ) return 1;
+
+		if ( rtnl_mul_checked(m->v[0][j], cof, &add) ) return 1;
+		if ( rtnl_add_checked(sum, add, &sum) ) return 1;
+
+	}
+
+	*det = sum;
+	return 0;
+}
+
+
+int rtnl_mtx3_is_identity(const RationalMatrix3 *m)
+{
+	int i, j;
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			Rational v = m->v[i][j];
+			squish(&v);
+			if ( v.num != ((i == j) ? 1 : 0) ) return 0;
+			if ( v.den != 1 ) return 0;
+		}
+	}
+	return 1;
+}
+
+
 /* rtnl_mtx_solve:
  * @P: A %RationalMatrix
  * @vec: An array of %Rational
@@ -534,6 +760,17 @@ RationalMatrix *rtnlmtx_times_intmat(const RationalMatrix *A,
 	intmat_size(B, &B_rows, &B_cols);
 	assert(A->cols == B_rows);
 
+	if ( (A->rows == 3) && (A->cols == 3) && (B_cols == 3) ) {
+		RationalMatrix3 A3, ans3;
+		IntegerMatrix3 B3;
+		rtnl_mtx3_from_rtnl_mtx(A, &A3);
+		intmat3_from_intmat(B, &B3);
+		if ( rtnl_mtx3_times_intmat3(&A3, B3, &ans3) ) {
+			mtx_overflow();
+		}
+		return rtnl_mtx_from_rtnl_mtx3(&ans3);
+	}
+
 	ans = rtnl_mtx_new(A->rows, B_cols);
 	if ( ans == NULL ) return NULL;
 
@@ -563,6 +800,16 @@ RationalMatrix *rtnlmtx_times_rtnlmtx(const RationalMatrix *A,
 
 	assert(A->cols == B->rows);
 
+	if ( (A->rows == 3) && (A->cols == 3) && (B->cols == 3) ) {
+		RationalMatrix3 A3, B3, ans3;
+		rtnl_mtx3_from_rtnl_mtx(A, &A3);
+		rtnl_mtx3_from_rtnl_mtx(B, &B3);
+		if ( rtnl_mtx3_times_rtnl_mtx3(&A3, &B3, &ans3) ) {
+			mtx_overflow();
+		}
+		return rtnl_mtx_from_rtnl_mtx3(&ans3);
+	}
+
 	ans = rtnl_mtx_new(A->rows, B->cols);
 	if ( ans == NULL ) return NULL;
 
@@ -592,6 +839,20 @@ RationalMatrix *intmat_times_rtnlmtx(const IntegerMatrix *A, const RationalMatri
 
 	intmat_size(A, &A_rows, &A_cols);
 
+	if ( (A_rows == 3) && (A_cols == 3) && (B->rows == 3)
+	  && (B->cols == 3) )
+	{
+		RationalMatrix3 A3, B3, ans3;
+		IntegerMatrix3 Ai;
+		intmat3_from_intmat(A, &Ai);
+		A3 = rtnl_mtx3_from_intmat3(Ai);
+		rtnl_mtx3_from_rtnl_mtx(B, &B3);
+		if ( rtnl_mtx3_times_rtnl_mtx3(&A3, &B3, &ans3) ) {
+			mtx_overflow();
+		}
+		return rtnl_mtx_from_rtnl_mtx3(&ans3);
+	}
+
 	ans = rtnl_mtx_new(A_rows, B->cols);
 	if ( ans == NULL ) return NULL;
 
@@ -694,6 +955,13 @@ Rational rtnl_mtx_det(const RationalMatrix *m)
 
 	assert(m->rows == m->cols);  /* Otherwise determinant doesn't exist */
 
+	if ( m->rows == 3 ) {
+		RationalMatrix3 m3;
+		rtnl_mtx3_from_rtnl_mtx(m, &m3);
+		if ( rtnl_mtx3_det(&m3, &det) ) mtx_overflow();
+		return det;
+	}
+
 	if ( m->rows == 2 ) {
 		Rational a, b;
 		a = rtnl_mul(rtnl_mtx_get(m, 0, 0), rtnl_mtx_get(m, 1, 1));
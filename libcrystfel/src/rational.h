@@ -54,6 +54,17 @@ typedef struct {
  **/
 typedef struct _rationalmatrix RationalMatrix;
 
+
+/**
+ * The RationalMatrix3 is an opaque-ish data structure representing a 3x3
+ * matrix of rational numbers.  Like \ref IntegerMatrix3, it is a value type,
+ * and none of the operations on it need to allocate memory.
+ **/
+typedef struct {
+	/* Private, don't modify */
+	Rational v[3][3];
+} RationalMatrix3;
+
 #include "integer_matrix.h"
 
 #ifdef __cplusplus
@@ -104,6 +115,26 @@ extern Rational rtnl_mtx_det(const RationalMatrix *m);
 extern int rtnl_mtx_is_identity(const RationalMatrix *m);
 extern int rtnl_mtx_is_perm(const RationalMatrix *m);
 
+/* Checked arithmetic, returning non-zero on overflow instead of aborting */
+extern int rtnl_mul_checked(Rational a, Rational b, Rational *ans);
+extern int rtnl_add_checked(Rational a, Rational b, Rational *ans);
+
+/* 3x3 value type */
+extern RationalMatrix3 rtnl_mtx3_identity(void);
+extern Rational rtnl_mtx3_get(const RationalMatrix3 *m, int i, int j);
+extern void rtnl_mtx3_set(RationalMatrix3 *m, int i, int j, Rational v);
+extern RationalMatrix3 rtnl_mtx3_from_intmat3(IntegerMatrix3 m);
+extern int rtnl_mtx3_from_rtnl_mtx(const RationalMatrix *m,
+                                   RationalMatrix3 *out);
+extern RationalMatrix *rtnl_mtx_from_rtnl_mtx3(const RationalMatrix3 *m);
+extern int rtnl_mtx3_times_rtnl_mtx3(const RationalMatrix3 *a,
+                                     const RationalMatrix3 *b,
+                                     RationalMatrix3 *ans);
+extern int rtnl_mtx3_times_intmat3(const RationalMatrix3 *a, IntegerMatrix3 b,
+                                   RationalMatrix3 *ans);
+extern int rtnl_mtx3_det(const RationalMatrix3 *m, Rational *det);
+extern int rtnl_mtx3_is_identity(const RationalMatrix3 *m);
+
 #ifdef __cplusplus
 }
 #endif
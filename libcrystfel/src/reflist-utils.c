@@ -31,7 +31,9 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_LIBCCP4
 #include <ccp4/cmtzlib.h>
@@ -281,19 +283,387 @@ int write_reflist(const char *filename, RefList *list)
 }
 
 
+/* The binary format is as follows.  All numbers are little-endian, and
+ * floating point numbers are IEEE 754 doubles, so that everything is stored
+ * exactly.
+ *
+ *   The line HEADER_BINARY, including the newline
+ *   u32      Length of symmetry name, followed by the name (no terminator)
+ *   u32      1 if a unit cell follows, otherwise 0
+ *   f64 x 6  a, b, c (metres), alpha, beta, gamma (radians)
+ *   u32 x 3  Lattice type, centering, unique axis
+ *   u64      Number of reflections, n
+ *   i32[n]   h, then k, then l
+ *   f64[n]   Intensity, then sigma(I), then phase (radians)
+ *   u8[n]    1 if the phase is known, otherwise 0
+ *   i32[n]   Number of measurements
+ *   u32      Length of notes, followed by the notes (no terminator)
+ *
+ * As for the text format, reflections with redundancy zero are not written.
+ */
+#define HEADER_BINARY "CrystFEL binary reflection list version 1.0"
+
+
+static int write_u32(FILE *fh, uint32_t v)
+{
+	unsigned char buf[4];
+	put_u32(buf, v);
+	return fwrite(buf, 4, 1, fh) != 1;
+}
+
+
+static int write_string(FILE *fh, const char *str)
+{
+	size_t len = strlen(str);
+	if ( write_u32(fh, len) ) return 1;
+	if ( len == 0 ) return 0;
+	return fwrite(str, len, 1, fh) != 1;
+}
+
+
+static int write_binary_cell(FILE *fh, UnitCell *cell)
+{
+	unsigned char buf[6*8+3*4];
+	double p[6];
+
+	if ( cell == NULL ) return write_u32(fh, 0);
+
+	cell_get_parameters(cell, &p[0], &p[1], &p[2], &p[3], &p[4], &p[5]);
+	put_f64(buf, p[0]);
+	put_f64(buf+8, p[1]);
+	put_f64(buf+16, p[2]);
+	put_f64(buf+24, p[3]);
+	put_f64(buf+32, p[4]);
+	put_f64(buf+40, p[5]);
+	put_u32(buf+48, cell_get_lattice_type(cell));
+	put_u32(buf+52, cell_get_centering(cell));
+	put_u32(buf+56, cell_get_unique_axis(cell));
+
+	if ( write_u32(fh, 1) ) return 1;
+	return fwrite(buf, sizeof(buf), 1, fh) != 1;
+}
+
+
+static int write_binary_reflections(FILE *fh, RefList *list, SymOpList *sym,
+                                    UnitCell *cell)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	Reflection **refls;
+	unsigned char *buf;
+	uint64_t n = 0;
+	uint64_t i;
+	int r = 0;
+
+	refls = malloc((num_reflections(list)+1)*sizeof(Reflection *));
+	buf = malloc(num_reflections(list)*12+8);
+	if ( (refls == NULL) || (buf == NULL) ) {
+		free(refls);
+		free(buf);
+		return 1;
+	}
+
+	/* Reflections with redundancy = 0 are not written */
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		if ( get_redundancy(refl) == 0 ) continue;
+		refls[n++] = refl;
+	}
+
+	r |= fprintf(fh, HEADER_BINARY"\n") < 0;
+	r |= write_string(fh, (sym == NULL) ? "unknown" : symmetry_name(sym));
+	r |= write_binary_cell(fh, cell);
+
+	put_u64(buf, n);
+	r |= fwrite(buf, 8, 1, fh) != 1;
+
+	/* Indices */
+	for ( i=0; i<n; i++ ) {
+		signed int h, k, l;
+		get_indices(refls[i], &h, &k, &l);
+		put_u32(buf+4*i, h);
+		put_u32(buf+4*(n+i), k);
+		put_u32(buf+4*(2*n+i), l);
+	}
+	r |= fwrite(buf, 4, 3*n, fh) != 3*n;
+
+	/* Intensities, sigmas and phases */
+	for ( i=0; i<n; i++ ) put_f64(buf+8*i, get_intensity(refls[i]));
+	r |= fwrite(buf, 8, n, fh) != n;
+	for ( i=0; i<n; i++ ) put_f64(buf+8*i, get_esd_intensity(refls[i]));
+	r |= fwrite(buf, 8, n, fh) != n;
+	for ( i=0; i<n; i++ ) put_f64(buf+8*i, get_phase(refls[i], NULL));
+	r |= fwrite(buf, 8, n, fh) != n;
+	for ( i=0; i<n; i++ ) {
+		int have_phase;
+		get_phase(refls[i], &have_phase);
+		buf[i] = have_phase ? 1 : 0;
+	}
+	r |= fwrite(buf, 1, n, fh) != n;
+
+	/* Numbers of measurements */
+	for ( i=0; i<n; i++ ) put_u32(buf+4*i, get_redundancy(refls[i]));
+	r |= fwrite(buf, 4, n, fh) != n;
+
+	if ( reflist_get_notes(list) != NULL ) {
+		r |= write_string(fh, reflist_get_notes(list));
+	} else {
+		r |= write_u32(fh, 0);
+	}
+
+	free(buf);
+	free(refls);
+	return r;
+}
+
+
+/**
+ * This function writes the contents of list to a file, in the compact binary
+ * format.  This is much faster to read and write than the text format, and
+ * keeps all values exactly.  The binary format is recognised automatically by
+ * read_reflections_2() and read_reflections().
+ *
+ * Reflections which have a redundancy of zero will not be written.
+ *
+ * \param filename Filename
+ * \param list The reflection list to write
+ * \param sym A %SymOpList describing the symmetry of the list, or NULL
+ * \param cell A %UnitCell to store along with the reflections, or NULL
+ *
+ * \returns zero on success, non-zero on failure.
+ **/
+int write_reflist_binary(const char *filename, RefList *list, SymOpList *sym,
+                         UnitCell *cell)
+{
+	FILE *fh;
+	int r;
+
+	fh = fopen(filename, "wb");
+	if ( fh == NULL ) {
+		ERROR("Couldn't open output file '%s'.\n", filename);
+		return 1;
+	}
+
+	r = write_binary_reflections(fh, list, sym, cell);
+	if ( fclose(fh) ) r = 1;
+
+	if ( r ) {
+		ERROR("Failed to write reflections to '%s'\n", filename);
+	}
+
+	return r;
+}
+
+
 #define HEADER_1_0 "  h   k   l          I    phase   sigma(I)  counts  " \
 	                  "fs/px  ss/px"
 
 #define HEADER_2_0 "CrystFEL reflection list version 2.0"
 
 
+static int read_u32(FILE *fh, uint32_t *v)
+{
+	unsigned char buf[4];
+	if ( fread(buf, 4, 1, fh) != 1 ) return 1;
+	*v = get_u32(buf);
+	return 0;
+}
+
+
+/* Number of bytes left in the file, or UINT64_MAX if that can't be found
+ * out (e.g. for a pipe) */
+static uint64_t bytes_remaining(FILE *fh)
+{
+	struct stat st;
+	long int pos;
+
+	if ( fstat(fileno(fh), &st) || !S_ISREG(st.st_mode) ) return UINT64_MAX;
+
+	pos = ftell(fh);
+	if ( (pos < 0) || (st.st_size < pos) ) return UINT64_MAX;
+	return st.st_size - pos;
+}
+
+
+static char *read_string(FILE *fh)
+{
+	uint32_t len;
+	char *str;
+
+	if ( read_u32(fh, &len) ) return NULL;
+
+	if ( len > bytes_remaining(fh) ) {
+		ERROR("Binary reflection list is corrupt (string length %u)\n",
+		      len);
+		return NULL;
+	}
+
+	str = malloc((size_t)len+1);
+	if ( str == NULL ) {
+		ERROR("Couldn't allocate string for binary reflection "
+		      "list\n");
+		return NULL;
+	}
+
+	if ( (len > 0) && (fread(str, len, 1, fh) != 1) ) {
+		free(str);
+		return NULL;
+	}
+	str[len] = '\0';
+
+	return str;
+}
+
+
+static int read_binary_cell(FILE *fh, UnitCell **pcell)
+{
+	unsigned char buf[6*8+3*4];
+	uint32_t have_cell;
+	UnitCell *cell;
+
+	if ( read_u32(fh, &have_cell) ) return 1;
+	if ( !have_cell ) return 0;
+
+	if ( fread(buf, sizeof(buf), 1, fh) != 1 ) return 1;
+	if ( pcell == NULL ) return 0;
+
+	cell = cell_new_from_parameters(get_f64(buf), get_f64(buf+8),
+	                                get_f64(buf+16), get_f64(buf+24),
+	                                get_f64(buf+32), get_f64(buf+40));
+	if ( cell == NULL ) return 1;
+	cell_set_lattice_type(cell, get_u32(buf+48));
+	cell_set_centering(cell, get_u32(buf+52));
+	cell_set_unique_axis(cell, get_u32(buf+56));
+
+	*pcell = cell;
+	return 0;
+}
+
+
+/* Bytes per reflection: indices, intensity, sigma, phase, phase flag and
+ * redundancy */
+#define BINARY_REFLECTION_SIZE (3*4 + 8 + 8 + 8 + 1 + 4)
+
+
+/* Reads the rest of a binary reflection list, after the header line */
+static RefList *read_binary_reflections(FILE *fh, char **sym,
+                                        UnitCell **cell)
+{
+	RefList *out;
+	Reflection **refls;
+	unsigned char *buf;
+	unsigned char nbuf[8];
+	char *ssym;
+	char *notes;
+	uint64_t n, i;
+
+	ssym = read_string(fh);
+	if ( ssym == NULL ) {
+		ERROR("Failed to read symmetry from binary reflection list\n");
+		return NULL;
+	}
+
+	if ( read_binary_cell(fh, cell) ) {
+		ERROR("Failed to read unit cell from binary reflection "
+		      "list\n");
+		free(ssym);
+		return NULL;
+	}
+
+	if ( fread(nbuf, 8, 1, fh) != 1 ) {
+		ERROR("Binary reflection list is truncated\n");
+		free(ssym);
+		return NULL;
+	}
+	n = get_u64(nbuf);
+
+	/* Also makes sure that the sizes below can't overflow */
+	if ( (n > bytes_remaining(fh) / BINARY_REFLECTION_SIZE)
+	  || (n > (SIZE_MAX-8) / 12) )
+	{
+		ERROR("Binary reflection list is truncated or corrupt "
+		      "(%llu reflections)\n", (unsigned long long)n);
+		free(ssym);
+		return NULL;
+	}
+
+	refls = malloc((n+1)*sizeof(Reflection *));
+	buf = malloc(n*12+8);
+	if ( (refls == NULL) || (buf == NULL) ) {
+		ERROR("Couldn't allocate memory for %llu reflections\n",
+		      (unsigned long long)n);
+		free(refls);
+		free(buf);
+		free(ssym);
+		return NULL;
+	}
+
+	out = reflist_new();
+
+	/* Indices, read all at once to create the reflections */
+	if ( fread(buf, 4, 3*n, fh) != 3*n ) goto err;
+	for ( i=0; i<n; i++ ) {
+		refls[i] = add_refl(out, (int32_t)get_u32(buf+4*i),
+		                    (int32_t)get_u32(buf+4*(n+i)),
+		                    (int32_t)get_u32(buf+4*(2*n+i)));
+	}
+
+	if ( fread(buf, 8, n, fh) != n ) goto err;
+	for ( i=0; i<n; i++ ) set_intensity(refls[i], get_f64(buf+8*i));
+	if ( fread(buf, 8, n, fh) != n ) goto err;
+	for ( i=0; i<n; i++ ) set_esd_intensity(refls[i], get_f64(buf+8*i));
+
+	/* Keep the phases after the first n bytes of the buffer, so that the
+	 * flags can be read into the start */
+	if ( fread(buf+4*n, 4, 2*n, fh) != 2*n ) goto err;
+	if ( fread(buf, 1, n, fh) != n ) goto err;
+	for ( i=0; i<n; i++ ) {
+		if ( buf[i] ) set_phase(refls[i], get_f64(buf+4*n+8*i));
+	}
+
+	if ( fread(buf, 4, n, fh) != n ) goto err;
+	for ( i=0; i<n; i++ ) {
+		set_redundancy(refls[i], (int32_t)get_u32(buf+4*i));
+	}
+
+	notes = read_string(fh);
+	if ( notes == NULL ) goto err;
+	if ( notes[0] != '\0' ) reflist_add_notes(out, notes);
+	free(notes);
+
+	free(buf);
+	free(refls);
+
+	if ( sym != NULL ) {
+		*sym = ssym;
+	} else {
+		free(ssym);
+	}
+
+	return out;
+
+err:
+	ERROR("Binary reflection list is truncated\n");
+	reflist_free(out);
+	free(buf);
+	free(refls);
+	free(ssym);
+	return NULL;
+}
+
+
 /* fh: File handle to read from
  * sym: Location at which to store pointer to symmetry, or NULL if you don't
  *  need it
+ * cell: Location at which to store pointer to the unit cell, or NULL if you
+ *  don't need it.  Only binary files can contain a unit cell.
  *
  * Returns: a %RefList read from the file, or NULL on error
  */
-static RefList *read_reflections_from_file(FILE *fh, char **sym)
+static RefList *read_reflections_from_file(FILE *fh, char **sym,
+                                           UnitCell **cell)
 {
 	char *rval = NULL;
 	RefList *out;
@@ -303,7 +673,9 @@ static RefList *read_reflections_from_file(FILE *fh, char **sym)
 	rval = fgets(line, 1023, fh);
 	if ( rval == NULL ) return NULL;
 	chomp(line);
-	if ( strcmp(line, HEADER_1_0) == 0 ) {
+	if ( strcmp(line, HEADER_BINARY) == 0 ) {
+		return read_binary_reflections(fh, sym, cell);
+	} else if ( strcmp(line, HEADER_1_0) == 0 ) {
 		major_version = 1;
 	} else if ( strcmp(line, HEADER_2_0) == 0 ) {
 		major_version = 2;
@@ -422,16 +794,22 @@ static RefList *read_reflections_from_file(FILE *fh, char **sym)
 
 
 /**
- * read_reflections_2:
+ * read_reflections_3:
  * \param filename: Filename to read from
  * \param sym: Pointer to a "char *" at which to store the symmetry
+ * \param cell: Pointer to a "UnitCell *" at which to store the unit cell
  *
  * This function reads a reflection list from a file, including the
- * symmetry from the header (e.g. "Symmetry: 4/mmm").
+ * symmetry from the header (e.g. "Symmetry: 4/mmm").  Both the text and the
+ * binary formats are recognised automatically.
+ *
+ * If the file contains a unit cell, which is only possible for the binary
+ * format, it will be stored at \p cell.  Otherwise, \p cell will not be
+ * changed.  Either of \p sym or \p cell can be NULL.
  *
  * Returns: A %RefList read from the file, or NULL on error
  */
-RefList *read_reflections_2(const char *filename, char **sym)
+RefList *read_reflections_3(const char *filename, char **sym, UnitCell **cell)
 {
 	FILE *fh;
 	RefList *out;
@@ -447,7 +825,7 @@ RefList *read_reflections_2(const char *filename, char **sym)
 		return NULL;
 	}
 
-	out = read_reflections_from_file(fh, sym);
+	out = read_reflections_from_file(fh, sym, cell);
 
 	fclose(fh);
 
@@ -455,6 +833,23 @@ RefList *read_reflections_2(const char *filename, char **sym)
 }
 
 
+/**
+ * read_reflections_2:
+ * \param filename: Filename to read from
+ * \param sym: Pointer to a "char *" at which to store the symmetry
+ *
+ * This function reads a reflection list from a file, including the
+ * symmetry from the header (e.g. "Symmetry: 4/mmm").  Both the text and the
+ * binary formats are recognised automatically.
+ *
+ * Returns: A %RefList read from the file, or NULL on error
+ */
+RefList *read_reflections_2(const char *filename, char **sym)
+{
+	return read_reflections_3(filename, sym, NULL);
+}
+
+
 /**
  * read_reflections:
  * \param filename: Filename to read from
@@ -666,6 +1061,7 @@ void free_contribs(RefList *list)
 	{
 		struct reflection_contributions *c;
 		c = get_contributions(refl);
+		if ( c == NULL ) continue;
 		free(c->contribs);
 		free(c->contrib_crystals);
 		free(c);
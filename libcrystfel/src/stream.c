@@ -40,6 +40,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "cell.h"
 #include "cell-utils.h"
@@ -1106,6 +1108,30 @@ Stream *stream_open_for_read(const char *filename)
  * \returns A \ref Stream, or NULL on failure.
  */
 Stream *stream_open_fd_for_write(int fd, const DataTemplate *dtempl)
+{
+	FILE *fh;
+	Stream *st;
+
+	fh = fdopen(fd, "w");
+	if ( fh == NULL ) return NULL;
+
+	st = stream_open_fh_for_write(fh, dtempl);
+	if ( st == NULL ) fclose(fh);
+	return st;
+}
+
+
+/**
+ * \param fh File handle to use for stream data.
+ *
+ * Creates a new \ref Stream from \p fh, in the same way as
+ * \ref stream_open_fd_for_write.  This is for when the stream data should go
+ * somewhere other than a file descriptor, for example into a buffer in
+ * memory.  The \p fh will be closed by \ref stream_close.
+ *
+ * \returns A \ref Stream, or NULL on failure.
+ */
+Stream *stream_open_fh_for_write(FILE *fh, const DataTemplate *dtempl)
 {
 	Stream *st;
 
@@ -1119,12 +1145,7 @@ Stream *stream_open_fd_for_write(int fd, const DataTemplate *dtempl)
 	st->dtempl_read = NULL;
 	st->dtempl_write = NULL;
 
-	st->fh = fdopen(fd, "w");
-	if ( st->fh == NULL ) {
-		free(st);
-		return NULL;
-	}
-
+	st->fh = fh;
 	st->dtempl_write = dtempl;
 	st->major_version = LATEST_MAJOR_VERSION;
 	st->minor_version = LATEST_MINOR_VERSION;
@@ -1483,3 +1504,289 @@ StreamIndex *stream_make_index(const char *filename)
 	fclose(fh);
 	return index;
 }
+
+
+/* Cell list, a compact sidecar to the stream containing only the unit cell
+ * parameters and indexing method for each crystal.  This allows the cell
+ * distribution to be loaded without parsing the whole stream.
+ *
+ * After the header line, the file consists of fixed-size little-endian
+ * records:
+ *   u32      Record type (CELL_LIST_*)
+ *   u32      Indexing method
+ *   f64[6]   a, b, c (m), alpha, beta, gamma (radians)
+ *   u8[3]    Lattice type, centering, unique axis
+ *   u8[5]    Unused
+ *
+ * Each chunk is a CELL_LIST_CHUNK record followed by one CELL_LIST_CRYSTAL
+ * record per crystal.  The chunks are not necessarily in the same order as
+ * in the stream.  The final record is CELL_LIST_END, with the size
+ * of the completed stream in place of the first cell parameter.  If the
+ * stream has changed since then, the cell list is not used.
+ */
+#define CELL_LIST_HEADER "CrystFEL cell list version 1.0\n"
+#define CELL_LIST_RECORD_SIZE (STREAM_CELLS_RECORD_SIZE)
+#define CELL_LIST_CHUNK (1)
+#define CELL_LIST_CRYSTAL (2)
+#define CELL_LIST_END (3)
+
+
+/**
+ * \param stream_filename Filename of a stream
+ *
+ * \returns The filename of the cell list belonging to \p stream_filename,
+ * which should be freed by the caller.
+ */
+char *stream_cells_filename(const char *stream_filename)
+{
+	char *fn = malloc(strlen(stream_filename)+7);
+	if ( fn == NULL ) return NULL;
+	strcpy(fn, stream_filename);
+	strcat(fn, ".cells");
+	return fn;
+}
+
+
+/**
+ * \param stream_filename Filename of the stream being written
+ *
+ * Creates the cell list for \p stream_filename, replacing any existing one.
+ * Records should be made with \ref stream_cells_pack and added with
+ * \ref stream_cells_write, and the file completed with
+ * \ref stream_cells_finish after the stream has been closed.
+ *
+ * \returns A file descriptor, or -1 on failure.
+ */
+int stream_cells_open_for_write(const char *stream_filename)
+{
+	char *fn;
+	int fd;
+
+	fn = stream_cells_filename(stream_filename);
+	if ( fn == NULL ) return -1;
+
+	fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if ( fd == -1 ) {
+		ERROR("Failed to open cell list '%s': %s\n",
+		      fn, strerror(errno));
+		free(fn);
+		return -1;
+	}
+	free(fn);
+
+	if ( write(fd, CELL_LIST_HEADER, strlen(CELL_LIST_HEADER)) == -1 ) {
+		ERROR("Failed to write cell list: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static void put_cell_record(unsigned char *p, uint32_t type,
+                            IndexingMethod indm, UnitCell *cell)
+{
+	memset(p, 0, CELL_LIST_RECORD_SIZE);
+	put_u32(p, type);
+	put_u32(p+4, indm);
+
+	if ( cell != NULL ) {
+		double a, b, c, al, be, ga;
+		cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga);
+		put_f64(p+8, a);
+		put_f64(p+16, b);
+		put_f64(p+24, c);
+		put_f64(p+32, al);
+		put_f64(p+40, be);
+		put_f64(p+48, ga);
+		p[56] = cell_get_lattice_type(cell);
+		p[57] = cell_get_centering(cell);
+		p[58] = cell_get_unique_axis(cell);
+	}
+}
+
+
+/**
+ * \param image An \ref image structure
+ * \param buf Buffer for the records
+ * \param max_records Number of records which fit in \p buf
+ *
+ * Converts the crystals in \p image to cell list records, for writing later
+ * with \ref stream_cells_write.  Each record is \ref STREAM_CELLS_RECORD_SIZE
+ * bytes long.  The records should be written at the same time as the chunk
+ * is written to the stream, so that the cell list matches the stream.
+ *
+ * \returns The number of records, or -1 if \p buf is too small.
+ */
+int stream_cells_pack(const struct image *image, unsigned char *buf,
+                      int max_records)
+{
+	int i;
+
+	if ( image->n_crystals+1 > max_records ) return -1;
+
+	put_cell_record(buf, CELL_LIST_CHUNK, image->indexed_by, NULL);
+	for ( i=0; i<image->n_crystals; i++ ) {
+		put_cell_record(buf+(i+1)*CELL_LIST_RECORD_SIZE,
+		                CELL_LIST_CRYSTAL, image->indexed_by,
+		                crystal_get_cell(image->crystals[i]));
+	}
+
+	return image->n_crystals+1;
+}
+
+
+/**
+ * \param fd File descriptor from \ref stream_cells_open_for_write
+ * \param buf Records from \ref stream_cells_pack
+ * \param n_records The number of records in \p buf
+ *
+ * Adds the records to the cell list.
+ *
+ * \returns non-zero on error.
+ */
+int stream_cells_write(int fd, const unsigned char *buf, int n_records)
+{
+	size_t len = n_records*CELL_LIST_RECORD_SIZE;
+	return write(fd, buf, len) != (ssize_t)len;
+}
+
+
+/**
+ * \param fd File descriptor from \ref stream_cells_open_for_write
+ * \param stream_filename Filename of the stream, which must be complete
+ *
+ * Completes and closes the cell list.
+ *
+ * \returns non-zero on error.
+ */
+int stream_cells_finish(int fd, const char *stream_filename)
+{
+	unsigned char buf[CELL_LIST_RECORD_SIZE];
+	struct stat s;
+	int r;
+
+	if ( stat(stream_filename, &s) ) {
+		close(fd);
+		return 1;
+	}
+
+	put_cell_record(buf, CELL_LIST_END, 0, NULL);
+	put_u64(buf+8, s.st_size);
+	r = (write(fd, buf, CELL_LIST_RECORD_SIZE) != CELL_LIST_RECORD_SIZE);
+	r |= close(fd);
+	return r;
+}
+
+
+/**
+ * \param stream_filename Filename of a stream
+ * \param pcells Place to store a newly allocated array of unit cells
+ * \param pindms Place to store a newly allocated array of indexing methods
+ * \param pn_cells Place to store the number of unit cells
+ * \param pn_chunks Place to store the number of chunks
+ *
+ * Reads the unit cells for \p stream_filename from its cell list, if it has
+ * one.  The cells have the parameters, lattice type, centering and unique
+ * axis of the crystals in the stream, but not their orientations.
+ *
+ * \returns zero on success, or non-zero if there is no cell list or it is
+ * incomplete or out of date.  In that case, the stream itself should be read.
+ */
+int stream_cells_read(const char *stream_filename,
+                      UnitCell ***pcells, IndexingMethod **pindms,
+                      int *pn_cells, int *pn_chunks)
+{
+	char *fn;
+	FILE *fh;
+	struct stat s;
+	struct stat ss;
+	unsigned char *buf;
+	size_t hlen = strlen(CELL_LIST_HEADER);
+	size_t n_rec, i;
+	const unsigned char *end;
+	UnitCell **cells;
+	IndexingMethod *indms;
+	int n_cells = 0;
+	int n_chunks = 0;
+
+	if ( stat(stream_filename, &ss) ) return 1;
+
+	fn = stream_cells_filename(stream_filename);
+	if ( fn == NULL ) return 1;
+	fh = fopen(fn, "rb");
+	free(fn);
+	if ( fh == NULL ) return 1;
+
+	if ( fstat(fileno(fh), &s)
+	  || ((size_t)s.st_size < hlen+CELL_LIST_RECORD_SIZE)
+	  || (((size_t)s.st_size - hlen) % CELL_LIST_RECORD_SIZE != 0) )
+	{
+		fclose(fh);
+		return 1;
+	}
+
+	buf = malloc(s.st_size);
+	if ( buf == NULL ) {
+		fclose(fh);
+		return 1;
+	}
+	if ( fread(buf, s.st_size, 1, fh) != 1 ) {
+		free(buf);
+		fclose(fh);
+		return 1;
+	}
+	fclose(fh);
+
+	n_rec = (s.st_size - hlen) / CELL_LIST_RECORD_SIZE;
+	end = buf + hlen + (n_rec-1)*CELL_LIST_RECORD_SIZE;
+	if ( (memcmp(buf, CELL_LIST_HEADER, hlen) != 0)
+	  || (get_u32(end) != CELL_LIST_END)
+	  || (get_u64(end+8) != (uint64_t)ss.st_size) )
+	{
+		free(buf);
+		return 1;
+	}
+
+	cells = malloc(n_rec*sizeof(UnitCell *));
+	indms = malloc(n_rec*sizeof(IndexingMethod));
+	if ( (cells == NULL) || (indms == NULL) ) {
+		free(cells);
+		free(indms);
+		free(buf);
+		return 1;
+	}
+
+	for ( i=0; i<n_rec-1; i++ ) {
+
+		const unsigned char *p = buf + hlen + i*CELL_LIST_RECORD_SIZE;
+		UnitCell *cell;
+
+		if ( get_u32(p) == CELL_LIST_CHUNK ) {
+			n_chunks++;
+			continue;
+		}
+		if ( get_u32(p) != CELL_LIST_CRYSTAL ) continue;
+
+		cell = cell_new_from_parameters(get_f64(p+8), get_f64(p+16),
+		                                get_f64(p+24), get_f64(p+32),
+		                                get_f64(p+40), get_f64(p+48));
+		if ( cell == NULL ) continue;
+		cell_set_lattice_type(cell, p[56]);
+		cell_set_centering(cell, p[57]);
+		cell_set_unique_axis(cell, p[58]);
+
+		cells[n_cells] = cell;
+		indms[n_cells] = get_u32(p+4);
+		n_cells++;
+
+	}
+
+	free(buf);
+	*pcells = cells;
+	*pindms = indms;
+	*pn_cells = n_cells;
+	*pn_chunks = n_chunks;
+	return 0;
+}
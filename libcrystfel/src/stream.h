@@ -38,8 +38,11 @@
 
 struct image;
 
+#include <stdio.h>
+
 #include "datatemplate.h"
 #include "cell.h"
+#include "index.h"
 
 #define STREAM_GEOM_START_MARKER "----- Begin geometry file -----"
 #define STREAM_GEOM_END_MARKER "----- End geometry file -----"
@@ -92,6 +95,8 @@ extern Stream *stream_open_for_write(const char *filename,
                                      const DataTemplate *dtempl);
 extern Stream *stream_open_fd_for_write(int fd,
                                         const DataTemplate *dtempl);
+extern Stream *stream_open_fh_for_write(FILE *fh,
+                                        const DataTemplate *dtempl);
 extern void stream_close(Stream *st);
 
 /* Writing things to stream header */
@@ -121,6 +126,19 @@ extern int stream_select_chunk(Stream *st, StreamIndex *index,
                                const char *ev);
 extern void stream_index_free(StreamIndex *index);
 
+/* Cell list, for loading the cell parameters without reading the stream */
+#define STREAM_CELLS_RECORD_SIZE (64)
+extern char *stream_cells_filename(const char *stream_filename);
+extern int stream_cells_open_for_write(const char *stream_filename);
+extern int stream_cells_pack(const struct image *image, unsigned char *buf,
+                             int max_records);
+extern int stream_cells_write(int fd, const unsigned char *buf,
+                              int n_records);
+extern int stream_cells_finish(int fd, const char *stream_filename);
+extern int stream_cells_read(const char *stream_filename,
+                             UnitCell ***pcells, IndexingMethod **pindms,
+                             int *pn_cells, int *pn_chunks);
+
 /* Read/write chunks */
 extern struct image *stream_read_chunk(Stream *st, StreamFlags srf);
 extern int stream_write_chunk(Stream *st, const struct image *image,
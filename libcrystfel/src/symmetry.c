@@ -49,6 +49,7 @@
 struct _symoplist
 {
 	IntegerMatrix **ops;
+	IntegerMatrix3 *ops3;  /* Same as 'ops', for use internally */
 	int n_ops;
 	int max_ops;
 	char *name;
@@ -67,6 +68,7 @@ struct _symopmask
 static void alloc_ops(SymOpList *ops)
 {
 	ops->ops = realloc(ops->ops, ops->max_ops*sizeof(IntegerMatrix *));
+	ops->ops3 = realloc(ops->ops3, ops->max_ops*sizeof(IntegerMatrix3));
 }
 
 
@@ -109,6 +111,7 @@ static SymOpList *new_symoplist()
 	new->max_ops = 16;
 	new->n_ops = 0;
 	new->ops = NULL;
+	new->ops3 = NULL;
 	new->name = NULL;
 	new->num_equivs = 1;
 	alloc_ops(new);
@@ -130,6 +133,7 @@ void free_symoplist(SymOpList *ops)
 		intmat_free(ops->ops[i]);
 	}
 	if ( ops->ops != NULL ) free(ops->ops);
+	free(ops->ops3);
 	if ( ops->name != NULL ) free(ops->name);
 	free(ops);
 }
@@ -168,45 +172,46 @@ void add_symop(SymOpList *ops, IntegerMatrix *m)
 		alloc_ops(ops);
 	}
 
+	if ( intmat3_from_intmat(m, &ops->ops3[ops->n_ops]) ) {
+		ERROR("Symmetry operations must be 3x3 matrices.\n");
+		intmat_free(m);
+		return;
+	}
+
 	ops->ops[ops->n_ops++] = m;
 }
 
 
+static void add_symop3(SymOpList *ops, IntegerMatrix3 m)
+{
+	IntegerMatrix *n = intmat_from_intmat3(m);
+	assert(n != NULL);
+	add_symop(ops, n);
+}
+
+
 /* Add a operation to a SymOpList, starting from v(..) */
 static void add_symop_v(SymOpList *ops,
                         signed int *h, signed int *k, signed int *l)
 {
-	IntegerMatrix *m;
+	IntegerMatrix3 m;
 	int i;
 
-	m = intmat_new(3, 3);
-	assert(m != NULL);
-
-	for ( i=0; i<3; i++ ) intmat_set(m, i, 0, h[i]);
-	for ( i=0; i<3; i++ ) intmat_set(m, i, 1, k[i]);
-	for ( i=0; i<3; i++ ) intmat_set(m, i, 2, l[i]);
+	for ( i=0; i<3; i++ ) intmat3_set(&m, i, 0, h[i]);
+	for ( i=0; i<3; i++ ) intmat3_set(&m, i, 1, k[i]);
+	for ( i=0; i<3; i++ ) intmat3_set(&m, i, 2, l[i]);
 
 	free(h);
 	free(k);
 	free(l);
 
-	add_symop(ops, m);
+	add_symop3(ops, m);
 }
 
 
-/**
- * \param ops A \ref SymOpList
- * \param m A \ref SymOpMask
- * \param idx Index of the operation to get
- *
- * This function returns a pointer to an integer matrix specifying a symmetry
- * operation contained in the symmetry operator list, and identified by the
- * specified index.
- *
- * The returned IntegerMatrix is owned by the SymOpList and must not be
- * freed separately.  It is valid as long as 'ops' exists.
- **/
-IntegerMatrix *get_symop(const SymOpList *ops, const SymOpMask *m, int idx)
+/* Returns the index in ops->ops of the idx-th operation which is not masked
+ * out by 'm', or -1 if there is no such operation */
+static int symop_index(const SymOpList *ops, const SymOpMask *m, int idx)
 {
 	const int n = num_ops(ops);
 
@@ -218,7 +223,7 @@ IntegerMatrix *get_symop(const SymOpList *ops, const SymOpMask *m, int idx)
 		for ( i=0; i<n; i++ ) {
 
 			if ( (c == idx) && m->mask[i] ) {
-				return ops->ops[i];
+				return i;
 			}
 
 			if ( m->mask[i] ) {
@@ -230,7 +235,7 @@ IntegerMatrix *get_symop(const SymOpList *ops, const SymOpMask *m, int idx)
 		ERROR("Index %i out of range for point group '%s'\n",
 			      idx, symmetry_name(ops));
 
-		return NULL;
+		return -1;
 
 	}
 
@@ -239,11 +244,31 @@ IntegerMatrix *get_symop(const SymOpList *ops, const SymOpMask *m, int idx)
 		ERROR("Index %i out of range for point group '%s'\n", idx,
 		      symmetry_name(ops));
 
-		return NULL;
+		return -1;
 
 	}
 
-	return ops->ops[idx];
+	return idx;
+}
+
+
+/**
+ * \param ops A \ref SymOpList
+ * \param m A \ref SymOpMask
+ * \param idx Index of the operation to get
+ *
+ * This function returns a pointer to an integer matrix specifying a symmetry
+ * operation contained in the symmetry operator list, and identified by the
+ * specified index.
+ *
+ * The returned IntegerMatrix is owned by the SymOpList and must not be
+ * freed separately.  It is valid as long as 'ops' exists.
+ **/
+IntegerMatrix *get_symop(const SymOpList *ops, const SymOpMask *m, int idx)
+{
+	int i = symop_index(ops, m, idx);
+	if ( i < 0 ) return NULL;
+	return ops->ops[i];
 }
 
 static signed int *v(signed int h, signed int k, signed int i, signed int l)
@@ -289,7 +314,7 @@ static void add_identity(SymOpList *s)
 	found = 0;
 	ni = num_ops(s);
 	for ( i=0; i<ni; i++ ) {
-		if ( intmat_is_identity(s->ops[i]) ) {
+		if ( intmat3_is_identity(s->ops3[i]) ) {
 			found = 1;
 			break;
 		}
@@ -318,31 +343,28 @@ static void expand_ops(SymOpList *s)
 		for ( i=0; i<ni; i++ ) {
 
 			int j;
-			IntegerMatrix *opi = s->ops[i];
+			IntegerMatrix3 opi = s->ops3[i];
 
 			/* Apply op 'i' to all the current ops in the list */
 			for ( j=0; j<ni; j++ ) {
 
-				IntegerMatrix *opj = s->ops[j];
-				IntegerMatrix *m;
+				IntegerMatrix3 m;
 				int k, nk;
 				int found;
 
-				m = intmat_times_intmat(opi, opj);
-				assert(m != NULL);
+				m = intmat3_times_intmat3(opi, s->ops3[j]);
 
 				nk = num_ops(s);
 				found = 0;
 				for ( k=0; k<nk; k++ ) {
-					if ( intmat_equals(m, s->ops[k]) ) {
+					if ( intmat3_equals(m, s->ops3[k]) ) {
 						found = 1;
-						intmat_free(m);
 						break;
 					}
 				}
 
 				if ( !found ) {
-					add_symop(s, m);
+					add_symop3(s, m);
 					added++;
 				}
 
@@ -357,13 +379,13 @@ static void expand_ops(SymOpList *s)
 /* Transform all the operations in a SymOpList by a given matrix.
  * The matrix must have a determinant of +/- 1 (otherwise its inverse would
  * not also be an integer matrix). */
-static void transform_ops(SymOpList *s, IntegerMatrix *P)
+static void transform_ops(SymOpList *s, IntegerMatrix3 P)
 {
 	int n, i;
-	IntegerMatrix *Pi;
+	IntegerMatrix3 Pi;
 	signed int det;
 
-	det = intmat_det(P);
+	det = intmat3_det(P);
 	if ( det == -1 ) {
 		ERROR("WARNING: mirrored SymOpList.\n");
 	} else if ( det != 1 ) {
@@ -371,8 +393,7 @@ static void transform_ops(SymOpList *s, IntegerMatrix *P)
 		return;
 	}
 
-	Pi = intmat_inverse(P);
-	if ( Pi == NULL ) {
+	if ( intmat3_inverse(P, &Pi) ) {
 		ERROR("Failed to invert matrix.\n");
 		return;
 	}
@@ -380,28 +401,16 @@ static void transform_ops(SymOpList *s, IntegerMatrix *P)
 	n = num_ops(s);
 	for ( i=0; i<n; i++ ) {
 
-		IntegerMatrix *r, *f;
-
-		r = intmat_times_intmat(P, s->ops[i]);
-		if ( r == NULL ) {
-			ERROR("Matrix multiplication failed.\n");
-			return;
-		}
+		IntegerMatrix3 f;
 
-		f = intmat_times_intmat(r, Pi);
-		if ( f == NULL ) {
-			ERROR("Matrix multiplication failed.\n");
-			return;
-		}
-		intmat_free(r);
+		f = intmat3_times_intmat3(intmat3_times_intmat3(P, s->ops3[i]),
+		                          Pi);
 
+		s->ops3[i] = f;
 		intmat_free(s->ops[i]);
-		s->ops[i] = intmat_copy(f);
-		intmat_free(f);
+		s->ops[i] = intmat_from_intmat3(f);
 
 	}
-
-	intmat_free(Pi);
 }
 
 
@@ -969,7 +978,7 @@ static SymOpList *getpg_arbitrary_ua(const char *sym, size_t s)
 	char ua;
 	char *pg_type;
 	SymOpList *pg;
-	IntegerMatrix *t;
+	IntegerMatrix3 t;
 	char *new_name;
 
 	if ( strncmp(sym+s, "ua", 2) == 0 ) {
@@ -993,28 +1002,27 @@ static SymOpList *getpg_arbitrary_ua(const char *sym, size_t s)
 	}
 	free(pg_type);
 
-	t = intmat_new(3, 3);
-	if ( t == NULL ) return NULL;
+	t = intmat3_zero();
 
 	switch ( ua ) {
 
 		case 'a' :
-		intmat_set(t, 0, 2, 1);
-		intmat_set(t, 1, 0, 1);
-		intmat_set(t, 2, 1, 1);
+		intmat3_set(&t, 0, 2, 1);
+		intmat3_set(&t, 1, 0, 1);
+		intmat3_set(&t, 2, 1, 1);
 		break;
 
 		case 'b' :
-		intmat_set(t, 0, 1, 1);
-		intmat_set(t, 1, 2, 1);
-		intmat_set(t, 2, 0, 1);
+		intmat3_set(&t, 0, 1, 1);
+		intmat3_set(&t, 1, 2, 1);
+		intmat3_set(&t, 2, 0, 1);
 
 		break;
 
 		case 'c' :
-		intmat_set(t, 0, 0, 1);
-		intmat_set(t, 1, 1, 1);
-		intmat_set(t, 2, 2, 1);
+		intmat3_set(&t, 0, 0, 1);
+		intmat3_set(&t, 1, 1, 1);
+		intmat3_set(&t, 2, 2, 1);
 		break;
 
 		default :
@@ -1025,7 +1033,6 @@ static SymOpList *getpg_arbitrary_ua(const char *sym, size_t s)
 	}
 
 	transform_ops(pg, t);
-	intmat_free(t);
 
 	new_name = malloc(64);
 	if ( new_name == NULL ) {
@@ -1102,20 +1109,18 @@ void pointgroup_warning(const char *sym)
 }
 
 
-static void do_op(const IntegerMatrix *op,
+static void do_op(IntegerMatrix3 op,
                   signed int h, signed int k, signed int l,
                   signed int *he, signed int *ke, signed int *le)
 {
 	signed int vec[3];
-	signed int *ans;
+	signed int ans[3];
 
 	vec[0] = h;  vec[1] = k;  vec[2] = l;
 
-	ans = transform_indices(op, vec);
-	assert(ans != NULL);
+	intmat3_transform_indices(op, vec, ans);
 
 	*he = ans[0];  *ke = ans[1];  *le = ans[2];
-	free(ans);
 }
 
 
@@ -1144,13 +1149,13 @@ void get_equiv(const SymOpList *ops, const SymOpMask *m, int idx,
                signed int h, signed int k, signed int l,
                signed int *he, signed int *ke, signed int *le)
 {
-	IntegerMatrix *op;
-	op = get_symop(ops, m, idx);
-	if ( op == NULL ) {
+	int i;
+	i = symop_index(ops, m, idx);
+	if ( i < 0 ) {
 		fprintf(stderr, "Cannot proceed.\n");
 		abort();
 	}
-	do_op(op, h, k, l, he, ke, le);
+	do_op(ops->ops3[i], h, k, l, he, ke, le);
 }
 
 
@@ -1331,7 +1336,7 @@ int is_centrosymmetric(const SymOpList *s)
 
 	n = num_ops(s);
 	for ( i=0; i<n; i++ ) {
-		if ( intmat_is_inversion(s->ops[i]) ) return 1;
+		if ( intmat3_is_inversion(s->ops3[i]) ) return 1;
 	}
 
 	return 0;
@@ -1339,19 +1344,9 @@ int is_centrosymmetric(const SymOpList *s)
 
 
 /* Return true if a*b = ans */
-static int check_mult(const IntegerMatrix *ans,
-                      const IntegerMatrix *a, const IntegerMatrix *b)
+static int check_mult(IntegerMatrix3 ans, IntegerMatrix3 a, IntegerMatrix3 b)
 {
-	int val;
-	IntegerMatrix *m;
-
-	m = intmat_times_intmat(a, b);
-	assert(m != NULL);
-
-	val = intmat_equals(ans, m);
-	intmat_free(m);
-
-	return val;
+	return intmat3_equals(ans, intmat3_times_intmat3(a, b));
 }
 
 
@@ -1376,7 +1371,7 @@ int is_subgroup(const SymOpList *source, const SymOpList *target)
 
 		for ( j=0; j<n_src; j++ ) {
 
-			if ( intmat_equals(target->ops[i], source->ops[j]) ) {
+			if ( intmat3_equals(target->ops3[i], source->ops3[j]) ) {
 				found = 1;
 				break;
 			}
@@ -1392,30 +1387,20 @@ int is_subgroup(const SymOpList *source, const SymOpList *target)
 
 
 /* Returns n, where m^n = I */
-static int order(const IntegerMatrix *m)
+static int order(IntegerMatrix3 m)
 {
-	IntegerMatrix *a;
+	IntegerMatrix3 a;
 	int i;
 
-	a = intmat_new(3, 3);
-	assert(a != NULL);
-	intmat_set(a, 0, 0, 1);
-	intmat_set(a, 1, 1, 1);
-	intmat_set(a, 2, 2, 1);
+	a = intmat3_identity();
 
 	i = 0;
 	do {
 
-		IntegerMatrix *anew;
-
-		anew = intmat_times_intmat(m, a);
-		assert(anew != NULL);
-		intmat_free(a);
-		a = anew;
-
+		a = intmat3_times_intmat3(m, a);
 		i++;
 
-	} while ( !intmat_is_identity(a) );
+	} while ( !intmat3_is_identity(a) );
 
 	return i;
 }
@@ -1435,8 +1420,8 @@ static SymOpList *flack_reorder(const SymOpList *source)
 	/* Find identity */
 	for ( i=0; i<n_src; i++ ) {
 		if ( used->mask[i] == 0 ) continue;
-		if ( intmat_is_identity(source->ops[i]) ) {
-			add_symop(src_reordered, intmat_copy(source->ops[i]));
+		if ( intmat3_is_identity(source->ops3[i]) ) {
+			add_symop3(src_reordered, source->ops3[i]);
 			used->mask[i] = 0;
 		}
 	}
@@ -1444,9 +1429,9 @@ static SymOpList *flack_reorder(const SymOpList *source)
 	/* Find binary options (order=2) of first kind (determinant positive) */
 	for ( i=0; i<n_src; i++ ) {
 		if ( used->mask[i] == 0 ) continue;
-		if ( (order(source->ops[i]) == 2)
-		  && (intmat_det(source->ops[i]) > 0) ) {
-			add_symop(src_reordered, intmat_copy(source->ops[i]));
+		if ( (order(source->ops3[i]) == 2)
+		  && (intmat3_det(source->ops3[i]) > 0) ) {
+			add_symop3(src_reordered, source->ops3[i]);
 			used->mask[i] = 0;
 		}
 	}
@@ -1454,8 +1439,8 @@ static SymOpList *flack_reorder(const SymOpList *source)
 	/* Find other operations of first kind (determinant positive) */
 	for ( i=0; i<n_src; i++ ) {
 		if ( used->mask[i] == 0 ) continue;
-		if ( intmat_det(source->ops[i]) > 0 ) {
-			add_symop(src_reordered, intmat_copy(source->ops[i]));
+		if ( intmat3_det(source->ops3[i]) > 0 ) {
+			add_symop3(src_reordered, source->ops3[i]);
 			used->mask[i] = 0;
 		}
 	}
@@ -1463,8 +1448,8 @@ static SymOpList *flack_reorder(const SymOpList *source)
 	/* Find inversion */
 	for ( i=0; i<n_src; i++ ) {
 		if ( used->mask[i] == 0 ) continue;
-		if ( intmat_is_inversion(source->ops[i]) ) {
-			add_symop(src_reordered, intmat_copy(source->ops[i]));
+		if ( intmat3_is_inversion(source->ops3[i]) ) {
+			add_symop3(src_reordered, source->ops3[i]);
 			used->mask[i] = 0;
 		}
 	}
@@ -1472,9 +1457,9 @@ static SymOpList *flack_reorder(const SymOpList *source)
 	/* Find binary options of second kind (determinant negative) */
 	for ( i=0; i<n_src; i++ ) {
 		if ( used->mask[i] == 0 ) continue;
-		if ( (order(source->ops[i]) == 2)
-		  && (intmat_det(source->ops[i]) < 0) ) {
-			add_symop(src_reordered, intmat_copy(source->ops[i]));
+		if ( (order(source->ops3[i]) == 2)
+		  && (intmat3_det(source->ops3[i]) < 0) ) {
+			add_symop3(src_reordered, source->ops3[i]);
 			used->mask[i] = 0;
 		}
 	}
@@ -1482,8 +1467,8 @@ static SymOpList *flack_reorder(const SymOpList *source)
 	/* Find other operations of second kind (determinant negative) */
 	for ( i=0; i<n_src; i++ ) {
 		if ( used->mask[i] == 0 ) continue;
-		if ( intmat_det(source->ops[i]) < 0 ) {
-			add_symop(src_reordered, intmat_copy(source->ops[i]));
+		if ( intmat3_det(source->ops3[i]) < 0 ) {
+			add_symop3(src_reordered, source->ops3[i]);
 			used->mask[i] = 0;
 		}
 	}
@@ -1569,9 +1554,9 @@ SymOpList *get_ambiguities(const SymOpList *source, const SymOpList *target)
 
 			int k;
 			for ( k=i+1; k<n_src; k++ ) {
-				if ( check_mult(src_reordered->ops[k],
-				                src_reordered->ops[i],
-				                tgt_reordered->ops[j]) )
+				if ( check_mult(src_reordered->ops3[k],
+				                src_reordered->ops3[i],
+				                tgt_reordered->ops3[j]) )
 				{
 					used->mask[k] = 0;
 				}
@@ -1584,7 +1569,7 @@ SymOpList *get_ambiguities(const SymOpList *source, const SymOpList *target)
 	twins = new_symoplist();
 	for ( i=0; i<n_src; i++ ) {
 		if ( used->mask[i] == 0 ) continue;
-		if ( intmat_det(src_reordered->ops[i]) < 0 ) {
+		if ( intmat3_det(src_reordered->ops3[i]) < 0 ) {
 			/* A mirror or inversion turned up in the list.
 			 * That means that no pure rotational ambiguity can
 			 * account for this subgroup relationship. */
@@ -1593,8 +1578,8 @@ SymOpList *get_ambiguities(const SymOpList *source, const SymOpList *target)
 			free_symoplist(src_reordered);
 			return NULL;
 		}
-		if ( !intmat_is_identity(src_reordered->ops[i]) ) {
-			add_symop(twins, intmat_copy(src_reordered->ops[i]));
+		if ( !intmat3_is_identity(src_reordered->ops3[i]) ) {
+			add_symop3(twins, src_reordered->ops3[i]);
 		} else {
 			have_identity = 1;
 		}
@@ -43,26 +43,33 @@
 
 /* --------------------------- Status label stuff --------------------------- */
 
-static int use_status_labels = 0;
+/* The key is created only once, and each worker thread sets its own label
+ * (or none), so that run_threads() can be called from within a task. */
 static pthread_key_t status_label_key;
+static pthread_once_t status_label_once = PTHREAD_ONCE_INIT;
 
 struct worker_args
 {
 	struct task_queue_range *tqr;
 	struct task_queue *tq;
 	int id;
+	int use_label;
 };
 
 
+static void make_status_label_key(void)
+{
+	pthread_key_create(&status_label_key, NULL);
+}
+
+
 signed int get_status_label()
 {
 	int *cookie;
 
-	if ( !use_status_labels ) {
-		return -1;
-	}
-
+	pthread_once(&status_label_once, make_status_label_key);
 	cookie = pthread_getspecific(status_label_key);
+	if ( cookie == NULL ) return -1;
 	return *cookie;
 }
 
@@ -86,10 +93,13 @@ static void *task_worker(void *pargsv)
 {
 	struct worker_args *w = pargsv;
 	struct task_queue *q = w->tq;
-	int *cookie_slot;
+	int cookie = w->id;
+	int *cookie_slot = NULL;
 
-	cookie_slot = malloc(sizeof(int));
-	*cookie_slot = w->id;
+	if ( w->use_label ) {
+		cookie_slot = malloc(sizeof(int));
+		if ( cookie_slot != NULL ) *cookie_slot = w->id;
+	}
 	pthread_setspecific(status_label_key, cookie_slot);
 
 	free(w);
@@ -97,7 +107,6 @@ static void *task_worker(void *pargsv)
 	do {
 
 		void *task;
-		int cookie;
 
 		/* Get a task */
 		pthread_mutex_lock(&q->lock);
@@ -116,7 +125,6 @@ static void *task_worker(void *pargsv)
 		q->n_started++;
 		pthread_mutex_unlock(&q->lock);
 
-		cookie = *(int *)pthread_getspecific(status_label_key);
 		q->work(task, cookie);
 
 		/* Update totals etc */
@@ -171,7 +179,7 @@ int run_threads(int n_threads, TPWorkFunc work,
 	int i;
 	struct task_queue q;
 
-	pthread_key_create(&status_label_key, NULL);
+	pthread_once(&status_label_once, make_status_label_key);
 
 	workers = malloc(n_threads * sizeof(pthread_t));
 
@@ -184,9 +192,6 @@ int run_threads(int n_threads, TPWorkFunc work,
 	q.n_completed = 0;
 	q.max = max;
 
-	/* Now it's safe to start using the status labels */
-	if ( n_threads > 1 ) use_status_labels = 1;
-
 	/* Start threads */
 	for ( i=0; i<n_threads; i++ ) {
 
@@ -197,6 +202,7 @@ int run_threads(int n_threads, TPWorkFunc work,
 		w->tq = &q;
 		w->tqr = NULL;
 		w->id = i;
+		w->use_label = (n_threads > 1);
 
 		if ( pthread_create(&workers[i], NULL, task_worker, w) ) {
 			/* Not ERROR() here */
@@ -212,9 +218,89 @@ int run_threads(int n_threads, TPWorkFunc work,
 		pthread_join(workers[i], NULL);
 	}
 
-	use_status_labels = 0;
-
 	free(workers);
 
 	return q.n_completed;
 }
+
+
+/* ------------------------------ Block queue ------------------------------- */
+
+struct block_queue
+{
+	int n;
+	int next;
+	int block_size;
+	TPBlockFunc func;
+	void *vp;
+};
+
+
+struct block_task
+{
+	struct block_queue *q;
+	int start;
+	int end;
+};
+
+
+static void *get_block(void *vq)
+{
+	struct block_queue *q = vq;
+	struct block_task *t;
+
+	if ( q->next >= q->n ) return NULL;
+
+	t = malloc(sizeof(struct block_task));
+	if ( t == NULL ) return NULL;
+
+	t->q = q;
+	t->start = q->next;
+	t->end = q->next + q->block_size;
+	if ( t->end > q->n ) t->end = q->n;
+	q->next = t->end;
+
+	return t;
+}
+
+
+static void run_block(void *vt, int cookie)
+{
+	struct block_task *t = vt;
+	t->q->func(t->q->vp, t->start, t->end);
+}
+
+
+static void finalise_block(void *vq, void *vt)
+{
+	free(vt);
+}
+
+
+/**
+ * \param n_threads The number of threads to run in parallel
+ * \param n The number of items
+ * \param block_size The number of items to give to \p func at once
+ * \param func The function to be called for each block of items
+ * \param vp A pointer which will be passed to \p func
+ *
+ * Calls \p func for consecutive blocks of items covering items 0 to \p n-1,
+ * using \ref run_threads.  This is for work which is split up by position in
+ * an array, where each item needs only a small amount of work.
+ **/
+void run_blocks(int n_threads, int n, int block_size, TPBlockFunc func,
+                void *vp)
+{
+	struct block_queue q;
+
+	if ( n == 0 ) return;
+
+	q.n = n;
+	q.next = 0;
+	q.block_size = (block_size > 0) ? block_size : 1;
+	q.func = func;
+	q.vp = vp;
+
+	run_threads(n_threads, run_block, get_block, finalise_block, &q,
+	            0, 0, 0, 0);
+}
@@ -79,6 +79,20 @@ extern int run_threads(int n_threads, TPWorkFunc work,
                        void *queue_args, int max,
                        int cpu_num, int cpu_groupsize, int cpu_offset);
 
+
+/**
+ * \param vp The pointer which was given to \ref run_blocks.
+ * \param start The first item in the block
+ * \param end One more than the last item in the block
+ *
+ * This function is called, reentrantly, for each block of items.
+ **/
+typedef void (*TPBlockFunc)(void *vp, int start, int end);
+
+
+extern void run_blocks(int n_threads, int n, int block_size,
+                       TPBlockFunc func, void *vp);
+
 #ifdef __cplusplus
 }
 #endif
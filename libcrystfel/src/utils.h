@@ -34,6 +34,7 @@
 #include <float.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_vector.h>
@@ -238,6 +239,52 @@ extern char *load_entire_file(const char *filename);
 extern int file_exists(const char *filename);
 extern const char *filename_extension(const char *fn, const char **ext2);
 
+/* Little-endian packing for binary files */
+static inline void put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+
+static inline uint32_t get_u32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+	     | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static inline void put_u64(unsigned char *p, uint64_t v)
+{
+	put_u32(p, v & 0xffffffff);
+	put_u32(p+4, v >> 32);
+}
+
+
+static inline uint64_t get_u64(const unsigned char *p)
+{
+	return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p+4) << 32);
+}
+
+
+static inline void put_f64(unsigned char *p, double v)
+{
+	uint64_t u;
+	memcpy(&u, &v, 8);
+	put_u64(p, u);
+}
+
+
+static inline double get_f64(const unsigned char *p)
+{
+	uint64_t u = get_u64(p);
+	double v;
+	memcpy(&v, &u, 8);
+	return v;
+}
+
 
 /* ------------------------------ Useful stuff ------------------------------ */
 
@@ -1952,6 +1952,63 @@ static void indexing_method_list(CellWindow *w, GtkWidget *vbox)
 }
 
 
+/* Returns zero if the cells were loaded from the stream's cell list */
+static int add_cell_list(CellWindow *w, const char *stream_filename,
+                         int *pmax_cells, int *pn_total_chunks)
+{
+	UnitCell **cells;
+	IndexingMethod *indms;
+	UnitCell **cells_new;
+	IndexingMethod *indms_new;
+	int n_cells, n_chunks;
+	int max_cells;
+	int i;
+
+	if ( stream_cells_read(stream_filename, &cells, &indms,
+	                       &n_cells, &n_chunks) )
+	{
+		char *fn = stream_cells_filename(stream_filename);
+		if ( (fn != NULL) && file_exists(fn) ) {
+			fprintf(stderr, "%s is incomplete or out of date, "
+			        "reading the stream instead.\n", fn);
+		}
+		free(fn);
+		return 1;
+	}
+
+	/* Allocate one extra, in case there are no cells at all */
+	max_cells = w->n_cells + n_cells + 1;
+	if ( max_cells < *pmax_cells ) max_cells = *pmax_cells;
+	cells_new = realloc(w->cells, max_cells*sizeof(UnitCell *));
+	indms_new = realloc(w->indms, max_cells*sizeof(IndexingMethod));
+	if ( cells_new != NULL ) w->cells = cells_new;
+	if ( indms_new != NULL ) w->indms = indms_new;
+	if ( (cells_new == NULL) || (indms_new == NULL) ) {
+		fprintf(stderr, "Failed to allocate memory for cells.\n");
+		for ( i=0; i<n_cells; i++ ) cell_free(cells[i]);
+		free(cells);
+		free(indms);
+		return 1;
+	}
+
+	for ( i=0; i<n_cells; i++ ) {
+		w->cells[w->n_cells] = cells[i];
+		w->indms[w->n_cells] = indms[i];
+		w->n_cells++;
+	}
+	*pmax_cells = max_cells;
+
+	free(cells);
+	free(indms);
+
+	fprintf(stderr, "%s: Loaded %i cells from %i chunks (cell list)\n",
+	        stream_filename, n_cells, n_chunks);
+
+	*pn_total_chunks += n_chunks;
+	return 0;
+}
+
+
 static int add_stream(CellWindow *w, const char *stream_filename,
                       int *pmax_cells, int *pn_total_chunks)
 {
@@ -1962,6 +2019,12 @@ static int add_stream(CellWindow *w, const char *stream_filename,
 
 	fprintf(stderr, "%s\r", stream_filename);
 
+	if ( add_cell_list(w, stream_filename, pmax_cells,
+	                   pn_total_chunks) == 0 )
+	{
+		return 0;
+	}
+
 	st = stream_open_for_read(stream_filename);
 	if ( st == NULL ) {
 		fprintf(stderr, "Failed to open '%s' (skipping)\n",
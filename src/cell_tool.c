@@ -43,6 +43,10 @@
 #include <cell-utils.h>
 #include <reflist-utils.h>
 #include <reflist.h>
+#include <stream.h>
+#include <image.h>
+#include <crystal.h>
+#include <thread-pool.h>
 
 #include "version.h"
 
@@ -70,6 +74,13 @@ static void show_help(const char *s)
 "     --tolerance=<tol>      Set the tolerances for cell comparison.\n"
 "                             Default: 5,1.5 (axis percentage, angle deg).\n"
 "     --highres=n            Resolution limit (Angstroms) for --rings\n"
+"\n"
+"  Batch comparison:\n"
+"     --batch=<file>         Compare all cells in <file> (a stream, or a list\n"
+"                             of unit cell files) with the --compare-cell\n"
+"                             cell(s).  --compare-cell can be given more than\n"
+"                             once.  The results are written to the -o file.\n"
+" -j <n>                     Run <n> comparisons in parallel.\n"
 );
 }
 
@@ -459,6 +470,451 @@ static int cell_choices(UnitCell *cell)
 }
 
 
+/* A cell to be compared in batch mode */
+struct batch_cell
+{
+	UnitCell *cell;
+	char *filename;
+	char *ev;       /* Event ID, or NULL if not from a stream */
+	int crystal;    /* Crystal number within the chunk */
+};
+
+
+struct batch_reference
+{
+	char *filename;
+	PreparedReference *prep;
+};
+
+
+enum batch_relation
+{
+	BATCH_NONE,
+	BATCH_REINDEXED,
+	BATCH_DERIVATIVE,
+};
+
+
+struct batch_result
+{
+	enum batch_relation rel;
+	RationalMatrix *m;
+	UnitCell *trans;
+};
+
+
+struct batch_args
+{
+	struct batch_cell *cells;
+	int n_cells;
+	struct batch_reference *refs;
+	int n_refs;
+	double tolerance[6];
+	struct batch_result *results;  /* n_refs results for each cell */
+	int next;
+	int n_done;
+};
+
+
+struct batch_task
+{
+	struct batch_args *args;
+	int cell;
+};
+
+
+static int add_batch_cell(struct batch_cell **pcells, int *pn, int *pmax,
+                          UnitCell *cell, const char *filename,
+                          const char *ev, int crystal)
+{
+	struct batch_cell *bc;
+
+	if ( *pn == *pmax ) {
+		struct batch_cell *cells_new;
+		cells_new = realloc(*pcells,
+		                    (*pmax+1024)*sizeof(struct batch_cell));
+		if ( cells_new == NULL ) {
+			ERROR("Failed to allocate memory for cells.\n");
+			return 1;
+		}
+		*pcells = cells_new;
+		*pmax += 1024;
+	}
+
+	bc = &(*pcells)[(*pn)++];
+	bc->cell = cell;
+	bc->filename = strdup(filename);
+	bc->ev = safe_strdup(ev);
+	bc->crystal = crystal;
+	return 0;
+}
+
+
+static int read_batch_stream(const char *filename, struct batch_cell **pcells,
+                             int *pn, int *pmax)
+{
+	Stream *st;
+
+	st = stream_open_for_read(filename);
+	if ( st == NULL ) {
+		ERROR("Failed to open stream '%s'\n", filename);
+		return 1;
+	}
+
+	do {
+
+		struct image *image;
+		int i;
+
+		image = stream_read_chunk(st, 0);
+		if ( image == NULL ) break;
+
+		for ( i=0; i<image->n_crystals; i++ ) {
+			UnitCell *cell;
+			cell = crystal_get_cell(image->crystals[i]);
+			if ( add_batch_cell(pcells, pn, pmax,
+			                    cell_new_from_cell(cell),
+			                    image->filename, image->ev, i) )
+			{
+				image_free(image);
+				stream_close(st);
+				return 1;
+			}
+		}
+
+		image_free(image);
+
+	} while ( 1 );
+
+	stream_close(st);
+	return 0;
+}
+
+
+/* A list of unit cell files, one per line */
+static int read_batch_list(const char *filename, struct batch_cell **pcells,
+                           int *pn, int *pmax)
+{
+	FILE *fh;
+	char line[1024];
+
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) {
+		ERROR("Failed to open '%s'\n", filename);
+		return 1;
+	}
+
+	while ( fgets(line, 1024, fh) != NULL ) {
+
+		UnitCell *cell;
+
+		chomp(line);
+		notrail(line);
+		if ( (line[0] == '\0') || (line[0] == '#') ) continue;
+
+		cell = load_cell_from_file(line);
+		if ( cell == NULL ) {
+			ERROR("Failed to load cell from '%s'\n", line);
+			fclose(fh);
+			return 1;
+		}
+
+		if ( add_batch_cell(pcells, pn, pmax, cell, line, NULL, 0) ) {
+			fclose(fh);
+			return 1;
+		}
+
+	}
+
+	fclose(fh);
+	return 0;
+}
+
+
+static int is_stream(const char *filename)
+{
+	FILE *fh;
+	char line[64];
+	int r = 0;
+
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) return 0;
+	if ( fgets(line, 64, fh) != NULL ) {
+		r = (strncmp(line, "CrystFEL stream format", 22) == 0);
+	}
+	fclose(fh);
+	return r;
+}
+
+
+static void *get_batch_task(void *vp)
+{
+	struct batch_args *args = vp;
+	struct batch_task *task;
+
+	if ( args->next >= args->n_cells ) return NULL;
+
+	task = malloc(sizeof(struct batch_task));
+	if ( task == NULL ) return NULL;
+
+	task->args = args;
+	task->cell = args->next++;
+	return task;
+}
+
+
+static void run_batch_task(void *vp, int cookie)
+{
+	struct batch_task *task = vp;
+	struct batch_args *args = task->args;
+	UnitCell *cell = args->cells[task->cell].cell;
+	int i;
+
+	for ( i=0; i<args->n_refs; i++ ) {
+
+		struct batch_result *res;
+		RationalMatrix *m;
+
+		res = &args->results[task->cell*args->n_refs + i];
+		res->rel = BATCH_NONE;
+		res->m = NULL;
+
+		res->trans = compare_reindexed_cell_parameters_prepared(cell,
+		                                            args->refs[i].prep,
+		                                            args->tolerance, &m);
+		if ( res->trans != NULL ) {
+			res->rel = BATCH_REINDEXED;
+			res->m = m;
+			continue;
+		}
+
+		if ( compare_derivative_cell_parameters(cell,
+		                          prepared_reference_cell(args->refs[i].prep),
+		                          args->tolerance, 0, &m) )
+		{
+			res->rel = BATCH_DERIVATIVE;
+			res->m = m;
+			res->trans = cell_transform_rational(cell, m);
+		}
+
+	}
+}
+
+
+static void finalise_batch_task(void *vp, void *vtask)
+{
+	struct batch_args *args = vp;
+
+	args->n_done++;
+	if ( args->n_done % 1000 == 0 ) {
+		STATUS("Compared %i of %i cells.\n", args->n_done,
+		       args->n_cells);
+	}
+	free(vtask);
+}
+
+
+/* Formats the transformation in the same way as accepted by --transform */
+static void format_transformation(RationalMatrix *m, char *out, size_t max)
+{
+	int i, j;
+	const char *axes = "abc";
+
+	out[0] = '\0';
+	for ( j=0; j<3; j++ ) {
+
+		int printed = 0;
+
+		if ( j > 0 ) strncat(out, ",", max-strlen(out)-1);
+
+		for ( i=0; i<3; i++ ) {
+
+			Rational v = rtnl_mtx_get(m, i, j);
+			char term[48];
+			char *num;
+
+			if ( rtnl_cmp(v, rtnl_zero()) == 0 ) continue;
+
+			num = rtnl_format(rtnl_abs(v));
+			snprintf(term, 48, "%s%s%c",
+			         (rtnl_cmp(v, rtnl_zero()) < 0) ? "-"
+			                               : (printed ? "+" : ""),
+			         (rtnl_cmp(rtnl_abs(v), rtnl(1, 1)) == 0) ? ""
+			                                                 : num,
+			         axes[i]);
+			free(num);
+			strncat(out, term, max-strlen(out)-1);
+			printed = 1;
+
+		}
+
+	}
+}
+
+
+static const char *batch_relation_name(enum batch_relation rel)
+{
+	switch ( rel ) {
+		case BATCH_NONE : return "none";
+		case BATCH_REINDEXED : return "reindexed";
+		case BATCH_DERIVATIVE : return "derivative";
+		default : return "unknown";
+	}
+}
+
+
+static void write_batch_table(struct batch_args *args, FILE *fh)
+{
+	int i, j;
+
+	fprintf(fh, "# Filename Event Crystal Reference Relationship "
+	            "Transformation a/A b/A c/A al/deg be/deg ga/deg\n");
+
+	for ( i=0; i<args->n_cells; i++ ) {
+
+		struct batch_cell *bc = &args->cells[i];
+
+		for ( j=0; j<args->n_refs; j++ ) {
+
+			struct batch_result *res;
+			double a, b, c, al, be, ga;
+			char trans[256];
+
+			res = &args->results[i*args->n_refs + j];
+
+			fprintf(fh, "%s %s %i %s %s", bc->filename,
+			        (bc->ev != NULL) ? bc->ev : "-", bc->crystal,
+			        args->refs[j].filename,
+			        batch_relation_name(res->rel));
+
+			if ( res->rel == BATCH_NONE ) {
+				fprintf(fh, " - - - - - - -\n");
+				continue;
+			}
+
+			format_transformation(res->m, trans, 256);
+			cell_get_parameters(res->trans, &a, &b, &c,
+			                    &al, &be, &ga);
+			fprintf(fh, " %s %.3f %.3f %.3f %.2f %.2f %.2f\n",
+			        trans, a*1e10, b*1e10, c*1e10,
+			        rad2deg(al), rad2deg(be), rad2deg(ga));
+
+		}
+
+	}
+}
+
+
+static int batch_compare(const char *batch_file, char **ref_files, int n_refs,
+                         double ltl, double atl, int n_threads,
+                         const char *out_file)
+{
+	struct batch_args args;
+	int max_cells = 0;
+	int i;
+	int n_rel[3] = {0, 0, 0};
+	FILE *fh;
+	int r;
+
+	args.cells = NULL;
+	args.n_cells = 0;
+	if ( is_stream(batch_file) ) {
+		r = read_batch_stream(batch_file, &args.cells, &args.n_cells,
+		                      &max_cells);
+	} else {
+		r = read_batch_list(batch_file, &args.cells, &args.n_cells,
+		                    &max_cells);
+	}
+	if ( r ) return 1;
+	STATUS("Read %i cells from %s\n", args.n_cells, batch_file);
+
+	/* The references only need to be reduced once */
+	args.n_refs = n_refs;
+	args.refs = malloc(n_refs*sizeof(struct batch_reference));
+	if ( args.refs == NULL ) return 1;
+	for ( i=0; i<n_refs; i++ ) {
+
+		UnitCell *ref;
+
+		ref = load_cell_from_file(ref_files[i]);
+		if ( ref == NULL ) {
+			ERROR("Failed to load unit cell from '%s'\n",
+			      ref_files[i]);
+			return 1;
+		}
+		if ( validate_cell(ref) > 1 ) {
+			ERROR("Comparison cell '%s' is invalid.\n",
+			      ref_files[i]);
+			return 1;
+		}
+
+		args.refs[i].filename = ref_files[i];
+		args.refs[i].prep = prepare_reference_cell(ref);
+		cell_free(ref);
+		if ( args.refs[i].prep == NULL ) {
+			ERROR("Failed to prepare reference cell '%s'\n",
+			      ref_files[i]);
+			return 1;
+		}
+
+	}
+
+	args.tolerance[0] = ltl;
+	args.tolerance[1] = ltl;
+	args.tolerance[2] = ltl;
+	args.tolerance[3] = atl;
+	args.tolerance[4] = atl;
+	args.tolerance[5] = atl;
+
+	args.results = malloc(args.n_cells*n_refs*sizeof(struct batch_result));
+	if ( args.results == NULL ) {
+		ERROR("Failed to allocate memory for results.\n");
+		return 1;
+	}
+	args.next = 0;
+	args.n_done = 0;
+
+	run_threads(n_threads, run_batch_task, get_batch_task,
+	            finalise_batch_task, &args, 0, 0, 0, 0);
+
+	if ( out_file != NULL ) {
+		fh = fopen(out_file, "w");
+		if ( fh == NULL ) {
+			ERROR("Failed to open '%s'\n", out_file);
+			return 1;
+		}
+	} else {
+		fh = stdout;
+	}
+	write_batch_table(&args, fh);
+	if ( fh != stdout ) fclose(fh);
+
+	for ( i=0; i<args.n_cells*n_refs; i++ ) {
+		n_rel[args.results[i].rel]++;
+		rtnl_mtx_free(args.results[i].m);
+		cell_free(args.results[i].trans);
+	}
+	STATUS("%i comparisons: %i reindexed, %i derivative, "
+	       "%i no relationship found.\n", args.n_cells*n_refs,
+	       n_rel[BATCH_REINDEXED], n_rel[BATCH_DERIVATIVE],
+	       n_rel[BATCH_NONE]);
+
+	for ( i=0; i<args.n_cells; i++ ) {
+		cell_free(args.cells[i].cell);
+		free(args.cells[i].filename);
+		free(args.cells[i].ev);
+	}
+	free(args.cells);
+	for ( i=0; i<n_refs; i++ ) {
+		prepared_reference_free(args.refs[i].prep);
+	}
+	free(args.refs);
+	free(args.results);
+
+	return 0;
+}
+
+
 enum {
 	CT_NOTHING,
 	CT_FINDAMBI,
@@ -481,7 +937,10 @@ int main(int argc, char *argv[])
 	char *sym_str = NULL;
 	SymOpList *sym = NULL;
 	int mode = CT_NOTHING;
-	char *comparecell = NULL;
+	char **compare_files = NULL;
+	int n_compare_files = 0;
+	char *batch_file = NULL;
+	int n_threads = 1;
 	char *out_file = NULL;
 	float highres;
 	double rmax = 1/(2.0e-10);
@@ -505,12 +964,13 @@ int main(int argc, char *argv[])
 
 		{"transform",          1, NULL,                4},
 		{"highres",            1, NULL,                5},
+		{"batch",              1, NULL,                7},
 
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hp:y:o:",
+	while ((c = getopt_long(argc, argv, "hp:y:o:j:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -536,7 +996,9 @@ int main(int argc, char *argv[])
 			break;
 
 			case 3 :
-			comparecell = strdup(optarg);
+			compare_files = realloc(compare_files,
+			                        (n_compare_files+1)*sizeof(char *));
+			compare_files[n_compare_files++] = strdup(optarg);
 			mode = CT_COMPARE;
 			break;
 
@@ -560,6 +1022,18 @@ int main(int argc, char *argv[])
 			       crystfel_licence_string());
 			return 0;
 
+			case 7 :
+			batch_file = strdup(optarg);
+			break;
+
+			case 'j' :
+			n_threads = atoi(optarg);
+			if ( n_threads < 1 ) {
+				ERROR("Invalid number of threads.\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -584,18 +1058,6 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if ( cell_file == NULL ) {
-		ERROR("You must give a filename for the unit cell PDB file.\n");
-		return 1;
-	}
-	STATUS("Input unit cell: %s\n", cell_file);
-	cell = load_cell_from_file(cell_file);
-	if ( cell == NULL ) {
-		ERROR("Failed to load cell from '%s'\n", cell_file);
-		return 1;
-	}
-	free(cell_file);
-
 	if ( toler != NULL ) {
 		int i;
 		int ncomma = 0;
@@ -616,6 +1078,33 @@ int main(int argc, char *argv[])
 		free(toler);
 	}
 
+	if ( batch_file != NULL ) {
+		if ( mode != CT_COMPARE ) {
+			ERROR("--batch can only be used with --compare-cell\n");
+			return 1;
+		}
+		return batch_compare(batch_file, compare_files, n_compare_files,
+		                     ltl, atl, n_threads, out_file);
+	}
+
+	if ( n_compare_files > 1 ) {
+		ERROR("--compare-cell can only be given more than once when "
+		      "using --batch\n");
+		return 1;
+	}
+
+	if ( cell_file == NULL ) {
+		ERROR("You must give a filename for the unit cell PDB file.\n");
+		return 1;
+	}
+	STATUS("Input unit cell: %s\n", cell_file);
+	cell = load_cell_from_file(cell_file);
+	if ( cell == NULL ) {
+		ERROR("Failed to load cell from '%s'\n", cell_file);
+		return 1;
+	}
+	free(cell_file);
+
 	STATUS("------------------> The input unit cell:\n");
 	cell_print(cell);
 
@@ -638,7 +1127,9 @@ int main(int argc, char *argv[])
 	if ( mode == CT_FINDAMBI ) return find_ambi(cell, sym, ltl, atl);
 	if ( mode == CT_UNCENTER ) return uncenter(cell, out_file);
 	if ( mode == CT_RINGS ) return all_rings(cell, sym, rmax);
-	if ( mode == CT_COMPARE ) return comparecells(cell, comparecell, ltl, atl);
+	if ( mode == CT_COMPARE ) {
+		return comparecells(cell, compare_files[0], ltl, atl);
+	}
 	if ( mode == CT_TRANSFORM ) return transform(cell, trans_str, out_file);
 	if ( mode == CT_CHOICES ) return cell_choices(cell);
 
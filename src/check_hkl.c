@@ -46,6 +46,7 @@
 #include <reflist-utils.h>
 #include <cell-utils.h>
 #include <fom.h>
+#include <thread-pool.h>
 
 #include "version.h"
 
@@ -71,62 +72,107 @@ static void show_help(const char *s)
 "      --shell-file=<file>    Write results table to <file>.\n"
 "      --ignore-negs          Ignore reflections with negative intensities.\n"
 "      --zero-negs            Set negative intensities to zero.\n"
+"  -j <n>                     Use <n> threads.\n"
 "\n");
 }
 
 
-static int add_ltest(RefList *list, double i1, int *bins, int nbins,
-                     double step, const SymOpList *sym, double *lt, double *l2t,
-                     signed int h1, signed int k1, signed int l1,
-                     signed int h2, signed int k2, signed int l2)
+/* Reflections are handed out to the worker threads in blocks of this size */
+#define BLOCK_SIZE (4096)
+
+
+static Reflection **flatten_reflections(RefList *list, int *pn)
+{
+	Reflection **refls;
+	Reflection *refl;
+	RefListIterator *iter;
+	int n = 0;
+
+	refls = malloc(num_reflections(list)*sizeof(Reflection *));
+	if ( refls == NULL ) return NULL;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		refls[n++] = refl;
+	}
+
+	*pn = n;
+	return refls;
+}
+
+
+/* Returns the value of L for the pair, or NAN if the pair should not be used */
+static double ltest_pair(RefList *list, double i1, const SymOpList *sym,
+                         signed int h1, signed int k1, signed int l1,
+                         signed int h2, signed int k2, signed int l2)
 {
 	Reflection *refl;
-	double i2, L;
-	int bin;
+	double i2;
 
-	if ( SERIAL(h1, k1, l1) > SERIAL(h2, k2, l2) ) return 0;
+	if ( SERIAL(h1, k1, l1) > SERIAL(h2, k2, l2) ) return NAN;
 
 	refl = find_refl(list, h2, k2, l2);
 	if ( refl == NULL ) {
 		signed int h, k, l;
 		if ( !find_equiv_in_list(list, h2, k2, l2, sym, &h, &k, &l) ) {
-			return 0;
+			return NAN;
 		}
 		refl = find_refl(list, h, k, l);
 	}
 
 	i2 = get_intensity(refl);
-	L = (i1-i2) / (i1+i2);
-	if ( isnan(L) ) {
-		/* This happens with --zero-negs and two negative intensities,
-		 * because L=(0-0)/(0+0) */
-		return 0;
-	}
 
-	bin = fabs(L)/step;
-	if ( (bin < 0) || (isnan(L)) ) {
-		bin = 0;
-	} else if ( bin >= nbins ) {
-		bin = nbins-1;
-	}
-	bins[bin]++;
+	/* L is NaN with --zero-negs and two negative intensities,
+	 * because L=(0-0)/(0+0) */
+	return (i1-i2) / (i1+i2);
+}
+
+
+struct ltest_args
+{
+	RefList *list;
+	Reflection **refls;
+	const SymOpList *sym;
+	int hd, kd, ld;
+	double *L;  /* Six values for each reflection */
+};
+
+
+static void ltest_block(void *vp, int start, int end)
+{
+	struct ltest_args *a = vp;
+	int i;
+
+	for ( i=start; i<end; i++ ) {
 
-	*lt += fabs(L);
-	*l2t += pow(L, 2.0);
+		signed int h, k, l;
+		double i1;
+		double *L = &a->L[6*i];
+
+		get_indices(a->refls[i], &h, &k, &l);
+		i1 = get_intensity(a->refls[i]);
+
+		L[0] = ltest_pair(a->list, i1, a->sym, h, k, l, h-a->hd, k, l);
+		L[1] = ltest_pair(a->list, i1, a->sym, h, k, l, h+a->hd, k, l);
+		L[2] = ltest_pair(a->list, i1, a->sym, h, k, l, h, k-a->kd, l);
+		L[3] = ltest_pair(a->list, i1, a->sym, h, k, l, h, k+a->kd, l);
+		L[4] = ltest_pair(a->list, i1, a->sym, h, k, l, h, k, l-a->ld);
+		L[5] = ltest_pair(a->list, i1, a->sym, h, k, l, h, k, l+a->ld);
 
-	return 1;
+	}
 }
 
 
 static void l_test(RefList *list, UnitCell *cell, const SymOpList *sym,
                    double rmin_fix, double rmax_fix, int nbins,
-                   const char *filename)
+                   const char *filename, int n_threads)
 {
-	Reflection *refl;
-	RefListIterator *iter;
+	struct ltest_args a;
 	int *bins;
 	FILE *fh;
-	int npairs, i;
+	int npairs, i, n;
 	double tot;
 	double lt = 0.0;
 	double l2t = 0.0;
@@ -152,30 +198,41 @@ static void l_test(RefList *list, UnitCell *cell, const SymOpList *sym,
 	/* Obverse setting */
 	if ( cen == 'H' ) { hd = 3;  kd = 3;  ld = 3; }
 
+	a.list = list;
+	a.sym = sym;
+	a.hd = hd;  a.kd = kd;  a.ld = ld;
+	a.refls = flatten_reflections(list, &n);
+	if ( a.refls == NULL ) return;
+	a.L = malloc(6*n*sizeof(double));
+	if ( a.L == NULL ) return;
+
+	run_blocks(n_threads, n, BLOCK_SIZE, ltest_block, &a);
+
+	/* Add up in the original order */
 	npairs = 0;
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		signed int h, k, l;
-		double i1;
+	for ( i=0; i<6*n; i++ ) {
+
+		double L = a.L[i];
+		int bin;
+
+		if ( isnan(L) ) continue;
+
+		bin = fabs(L)/step;
+		if ( bin < 0 ) {
+			bin = 0;
+		} else if ( bin >= nbins ) {
+			bin = nbins-1;
+		}
+		bins[bin]++;
+
+		lt += fabs(L);
+		l2t += pow(L, 2.0);
+		npairs++;
 
-		get_indices(refl, &h, &k, &l);
-		i1 = get_intensity(refl);
-
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
-		                    h, k, l, h-hd, k, l);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
-		                    h, k, l, h+hd, k, l);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
-		                    h, k, l, h, k-kd, l);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
-		                    h, k, l, h, k+kd, l);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
-		                    h, k, l, h, k, l-ld);
-		npairs += add_ltest(list, i1, bins, nbins, step, sym, &lt, &l2t,
-		                    h, k, l, h, k, l+ld);
 	}
+	free(a.L);
+	free(a.refls);
+
 	STATUS("%i pairs\n", npairs);
 	STATUS("<|L|> = %.3f (ideal untwinned %.3f, twinned %.3f)\n",
 	       lt/npairs, 1.0/2.0, 3.0/8.0);
@@ -254,19 +311,75 @@ static double get_sfac(char el, double s)
 }
 
 
+struct wilson_args
+{
+	Reflection **refls;
+	UnitCell *cell;
+	const SymOpList *sym;
+	double s2min;
+	double s2step;
+	int nbins;
+	int *bin;
+	double *val;
+};
+
+
+static void wilson_block(void *vp, int start, int end)
+{
+	struct wilson_args *a = vp;
+	SymOpMask *mask;
+	int ngen;
+	int i;
+
+	ngen = num_equivs(a->sym, NULL);
+	mask = new_symopmask(a->sym);
+
+	for ( i=start; i<end; i++ ) {
+
+		signed int h, k, l;
+		double s, intensity, E;
+		int bin;
+		int e;
+
+		get_indices(a->refls[i], &h, &k, &l);
+
+		s = resolution(a->cell, h, k, l);  /* This gives "s" directly */
+		intensity = get_intensity(a->refls[i]);
+
+		bin = (pow(s, 2.0) - a->s2min)/a->s2step;
+
+		special_position(a->sym, mask, h, k, l);
+		e = ngen / num_equivs(a->sym, mask);
+
+		/* Average atoms per residue from Rupp BMC 1st ed p356 */
+		E  = 5.00*get_sfac('C', s);
+		E += 1.35*get_sfac('N', s);
+		E += 1.50*get_sfac('O', s);
+		E += 8.00*get_sfac('H', s);
+
+		if ( bin == a->nbins ) bin = a->nbins-1;
+		assert(bin < a->nbins);
+
+		a->bin[i] = bin;
+		a->val[i] = intensity / (e*E);
+
+	}
+
+	free_symopmask(mask);
+}
+
+
 static void wilson_plot(RefList *list, UnitCell *cell, const SymOpList *sym,
                         double rmin_fix, double rmax_fix, int nbins,
-                        const char *filename)
+                        const char *filename, int n_threads)
 {
 	double rmin, rmax;
 	double s2min, s2max, s2step;
-	Reflection *refl;
-	RefListIterator *iter;
 	FILE *fh;
 	double *plot_i, *s2;
 	int *plot_n;
-	int i, ngen;
-	SymOpMask *mask;
+	int i, n;
+	struct wilson_args a;
 
 	resolution_limits(list, cell, &rmin, &rmax);
 	STATUS("1/d goes from %f to %f nm^-1\n", rmin/1e9, rmax/1e9);
@@ -293,43 +406,27 @@ static void wilson_plot(RefList *list, UnitCell *cell, const SymOpList *sym,
 	plot_n = calloc(nbins, sizeof(int));
 	if ( plot_n == NULL ) return;
 
-	ngen = num_equivs(sym, NULL);
-	mask = new_symopmask(sym);
-
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		signed int h, k, l;
-		double s, intensity, E;
-		int bin;
-		int e;
-
-		get_indices(refl, &h, &k, &l);
-
-		s = resolution(cell, h, k, l);  /* This gives "s" directly */
-		intensity = get_intensity(refl);
-
-		bin = (pow(s, 2.0) - s2min)/s2step;
-
-		special_position(sym, mask, h, k, l);
-		e = ngen / num_equivs(sym, mask);
-
-		/* Average atoms per residue from Rupp BMC 1st ed p356 */
-		E  = 5.00*get_sfac('C', s);
-		E += 1.35*get_sfac('N', s);
-		E += 1.50*get_sfac('O', s);
-		E += 8.00*get_sfac('H', s);
-
-		if ( bin == nbins ) bin = nbins-1;
-		assert(bin < nbins);
-
-		plot_i[bin] += intensity / (e*E);
-		plot_n[bin]++;
-
+	a.refls = flatten_reflections(list, &n);
+	if ( a.refls == NULL ) return;
+	a.bin = malloc(n*sizeof(int));
+	a.val = malloc(n*sizeof(double));
+	if ( (a.bin == NULL) || (a.val == NULL) ) return;
+	a.cell = cell;
+	a.sym = sym;
+	a.s2min = s2min;
+	a.s2step = s2step;
+	a.nbins = nbins;
+
+	run_blocks(n_threads, n, BLOCK_SIZE, wilson_block, &a);
+
+	/* Add up in the original order */
+	for ( i=0; i<n; i++ ) {
+		plot_i[a.bin[i]] += a.val[i];
+		plot_n[a.bin[i]]++;
 	}
-
-	free_symopmask(mask);
+	free(a.refls);
+	free(a.bin);
+	free(a.val);
 
 	for ( i=0; i<nbins; i++ ) {
 		plot_i[i] = log(plot_i[i] / plot_n[i]);
@@ -397,17 +494,23 @@ static void wilson_plot(RefList *list, UnitCell *cell, const SymOpList *sym,
 
 static void plot_shells(RefList *list, UnitCell *cell, const SymOpList *sym,
                         double rmin_fix, double rmax_fix, int nshells,
-			const char *shell_file)
+			const char *shell_file, int n_threads)
 {
 	double rmin, rmax;
 	int i;
 	FILE *fh;
 	struct fom_shells *shells;
+	struct fom_context *fctxs[5];
 	struct fom_context *nmeas_ctx;
 	struct fom_context *red_ctx;
 	struct fom_context *snr_ctx;
 	struct fom_context *mean_ctx;
 	struct fom_context *compl_ctx;
+	const enum fom_type foms[5] = { FOM_NUM_MEASUREMENTS,
+	                                FOM_REDUNDANCY,
+	                                FOM_SNR,
+	                                FOM_MEAN_INTENSITY,
+	                                FOM_COMPLETENESS };
 
 	fh = fopen(shell_file, "w");
 	if ( fh == NULL ) {
@@ -426,16 +529,18 @@ static void plot_shells(RefList *list, UnitCell *cell, const SymOpList *sym,
 
 	STATUS("Overall values within specified resolution range:\n");
 
-	nmeas_ctx = fom_calculate(list, NULL, cell, shells,
-	                          FOM_NUM_MEASUREMENTS, 0, sym);
-	red_ctx = fom_calculate(list, NULL, cell, shells,
-	                        FOM_REDUNDANCY, 0, sym);
-	snr_ctx = fom_calculate(list, NULL, cell, shells,
-	                        FOM_SNR, 0, sym);
-	mean_ctx = fom_calculate(list, NULL, cell, shells,
-	                         FOM_MEAN_INTENSITY, 0, sym);
-	compl_ctx = fom_calculate(list, NULL, cell, shells,
-	                          FOM_COMPLETENESS, 0, sym);
+	/* All the figures of merit in one go */
+	if ( fom_calculate_multi(list, cell, shells, foms, 5, sym, n_threads,
+	                         fctxs) )
+	{
+		fclose(fh);
+		return;
+	}
+	nmeas_ctx = fctxs[0];
+	red_ctx = fctxs[1];
+	snr_ctx = fctxs[2];
+	mean_ctx = fctxs[3];
+	compl_ctx = fctxs[4];
 
 	STATUS("%.0f measurements in total.\n",
 	       fom_overall_value(nmeas_ctx));
@@ -526,6 +631,7 @@ int main(int argc, char *argv[])
 	int zeronegs = 0;
 	float highres, lowres;
 	struct fom_rejections rej;
+	int n_threads = 1;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -552,7 +658,7 @@ int main(int argc, char *argv[])
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hy:p:", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hy:p:j:", longopts, NULL)) != -1) {
 
 		switch (c) {
 
@@ -575,6 +681,14 @@ int main(int argc, char *argv[])
 			cellfile = strdup(optarg);
 			break;
 
+			case 'j' :
+			n_threads = atoi(optarg);
+			if ( n_threads < 1 ) {
+				ERROR("Invalid number of threads.\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -734,7 +848,7 @@ int main(int argc, char *argv[])
 	if ( wilson ) {
 		if ( !have_nshells ) nshells = 50;
 		wilson_plot(list, cell, sym, rmin_fix, rmax_fix, nshells,
-		            shell_file);
+		            shell_file, n_threads);
 	} else if ( ltest ) {
 		if ( !have_nshells ) nshells = 50;
 		if ( !ignorenegs && !zeronegs ) {
@@ -743,10 +857,10 @@ int main(int argc, char *argv[])
 			return 1;
 		}
 		l_test(list, cell, sym, rmin_fix, rmax_fix, nshells,
-		       shell_file);
+		       shell_file, n_threads);
 	} else {
 		plot_shells(list, cell, sym, rmin_fix, rmax_fix, nshells,
-		            shell_file);
+		            shell_file, n_threads);
 	}
 
 	free_symoplist(sym);
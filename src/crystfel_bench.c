@@ -0,0 +1,1058 @@
+/*
+ * crystfel_bench.c
+ *
+ * Measure the speed of each stage of processing, using synthetic data
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <gsl/gsl_rng.h>
+
+#include <image.h>
+#include <utils.h>
+#include <reflist.h>
+#include <reflist-utils.h>
+#include <symmetry.h>
+#include <geometry.h>
+#include <stream.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <crystal.h>
+#include <detgeom.h>
+#include <filters.h>
+#include <peaks.h>
+#include <peakfinder8.h>
+#include <integration.h>
+#include <index.h>
+
+#include "version.h"
+#include "merge.h"
+#include "post-refinement.h"
+
+
+/* Count calls to the allocator, by intercepting malloc() and friends.  This
+ * only works with glibc, where the real allocator can be reached directly.
+ * Elsewhere, the counts will all be zero. */
+#if defined(__GLIBC__)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static long int n_allocs = 0;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+static long int get_n_allocs(void)
+{
+	return __atomic_load_n(&n_allocs, __ATOMIC_RELAXED);
+}
+
+#define COUNTING_ALLOCS (1)
+
+#else
+
+static long int get_n_allocs(void)
+{
+	return 0;
+}
+
+#define COUNTING_ALLOCS (0)
+
+#endif
+
+
+/* Four 512x512 panels in a square, 100 mm from the sample */
+static const char *default_geom =
+	"photon_energy = 9000 eV\n"
+	"adu_per_photon = 1\n"
+	"clen = 0.1\n"
+	"res = 10000\n"
+	"data = /data/data\n"
+	"dim0 = ss\n"
+	"dim1 = fs\n"
+	"fs = x\n"
+	"ss = y\n"
+	"min_fs = 0\n"
+	"max_fs = 511\n"
+	"q0/min_ss = 0\n"
+	"q0/max_ss = 511\n"
+	"q0/corner_x = -516\n"
+	"q0/corner_y = 4\n"
+	"q1/min_ss = 512\n"
+	"q1/max_ss = 1023\n"
+	"q1/corner_x = 4\n"
+	"q1/corner_y = 4\n"
+	"q2/min_ss = 1024\n"
+	"q2/max_ss = 1535\n"
+	"q2/corner_x = -516\n"
+	"q2/corner_y = -516\n"
+	"q3/min_ss = 1536\n"
+	"q3/max_ss = 2047\n"
+	"q3/corner_x = 4\n"
+	"q3/corner_y = -516\n";
+
+
+struct bench_stage
+{
+	const char *name;
+	int n_frames;
+	double time;
+	long int n_allocs;
+	long int max_rss;
+	int n_ok;       /* Number of frames where the stage "worked" */
+	int skipped;
+
+	double t_start;
+	long int n_allocs_start;
+};
+
+
+struct bench
+{
+	DataTemplate *dtempl;
+	UnitCell *cell;
+	SymOpList *sym;
+	gsl_rng *rng;
+	const char *workdir;
+
+	int n_frames;
+	struct image **frames;
+	Crystal **truth;
+
+	struct bench_stage *stages;
+	int n_stages;
+	int max_stages;
+};
+
+
+static double get_time(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+
+static struct bench_stage *stage_start(struct bench *b, const char *name)
+{
+	struct bench_stage *st;
+
+	if ( b->n_stages == b->max_stages ) {
+		struct bench_stage *nst;
+		nst = realloc(b->stages, (b->max_stages+16)*sizeof(*nst));
+		if ( nst == NULL ) return NULL;
+		b->stages = nst;
+		b->max_stages += 16;
+	}
+
+	st = &b->stages[b->n_stages++];
+	st->name = name;
+	st->n_frames = 0;
+	st->n_ok = 0;
+	st->skipped = 0;
+	st->time = 0.0;
+	st->n_allocs = 0;
+	st->max_rss = 0;
+
+	STATUS("Running stage '%s'\n", name);
+	st->n_allocs_start = get_n_allocs();
+	st->t_start = get_time();
+	return st;
+}
+
+
+static void stage_end(struct bench_stage *st, int n_frames, int n_ok)
+{
+	struct rusage ru;
+
+	st->time = get_time() - st->t_start;
+	st->n_allocs = get_n_allocs() - st->n_allocs_start;
+	st->n_frames = n_frames;
+	st->n_ok = n_ok;
+
+	if ( getrusage(RUSAGE_SELF, &ru) == 0 ) {
+		st->max_rss = ru.ru_maxrss;
+	}
+}
+
+
+static void stage_skip(struct bench *b, const char *name, const char *why)
+{
+	struct bench_stage *st = stage_start(b, name);
+	if ( st == NULL ) return;
+	STATUS("Skipping stage '%s': %s\n", name, why);
+	stage_end(st, 0, 0);
+	st->skipped = 1;
+}
+
+
+static void draw_spot(struct image *image, int pn, double fs, double ss,
+                      double intensity)
+{
+	struct detgeom_panel *p = &image->detgeom->panels[pn];
+	int ifs, iss;
+	double total = 0.0;
+	double w[5][5];
+
+	/* Gaussian spot, sigma = 0.8 px, cut off at +/- 2 px */
+	for ( iss=-2; iss<=2; iss++ ) {
+		for ( ifs=-2; ifs<=2; ifs++ ) {
+			double dfs = floor(fs) + ifs + 0.5 - fs;
+			double dss = floor(ss) + iss + 0.5 - ss;
+			w[iss+2][ifs+2] = exp(-(dfs*dfs + dss*dss)/(2.0*0.64));
+			total += w[iss+2][ifs+2];
+		}
+	}
+
+	for ( iss=-2; iss<=2; iss++ ) {
+		for ( ifs=-2; ifs<=2; ifs++ ) {
+			int pfs = floor(fs) + ifs;
+			int pss = floor(ss) + iss;
+			if ( (pfs < 0) || (pfs >= p->w) ) continue;
+			if ( (pss < 0) || (pss >= p->h) ) continue;
+			image->dp[pn][pfs + p->w*pss] += intensity
+			                                  * w[iss+2][ifs+2]/total;
+		}
+	}
+}
+
+
+/* Like partial_sim, but with a little more effort to make the spots look like
+ * spots, so that the peak search and indexing have something to do */
+static struct image *simulate_frame(struct bench *b, int n, RefList *full,
+                                    double max_q, double background,
+                                    Crystal **ptruth)
+{
+	struct image *image;
+	struct quaternion orientation;
+	Crystal *cr;
+	RefList *reflections;
+	Reflection *refl;
+	RefListIterator *iter;
+	char tmp[256];
+	int i;
+
+	image = image_create_for_simulation(b->dtempl);
+	if ( image == NULL ) return NULL;
+
+	image->div = 0.001;
+	image->bw = 0.01;
+
+	snprintf(tmp, 255, "%s/frame%i.h5", b->workdir, n);
+	image->filename = strdup(tmp);
+	image->ev = strdup("//");
+
+	cr = crystal_new();
+	if ( cr == NULL ) {
+		image_free(image);
+		return NULL;
+	}
+	crystal_set_image(cr, image);
+	crystal_set_osf(cr, 1.0);
+	crystal_set_Bfac(cr, 0.0);
+	crystal_set_mosaicity(cr, 0.0);
+	crystal_set_profile_radius(cr, 0.003e9);
+	orientation = random_quaternion(b->rng);
+	crystal_set_cell(cr, cell_rotate(b->cell, orientation));
+
+	reflections = predict_to_res(cr, max_q);
+	crystal_set_reflections(cr, reflections);
+	calculate_partialities(cr, PMODEL_XSPHERE);
+
+	for ( i=0; i<image->detgeom->n_panels; i++ ) {
+		int j;
+		struct detgeom_panel *p = &image->detgeom->panels[i];
+		for ( j=0; j<p->w*p->h; j++ ) {
+			image->dp[i][j] = poisson_noise(b->rng, background);
+		}
+	}
+
+	for ( refl = first_refl(reflections, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *rfull;
+		double If, Ip, fs, ss;
+
+		get_indices(refl, &h, &k, &l);
+		get_asymm(b->sym, h, k, l, &h, &k, &l);
+		rfull = find_refl(full, h, k, l);
+		if ( rfull == NULL ) {
+			rfull = add_refl(full, h, k, l);
+			set_intensity(rfull, fabs(gaussian_noise(b->rng, 0.0,
+			                                         10000.0)));
+		}
+		If = get_intensity(rfull);
+
+		Ip = get_lorentz(refl) * get_partiality(refl) * If;
+		set_intensity(refl, Ip);
+		set_esd_intensity(refl, sqrt(Ip + background));
+
+		get_detector_pos(refl, &fs, &ss);
+		draw_spot(image, get_panel_number(refl), fs, ss, Ip);
+	}
+
+	*ptruth = cr;
+	return image;
+}
+
+
+static int generate_frames(struct bench *b, double background)
+{
+	struct bench_stage *st;
+	RefList *full;
+	double max_q;
+	int i;
+
+	b->frames = calloc(b->n_frames, sizeof(struct image *));
+	b->truth = calloc(b->n_frames, sizeof(Crystal *));
+	if ( (b->frames == NULL) || (b->truth == NULL) ) return 1;
+
+	full = reflist_new();
+	if ( full == NULL ) return 1;
+
+	st = stage_start(b, "simulation");
+	for ( i=0; i<b->n_frames; i++ ) {
+
+		if ( i == 0 ) {
+			struct image *test = image_create_for_simulation(b->dtempl);
+			if ( test == NULL ) return 1;
+			max_q = detgeom_max_resolution(test->detgeom,
+			                               test->lambda);
+			image_free(test);
+		}
+
+		b->frames[i] = simulate_frame(b, i, full, max_q, background,
+		                              &b->truth[i]);
+		if ( b->frames[i] == NULL ) {
+			ERROR("Failed to simulate frame %i\n", i);
+			return 1;
+		}
+	}
+	stage_end(st, b->n_frames, b->n_frames);
+
+	reflist_free(full);
+	return 0;
+}
+
+
+static void bench_image_io(struct bench *b)
+{
+	struct bench_stage *st;
+	int i, n_ok;
+
+#ifndef HAVE_HDF5
+	stage_skip(b, "image_write", "compiled without HDF5");
+	stage_skip(b, "image_read", "compiled without HDF5");
+#else
+	st = stage_start(b, "image_write");
+	n_ok = 0;
+	for ( i=0; i<b->n_frames; i++ ) {
+		if ( image_write(b->frames[i], b->dtempl,
+		                 b->frames[i]->filename) == 0 ) n_ok++;
+	}
+	stage_end(st, b->n_frames, n_ok);
+
+	st = stage_start(b, "image_read");
+	n_ok = 0;
+	for ( i=0; i<b->n_frames; i++ ) {
+		struct image *image;
+		image = image_read(b->dtempl, b->frames[i]->filename,
+		                   b->frames[i]->ev, 0, 0);
+		if ( image != NULL ) {
+			n_ok++;
+			image_free(image);
+		}
+	}
+	stage_end(st, b->n_frames, n_ok);
+#endif
+}
+
+
+/* The filters change the image data, so run them on a copy.  The copying is
+ * not included in the timing. */
+static void bench_filter(struct bench *b, const char *name, int median)
+{
+	struct bench_stage *st;
+	float **scratch;
+	double t = 0.0;
+	long int na = 0;
+	int i;
+
+	scratch = malloc(b->frames[0]->detgeom->n_panels*sizeof(float *));
+	if ( scratch == NULL ) return;
+
+	st = stage_start(b, name);
+	for ( i=0; i<b->n_frames; i++ ) {
+
+		struct image *image = b->frames[i];
+		float **orig = image->dp;
+		double t0;
+		long int na0;
+		int pn;
+
+		for ( pn=0; pn<image->detgeom->n_panels; pn++ ) {
+			struct detgeom_panel *p = &image->detgeom->panels[pn];
+			scratch[pn] = malloc(p->w*p->h*sizeof(float));
+			memcpy(scratch[pn], orig[pn], p->w*p->h*sizeof(float));
+		}
+		image->dp = scratch;
+
+		t0 = get_time();
+		na0 = get_n_allocs();
+		if ( median ) {
+			filter_median(image, 3);
+		} else {
+			filter_noise(image);
+		}
+		t += get_time() - t0;
+		na += get_n_allocs() - na0;
+
+		image->dp = orig;
+		for ( pn=0; pn<image->detgeom->n_panels; pn++ ) {
+			free(scratch[pn]);
+		}
+
+	}
+	stage_end(st, b->n_frames, b->n_frames);
+	st->time = t;
+	st->n_allocs = na;
+
+	free(scratch);
+}
+
+
+static void bench_peaksearch(struct bench *b)
+{
+	struct bench_stage *st;
+	struct pf8_private_data *pf8;
+	int i, n_ok;
+
+	st = stage_start(b, "peaksearch_zaef");
+	n_ok = 0;
+	for ( i=0; i<b->n_frames; i++ ) {
+		search_peaks(b->frames[i], 200.0, 100000.0, 5.0,
+		             4.0, 5.0, 7.0, 1);
+		if ( image_feature_count(b->frames[i]->features) > 0 ) n_ok++;
+	}
+	stage_end(st, b->n_frames, n_ok);
+
+	/* The results from peakfinder8 are used for indexing and
+	 * integration */
+	pf8 = prepare_peakfinder8(b->frames[0]->detgeom, 0);
+	st = stage_start(b, "peaksearch_peakfinder8");
+	n_ok = 0;
+	for ( i=0; i<b->n_frames; i++ ) {
+		image_feature_list_free(b->frames[i]->features);
+		b->frames[i]->features = NULL;
+		if ( search_peaks_peakfinder8(b->frames[i], 2048, 200.0, 5.0,
+		                              2, 200, 3, 0, 1200, 1, 0,
+		                              pf8) == 0 ) n_ok++;
+	}
+	stage_end(st, b->n_frames, n_ok);
+	free_pf8_private_data(pf8);
+}
+
+
+static void bench_indexing(struct bench *b, const char *methods)
+{
+	char *list;
+	char *method;
+	char *saveptr = NULL;
+	float tols[6] = {0.05, 0.05, 0.05,
+	                 deg2rad(1.5), deg2rad(1.5), deg2rad(1.5)};
+
+	list = strdup(methods);
+	if ( list == NULL ) return;
+
+	for ( method = strtok_r(list, ",", &saveptr);
+	      method != NULL;
+	      method = strtok_r(NULL, ",", &saveptr) )
+	{
+		struct taketwo_options *ttopts;
+		struct xgandalf_options *xgopts;
+		struct pinkindexer_options *pinkopts;
+		struct felix_options *felixopts;
+		struct fromfile_options *ffopts;
+		struct asdf_options *asdfopts;
+		IndexingPrivate *ipriv;
+		struct bench_stage *st;
+		char *name;
+		int i, n_ok;
+
+		name = malloc(strlen(method)+10);
+		if ( name == NULL ) break;
+		strcpy(name, "indexing_");
+		strcat(name, method);
+
+		default_method_options(&ttopts, &xgopts, &pinkopts,
+		                       &felixopts, &ffopts, &asdfopts);
+		ipriv = setup_indexing(method, b->cell, tols,
+		                       INDEXING_CHECK_CELL | INDEXING_REFINE,
+		                       b->frames[0]->lambda,
+		                       detgeom_mean_camera_length(b->frames[0]->detgeom),
+		                       1, ttopts, xgopts, pinkopts, felixopts,
+		                       ffopts, asdfopts);
+		if ( ipriv == NULL ) {
+			stage_skip(b, name, "indexing method not available");
+			continue;
+		}
+
+		st = stage_start(b, name);
+		n_ok = 0;
+		for ( i=0; i<b->n_frames; i++ ) {
+			int ping = 0;
+			char last_task[1024];
+			index_pattern_3(b->frames[i], ipriv, &ping, last_task);
+			if ( b->frames[i]->n_crystals > 0 ) n_ok++;
+			free_all_crystals(b->frames[i]);
+		}
+		stage_end(st, b->n_frames, n_ok);
+
+		cleanup_indexing(ipriv);
+	}
+
+	free(list);
+}
+
+
+static void bench_prediction(struct bench *b)
+{
+	struct bench_stage *st;
+	int i;
+
+	st = stage_start(b, "prediction");
+	for ( i=0; i<b->n_frames; i++ ) {
+		Crystal *cr = b->truth[i];
+		struct image *image = b->frames[i];
+		RefList *reflections;
+		reflections = predict_to_res(cr,
+		                             detgeom_max_resolution(image->detgeom,
+		                                                    image->lambda));
+		reflist_free(crystal_get_reflections(cr));
+		crystal_set_reflections(cr, reflections);
+		calculate_partialities(cr, PMODEL_XSPHERE);
+	}
+	stage_end(st, b->n_frames, b->n_frames);
+}
+
+
+/* Integrate using the true orientations, so that the result doesn't depend on
+ * which indexing methods are available */
+static void bench_integration(struct bench *b)
+{
+	struct bench_stage *st;
+	pthread_mutex_t term_lock = PTHREAD_MUTEX_INITIALIZER;
+	int i, n_ok;
+
+	for ( i=0; i<b->n_frames; i++ ) {
+		Crystal *cr = crystal_new();
+		crystal_set_cell(cr,
+		                 cell_new_from_cell(crystal_get_cell(b->truth[i])));
+		crystal_set_image(cr, b->frames[i]);
+		crystal_set_osf(cr, 1.0);
+		crystal_set_Bfac(cr, 0.0);
+		crystal_set_mosaicity(cr, 0.0);
+		crystal_set_profile_radius(cr, 0.003e9);
+		image_add_crystal(b->frames[i], cr);
+	}
+
+	st = stage_start(b, "integration");
+	n_ok = 0;
+	for ( i=0; i<b->n_frames; i++ ) {
+		RefList *list;
+		integrate_all_5(b->frames[i], INTEGRATION_RINGS, PMODEL_XSPHERE,
+		                0.0, 4.0, 5.0, 7.0, INTDIAG_NONE, 0, 0, 0,
+		                &term_lock, 0);
+		list = crystal_get_reflections(b->frames[i]->crystals[0]);
+		if ( (list != NULL) && (num_reflections(list) > 0) ) n_ok++;
+	}
+	stage_end(st, b->n_frames, n_ok);
+}
+
+
+static Crystal **bench_stream(struct bench *b, int *pn_crystals)
+{
+	struct bench_stage *st;
+	Stream *stream;
+	char *filename;
+	Crystal **crystals;
+	int n_crystals = 0;
+	int i, n_ok;
+
+	filename = malloc(strlen(b->workdir)+16);
+	if ( filename == NULL ) return NULL;
+	strcpy(filename, b->workdir);
+	strcat(filename, "/bench.stream");
+
+	st = stage_start(b, "stream_write");
+	stream = stream_open_for_write(filename, b->dtempl);
+	if ( stream == NULL ) {
+		ERROR("Failed to open stream\n");
+		free(filename);
+		return NULL;
+	}
+	n_ok = 0;
+	for ( i=0; i<b->n_frames; i++ ) {
+		if ( stream_write_chunk(stream, b->frames[i],
+		                        STREAM_REFLECTIONS | STREAM_PEAKS) == 0 )
+		{
+			n_ok++;
+		}
+	}
+	stream_close(stream);
+	stage_end(st, b->n_frames, n_ok);
+
+	crystals = malloc(b->n_frames*sizeof(Crystal *));
+	if ( crystals == NULL ) return NULL;
+
+	st = stage_start(b, "stream_read");
+	stream = stream_open_for_read(filename);
+	if ( stream == NULL ) {
+		ERROR("Failed to open stream\n");
+		free(filename);
+		free(crystals);
+		return NULL;
+	}
+	n_ok = 0;
+	do {
+		struct image *image;
+		image = stream_read_chunk(stream, STREAM_REFLECTIONS
+		                                  | STREAM_PEAKS);
+		if ( image == NULL ) break;
+		n_ok++;
+
+		/* Keep the crystals (and images) for merging */
+		if ( (image->n_crystals == 1) && (n_crystals < b->n_frames) ) {
+			crystal_set_image(image->crystals[0], image);
+			crystals[n_crystals++] = image->crystals[0];
+		} else {
+			image_free(image);
+		}
+	} while ( 1 );
+	stream_close(stream);
+	stage_end(st, b->n_frames, n_ok);
+
+	unlink(filename);
+	free(filename);
+	*pn_crystals = n_crystals;
+	return crystals;
+}
+
+
+static void bench_merging(struct bench *b, Crystal **crystals, int n)
+{
+	struct bench_stage *st;
+	RefList *full;
+	int i, n_ok;
+
+	if ( n == 0 ) {
+		stage_skip(b, "merging", "no crystals");
+		stage_skip(b, "post_refinement", "no crystals");
+		return;
+	}
+
+	/* Set up the crystals as partialator would */
+	for ( i=0; i<n; i++ ) {
+		RefList *as;
+		Crystal *cr = crystals[i];
+		as = asymmetric_indices(crystal_get_reflections(cr), b->sym);
+		reflist_free(crystal_get_reflections(cr));
+		crystal_set_reflections(cr, as);
+		crystal_set_user_flag(cr, PRFLAG_OK);
+		crystal_set_osf(cr, 1.0);
+		crystal_set_Bfac(cr, 0.0);
+		update_predictions(cr);
+		calculate_partialities(cr, PMODEL_XSPHERE);
+	}
+
+	st = stage_start(b, "merging");
+	full = merge_intensities(crystals, n, 1, 1, INFINITY, 1, 0);
+	stage_end(st, n, (full != NULL) ? n : 0);
+	if ( full == NULL ) {
+		stage_skip(b, "post_refinement", "merging failed");
+		return;
+	}
+
+	st = stage_start(b, "post_refinement");
+	refine_all(crystals, n, full, 1, PMODEL_XSPHERE, 1, 1, b->sym, NULL,
+	           0, b->workdir);
+	n_ok = 0;
+	for ( i=0; i<n; i++ ) {
+		if ( crystal_get_user_flag(crystals[i]) == PRFLAG_OK ) n_ok++;
+	}
+	stage_end(st, n, n_ok);
+
+	free_contribs(full);
+	reflist_free(full);
+}
+
+
+static void write_results(FILE *fh, struct bench *b)
+{
+	int i;
+
+	fprintf(fh, "{\n");
+	fprintf(fh, "  \"crystfel_version\": \"%s\",\n",
+	        crystfel_version_string());
+	fprintf(fh, "  \"n_frames\": %i,\n", b->n_frames);
+	fprintf(fh, "  \"n_panels\": %i,\n",
+	        b->frames[0]->detgeom->n_panels);
+	fprintf(fh, "  \"counting_allocations\": %s,\n",
+	        COUNTING_ALLOCS ? "true" : "false");
+	fprintf(fh, "  \"stages\": [\n");
+	for ( i=0; i<b->n_stages; i++ ) {
+		struct bench_stage *st = &b->stages[i];
+		fprintf(fh, "    {\n");
+		fprintf(fh, "      \"name\": \"%s\",\n", st->name);
+		fprintf(fh, "      \"skipped\": %s,\n",
+		        st->skipped ? "true" : "false");
+		fprintf(fh, "      \"frames\": %i,\n", st->n_frames);
+		fprintf(fh, "      \"frames_ok\": %i,\n", st->n_ok);
+		fprintf(fh, "      \"seconds\": %f,\n", st->time);
+		if ( (st->n_frames > 0) && (st->time > 0.0) ) {
+			fprintf(fh, "      \"frames_per_second\": %f,\n",
+			        st->n_frames/st->time);
+		} else {
+			fprintf(fh, "      \"frames_per_second\": null,\n");
+		}
+		fprintf(fh, "      \"allocations\": %li,\n", st->n_allocs);
+		if ( st->n_frames > 0 ) {
+			fprintf(fh, "      \"allocations_per_frame\": %f,\n",
+			        (double)st->n_allocs/st->n_frames);
+		} else {
+			fprintf(fh, "      \"allocations_per_frame\": null,\n");
+		}
+		fprintf(fh, "      \"max_rss_kB\": %li\n", st->max_rss);
+		fprintf(fh, "    }%s\n", (i<b->n_stages-1) ? "," : "");
+	}
+	fprintf(fh, "  ]\n");
+	fprintf(fh, "}\n");
+}
+
+
+static void show_summary(struct bench *b)
+{
+	int i;
+
+	STATUS("%-32s %8s %8s %12s %14s\n", "Stage", "Frames", "OK",
+	       "Frames/sec", "Allocs/frame");
+	for ( i=0; i<b->n_stages; i++ ) {
+		struct bench_stage *st = &b->stages[i];
+		if ( st->skipped ) {
+			STATUS("%-32s %8s\n", st->name, "skipped");
+			continue;
+		}
+		STATUS("%-32s %8i %8i %12.2f %14.1f\n", st->name,
+		       st->n_frames, st->n_ok,
+		       (st->time > 0.0) ? st->n_frames/st->time : NAN,
+		       (st->n_frames > 0) ? (double)st->n_allocs/st->n_frames
+		                          : NAN);
+	}
+}
+
+
+static void show_help(const char *s)
+{
+	printf("Syntax: %s [options]\n\n", s);
+	printf(
+"Measure the speed of each stage of processing, using synthetic data.\n"
+"\n"
+" -h, --help               Display this help message.\n"
+"     --version            Print CrystFEL version number and exit.\n"
+"\n"
+" -o, --output=<file>      Write results in JSON format to <file>.\n"
+" -n <n>                   Simulate <n> frames.  Default: 20.\n"
+" -g, --geometry=<file>    Get detector geometry from file.  Default: four\n"
+"                           512x512 panels, 100 mm from the sample.\n"
+" -p, --pdb=<file>         Get unit cell from file.  Default: lysozyme.\n"
+" -y, --symmetry=<sym>     Point group for merging.  Default: 4/mmm.\n"
+"     --indexing=<methods> Indexing methods to test, one at a time.\n"
+"                           Default: taketwo,asdf,xgandalf.\n"
+"     --background=<val>   Background level in photons.  Default 10.\n"
+"     --seed=<n>           Random number seed.  Default 1.\n"
+"     --work-dir=<dir>     Put temporary files in <dir>.  Default: /tmp.\n"
+"\n"
+);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	struct bench b;
+	char *outfile = NULL;
+	char *geomfile = NULL;
+	char *cellfile = NULL;
+	char *sym_str = NULL;
+	char *indm_str = NULL;
+	char *tmpbase = NULL;
+	char *workdir;
+	double background = 10.0;
+	unsigned long int seed = 1;
+	Crystal **crystals;
+	int n_crystals = 0;
+	int i;
+
+	/* Long options */
+	const struct option longopts[] = {
+		{"help",               0, NULL,               'h'},
+		{"version",            0, NULL,               'v'},
+		{"output",             1, NULL,               'o'},
+		{"geometry",           1, NULL,               'g'},
+		{"pdb",                1, NULL,               'p'},
+		{"symmetry",           1, NULL,               'y'},
+
+		{"indexing",           1, NULL,                2},
+		{"background",         1, NULL,                3},
+		{"seed",               1, NULL,                4},
+		{"work-dir",           1, NULL,                5},
+
+		{0, 0, NULL, 0}
+	};
+
+	b.n_frames = 20;
+
+	/* Short options */
+	while ((c = getopt_long(argc, argv, "hvo:g:p:y:n:",
+	                        longopts, NULL)) != -1)
+	{
+		char *rval;
+
+		switch (c) {
+
+			case 'h' :
+			show_help(argv[0]);
+			return 0;
+
+			case 'v' :
+			printf("CrystFEL: %s\n",
+			       crystfel_version_string());
+			printf("%s\n",
+			       crystfel_licence_string());
+			return 0;
+
+			case 'o' :
+			outfile = strdup(optarg);
+			break;
+
+			case 'g' :
+			geomfile = strdup(optarg);
+			break;
+
+			case 'p' :
+			cellfile = strdup(optarg);
+			break;
+
+			case 'y' :
+			sym_str = strdup(optarg);
+			break;
+
+			case 'n' :
+			b.n_frames = atoi(optarg);
+			if ( b.n_frames < 1 ) {
+				ERROR("Invalid number of frames.\n");
+				return 1;
+			}
+			break;
+
+			case 2 :
+			indm_str = strdup(optarg);
+			break;
+
+			case 3 :
+			background = strtod(optarg, &rval);
+			if ( (*rval != '\0') || (background < 0.0) ) {
+				ERROR("Invalid background level.\n");
+				return 1;
+			}
+			break;
+
+			case 4 :
+			seed = strtoul(optarg, &rval, 10);
+			if ( *rval != '\0' ) {
+				ERROR("Invalid random number seed.\n");
+				return 1;
+			}
+			break;
+
+			case 5 :
+			tmpbase = strdup(optarg);
+			break;
+
+			case 0 :
+			break;
+
+			case '?' :
+			break;
+
+			default :
+			ERROR("Unhandled option '%c'\n", c);
+			break;
+
+		}
+
+	}
+
+	if ( geomfile != NULL ) {
+		b.dtempl = data_template_new_from_file(geomfile);
+	} else {
+		b.dtempl = data_template_new_from_string(default_geom);
+	}
+	if ( b.dtempl == NULL ) {
+		ERROR("Failed to read geometry.\n");
+		return 1;
+	}
+	free(geomfile);
+
+	if ( cellfile != NULL ) {
+		b.cell = load_cell_from_file(cellfile);
+		free(cellfile);
+	} else {
+		b.cell = cell_new_from_parameters(79.1e-10, 79.1e-10, 37.9e-10,
+		                                  deg2rad(90.0), deg2rad(90.0),
+		                                  deg2rad(90.0));
+		cell_set_lattice_type(b.cell, L_TETRAGONAL);
+		cell_set_centering(b.cell, 'P');
+		cell_set_unique_axis(b.cell, 'c');
+	}
+	if ( b.cell == NULL ) {
+		ERROR("Failed to load unit cell.\n");
+		return 1;
+	}
+
+	if ( sym_str == NULL ) sym_str = strdup("4/mmm");
+	b.sym = get_pointgroup(sym_str);
+	if ( b.sym == NULL ) return 1;
+	free(sym_str);
+
+	if ( indm_str == NULL ) indm_str = strdup("taketwo,asdf,xgandalf");
+
+	workdir = malloc(strlen((tmpbase != NULL) ? tmpbase : "/tmp") + 32);
+	if ( workdir == NULL ) return 1;
+	strcpy(workdir, (tmpbase != NULL) ? tmpbase : "/tmp");
+	strcat(workdir, "/crystfel-bench-XXXXXX");
+	if ( mkdtemp(workdir) == NULL ) {
+		ERROR("Failed to create temporary folder: %s\n",
+		      strerror(errno));
+		return 1;
+	}
+	free(tmpbase);
+	b.workdir = workdir;
+
+	b.rng = gsl_rng_alloc(gsl_rng_mt19937);
+	gsl_rng_set(b.rng, seed);
+
+	b.stages = NULL;
+	b.n_stages = 0;
+	b.max_stages = 0;
+
+	if ( generate_frames(&b, background) ) return 1;
+
+	bench_image_io(&b);
+	bench_filter(&b, "filter_median", 1);
+	bench_filter(&b, "filter_noise", 0);
+	bench_peaksearch(&b);
+	bench_indexing(&b, indm_str);
+	bench_prediction(&b);
+	bench_integration(&b);
+	crystals = bench_stream(&b, &n_crystals);
+	if ( crystals != NULL ) {
+		bench_merging(&b, crystals, n_crystals);
+	}
+
+	show_summary(&b);
+
+	if ( outfile != NULL ) {
+		FILE *fh;
+		if ( strcmp(outfile, "-") == 0 ) {
+			fh = stdout;
+		} else {
+			fh = fopen(outfile, "w");
+		}
+		if ( fh == NULL ) {
+			ERROR("Failed to open %s\n", outfile);
+			return 1;
+		}
+		write_results(fh, &b);
+		if ( fh != stdout ) fclose(fh);
+		free(outfile);
+	}
+
+	/* Clean up */
+	for ( i=0; i<n_crystals; i++ ) {
+		image_free(crystal_get_image(crystals[i]));
+	}
+	free(crystals);
+	for ( i=0; i<b.n_frames; i++ ) {
+		unlink(b.frames[i]->filename);
+		image_free(b.frames[i]);
+		cell_free(crystal_get_cell(b.truth[i]));
+		reflist_free(crystal_get_reflections(b.truth[i]));
+		crystal_free(b.truth[i]);
+	}
+	free(b.frames);
+	free(b.truth);
+	free(b.stages);
+	free(indm_str);
+	rmdir(workdir);
+	free(workdir);
+	cell_free(b.cell);
+	free_symoplist(b.sym);
+	data_template_free(b.dtempl);
+	gsl_rng_free(b.rng);
+
+	return 0;
+}
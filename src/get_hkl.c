@@ -43,6 +43,7 @@
 #include <symmetry.h>
 #include <cell.h>
 #include <cell-utils.h>
+#include <thread-pool.h>
 
 #include "version.h"
 
@@ -74,6 +75,7 @@ static void show_help(const char *s)
 "  -e, --expand=<sym>         Expand reflections to this point group.\n"
 "      --no-need-all-parts    Output a twinned reflection even if not all\n"
 "                              the necessary equivalents were present.\n"
+"  -j, --threads=<n>          Use <n> threads for twinning or expanding.\n"
 "\n"
 "You can reindex the reflections according to an operation, e.g. k,h,-l:\n"
 "      --reindex=<op>         Reindex according to <op>.\n"
@@ -98,6 +100,8 @@ static void show_help(const char *s)
 "      --output-format=mtz     Output in MTZ format.\n"
 "      --output-format=mtz-bij Output in MTZ format, Bijvoet pairs together\n"
 "      --output-format=xds     Output in XDS format.\n"
+"      --output-format=binary  Output in CrystFEL's binary format, including\n"
+"                              the unit cell if one was given.\n"
 );
 }
 
@@ -190,120 +194,357 @@ static RefList *template_reflections(RefList *list, RefList *template)
 }
 
 
-static RefList *twin_reflections(RefList *in, int need_all_parts,
-                                 const SymOpList *holo, const SymOpList *mero)
+/* Reflections are handed out to the worker threads in blocks of this size */
+#define BLOCK_SIZE (4096)
+
+/* Reflections are expanded in batches of this size, to limit the amount of
+ * memory needed for the lists of equivalents */
+#define EXPAND_BATCH (65536)
+
+
+/* The reflections of a list, in the order of iteration */
+struct flat_list
+{
+	int n;
+	signed int *h;
+	signed int *k;
+	signed int *l;
+	Reflection **refls;
+};
+
+
+static void free_flat_list(struct flat_list *fl)
+{
+	if ( fl == NULL ) return;
+	free(fl->h);
+	free(fl->k);
+	free(fl->l);
+	free(fl->refls);
+	free(fl);
+}
+
+
+static struct flat_list *flatten_reflections(RefList *list)
 {
+	struct flat_list *fl;
 	Reflection *refl;
 	RefListIterator *iter;
-	RefList *out;
-	SymOpMask *m;
 	int n;
 
-	out = reflist_new();
-	copy_notes(out, in);
+	n = num_reflections(list);
 
-	/* No need to free and reallocate this for every reflection */
-	m = new_symopmask(holo);
+	fl = malloc(sizeof(struct flat_list));
+	if ( fl == NULL ) return NULL;
+	fl->h = malloc(n*sizeof(signed int));
+	fl->k = malloc(n*sizeof(signed int));
+	fl->l = malloc(n*sizeof(signed int));
+	fl->refls = malloc(n*sizeof(Reflection *));
+	if ( (fl->h == NULL) || (fl->k == NULL) || (fl->l == NULL)
+	  || (fl->refls == NULL) )
+	{
+		free_flat_list(fl);
+		return NULL;
+	}
 
-	for ( refl = first_refl(in, &iter);
+	fl->n = 0;
+	for ( refl = first_refl(list, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-		double total, sigma;
-		int multi;
-		signed int h, k, l;
-		int j;
-		int skip;
+		get_indices(refl, &fl->h[fl->n], &fl->k[fl->n],
+		            &fl->l[fl->n]);
+		fl->refls[fl->n++] = refl;
+	}
 
-		/* Figure out where to put the twinned version, and check it's
-		 * not there already. */
-		get_indices(refl, &h, &k, &l);
-		get_asymm(holo, h, k, l, &h, &k, &l);
-		if ( find_refl(out, h, k, l) != NULL ) continue;
+	return fl;
+}
 
-		special_position(holo, m, h, k, l);
-		n = num_equivs(holo, m);
 
-		total = 0.0;
-		sigma = 0.0;
-		multi = 0;
-		skip = 0;
+struct twin_result
+{
+	double total;
+	double sigma;
+	int multi;
+	int skip;
+	signed int he;  /* Missing part, if skip is set */
+	signed int ke;
+	signed int le;
+};
 
-		for ( j=0; j<n; j++ ) {
 
-			signed int he, ke, le;
-			signed int hu, ku, lu;
-			int r;
+struct twin_args
+{
+	RefList *in;
+	struct flat_list *fl;
+	int need_all_parts;
+	const SymOpList *holo;
+	const SymOpList *mero;
 
-			get_equiv(holo, m, j, h, k, l, &he, &ke, &le);
-			get_asymm(mero, he, ke, le, &he, &ke, &le);
+	/* For each input reflection, the asymmetric indices in holo */
+	signed int *ah;
+	signed int *ak;
+	signed int *al;
 
-			/* Do we have this reflection?
-			 * We might not have the particular (merohedral)
-			 * equivalent which belongs to our definition of the
-			 * asymmetric unit cell, so check them all.
-			 */
-			r = find_equiv_in_list(in, he, ke, le, mero,
-			                       &hu, &ku, &lu);
+	/* For each orbit, the first input reflection in it */
+	int n_orbits;
+	int *orbits;
+	struct twin_result *res;
+};
 
-			if ( need_all_parts && !r ) {
 
-				ERROR("Twinning %i %i %i requires the %i %i %i "
-				      "reflection (or an equivalent in %s), "
-				      "which I don't have.\n",
-				      h, k, l, he, ke, le, symmetry_name(mero));
+static void twin_asymm_block(void *vp, int start, int end)
+{
+	struct twin_args *a = vp;
+	int i;
 
-				skip = 1;
-				break;
+	for ( i=start; i<end; i++ ) {
+		get_asymm(a->holo, a->fl->h[i], a->fl->k[i], a->fl->l[i],
+		          &a->ah[i], &a->ak[i], &a->al[i]);
+	}
+}
 
-			}
 
-			if ( r ) {
+/* The orbits are disjoint, so different threads never touch the same
+ * reflections in the input list */
+static void twin_orbit(struct twin_args *a, SymOpMask *m,
+                       signed int h, signed int k, signed int l,
+                       struct twin_result *res)
+{
+	int n, j;
 
-				double i, sigi;
-				int mult;
-				Reflection *part;
+	special_position(a->holo, m, h, k, l);
+	n = num_equivs(a->holo, m);
 
-				part = find_refl(in, hu, ku, lu);
+	res->total = 0.0;
+	res->sigma = 0.0;
+	res->multi = 0;
+	res->skip = 0;
 
-				i = get_intensity(part);
-				sigi = get_esd_intensity(part);
-				mult = get_redundancy(part);
+	for ( j=0; j<n; j++ ) {
 
-				total += mult*i;
-				sigma += pow(sigi*mult, 2.0);
-				multi += mult;
+		signed int he, ke, le;
+		signed int hu, ku, lu;
+		int r;
 
-				set_intensity(part, 0.0);
-				set_esd_intensity(part, 0.0);
-				set_redundancy(part, 0);
-			}
+		get_equiv(a->holo, m, j, h, k, l, &he, &ke, &le);
+		get_asymm(a->mero, he, ke, le, &he, &ke, &le);
+
+		/* Do we have this reflection?
+		 * We might not have the particular (merohedral)
+		 * equivalent which belongs to our definition of the
+		 * asymmetric unit cell, so check them all.
+		 */
+		r = find_equiv_in_list(a->in, he, ke, le, a->mero,
+		                       &hu, &ku, &lu);
+
+		if ( a->need_all_parts && !r ) {
+			res->skip = 1;
+			res->he = he;
+			res->ke = ke;
+			res->le = le;
+			return;
+		}
+
+		if ( r ) {
+
+			double i, sigi;
+			int mult;
+			Reflection *part;
+
+			part = find_refl(a->in, hu, ku, lu);
+
+			i = get_intensity(part);
+			sigi = get_esd_intensity(part);
+			mult = get_redundancy(part);
+
+			res->total += mult*i;
+			res->sigma += pow(sigi*mult, 2.0);
+			res->multi += mult;
+
+			set_intensity(part, 0.0);
+			set_esd_intensity(part, 0.0);
+			set_redundancy(part, 0);
+		}
+
+	}
+}
+
+
+static void twin_orbit_block(void *vp, int start, int end)
+{
+	struct twin_args *a = vp;
+	SymOpMask *m;
+	int i;
+
+	m = new_symopmask(a->holo);
+
+	for ( i=start; i<end; i++ ) {
+		int o = a->orbits[i];
+		twin_orbit(a, m, a->ah[o], a->ak[o], a->al[o], &a->res[i]);
+	}
 
+	free_symopmask(m);
+}
+
+
+static RefList *twin_reflections(RefList *in, int need_all_parts,
+                                 const SymOpList *holo, const SymOpList *mero,
+                                 int n_threads)
+{
+	struct twin_args a;
+	RefList *out;
+	RefList *seen;
+	int i;
+
+	out = reflist_new();
+	if ( out == NULL ) return NULL;
+	copy_notes(out, in);
+	if ( num_reflections(in) == 0 ) return out;
+
+	a.in = in;
+	a.need_all_parts = need_all_parts;
+	a.holo = holo;
+	a.mero = mero;
+	a.fl = flatten_reflections(in);
+	if ( a.fl == NULL ) {
+		reflist_free(out);
+		return NULL;
+	}
+
+	a.ah = malloc(a.fl->n*sizeof(signed int));
+	a.ak = malloc(a.fl->n*sizeof(signed int));
+	a.al = malloc(a.fl->n*sizeof(signed int));
+	a.orbits = malloc(a.fl->n*sizeof(int));
+	a.res = malloc(a.fl->n*sizeof(struct twin_result));
+	seen = reflist_new();
+	if ( (a.ah == NULL) || (a.ak == NULL) || (a.al == NULL)
+	  || (a.orbits == NULL) || (a.res == NULL) || (seen == NULL) )
+	{
+		ERROR("Failed to allocate memory for twinning.\n");
+		reflist_free(out);
+		out = NULL;
+		goto out;
+	}
+
+	/* Figure out where to put the twinned version of each reflection */
+	run_blocks(n_threads, a.fl->n, BLOCK_SIZE, twin_asymm_block, &a);
+
+	/* Each orbit is handled once, starting from the first reflection in
+	 * it.  This keeps the messages in the same order as the input. */
+	a.n_orbits = 0;
+	for ( i=0; i<a.fl->n; i++ ) {
+		if ( find_refl(seen, a.ah[i], a.ak[i], a.al[i]) != NULL ) {
+			continue;
 		}
+		add_refl(seen, a.ah[i], a.ak[i], a.al[i]);
+		a.orbits[a.n_orbits++] = i;
+	}
+
+	run_blocks(n_threads, a.n_orbits, BLOCK_SIZE, twin_orbit_block, &a);
 
-		if ( !skip ) {
+	for ( i=0; i<a.n_orbits; i++ ) {
 
-			Reflection *new = add_refl(out, h, k, l);
-			set_intensity(new, total/multi);
-			set_esd_intensity(new, sqrt(sigma)/multi);
-			set_redundancy(new, multi);
+		struct twin_result *res = &a.res[i];
+		int o = a.orbits[i];
+		Reflection *new;
 
+		if ( res->skip ) {
+			ERROR("Twinning %i %i %i requires the %i %i %i "
+			      "reflection (or an equivalent in %s), "
+			      "which I don't have.\n",
+			      a.ah[o], a.ak[o], a.al[o],
+			      res->he, res->ke, res->le, symmetry_name(mero));
+			continue;
 		}
 
+		new = add_refl(out, a.ah[o], a.ak[o], a.al[o]);
+		set_intensity(new, res->total/res->multi);
+		set_esd_intensity(new, sqrt(res->sigma)/res->multi);
+		set_redundancy(new, res->multi);
+
 	}
 
+out:
+	reflist_free(seen);
+	free(a.ah);
+	free(a.ak);
+	free(a.al);
+	free(a.orbits);
+	free(a.res);
+	free_flat_list(a.fl);
 	return out;
 }
 
 
+struct expand_args
+{
+	struct flat_list *fl;
+	const SymOpList *initial;
+	const SymOpList *target;
+
+	/* The current batch */
+	int start;
+
+	/* For each reflection in the batch, the asymmetric indices in target
+	 * of its equivalents in initial */
+	int max_equivs;
+	int *n_equivs;
+	signed int *eh;
+	signed int *ek;
+	signed int *el;
+};
+
+
+static void expand_block(void *vp, int start, int end)
+{
+	struct expand_args *a = vp;
+	SymOpMask *m;
+	int i;
+
+	m = new_symopmask(a->initial);
+
+	for ( i=start; i<end; i++ ) {
+
+		signed int h, k, l;
+		int n, j;
+
+		h = a->fl->h[a->start+i];
+		k = a->fl->k[a->start+i];
+		l = a->fl->l[a->start+i];
+
+		special_position(a->initial, m, h, k, l);
+		n = num_equivs(a->initial, m);
+
+		/* For each equivalent in the higher symmetry group */
+		for ( j=0; j<n; j++ ) {
+
+			signed int he, ke, le;
+			int idx = i*a->max_equivs + j;
+
+			/* Get the equivalent */
+			get_equiv(a->initial, m, j, h, k, l, &he, &ke, &le);
+
+			/* Put it into the asymmetric unit for the target */
+			get_asymm(a->target, he, ke, le,
+			          &a->eh[idx], &a->ek[idx], &a->el[idx]);
+
+		}
+
+		a->n_equivs[i] = n;
+
+	}
+
+	free_symopmask(m);
+}
+
+
 static RefList *expand_reflections(RefList *in, const SymOpList *initial,
-                                                const SymOpList *target)
+                                   const SymOpList *target, int n_threads)
 {
-	Reflection *refl;
-	RefListIterator *iter;
+	struct expand_args a;
 	RefList *out;
-	SymOpMask *m;
 	int phase_warning = 0;
+	int batch_size;
 
 	if ( !is_subgroup(initial, target) ) {
 		ERROR("%s is not a subgroup of %s!\n", symmetry_name(target),
@@ -312,59 +553,90 @@ static RefList *expand_reflections(RefList *in, const SymOpList *initial,
 	}
 
 	out = reflist_new();
+	if ( out == NULL ) return NULL;
 	copy_notes(out, in);
-	m = new_symopmask(initial);
+	if ( num_reflections(in) == 0 ) return out;
 
-	for ( refl = first_refl(in, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) ) {
+	a.initial = initial;
+	a.target = target;
+	a.fl = flatten_reflections(in);
+	if ( a.fl == NULL ) {
+		reflist_free(out);
+		return NULL;
+	}
 
-		signed int h, k, l;
-		int n, j;
+	batch_size = (a.fl->n < EXPAND_BATCH) ? a.fl->n : EXPAND_BATCH;
+	a.max_equivs = num_equivs(initial, NULL);
+	a.n_equivs = malloc(batch_size*sizeof(int));
+	a.eh = malloc(batch_size*a.max_equivs*sizeof(signed int));
+	a.ek = malloc(batch_size*a.max_equivs*sizeof(signed int));
+	a.el = malloc(batch_size*a.max_equivs*sizeof(signed int));
+	if ( (a.n_equivs == NULL) || (a.eh == NULL) || (a.ek == NULL)
+	  || (a.el == NULL) )
+	{
+		ERROR("Failed to allocate memory for expansion.\n");
+		reflist_free(out);
+		out = NULL;
+		goto out;
+	}
 
-		get_indices(refl, &h, &k, &l);
+	for ( a.start=0; a.start<a.fl->n; a.start+=batch_size ) {
 
-		special_position(initial, m, h, k, l);
-		n = num_equivs(initial, m);
+		int n, i;
 
-		/* For each equivalent in the higher symmetry group */
-		for ( j=0; j<n; j++ ) {
+		n = a.fl->n - a.start;
+		if ( n > batch_size ) n = batch_size;
 
-			signed int he, ke, le;
-			Reflection *copy;
-			int have_phase;
-			double ph;
+		run_blocks(n_threads, n, BLOCK_SIZE, expand_block, &a);
 
-			/* Get the equivalent */
-			get_equiv(initial, m, j, h, k, l, &he, &ke, &le);
+		/* Add the new reflections in the same order as before, so that
+		 * the first one to land on each index wins */
+		for ( i=0; i<n; i++ ) {
 
-			/* Put it into the asymmetric unit for the target */
-			get_asymm(target, he, ke, le, &he, &ke, &le);
-
-			if ( find_refl(out, he, ke, le) != NULL ) continue;
-
-			/* Make sure the intensity is in the right place */
-			copy = add_refl(out, he, ke, le);
-			copy_data(copy, refl);
-
-			ph = get_phase(refl, &have_phase);
-			if ( have_phase ) {
-				set_phase(copy, ph);
-				if ( !phase_warning ) {
-					ERROR("WARNING: get_hkl can't expand "
-					      "phase values correctly when the "
-					      "structure contains glides or "
-					      "screw axes.\n");
-					phase_warning = 1;
+			Reflection *refl = a.fl->refls[a.start+i];
+			int j;
+
+			for ( j=0; j<a.n_equivs[i]; j++ ) {
+
+				int idx = i*a.max_equivs + j;
+				Reflection *copy;
+				int have_phase;
+				double ph;
+
+				if ( find_refl(out, a.eh[idx], a.ek[idx],
+				               a.el[idx]) != NULL ) continue;
+
+				/* Make sure the intensity is in the right
+				 * place */
+				copy = add_refl(out, a.eh[idx], a.ek[idx],
+				                a.el[idx]);
+				copy_data(copy, refl);
+
+				ph = get_phase(refl, &have_phase);
+				if ( have_phase ) {
+					set_phase(copy, ph);
+					if ( !phase_warning ) {
+						ERROR("WARNING: get_hkl can't "
+						      "expand phase values "
+						      "correctly when the "
+						      "structure contains "
+						      "glides or screw axes.\n");
+						phase_warning = 1;
+					}
 				}
+
 			}
 
 		}
 
 	}
 
-	free_symopmask(m);
-
+out:
+	free(a.n_equivs);
+	free(a.eh);
+	free(a.ek);
+	free(a.el);
+	free_flat_list(a.fl);
 	return out;
 }
 
@@ -473,6 +745,7 @@ int main(int argc, char *argv[])
 	double highres = INFINITY;  /* 1/d value */
 	UnitCell *cell = NULL;
 	char *output_format_str = NULL;
+	int n_threads = 1;
 	int r;
 
 	/* Long options */
@@ -497,11 +770,12 @@ int main(int argc, char *argv[])
 		{"reindex",            1, NULL,                4},
 		{"lowres",             1, NULL,                6},
 		{"output-format",      1, NULL,                7},
+		{"threads",            1, NULL,               'j'},
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "ht:o:i:w:y:e:p:",
+	while ((c = getopt_long(argc, argv, "ht:o:i:w:y:e:p:j:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -571,6 +845,14 @@ int main(int argc, char *argv[])
 			output_format_str = strdup(optarg);
 			break;
 
+			case 'j' :
+			n_threads = atoi(optarg);
+			if ( n_threads < 1 ) {
+				ERROR("Invalid number of threads.\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -719,7 +1001,9 @@ int main(int argc, char *argv[])
 		RefList *new;
 		STATUS("Twinning from %s into %s\n", symmetry_name(mero),
 		                                     symmetry_name(holo));
-		new = twin_reflections(input, config_nap, holo, mero);
+		new = twin_reflections(input, config_nap, holo, mero,
+		                       n_threads);
+		if ( new == NULL ) return 1;
 
 		/* Replace old with new */
 		reflist_free(input);
@@ -736,7 +1020,8 @@ int main(int argc, char *argv[])
 		RefList *new;
 		STATUS("Expanding from %s into %s\n", symmetry_name(mero),
 		                                      symmetry_name(expand));
-		new = expand_reflections(input, mero, expand);
+		new = expand_reflections(input, mero, expand, n_threads);
+		if ( new == NULL ) return 1;
 
 		/* Replace old with new */
 		reflist_free(input);
@@ -904,6 +1189,13 @@ int main(int argc, char *argv[])
 
 	if ( output_format_str == NULL ) {
 		r = write_reflist_2(output, input, mero);
+	} else if ( strcasecmp(output_format_str, "binary") == 0 ) {
+		if ( output == NULL ) {
+			ERROR("You must provide the binary output filename.\n");
+			r = 1;
+		} else {
+			r = write_reflist_binary(output, input, mero, cell);
+		}
 	} else if ( cell == NULL ) {
 		ERROR("You must provide a unit cell to use MTZ or XDS output.\n");
 		r = 1;
@@ -997,6 +997,9 @@ static char **indexamajig_command_line(const char *geom_filename,
 	if ( indexing_params->exclude_nonhits ) add_arg(args, n_args++, "--no-non-hits-in-stream");
 	if ( indexing_params->exclude_peaks ) add_arg(args, n_args++, "--no-peaks-in-stream");
 	if ( indexing_params->exclude_refls ) add_arg(args, n_args++, "--no-refls-in-stream");
+
+	/* For the Cell Explorer */
+	add_arg(args, n_args++, "--cell-list");
 	for ( i=0; i<indexing_params->n_metadata; i++ ) {
 		add_arg_string(args, n_args++, "copy-header",
 		               indexing_params->metadata_to_copy[i]);
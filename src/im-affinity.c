@@ -0,0 +1,420 @@
+/*
+ * im-affinity.c
+ *
+ * CPU and NUMA placement of indexamajig worker processes
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+#include <utils.h>
+
+#include "im-affinity.h"
+
+
+enum cpu_layout parse_cpu_layout(const char *str)
+{
+	if ( strcmp(str, "none") == 0 ) return CPU_LAYOUT_NONE;
+	if ( strcmp(str, "compact") == 0 ) return CPU_LAYOUT_COMPACT;
+	if ( strcmp(str, "scatter") == 0 ) return CPU_LAYOUT_SCATTER;
+	if ( strcmp(str, "numa") == 0 ) return CPU_LAYOUT_NUMA;
+	return CPU_LAYOUT_ERROR;
+}
+
+
+#ifdef HAVE_SCHED_SETAFFINITY
+
+/* Highest NUMA node number to look for */
+#define MAX_NUMA_NODES (256)
+
+struct im_affinity
+{
+	enum cpu_layout layout;
+	int n_workers;
+
+	/* The CPUs which we are allowed to use, grouped by NUMA node */
+	int n_cpus;
+	int *cpus;
+	int n_nodes;
+	int *node_ids;
+	int *node_first;  /* Index in 'cpus' of the first CPU in each node */
+	int *node_ncpus;
+
+	/* Placement of each worker */
+	cpu_set_t *sets;
+	int *worker_node;
+	int oversubscribed;
+};
+
+
+static const char *layout_name(enum cpu_layout layout)
+{
+	switch ( layout ) {
+		case CPU_LAYOUT_NONE : return "none";
+		case CPU_LAYOUT_COMPACT : return "compact";
+		case CPU_LAYOUT_SCATTER : return "scatter";
+		case CPU_LAYOUT_NUMA : return "numa";
+		default : return "unknown";
+	}
+}
+
+
+/* Reads a list of CPUs in the same format as /sys/devices/system/cpu/online,
+ * e.g. "0-31,64-95" */
+static int read_cpulist(const char *filename, cpu_set_t *set)
+{
+	FILE *fh;
+	char line[4096];
+	char *tok;
+	char *saveptr = NULL;
+
+	CPU_ZERO(set);
+
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) return 1;
+	if ( fgets(line, 4096, fh) == NULL ) {
+		fclose(fh);
+		return 1;
+	}
+	fclose(fh);
+
+	tok = strtok_r(line, ",\n", &saveptr);
+	while ( tok != NULL ) {
+		int first, last, i;
+		if ( sscanf(tok, "%d-%d", &first, &last) != 2 ) {
+			if ( sscanf(tok, "%d", &first) != 1 ) return 1;
+			last = first;
+		}
+		for ( i=first; (i<=last) && (i<CPU_SETSIZE); i++ ) {
+			CPU_SET(i, set);
+		}
+		tok = strtok_r(NULL, ",\n", &saveptr);
+	}
+
+	return 0;
+}
+
+
+static void cpus_to_str(const cpu_set_t *set, char *out, size_t max)
+{
+	int i;
+	int first = -1;
+
+	out[0] = '\0';
+	for ( i=0; i<=CPU_SETSIZE; i++ ) {
+
+		int in = (i < CPU_SETSIZE) && CPU_ISSET(i, set);
+
+		if ( in && (first < 0) ) first = i;
+
+		if ( !in && (first >= 0) ) {
+			size_t l = strlen(out);
+			const char *sep = (l > 0) ? "," : "";
+			if ( first == i-1 ) {
+				snprintf(out+l, max-l, "%s%i", sep, first);
+			} else {
+				snprintf(out+l, max-l, "%s%i-%i", sep, first, i-1);
+			}
+			first = -1;
+		}
+
+	}
+}
+
+
+/* Find the CPUs we are allowed to use, and which NUMA nodes they are in */
+static int find_topology(struct im_affinity *af)
+{
+	cpu_set_t allowed;
+	int node;
+
+	if ( sched_getaffinity(0, sizeof(cpu_set_t), &allowed) ) {
+		ERROR("Failed to get CPU affinity: %s\n", strerror(errno));
+		return 1;
+	}
+
+	af->n_cpus = 0;
+	af->n_nodes = 0;
+	af->cpus = malloc(CPU_COUNT(&allowed)*sizeof(int));
+	af->node_ids = malloc(MAX_NUMA_NODES*sizeof(int));
+	af->node_first = malloc(MAX_NUMA_NODES*sizeof(int));
+	af->node_ncpus = malloc(MAX_NUMA_NODES*sizeof(int));
+	if ( (af->cpus == NULL) || (af->node_ids == NULL)
+	  || (af->node_first == NULL) || (af->node_ncpus == NULL) ) return 1;
+
+	for ( node=0; node<MAX_NUMA_NODES; node++ ) {
+
+		char filename[128];
+		cpu_set_t set;
+		int i;
+
+		snprintf(filename, 128, "/sys/devices/system/node/node%i/cpulist",
+		         node);
+		if ( read_cpulist(filename, &set) ) continue;
+
+		CPU_AND(&set, &set, &allowed);
+		if ( CPU_COUNT(&set) == 0 ) continue;
+
+		af->node_ids[af->n_nodes] = node;
+		af->node_first[af->n_nodes] = af->n_cpus;
+		for ( i=0; i<CPU_SETSIZE; i++ ) {
+			if ( !CPU_ISSET(i, &set) ) continue;
+			af->cpus[af->n_cpus++] = i;
+			CPU_CLR(i, &allowed);
+		}
+		af->node_ncpus[af->n_nodes] = af->n_cpus
+		                              - af->node_first[af->n_nodes];
+		af->n_nodes++;
+
+	}
+
+	/* Anything left over (or everything, if there is no NUMA
+	 * information) goes into a node of its own */
+	if ( CPU_COUNT(&allowed) > 0 ) {
+		int i;
+		af->node_ids[af->n_nodes] = (af->n_nodes == 0) ? 0 : -1;
+		af->node_first[af->n_nodes] = af->n_cpus;
+		for ( i=0; i<CPU_SETSIZE; i++ ) {
+			if ( CPU_ISSET(i, &allowed) ) af->cpus[af->n_cpus++] = i;
+		}
+		af->node_ncpus[af->n_nodes] = af->n_cpus
+		                              - af->node_first[af->n_nodes];
+		af->n_nodes++;
+	}
+
+	return 0;
+}
+
+
+static void place_worker(struct im_affinity *af, int w, int groupsize,
+                         int offset)
+{
+	int k, node, j;
+	cpu_set_t *set = &af->sets[w];
+
+	CPU_ZERO(set);
+
+	switch ( af->layout ) {
+
+		case CPU_LAYOUT_COMPACT :
+		/* Wrap around within the CPUs after the offset */
+		for ( k=0; k<groupsize; k++ ) {
+			CPU_SET(af->cpus[offset + (w*groupsize + k)
+			                 % (af->n_cpus - offset)], set);
+		}
+		node = 0;
+		j = offset + (w*groupsize) % (af->n_cpus - offset);
+		while ( (node < af->n_nodes-1)
+		     && (j >= af->node_first[node+1]) ) node++;
+		af->worker_node[w] = node;
+		if ( offset + (w+1)*groupsize > af->n_cpus ) {
+			af->oversubscribed = 1;
+		}
+		break;
+
+		case CPU_LAYOUT_SCATTER :
+		node = w % af->n_nodes;
+		j = w / af->n_nodes;
+		for ( k=0; k<groupsize; k++ ) {
+			int i = offset + (j*groupsize + k)
+			                 % (af->node_ncpus[node] - offset);
+			CPU_SET(af->cpus[af->node_first[node]+i], set);
+		}
+		af->worker_node[w] = node;
+		if ( offset + (j+1)*groupsize > af->node_ncpus[node] ) {
+			af->oversubscribed = 1;
+		}
+		break;
+
+		case CPU_LAYOUT_NUMA :
+		node = w % af->n_nodes;
+		for ( k=0; k<af->node_ncpus[node]; k++ ) {
+			CPU_SET(af->cpus[af->node_first[node]+k], set);
+		}
+		af->worker_node[w] = node;
+		break;
+
+		default :
+		break;
+
+	}
+}
+
+
+struct im_affinity *im_affinity_new(enum cpu_layout layout, int n_workers,
+                                    int groupsize, int offset)
+{
+	struct im_affinity *af;
+	int w;
+
+	if ( layout == CPU_LAYOUT_NONE ) return NULL;
+
+	af = calloc(1, sizeof(struct im_affinity));
+	if ( af == NULL ) return NULL;
+
+	af->layout = layout;
+	af->n_workers = n_workers;
+
+	if ( find_topology(af) || (af->n_cpus == 0) ) {
+		ERROR("Couldn't work out the CPU layout.\n");
+		im_affinity_free(af);
+		return NULL;
+	}
+
+	for ( w=0; w<af->n_nodes; w++ ) {
+		int n = (layout == CPU_LAYOUT_SCATTER) ? af->node_ncpus[w]
+		                                       : af->n_cpus;
+		if ( (layout != CPU_LAYOUT_NUMA) && (offset >= n) ) {
+			ERROR("CPU offset (%i) leaves no CPUs to use.\n",
+			      offset);
+			im_affinity_free(af);
+			return NULL;
+		}
+	}
+
+	af->sets = malloc(n_workers*sizeof(cpu_set_t));
+	af->worker_node = malloc(n_workers*sizeof(int));
+	if ( (af->sets == NULL) || (af->worker_node == NULL) ) {
+		im_affinity_free(af);
+		return NULL;
+	}
+
+	for ( w=0; w<n_workers; w++ ) {
+		place_worker(af, w, groupsize, offset);
+	}
+
+	return af;
+}
+
+
+void im_affinity_free(struct im_affinity *af)
+{
+	if ( af == NULL ) return;
+	free(af->cpus);
+	free(af->node_ids);
+	free(af->node_first);
+	free(af->node_ncpus);
+	free(af->sets);
+	free(af->worker_node);
+	free(af);
+}
+
+
+void im_affinity_report(struct im_affinity *af)
+{
+	int node;
+
+	if ( af == NULL ) return;
+
+	STATUS("Worker placement: %s, %i CPUs in %i NUMA node%s.\n",
+	       layout_name(af->layout), af->n_cpus, af->n_nodes,
+	       (af->n_nodes == 1) ? "" : "s");
+
+	for ( node=0; node<af->n_nodes; node++ ) {
+
+		cpu_set_t used;
+		char cpustr[1024];
+		int w;
+		int n = 0;
+
+		CPU_ZERO(&used);
+		for ( w=0; w<af->n_workers; w++ ) {
+			if ( af->worker_node[w] != node ) continue;
+			CPU_OR(&used, &used, &af->sets[w]);
+			n++;
+		}
+		if ( n == 0 ) continue;
+
+		cpus_to_str(&used, cpustr, 1024);
+		if ( af->node_ids[node] < 0 ) {
+			STATUS("  Other CPUs: %i worker%s on CPUs %s\n",
+			       n, (n == 1) ? "" : "s", cpustr);
+		} else {
+			STATUS("  Node %i: %i worker%s on CPUs %s\n",
+			       af->node_ids[node], n, (n == 1) ? "" : "s",
+			       cpustr);
+		}
+
+	}
+
+	if ( af->oversubscribed ) {
+		STATUS("WARNING: There are not enough CPUs for all the workers, "
+		       "so some of them will have to share.\n");
+	}
+}
+
+
+/* To be called by the worker itself, before it allocates anything, so that
+ * its memory ends up on the same NUMA node (first touch).  Any threads
+ * started by the worker later will use the same CPUs. */
+int im_affinity_apply(struct im_affinity *af, int worker)
+{
+	if ( af == NULL ) return 0;
+
+	if ( sched_setaffinity(0, sizeof(cpu_set_t), &af->sets[worker]) ) {
+		ERROR("Failed to set CPU affinity for worker %i: %s\n",
+		      worker, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+#else  /* HAVE_SCHED_SETAFFINITY */
+
+struct im_affinity *im_affinity_new(enum cpu_layout layout, int n_workers,
+                                    int groupsize, int offset)
+{
+	if ( layout == CPU_LAYOUT_NONE ) return NULL;
+	ERROR("Worker placement is not supported on this system.\n");
+	return NULL;
+}
+
+
+void im_affinity_free(struct im_affinity *af)
+{
+}
+
+
+void im_affinity_report(struct im_affinity *af)
+{
+}
+
+
+int im_affinity_apply(struct im_affinity *af, int worker)
+{
+	return 0;
+}
+
+#endif  /* HAVE_SCHED_SETAFFINITY */
@@ -0,0 +1,54 @@
+/*
+ * im-affinity.h
+ *
+ * CPU and NUMA placement of indexamajig worker processes
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_AFFINITY_H
+#define IM_AFFINITY_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+enum cpu_layout
+{
+	CPU_LAYOUT_NONE,     /* Let the operating system decide */
+	CPU_LAYOUT_COMPACT,  /* Fill up one NUMA node before the next */
+	CPU_LAYOUT_SCATTER,  /* Spread the workers evenly over the nodes */
+	CPU_LAYOUT_NUMA,     /* Like scatter, but only bind each worker to a
+	                      * node, not to particular CPUs */
+	CPU_LAYOUT_ERROR
+};
+
+struct im_affinity;
+
+extern enum cpu_layout parse_cpu_layout(const char *str);
+
+extern struct im_affinity *im_affinity_new(enum cpu_layout layout,
+                                           int n_workers, int groupsize,
+                                           int offset);
+extern void im_affinity_free(struct im_affinity *af);
+extern void im_affinity_report(struct im_affinity *af);
+extern int im_affinity_apply(struct im_affinity *af, int worker);
+
+#endif /* IM_AFFINITY_H */
@@ -142,17 +142,21 @@ static int stream_empty(struct im_asapo *a)
 }
 
 
+/* The timestamp is the time (in seconds since the epoch) when the record was
+ * created, or zero if unknown */
 void *im_asapo_fetch(struct im_asapo *a, size_t *pdata_size,
                      char **pmeta, char **pfilename, char **pevent,
-                     int *pfinished)
+                     int *pfinished, double *ptimestamp)
 {
 	void *data_copy;
 	AsapoMessageMetaHandle meta;
 	AsapoMessageDataHandle data;
 	AsapoErrorHandle err;
 	uint64_t msg_size;
+	struct timespec ts;
 
 	*pfinished = 0;
+	*ptimestamp = 0.0;
 
 	profile_start("create-handles");
 	err = asapo_new_handle();
@@ -204,6 +208,8 @@ void *im_asapo_fetch(struct im_asapo *a, size_t *pdata_size,
 	*pmeta = strdup(asapo_message_meta_get_metadata(meta));
 	*pfilename = strdup(asapo_message_meta_get_name(meta));
 	*pevent = strdup("//");
+	ts = asapo_message_meta_get_timestamp(meta);
+	*ptimestamp = ts.tv_sec + ts.tv_nsec*1e-9;
 	profile_end("copy-meta");
 
 	asapo_free_handle(&err);
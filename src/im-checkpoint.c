@@ -0,0 +1,406 @@
+/*
+ * im-checkpoint.c
+ *
+ * Checkpoint and resume for indexamajig
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include <utils.h>
+#include <stream.h>
+
+#include "im-checkpoint.h"
+
+
+/* The checkpoint file lives alongside the stream, and records which serial
+ * numbers are finished, as a bitmap starting at serial_start.  A frame is
+ * finished when its chunk is complete in the stream, or when the worker has
+ * finished with it without writing a chunk (for example, a non-hit with
+ * --no-non-hits-in-stream).  It also records the length of the stream at the time it
+ * was written, so that the stream does not have to be scanned from the start
+ * when resuming. */
+struct im_checkpoint
+{
+	char *filename;
+	int serial_start;
+
+	unsigned char *done;
+	int max_serials;    /* Size of 'done', in bits */
+	int n_serials;      /* One more than the highest bit which is set */
+	int n_done;
+
+	off_t stream_offset;
+	int dirty;
+};
+
+
+static int set_done(struct im_checkpoint *cp, int serial)
+{
+	int idx = serial - cp->serial_start;
+
+	if ( idx < 0 ) return 0;
+
+	if ( idx >= cp->max_serials ) {
+
+		unsigned char *done_new;
+		int max_new = cp->max_serials;
+
+		while ( idx >= max_new ) max_new *= 2;
+		done_new = realloc(cp->done, max_new/8);
+		if ( done_new == NULL ) {
+			ERROR("Failed to grow checkpoint bitmap.\n");
+			return 1;
+		}
+		memset(done_new + cp->max_serials/8, 0,
+		       (max_new - cp->max_serials)/8);
+		cp->done = done_new;
+		cp->max_serials = max_new;
+
+	}
+
+	if ( !(cp->done[idx/8] & (1 << (idx % 8))) ) {
+		cp->done[idx/8] |= 1 << (idx % 8);
+		cp->n_done++;
+		if ( idx >= cp->n_serials ) cp->n_serials = idx+1;
+	}
+
+	return 0;
+}
+
+
+int im_checkpoint_is_done(struct im_checkpoint *cp, int serial)
+{
+	int idx;
+
+	if ( cp == NULL ) return 0;
+
+	idx = serial - cp->serial_start;
+	if ( (idx < 0) || (idx >= cp->n_serials) ) return 0;
+	return (cp->done[idx/8] & (1 << (idx % 8))) != 0;
+}
+
+
+int im_checkpoint_n_done(struct im_checkpoint *cp)
+{
+	if ( cp == NULL ) return 0;
+	return cp->n_done;
+}
+
+
+struct im_checkpoint *im_checkpoint_new(const char *stream_filename,
+                                        int serial_start)
+{
+	struct im_checkpoint *cp;
+	size_t len;
+
+	cp = malloc(sizeof(struct im_checkpoint));
+	if ( cp == NULL ) return NULL;
+
+	len = strlen(stream_filename) + 6;
+	cp->filename = malloc(len);
+	cp->max_serials = 65536;
+	cp->done = calloc(cp->max_serials/8, 1);
+	if ( (cp->filename == NULL) || (cp->done == NULL) ) {
+		free(cp->filename);
+		free(cp->done);
+		free(cp);
+		return NULL;
+	}
+	snprintf(cp->filename, len, "%s.ckpt", stream_filename);
+
+	cp->serial_start = serial_start;
+	cp->n_serials = 0;
+	cp->n_done = 0;
+	cp->stream_offset = 0;
+	cp->dirty = 0;
+
+	return cp;
+}
+
+
+void im_checkpoint_free(struct im_checkpoint *cp)
+{
+	if ( cp == NULL ) return;
+	free(cp->filename);
+	free(cp->done);
+	free(cp);
+}
+
+
+/* To be called when a frame is finished, after its chunk (if any) has been
+ * written to the output stream.  'ofd' is the file descriptor of the
+ * stream. */
+void im_checkpoint_chunk_done(struct im_checkpoint *cp, int serial, int ofd)
+{
+	off_t pos;
+
+	if ( cp == NULL ) return;
+
+	set_done(cp, serial);
+	pos = lseek(ofd, 0, SEEK_CUR);
+	if ( pos != (off_t)-1 ) cp->stream_offset = pos;
+	cp->dirty = 1;
+}
+
+
+/* Writes the checkpoint file, if anything changed since last time.  The
+ * stream is flushed to disk first, so that the checkpoint never refers to
+ * chunks which might still be lost. */
+int im_checkpoint_write(struct im_checkpoint *cp, int ofd)
+{
+	FILE *fh;
+	char *tmp;
+	size_t len;
+	size_t n_bytes;
+	int r = 0;
+
+	if ( (cp == NULL) || !cp->dirty ) return 0;
+
+	if ( fdatasync(ofd) ) {
+		ERROR("Failed to flush stream: %s\n", strerror(errno));
+		return 1;
+	}
+
+	len = strlen(cp->filename) + 5;
+	tmp = malloc(len);
+	if ( tmp == NULL ) return 1;
+	snprintf(tmp, len, "%s.tmp", cp->filename);
+
+	fh = fopen(tmp, "w");
+	if ( fh == NULL ) {
+		ERROR("Failed to open checkpoint file '%s': %s\n",
+		      tmp, strerror(errno));
+		free(tmp);
+		return 1;
+	}
+
+	n_bytes = (cp->n_serials+7)/8;
+	fprintf(fh, "CrystFEL indexamajig checkpoint 1\n");
+	fprintf(fh, "serial_start %i\n", cp->serial_start);
+	fprintf(fh, "stream_offset %lld\n", (long long)cp->stream_offset);
+	fprintf(fh, "n_serials %i\n", cp->n_serials);
+	fprintf(fh, "bitmap\n");
+	if ( fwrite(cp->done, 1, n_bytes, fh) != n_bytes ) r = 1;
+	if ( fflush(fh) || fsync(fileno(fh)) ) r = 1;
+	if ( fclose(fh) ) r = 1;
+
+	if ( r ) {
+		ERROR("Failed to write checkpoint file '%s'\n", tmp);
+		unlink(tmp);
+		free(tmp);
+		return 1;
+	}
+
+	if ( rename(tmp, cp->filename) ) {
+		ERROR("Failed to rename checkpoint file: %s\n",
+		      strerror(errno));
+		free(tmp);
+		return 1;
+	}
+
+	free(tmp);
+	cp->dirty = 0;
+	return 0;
+}
+
+
+static int read_checkpoint(struct im_checkpoint *cp)
+{
+	FILE *fh;
+	char line[1024];
+	int serial_start, n_serials;
+	long long int offset;
+	size_t n_bytes;
+	unsigned char *bitmap;
+	int i;
+
+	fh = fopen(cp->filename, "r");
+	if ( fh == NULL ) {
+		ERROR("Failed to open checkpoint file '%s'\n", cp->filename);
+		return 1;
+	}
+
+	if ( (fgets(line, 1024, fh) == NULL)
+	  || (strcmp(line, "CrystFEL indexamajig checkpoint 1\n") != 0)
+	  || (fscanf(fh, "serial_start %i\n", &serial_start) != 1)
+	  || (fscanf(fh, "stream_offset %lld\n", &offset) != 1)
+	  || (fscanf(fh, "n_serials %i\n", &n_serials) != 1)
+	  || (fgets(line, 1024, fh) == NULL)
+	  || (strcmp(line, "bitmap\n") != 0)
+	  || (n_serials < 0) || (offset < 0) )
+	{
+		ERROR("Invalid checkpoint file '%s'\n", cp->filename);
+		fclose(fh);
+		return 1;
+	}
+
+	if ( serial_start != cp->serial_start ) {
+		ERROR("Checkpoint file '%s' was made with --serial-start=%i.\n",
+		      cp->filename, serial_start);
+		fclose(fh);
+		return 1;
+	}
+
+	n_bytes = (n_serials+7)/8;
+	bitmap = malloc(n_bytes);
+	if ( bitmap == NULL ) {
+		fclose(fh);
+		return 1;
+	}
+	if ( fread(bitmap, 1, n_bytes, fh) != n_bytes ) {
+		ERROR("Checkpoint file '%s' is truncated.\n", cp->filename);
+		free(bitmap);
+		fclose(fh);
+		return 1;
+	}
+	fclose(fh);
+
+	for ( i=0; i<n_serials; i++ ) {
+		if ( bitmap[i/8] & (1 << (i % 8)) ) {
+			set_done(cp, serial_start+i);
+		}
+	}
+	free(bitmap);
+
+	cp->stream_offset = offset;
+	return 0;
+}
+
+
+/* Look at the stream after the end of the part recorded in the checkpoint,
+ * add any complete chunks to the bitmap and cut off a final, incomplete
+ * chunk. */
+static int scan_stream_tail(struct im_checkpoint *cp,
+                            const char *stream_filename)
+{
+	FILE *fh;
+	char line[1024];
+	off_t chunk_start = 0;
+	off_t end;
+	int in_chunk = 0;
+	int ser = -1;
+	int n_new = 0;
+
+	fh = fopen(stream_filename, "r");
+	if ( fh == NULL ) {
+		ERROR("Failed to open stream '%s'\n", stream_filename);
+		return 1;
+	}
+
+	if ( fseeko(fh, 0, SEEK_END) ) {
+		fclose(fh);
+		return 1;
+	}
+	end = ftello(fh);
+	if ( end < cp->stream_offset ) {
+		ERROR("Stream '%s' is shorter than recorded in the "
+		      "checkpoint file.\n", stream_filename);
+		fclose(fh);
+		return 1;
+	}
+	fseeko(fh, cp->stream_offset, SEEK_SET);
+
+	do {
+
+		off_t pos = ftello(fh);
+
+		if ( fgets(line, 1024, fh) == NULL ) break;
+
+		if ( strcmp(line, STREAM_CHUNK_START_MARKER"\n") == 0 ) {
+			in_chunk = 1;
+			chunk_start = pos;
+			ser = -1;
+		} else if ( in_chunk
+		         && (sscanf(line, "Image serial number: %i", &ser) == 1) )
+		{
+			/* Got serial number */
+		} else if ( in_chunk
+		         && (strcmp(line, STREAM_CHUNK_END_MARKER"\n") == 0) )
+		{
+			in_chunk = 0;
+			if ( ser >= 0 ) {
+				set_done(cp, ser);
+				n_new++;
+			}
+		}
+
+	} while ( 1 );
+	fclose(fh);
+
+	if ( in_chunk ) {
+		STATUS("Removing incomplete chunk from end of stream.\n");
+		if ( truncate(stream_filename, chunk_start) ) {
+			ERROR("Failed to truncate stream: %s\n",
+			      strerror(errno));
+			return 1;
+		}
+		end = chunk_start;
+	}
+
+	cp->stream_offset = end;
+	cp->dirty = (n_new > 0) || in_chunk;
+	return 0;
+}
+
+
+/**
+ * Sets up checkpointing for an existing stream, reading the checkpoint file
+ * if there is one.  Chunks written to the stream after the last checkpoint
+ * update are found by scanning the end of the stream, and an incomplete chunk
+ * at the very end is removed.  Without a checkpoint file, the whole stream is
+ * scanned.
+ */
+struct im_checkpoint *im_checkpoint_resume(const char *stream_filename,
+                                           int serial_start)
+{
+	struct im_checkpoint *cp;
+
+	cp = im_checkpoint_new(stream_filename, serial_start);
+	if ( cp == NULL ) return NULL;
+
+	if ( file_exists(cp->filename) ) {
+		if ( read_checkpoint(cp) ) {
+			im_checkpoint_free(cp);
+			return NULL;
+		}
+	} else {
+		STATUS("No checkpoint file found - scanning whole stream.\n");
+	}
+
+	if ( scan_stream_tail(cp, stream_filename) ) {
+		im_checkpoint_free(cp);
+		return NULL;
+	}
+
+	STATUS("Resuming: %i frames have already been processed.\n",
+	       cp->n_done);
+	return cp;
+}
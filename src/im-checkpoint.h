@@ -0,0 +1,57 @@
+/*
+ * im-checkpoint.h
+ *
+ * Checkpoint and resume for indexamajig
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_CHECKPOINT_H
+#define IM_CHECKPOINT_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+
+/* Minimum number of seconds between checkpoint file updates */
+#define CHECKPOINT_INTERVAL (30)
+
+struct im_checkpoint;
+
+extern struct im_checkpoint *im_checkpoint_new(const char *stream_filename,
+                                               int serial_start);
+
+extern struct im_checkpoint *im_checkpoint_resume(const char *stream_filename,
+                                                  int serial_start);
+
+extern void im_checkpoint_free(struct im_checkpoint *cp);
+
+extern int im_checkpoint_is_done(struct im_checkpoint *cp, int serial);
+
+extern int im_checkpoint_n_done(struct im_checkpoint *cp);
+
+extern void im_checkpoint_chunk_done(struct im_checkpoint *cp, int serial,
+                                     int ofd);
+
+extern int im_checkpoint_write(struct im_checkpoint *cp, int ofd);
+
+#endif /* IM_CHECKPOINT_H */
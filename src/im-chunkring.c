@@ -0,0 +1,278 @@
+/*
+ * im-chunkring.c
+ *
+ * Shared memory hand-off of stream chunks from workers to the master
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <utils.h>
+
+#include "im-chunkring.h"
+#include "im-sandbox.h"
+
+
+/* Each worker formats its chunks straight into its own ring buffer, which
+ * is shared with the master.  When a chunk is complete, the worker adds a
+ * descriptor for it and writes one byte to a pipe (the "doorbell") to wake
+ * up the master.  The master writes the chunks out directly from the
+ * buffer, without looking at their contents, and then releases the space.
+ *
+ * The pipe also tells the master when the worker has gone away, because the
+ * master then gets EOF.
+ *
+ * If a chunk does not fit in the buffer, the worker hands over what it has
+ * as a partial piece, and waits for the master to make space.  The master
+ * must then not write anything else until the rest of the chunk arrives. */
+
+/* Bytes held back at the end of a partial piece, so that the last piece
+ * always contains the whole of the chunk end marker */
+#define CHUNK_RING_HOLDBACK (64)
+
+struct im_chunkring
+{
+	/* Written by the worker, read by the master */
+	size_t n_published;
+
+	/* Written by the master, read by the worker */
+	size_t n_released __attribute__((aligned(SB_CACHE_LINE)));
+	size_t bytes_released;
+
+	/* Only used by the worker */
+	size_t wpos __attribute__((aligned(SB_CACHE_LINE)));
+	size_t piece_start;
+	int doorbell;
+
+	struct chunk_desc desc[CHUNK_RING_SLOTS];
+	char data[CHUNK_RING_SIZE] __attribute__((aligned(SB_CACHE_LINE)));
+};
+
+
+struct im_chunkring *im_chunkring_new(void)
+{
+	struct im_chunkring *r;
+
+	r = mmap(NULL, sizeof(struct im_chunkring), PROT_READ | PROT_WRITE,
+	         MAP_SHARED | MAP_ANON, -1, 0);
+	if ( r == MAP_FAILED ) {
+		ERROR("Failed to set up chunk buffer: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	/* Anonymous mapping starts zeroed */
+	r->doorbell = -1;
+	return r;
+}
+
+
+void im_chunkring_free(struct im_chunkring *r)
+{
+	if ( r == NULL ) return;
+	munmap(r, sizeof(struct im_chunkring));
+}
+
+
+/* Gets the n-th descriptor after the last one released, and the (one or two)
+ * parts of the ring buffer which it covers.  Returns the number of parts, or
+ * zero if there is no such descriptor yet. */
+int im_chunkring_peek(struct im_chunkring *r, int n, struct chunk_desc *d,
+                      struct iovec *iov)
+{
+	size_t idx = r->n_released + n;
+	size_t ofs;
+
+	if ( idx >= __atomic_load_n(&r->n_published, __ATOMIC_ACQUIRE) ) {
+		return 0;
+	}
+
+	*d = r->desc[idx % CHUNK_RING_SLOTS];
+
+	ofs = d->start % CHUNK_RING_SIZE;
+	iov[0].iov_base = &r->data[ofs];
+	if ( ofs + d->len <= CHUNK_RING_SIZE ) {
+		iov[0].iov_len = d->len;
+		return 1;
+	}
+
+	iov[0].iov_len = CHUNK_RING_SIZE - ofs;
+	iov[1].iov_base = &r->data[0];
+	iov[1].iov_len = d->len - iov[0].iov_len;
+	return 2;
+}
+
+
+/* Frees the space used by the next n descriptors, which have been written */
+void im_chunkring_release(struct im_chunkring *r, int n)
+{
+	struct chunk_desc *d;
+
+	if ( n == 0 ) return;
+
+	d = &r->desc[(r->n_released+n-1) % CHUNK_RING_SLOTS];
+	__atomic_store_n(&r->bytes_released, d->start + d->len,
+	                 __ATOMIC_RELEASE);
+	__atomic_store_n(&r->n_released, r->n_released+n, __ATOMIC_RELEASE);
+}
+
+
+static void ring_doorbell(struct im_chunkring *r)
+{
+	char c = 0;
+	if ( write(r->doorbell, &c, 1) != 1 ) {
+		ERROR("Failed to wake up master: %s\n", strerror(errno));
+	}
+}
+
+
+static void add_descriptor(struct im_chunkring *r, size_t end, int partial,
+                           const struct chunk_info *info)
+{
+	struct chunk_desc *d;
+
+	/* Wait for a free slot */
+	while ( r->n_published - __atomic_load_n(&r->n_released,
+	                                         __ATOMIC_ACQUIRE)
+	        >= CHUNK_RING_SLOTS )
+	{
+		usleep(1000);
+	}
+
+	d = &r->desc[r->n_published % CHUNK_RING_SLOTS];
+	d->start = r->piece_start;
+	d->len = end - r->piece_start;
+	d->partial = partial;
+	if ( info != NULL ) {
+		d->info = *info;
+	} else {
+		memset(&d->info, 0, sizeof(struct chunk_info));
+	}
+
+	__atomic_store_n(&r->n_published, r->n_published+1, __ATOMIC_RELEASE);
+	r->piece_start = end;
+	ring_doorbell(r);
+}
+
+
+static size_t free_space(struct im_chunkring *r)
+{
+	return CHUNK_RING_SIZE - (r->wpos - __atomic_load_n(&r->bytes_released,
+	                                                    __ATOMIC_ACQUIRE));
+}
+
+
+static ssize_t ring_write(void *vp, const char *buf, size_t size)
+{
+	struct im_chunkring *r = vp;
+	size_t done = 0;
+
+	while ( done < size ) {
+
+		size_t n, ofs;
+
+		n = free_space(r);
+		if ( n == 0 ) {
+			/* Hand over what we have, unless the master already
+			 * has it all, and wait for space */
+			if ( r->wpos - r->piece_start > CHUNK_RING_HOLDBACK ) {
+				add_descriptor(r, r->wpos - CHUNK_RING_HOLDBACK,
+				               1, NULL);
+			}
+			usleep(1000);
+			continue;
+		}
+
+		if ( n > size - done ) n = size - done;
+		ofs = r->wpos % CHUNK_RING_SIZE;
+		if ( n > CHUNK_RING_SIZE - ofs ) n = CHUNK_RING_SIZE - ofs;
+
+		memcpy(&r->data[ofs], buf+done, n);
+		r->wpos += n;
+		done += n;
+
+	}
+
+	return size;
+}
+
+
+static int ring_close(void *vp)
+{
+	struct im_chunkring *r = vp;
+	close(r->doorbell);
+	r->doorbell = -1;
+	return 0;
+}
+
+
+#if defined(HAVE_FUNOPEN) && !defined(HAVE_FOPENCOOKIE)
+static int ring_write_bsd(void *vp, const char *buf, int size)
+{
+	return ring_write(vp, buf, size);
+}
+#endif
+
+
+/* Returns a FILE which writes into the ring buffer.  Whatever is written is
+ * handed over to the master by im_chunkring_publish().  Closing the FILE
+ * closes 'doorbell'. */
+FILE *im_chunkring_open_writer(struct im_chunkring *r, int doorbell)
+{
+#if defined(HAVE_FOPENCOOKIE)
+	cookie_io_functions_t funcs;
+#endif
+
+	r->doorbell = doorbell;
+
+#if defined(HAVE_FOPENCOOKIE)
+	funcs.read = NULL;
+	funcs.write = ring_write;
+	funcs.seek = NULL;
+	funcs.close = ring_close;
+	return fopencookie(r, "w", funcs);
+#elif defined(HAVE_FUNOPEN)
+	return funopen(r, NULL, ring_write_bsd, NULL, ring_close);
+#else
+	ERROR("Chunk buffers are not supported on this system.\n");
+	return NULL;
+#endif
+}
+
+
+/* Hands everything written since the last call over to the master, as a
+ * complete chunk.  The FILE must have been flushed first. */
+void im_chunkring_publish(struct im_chunkring *r,
+                          const struct chunk_info *info)
+{
+	add_descriptor(r, r->wpos, 0, info);
+}
@@ -0,0 +1,94 @@
+/*
+ * im-chunkring.h
+ *
+ * Shared memory hand-off of stream chunks from workers to the master
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_CHUNKRING_H
+#define IM_CHUNKRING_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include <stream.h>
+
+/* Size of each worker's buffer for stream chunks, in bytes.  Must be a power
+ * of two.  Chunks bigger than this are handed over in several pieces. */
+#define CHUNK_RING_SIZE (2*1024*1024)
+
+/* Maximum number of chunks (or pieces of chunks) waiting in each buffer */
+#define CHUNK_RING_SLOTS (64)
+
+/* Maximum number of cell list records for one chunk (one for the chunk, plus
+ * one for each crystal) */
+#define CHUNK_MAX_CELLS (16)
+
+/* Information about a chunk, which the master needs but which is not part
+ * of the chunk itself */
+struct chunk_info
+{
+	int serial;
+
+	/* Times (see get_monotonic_seconds()) when fetching started and
+	 * finished, and when decoding, peak search, indexing and integration
+	 * finished */
+	int have_trace;
+	double trace[6];
+
+	/* Number of frames dropped since the last chunk, and whether
+	 * processing of this frame was cut short */
+	int n_dropped;
+	int degraded;
+
+	/* Records for the cell list, if one is being written.  n_cells is -1
+	 * if there were too many crystals. */
+	int n_cells;
+	unsigned char cells[CHUNK_MAX_CELLS*STREAM_CELLS_RECORD_SIZE];
+};
+
+struct chunk_desc
+{
+	size_t start;  /* Position of first byte, counted since the start */
+	size_t len;
+	int partial;   /* Non-zero if the chunk continues in the next piece */
+	struct chunk_info info;
+};
+
+struct im_chunkring;
+
+/* Master side */
+extern struct im_chunkring *im_chunkring_new(void);
+extern void im_chunkring_free(struct im_chunkring *r);
+extern int im_chunkring_peek(struct im_chunkring *r, int n,
+                             struct chunk_desc *d, struct iovec *iov);
+extern void im_chunkring_release(struct im_chunkring *r, int n);
+
+/* Worker side */
+extern FILE *im_chunkring_open_writer(struct im_chunkring *r, int doorbell);
+extern void im_chunkring_publish(struct im_chunkring *r,
+                                 const struct chunk_info *info);
+
+#endif /* IM_CHUNKRING_H */
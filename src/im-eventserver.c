@@ -0,0 +1,847 @@
+/*
+ * im-eventserver.c
+ *
+ * Hand out events to indexamajig processes over a socket
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <utils.h>
+
+#include "im-eventserver.h"
+
+
+/* The protocol is line-based.  After connecting, the client sends
+ * "HELLO <name>", then "GET <n>" whenever it needs more events.  The server
+ * replies with up to n lines of "<filename><TAB><event>", followed by a line
+ * containing only ".".  A reply with no events means that the list has
+ * finished, after which the client disconnects.  If the list has finished
+ * but other clients still have events which they might not finish, the reply
+ * is "WAIT" instead, and the client should ask again a little later.
+ *
+ * The client sends "DONE <k>" when it has finished with the k'th event it
+ * was given (counting from zero).  If it disconnects before finishing with
+ * an event, the event is handed out again to another client.  The server
+ * exits when the list has finished and all clients have disconnected.
+ *
+ * Addresses are either "unix:/path/to/socket" or "host:port".  For the
+ * server, the host part can be left empty to listen on all interfaces. */
+
+
+static int open_unix_socket(const char *path, int server)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	if ( strlen(path) >= sizeof(sa.sun_path) ) {
+		ERROR("Socket path is too long: %s\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ( fd == -1 ) {
+		ERROR("Failed to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	if ( server ) {
+		if ( bind(fd, (struct sockaddr *)&sa, sizeof(sa))
+		  || listen(fd, 64) )
+		{
+			ERROR("Failed to listen on %s: %s\n",
+			      path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	} else {
+		if ( connect(fd, (struct sockaddr *)&sa, sizeof(sa)) ) {
+			ERROR("Failed to connect to %s: %s\n",
+			      path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+
+static int open_tcp_socket(const char *address, int server)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	const char *colon;
+	char *host;
+	int fd = -1;
+	int r;
+
+	colon = strrchr(address, ':');
+	if ( colon == NULL ) {
+		ERROR("Invalid event server address '%s' (should be "
+		      "host:port or unix:/path)\n", address);
+		return -1;
+	}
+
+	host = strndup(address, colon-address);
+	if ( host == NULL ) return -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( server ) hints.ai_flags = AI_PASSIVE;
+
+	r = getaddrinfo(((host[0] == '\0') || (strcmp(host, "*") == 0))
+	                ? NULL : host, colon+1, &hints, &res);
+	free(host);
+	if ( r ) {
+		ERROR("Failed to look up '%s': %s\n", address,
+		      gai_strerror(r));
+		return -1;
+	}
+
+	for ( ai=res; ai!=NULL; ai=ai->ai_next ) {
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if ( fd == -1 ) continue;
+
+		if ( server ) {
+			int one = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+			           &one, sizeof(one));
+			if ( !bind(fd, ai->ai_addr, ai->ai_addrlen)
+			  && !listen(fd, 64) ) break;
+		} else {
+			if ( !connect(fd, ai->ai_addr, ai->ai_addrlen) ) break;
+		}
+
+		close(fd);
+		fd = -1;
+
+	}
+	freeaddrinfo(res);
+
+	if ( fd == -1 ) {
+		ERROR("Failed to %s %s: %s\n",
+		      server ? "listen on" : "connect to",
+		      address, strerror(errno));
+	}
+
+	return fd;
+}
+
+
+static int open_socket(const char *address, int server)
+{
+	if ( strncmp(address, "unix:", 5) == 0 ) {
+		return open_unix_socket(address+5, server);
+	} else {
+		return open_tcp_socket(address, server);
+	}
+}
+
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	while ( len > 0 ) {
+		ssize_t w = send(fd, buf, len, MSG_NOSIGNAL);
+		if ( w < 0 ) {
+			if ( errno == EINTR ) continue;
+			return 1;
+		}
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+
+/************************************ Server **********************************/
+
+struct es_event
+{
+	char *filename;  /* NULL once the client has finished with it */
+	char *event;
+};
+
+
+struct es_client
+{
+	int fd;
+	char *name;
+	char buf[1024];
+	size_t len;
+	long int n_served;
+
+	/* Events handed out to this client, which it hasn't finished with
+	 * yet.  out[i] is the client's event number out_base+i. */
+	struct es_event *out;
+	int n_out;
+	int max_out;
+	long int out_base;
+	int n_unfinished;
+};
+
+
+struct es_state
+{
+	EventSourceFunc get_event;
+	void *ctx;
+	int finished;  /* End of the event source reached */
+	long int n_total;
+
+	/* Events given back by clients which disconnected early */
+	struct es_event *requeued;
+	int n_requeued;
+	int max_requeued;
+
+	struct es_client *clients;
+	int n_clients;
+};
+
+
+struct es_reply
+{
+	char *buf;
+	size_t len;
+	size_t max_len;
+};
+
+
+static int reply_add(struct es_reply *rep, const char *line)
+{
+	size_t len = strlen(line) + 2;
+
+	if ( rep->len + len > rep->max_len ) {
+		char *nbuf;
+		size_t nmax = 2*rep->max_len + len;
+		nbuf = realloc(rep->buf, nmax);
+		if ( nbuf == NULL ) return 1;
+		rep->buf = nbuf;
+		rep->max_len = nmax;
+	}
+
+	rep->len += snprintf(rep->buf+rep->len, len, "%s\n", line);
+	return 0;
+}
+
+
+static int reply_add_event(struct es_reply *rep, const struct es_event *ev)
+{
+	char *line;
+	int r;
+
+	line = malloc(strlen(ev->filename) + strlen(ev->event) + 2);
+	if ( line == NULL ) return 1;
+	strcpy(line, ev->filename);
+	strcat(line, "\t");
+	strcat(line, ev->event);
+	r = reply_add(rep, line);
+	free(line);
+	return r;
+}
+
+
+static int add_out(struct es_client *c, struct es_event ev)
+{
+	if ( c->n_out == c->max_out ) {
+		struct es_event *n;
+		int nmax = 2*c->max_out + 32;
+		n = realloc(c->out, nmax*sizeof(struct es_event));
+		if ( n == NULL ) return 1;
+		c->out = n;
+		c->max_out = nmax;
+	}
+	c->out[c->n_out++] = ev;
+	c->n_unfinished++;
+	return 0;
+}
+
+
+static void finish_event(struct es_client *c, long int k)
+{
+	long int i = k - c->out_base;
+	int n_gone;
+
+	if ( (i < 0) || (i >= c->n_out) ) return;
+	if ( c->out[i].filename == NULL ) return;
+
+	free(c->out[i].filename);
+	free(c->out[i].event);
+	c->out[i].filename = NULL;
+	c->n_unfinished--;
+
+	/* Forget about the events at the start which are all finished */
+	for ( n_gone=0; n_gone<c->n_out; n_gone++ ) {
+		if ( c->out[n_gone].filename != NULL ) break;
+	}
+	if ( n_gone > 0 ) {
+		memmove(c->out, c->out+n_gone,
+		        (c->n_out-n_gone)*sizeof(struct es_event));
+		c->n_out -= n_gone;
+		c->out_base += n_gone;
+	}
+}
+
+
+/* Returns zero if there are no more events right now */
+static int next_event(struct es_state *st, struct es_event *ev)
+{
+	if ( st->n_requeued > 0 ) {
+		*ev = st->requeued[--st->n_requeued];
+		return 1;
+	}
+
+	if ( st->finished ) return 0;
+
+	if ( !st->get_event(st->ctx, &ev->filename, &ev->event) ) {
+		STATUS("Event server: end of event list after %li "
+		       "events.\n", st->n_total);
+		st->finished = 1;
+		return 0;
+	}
+	if ( ev->event == NULL ) ev->event = strdup("");
+	st->n_total++;
+	return 1;
+}
+
+
+/* Events which aren't available now might still come back, if another client
+ * disconnects before finishing with them */
+static int others_unfinished(struct es_state *st, struct es_client *c)
+{
+	int i;
+
+	for ( i=0; i<st->n_clients; i++ ) {
+		if ( &st->clients[i] == c ) continue;
+		if ( st->clients[i].n_unfinished > 0 ) return 1;
+	}
+	return 0;
+}
+
+
+static int handle_get(struct es_state *st, struct es_client *c, int n)
+{
+	struct es_reply rep;
+	int i;
+
+	rep.buf = NULL;
+	rep.len = 0;
+	rep.max_len = 0;
+	for ( i=0; i<n; i++ ) {
+
+		struct es_event ev;
+
+		if ( !next_event(st, &ev) ) break;
+
+		if ( add_out(c, ev) ) {
+			free(ev.filename);
+			free(ev.event);
+			ev.filename = NULL;
+		}
+		if ( (ev.filename == NULL) || reply_add_event(&rep, &ev) ) {
+			ERROR("Event server: failed to allocate reply\n");
+			free(rep.buf);
+			return 1;
+		}
+		c->n_served++;
+
+	}
+
+	if ( reply_add(&rep, ((i == 0) && others_unfinished(st, c))
+	                     ? "WAIT" : ".") )
+	{
+		free(rep.buf);
+		return 1;
+	}
+	if ( send_all(c->fd, rep.buf, rep.len) ) {
+		ERROR("Event server: failed to send events to %s: %s\n",
+		      (c->name != NULL) ? c->name : "client",
+		      strerror(errno));
+		free(rep.buf);
+		return 1;
+	}
+
+	free(rep.buf);
+	return 0;
+}
+
+
+/* Returns non-zero if the client should be dropped */
+static int handle_line(struct es_state *st, struct es_client *c,
+                       const char *line)
+{
+	long int k;
+	int n;
+
+	if ( strncmp(line, "HELLO ", 6) == 0 ) {
+		free(c->name);
+		c->name = strdup(line+6);
+		STATUS("Event server: %s connected.\n", c->name);
+		return 0;
+	}
+
+	if ( sscanf(line, "DONE %li", &k) == 1 ) {
+		finish_event(c, k);
+		return 0;
+	}
+
+	if ( sscanf(line, "GET %i", &n) == 1 ) {
+		if ( n < 1 ) n = 1;
+		return handle_get(st, c, n);
+	}
+
+	ERROR("Event server: invalid request '%s'\n", line);
+	return 1;
+}
+
+
+/* Returns non-zero if the client should be dropped */
+static int read_from_client(struct es_state *st, struct es_client *c)
+{
+	ssize_t n;
+	char *nl;
+
+	n = read(c->fd, c->buf+c->len, sizeof(c->buf)-c->len-1);
+	if ( n < 0 ) {
+		if ( errno == EINTR ) return 0;
+		return 1;
+	}
+	if ( n == 0 ) return 1;  /* Disconnected */
+	c->len += n;
+	c->buf[c->len] = '\0';
+
+	while ( (nl = strchr(c->buf, '\n')) != NULL ) {
+		size_t used = nl - c->buf + 1;
+		*nl = '\0';
+		if ( handle_line(st, c, c->buf) ) return 1;
+		memmove(c->buf, c->buf+used, c->len-used+1);
+		c->len -= used;
+	}
+
+	if ( c->len == sizeof(c->buf)-1 ) {
+		ERROR("Event server: request too long\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* Gives back the events which the client didn't finish, so that another
+ * client can have them */
+static void drop_client(struct es_state *st, struct es_client *c)
+{
+	int i;
+
+	if ( c->n_unfinished > 0 ) {
+		STATUS("Event server: %s disconnected without finishing %i "
+		       "events.  They will be handed out again.\n",
+		       (c->name != NULL) ? c->name : "client",
+		       c->n_unfinished);
+	} else {
+		STATUS("Event server: %s disconnected after %li events.\n",
+		       (c->name != NULL) ? c->name : "client", c->n_served);
+	}
+
+	for ( i=0; i<c->n_out; i++ ) {
+
+		if ( c->out[i].filename == NULL ) continue;
+
+		if ( st->n_requeued == st->max_requeued ) {
+			struct es_event *n;
+			int nmax = 2*st->max_requeued + 32;
+			n = realloc(st->requeued, nmax*sizeof(struct es_event));
+			if ( n == NULL ) {
+				ERROR("Event server: failed to requeue "
+				      "%s\n", c->out[i].filename);
+				free(c->out[i].filename);
+				free(c->out[i].event);
+				continue;
+			}
+			st->requeued = n;
+			st->max_requeued = nmax;
+		}
+		st->requeued[st->n_requeued++] = c->out[i];
+
+	}
+
+	close(c->fd);
+	free(c->name);
+	free(c->out);
+}
+
+
+int im_eventserver_run(const char *address, EventSourceFunc get_event,
+                       void *ctx)
+{
+	int lfd;
+	struct es_state st;
+	struct pollfd *pfds = NULL;
+	int max_clients = 0;
+	int i;
+
+	lfd = open_socket(address, 1);
+	if ( lfd == -1 ) return 1;
+
+	STATUS("Serving events on %s\n", address);
+
+	st.get_event = get_event;
+	st.ctx = ctx;
+	st.finished = 0;
+	st.n_total = 0;
+	st.requeued = NULL;
+	st.n_requeued = 0;
+	st.max_requeued = 0;
+	st.clients = NULL;
+	st.n_clients = 0;
+
+	while ( !st.finished || (st.n_clients > 0) ) {
+
+		int r;
+
+		if ( st.n_clients+1 > max_clients ) {
+			struct es_client *nc;
+			struct pollfd *np;
+			max_clients += 32;
+			nc = realloc(st.clients,
+			             max_clients*sizeof(struct es_client));
+			np = realloc(pfds, (max_clients+1)*sizeof(*pfds));
+			if ( (nc == NULL) || (np == NULL) ) {
+				ERROR("Event server: failed to allocate "
+				      "client list\n");
+				break;
+			}
+			st.clients = nc;
+			pfds = np;
+		}
+
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		for ( i=0; i<st.n_clients; i++ ) {
+			pfds[i+1].fd = st.clients[i].fd;
+			pfds[i+1].events = POLLIN;
+		}
+
+		r = poll(pfds, st.n_clients+1, -1);
+		if ( r == -1 ) {
+			if ( errno == EINTR ) continue;
+			ERROR("Event server: poll failed: %s\n",
+			      strerror(errno));
+			break;
+		}
+
+		/* Backwards, so that clients can be removed by moving the
+		 * last one (which has already been handled) into the gap */
+		for ( i=st.n_clients-1; i>=0; i-- ) {
+			if ( !(pfds[i+1].revents & (POLLIN | POLLHUP | POLLERR)) ) {
+				continue;
+			}
+			if ( read_from_client(&st, &st.clients[i]) ) {
+				drop_client(&st, &st.clients[i]);
+				st.clients[i] = st.clients[--st.n_clients];
+			}
+		}
+
+		if ( pfds[0].revents & POLLIN ) {
+			int fd = accept(lfd, NULL, NULL);
+			if ( fd == -1 ) {
+				ERROR("Event server: accept failed: %s\n",
+				      strerror(errno));
+			} else {
+				struct es_client *c = &st.clients[st.n_clients++];
+				c->fd = fd;
+				c->name = NULL;
+				c->len = 0;
+				c->n_served = 0;
+				c->out = NULL;
+				c->n_out = 0;
+				c->max_out = 0;
+				c->out_base = 0;
+				c->n_unfinished = 0;
+			}
+		}
+
+	}
+
+	for ( i=0; i<st.n_clients; i++ ) drop_client(&st, &st.clients[i]);
+	free(st.clients);
+	free(pfds);
+	close(lfd);
+	if ( strncmp(address, "unix:", 5) == 0 ) unlink(address+5);
+
+	STATUS("Event server: handed out %li events in total.\n", st.n_total);
+	if ( st.n_requeued > 0 ) {
+		ERROR("Event server: %i events were not finished by any "
+		      "client.\n", st.n_requeued);
+	}
+	for ( i=0; i<st.n_requeued; i++ ) {
+		free(st.requeued[i].filename);
+		free(st.requeued[i].event);
+	}
+	free(st.requeued);
+
+	return !st.finished || (st.n_requeued > 0);
+}
+
+
+/************************************ Client **********************************/
+
+struct im_eventclient
+{
+	int fd;
+	FILE *fh;
+	int batch;
+
+	char **filenames;
+	char **events;
+	int n;
+	int pos;
+	int finished;
+
+	/* Requests come from the lookahead thread, but the events are
+	 * reported finished from the main thread */
+	pthread_mutex_t lock;
+	pthread_cond_t cancelled_cond;
+	int cancelled;
+};
+
+
+struct im_eventclient *im_eventclient_connect(const char *address, int batch)
+{
+	struct im_eventclient *c;
+	char host[256];
+	char hello[320];
+
+	c = malloc(sizeof(struct im_eventclient));
+	if ( c == NULL ) return NULL;
+
+	c->batch = (batch > 0) ? batch : EVENTSERVER_DEFAULT_BATCH;
+	c->filenames = malloc(c->batch*sizeof(char *));
+	c->events = malloc(c->batch*sizeof(char *));
+	if ( (c->filenames == NULL) || (c->events == NULL) ) {
+		free(c->filenames);
+		free(c->events);
+		free(c);
+		return NULL;
+	}
+	c->n = 0;
+	c->pos = 0;
+	c->finished = 0;
+	c->cancelled = 0;
+
+	c->fd = open_socket(address, 0);
+	if ( c->fd == -1 ) {
+		free(c->filenames);
+		free(c->events);
+		free(c);
+		return NULL;
+	}
+
+	c->fh = fdopen(c->fd, "r");
+	if ( c->fh == NULL ) {
+		close(c->fd);
+		free(c->filenames);
+		free(c->events);
+		free(c);
+		return NULL;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cancelled_cond, NULL);
+
+	if ( gethostname(host, sizeof(host)) ) strcpy(host, "unknown");
+	host[sizeof(host)-1] = '\0';
+	snprintf(hello, sizeof(hello), "HELLO %s/%i\n", host, getpid());
+	if ( send_all(c->fd, hello, strlen(hello)) ) {
+		ERROR("Failed to send to event server: %s\n",
+		      strerror(errno));
+		im_eventclient_free(c);
+		return NULL;
+	}
+
+	STATUS("Connected to event server at %s\n", address);
+	return c;
+}
+
+
+static int send_locked(struct im_eventclient *c, const char *msg)
+{
+	int r;
+
+	pthread_mutex_lock(&c->lock);
+	r = send_all(c->fd, msg, strlen(msg));
+	pthread_mutex_unlock(&c->lock);
+	if ( r ) {
+		ERROR("Failed to send to event server: %s\n",
+		      strerror(errno));
+	}
+	return r;
+}
+
+
+/* Returns non-zero if the server said to wait and ask again */
+static int fetch_batch(struct im_eventclient *c)
+{
+	char req[64];
+
+	c->n = 0;
+	c->pos = 0;
+
+	snprintf(req, sizeof(req), "GET %i\n", c->batch);
+	if ( send_locked(c, req) ) {
+		c->finished = 1;
+		return 0;
+	}
+
+	do {
+
+		char line[1024];
+		char *tab;
+
+		if ( fgets(line, sizeof(line), c->fh) == NULL ) {
+			ERROR("Lost connection to event server.\n");
+			c->finished = 1;
+			return 0;
+		}
+		chomp(line);
+
+		if ( strcmp(line, ".") == 0 ) break;
+		if ( strcmp(line, "WAIT") == 0 ) return 1;
+
+		if ( c->n == c->batch ) {
+			ERROR("Event server sent too many events.\n");
+			continue;
+		}
+
+		/* The event ID can't contain a tab, but the filename could */
+		tab = strrchr(line, '\t');
+		if ( tab == NULL ) {
+			ERROR("Invalid line from event server: '%s'\n", line);
+			continue;
+		}
+		*tab = '\0';
+		if ( tab[1] == '\0' ) {
+			/* Single-frame file */
+			c->events[c->n] = strdup("//");
+		} else {
+			c->events[c->n] = strdup(tab+1);
+		}
+		c->filenames[c->n] = strdup(line);
+		c->n++;
+
+	} while ( 1 );
+
+	if ( c->n == 0 ) c->finished = 1;
+	return 0;
+}
+
+
+int im_eventclient_next(struct im_eventclient *c, char **pfilename,
+                        char **pevent)
+{
+	while ( c->pos == c->n ) {
+
+		struct timespec ts;
+		int cancelled;
+
+		if ( c->finished ) return 0;
+		if ( !fetch_batch(c) ) continue;
+
+		/* Other clients still have events which might come back to
+		 * us, if they don't finish them */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_mutex_lock(&c->lock);
+		if ( !c->cancelled ) {
+			pthread_cond_timedwait(&c->cancelled_cond, &c->lock,
+			                       &ts);
+		}
+		cancelled = c->cancelled;
+		pthread_mutex_unlock(&c->lock);
+		if ( cancelled ) return 0;
+
+	}
+
+	*pfilename = c->filenames[c->pos];
+	*pevent = c->events[c->pos];
+	c->pos++;
+	return 1;
+}
+
+
+void im_eventclient_done(struct im_eventclient *c, long int k)
+{
+	char msg[64];
+
+	if ( c == NULL ) return;
+	snprintf(msg, sizeof(msg), "DONE %li\n", k);
+	send_locked(c, msg);
+}
+
+
+void im_eventclient_cancel(struct im_eventclient *c)
+{
+	if ( c == NULL ) return;
+	pthread_mutex_lock(&c->lock);
+	c->cancelled = 1;
+	pthread_cond_signal(&c->cancelled_cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+void im_eventclient_free(struct im_eventclient *c)
+{
+	int i;
+
+	if ( c == NULL ) return;
+
+	for ( i=c->pos; i<c->n; i++ ) {
+		free(c->filenames[i]);
+		free(c->events[i]);
+	}
+	free(c->filenames);
+	free(c->events);
+	fclose(c->fh);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cancelled_cond);
+	free(c);
+}
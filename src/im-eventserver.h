@@ -0,0 +1,61 @@
+/*
+ * im-eventserver.h
+ *
+ * Hand out events to indexamajig processes over a socket
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_EVENTSERVER_H
+#define IM_EVENTSERVER_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* Default number of events handed out per request */
+#define EVENTSERVER_DEFAULT_BATCH (16)
+
+/* Should put the next event into *pfilename and *pevent, which will be
+ * freed by the caller, and return non-zero.  Returns zero at the end. */
+typedef int (*EventSourceFunc)(void *ctx, char **pfilename, char **pevent);
+
+extern int im_eventserver_run(const char *address, EventSourceFunc get_event,
+                              void *ctx);
+
+struct im_eventclient;
+
+extern struct im_eventclient *im_eventclient_connect(const char *address,
+                                                     int batch);
+
+extern int im_eventclient_next(struct im_eventclient *c, char **pfilename,
+                               char **pevent);
+
+/* Tells the server that the k'th event given out by im_eventclient_next()
+ * (counting from zero) has been finished with */
+extern void im_eventclient_done(struct im_eventclient *c, long int k);
+
+/* Makes a call to im_eventclient_next() which is waiting for other clients
+ * return zero */
+extern void im_eventclient_cancel(struct im_eventclient *c);
+
+extern void im_eventclient_free(struct im_eventclient *c);
+
+#endif /* IM_EVENTSERVER_H */
@@ -41,6 +41,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <pthread.h>
@@ -50,12 +51,12 @@
 #include <sys/stat.h>
 #include <assert.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <semaphore.h>
 
+#include <sys/time.h>
 #ifdef HAVE_CLOCK_GETTIME
 #include <time.h>
-#else
-#include <sys/time.h>
 #endif
 
 #include "im-sandbox.h"
@@ -63,12 +64,78 @@
 #include "im-zmq.h"
 #include "profile.h"
 #include "im-asapo.h"
+#include "im-checkpoint.h"
+#include "im-eventserver.h"
+#include "im-chunkring.h"
+#include "im-affinity.h"
+
+
+/* Maximum number of events expanded ahead of the shared queue */
+#define EVENT_LOOKAHEAD (4096)
+
+/* Events expanded from the input list by a separate thread in the master, so
+ * that the shared queue can be kept full while a big file is being
+ * looked at.  If 'client' is non-NULL, the events come from an event server
+ * instead of the input list. */
+struct event_lookahead
+{
+	struct get_pattern_ctx *gpctx;
+	struct im_eventclient *client;
+	struct sandbox *sb;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_full;
+	char *filenames[EVENT_LOOKAHEAD];
+	char *events[EVENT_LOOKAHEAD];
+	int first;
+	int n;
+	int max_n;
+	int finished;  /* End of input list reached */
+	int stop;
+
+	/* Held while the input list is being expanded (which might involve
+	 * HDF5 calls), so that worker processes are not forked in the
+	 * middle of it */
+	pthread_mutex_t expand_lock;
+};
+
+
+/* Latency histogram bins are a quarter of a factor of two wide, starting at
+ * 0.1 ms, so the last one starts at about 100 s */
+#define LATENCY_NBINS (80)
+#define LATENCY_BIN0 (1e-4)
+
+enum latency_stage
+{
+	LATENCY_FETCH,
+	LATENCY_DECODE,
+	LATENCY_PEAKSEARCH,
+	LATENCY_INDEXING,
+	LATENCY_INTEGRATION,
+	LATENCY_FLUSH,
+	LATENCY_TOTAL,
+	NUM_LATENCY_STAGES
+};
+
+static const char *latency_stage_names[NUM_LATENCY_STAGES] = {
+	"fetch", "decode", "peaksearch", "indexing",
+	"integration", "flush", "total"
+};
+
+struct latency_histogram
+{
+	int n;
+	int bins[LATENCY_NBINS];
+	double max;
+};
 
 
 struct sandbox
 {
 	int n_processed_last_stats;
 	double t_last_stats;
+	double t_waiting_last_stats;
 
 	/* Processing timeout in seconds.  After this long without responding
 	 * to a ping, the worker will be killed.  After 3 times this long
@@ -86,10 +153,16 @@ struct sandbox
 	int last_ping[MAX_NUM_WORKERS];
 	int profile;  /* Whether to do wall-clock time profiling */
 
-	/* Streams to read from (NB not the same indices as the above) */
+	/* Chunk buffers to read from, and the pipes which tell us when there
+	 * is something in them (NB not the same indices as the above) */
 	int n_read;
-	FILE **fhs;
+	struct im_chunkring **rings;
 	int *fds;
+	int *closed;  /* Pipe closed, but chunks might still be waiting */
+
+	/* If non-NULL, a chunk from this buffer has been partly written to
+	 * the stream, and nothing else can be written until it's finished */
+	struct im_chunkring *stream_owner;
 
 	int serial;
 
@@ -106,6 +179,36 @@ struct sandbox
 
 	/* Final output */
 	Stream *stream;
+
+	/* If non-NULL, events are coming from a list of files */
+	struct event_lookahead *lookahead;
+
+	/* If non-NULL, the list of files is coming from an event server.
+	 * The server numbers the events in the order they're given to us,
+	 * which is also the order of the serial numbers from first_serial. */
+	struct im_eventclient *event_client;
+	int first_serial;
+
+	/* Maximum number of events in the shared queue */
+	int queue_max;
+
+	/* If non-NULL, we are recording completed frames for --resume */
+	struct im_checkpoint *checkpoint;
+	double t_last_checkpoint;
+	int n_skipped;
+
+	/* Maximum number of consecutive events from one file to be given to
+	 * the same worker, or zero to let any worker take any event */
+	int locality_run;
+	char *locality_file;
+	int locality_worker;
+	int locality_count;
+
+	/* If non-NULL, workers are bound to particular CPUs */
+	struct im_affinity *affinity;
+
+	/* Per-stage latencies, if iargs->trace_latency is set */
+	struct latency_histogram latency[NUM_LATENCY_STAGES];
 };
 
 struct get_pattern_ctx
@@ -123,7 +226,7 @@ struct get_pattern_ctx
 
 #ifdef HAVE_CLOCK_GETTIME
 
-static double get_monotonic_seconds()
+double get_monotonic_seconds(void)
 {
 	struct timespec tp;
 	clock_gettime(CLOCK_MONOTONIC, &tp);
@@ -135,7 +238,7 @@ static double get_monotonic_seconds()
 /* Fallback version of the above.  The time according to gettimeofday() is not
  * monotonic, so measuring intervals based on it will screw up if there's a
  * timezone change (e.g. daylight savings) while the program is running. */
-static double get_monotonic_seconds()
+double get_monotonic_seconds(void)
 {
 	struct timeval tp;
 	gettimeofday(&tp, NULL);
@@ -145,6 +248,15 @@ static double get_monotonic_seconds()
 #endif
 
 
+/* Wall-clock time, for comparison with timestamps from elsewhere */
+static double get_realtime_seconds(void)
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+
 static void stamp_response(struct sandbox *sb, int n)
 {
 	sb->last_response[n] = get_monotonic_seconds();
@@ -306,17 +418,75 @@ static int get_pattern(struct get_pattern_ctx *gpctx,
 }
 
 
-static void shuffle_events(struct sb_shm *sb_shared)
+static void shuffle_events(struct sb_shm *sb_shared, int qi)
 {
 	int i;
 
-	for ( i=1; i<sb_shared->n_events; i++ ) {
+	for ( i=qi+1; i<sb_shared->n_events; i++ ) {
 		memcpy(sb_shared->queue[i-1], sb_shared->queue[i], MAX_EV_LEN);
+		sb_shared->queue_owner[i-1] = sb_shared->queue_owner[i];
 	}
 	sb_shared->n_events--;
 }
 
 
+/* Choose the queue entry for worker 'cookie' to process next: the first one
+ * assigned to this worker, or any unassigned one, whichever comes first.
+ * If there is none, steal the last entry of the worker with the most
+ * entries, so that the victim can carry on with the first part of its run.
+ * Call under queue_lock, with at least one event in the queue. */
+static int pick_event(struct sb_shm *sb_shared, int cookie, int *pstolen)
+{
+	int i;
+	int n_owned[MAX_NUM_WORKERS];
+	int victim = -1;
+
+	*pstolen = 0;
+
+	for ( i=0; i<sb_shared->n_events; i++ ) {
+		int owner = sb_shared->queue_owner[i];
+		if ( (owner == cookie) || (owner < 0) ) return i;
+	}
+
+	memset(n_owned, 0, sizeof(n_owned));
+	for ( i=0; i<sb_shared->n_events; i++ ) {
+		int owner = sb_shared->queue_owner[i];
+		n_owned[owner]++;
+		if ( (victim < 0) || (n_owned[owner] > n_owned[victim]) ) {
+			victim = owner;
+		}
+	}
+
+	for ( i=sb_shared->n_events-1; i>=0; i-- ) {
+		if ( sb_shared->queue_owner[i] == victim ) {
+			*pstolen = 1;
+			return i;
+		}
+	}
+
+	return 0;  /* Not reached */
+}
+
+
+/* Returns non-zero if the queue entries (in the format "filename event serial")
+ * refer to the same file */
+static int same_file(const char *ev1, const char *ev2)
+{
+	const char *sp1 = strrchr(ev1, ' ');
+	const char *sp2 = strrchr(ev2, ' ');
+	size_t l1, l2;
+
+	if ( (sp1 == NULL) || (sp2 == NULL) ) return 0;
+
+	/* Skip back over the event ID as well */
+	for ( l1=sp1-ev1; l1>0 && ev1[l1-1]!=' '; l1-- );
+	for ( l2=sp2-ev2; l2>0 && ev2[l2-1]!=' '; l2-- );
+	if ( (l1 == 0) || (l2 == 0) || (l1 != l2) ) return 0;
+
+	return strncmp(ev1, ev2, l1) == 0;
+}
+
+
 void set_last_task(char *lt, const char *task)
 {
 	if ( lt == NULL ) return;
@@ -326,11 +496,19 @@ void set_last_task(char *lt, const char *task)
 
 
 static int run_work(const struct index_args *iargs, Stream *st,
-                    int cookie, const char *tmpdir, struct sandbox *sb)
+                    struct im_chunkring *ring, int cookie, const char *tmpdir,
+                    struct sandbox *sb)
 {
 	int allDone = 0;
 	struct im_zmq *zmqstuff = NULL;
 	struct im_asapo *asapostuff = NULL;
+	int n_dropped = 0;
+	int catch_up;
+	struct worker_stats *stats = &sb->shared->stats[cookie];
+
+	/* Drop frames which are too old already? */
+	catch_up = (iargs->latency_budget > 0.0)
+	        && (iargs->late_frames == LATE_FRAMES_DROP);
 
 	if ( sb->profile ) {
 		profile_init();
@@ -364,15 +542,22 @@ static int run_work(const struct index_args *iargs, Stream *st,
 		char *event_str = NULL;
 		char *ser_str = NULL;
 		int ok = 1;
+		int qi, stolen;
+		double t_wait;
+		double age = 0.0;
+		int n_skipped = 0;
 
 		/* Wait until an event is ready */
 		sb->shared->pings[cookie]++;
 		set_last_task(sb->shared->last_task[cookie], "wait_event");
 		profile_start("wait-queue-semaphore");
+		t_wait = get_monotonic_seconds();
 		if ( sem_wait(sb->queue_sem) != 0 ) {
 			ERROR("Failed to wait on queue semaphore: %s\n",
 			      strerror(errno));
 		}
+		stats->time_in_stage[STAGE_WAIT] += get_monotonic_seconds()
+		                                    - t_wait;
 		profile_end("wait-queue-semaphore");
 
 		/* Get the event from the queue */
@@ -396,7 +581,8 @@ static int run_work(const struct index_args *iargs, Stream *st,
 			continue;
 		}
 
-		line = strdup(sb->shared->queue[0]);
+		qi = pick_event(sb->shared, cookie, &stolen);
+		line = strdup(sb->shared->queue[qi]);
 
 		len = strlen(line);
 		assert(len > 1);
@@ -425,12 +611,20 @@ static int run_work(const struct index_args *iargs, Stream *st,
 		}
 		if ( !ok ) {
 			STATUS("Invalid event string '%s'\n",
-			       sb->shared->queue[0]);
+			       sb->shared->queue[qi]);
 			ok = 0;
 		}
-		memcpy(sb->shared->last_ev[cookie], sb->shared->queue[0],
+		if ( same_file(sb->shared->last_ev[cookie],
+		               sb->shared->queue[qi]) )
+		{
+			stats->n_same_file++;
+		} else {
+			stats->n_new_file++;
+		}
+		if ( stolen ) stats->n_stolen++;
+		memcpy(sb->shared->last_ev[cookie], sb->shared->queue[qi],
 		       MAX_EV_LEN);
-		shuffle_events(sb->shared);
+		shuffle_events(sb->shared, qi);
 		pthread_mutex_unlock(&sb->shared->queue_lock);
 
 		if ( !ok ) continue;
@@ -447,13 +641,16 @@ static int run_work(const struct index_args *iargs, Stream *st,
 		pargs.asapo_data = NULL;
 		pargs.asapo_data_size = 0;
 		pargs.asapo_meta = NULL;
+		pargs.ring = ring;
+		pargs.t_fetch_start = get_monotonic_seconds();
 
 		if ( sb->zmq_params != NULL ) {
 
 			profile_start("zmq-fetch");
 			set_last_task(sb->shared->last_task[cookie], "ZMQ fetch");
 			pargs.zmq_data = im_zmq_fetch(zmqstuff,
-			                              &pargs.zmq_data_size);
+			                              &pargs.zmq_data_size,
+			                              catch_up ? &n_skipped : NULL);
 			profile_end("zmq-fetch");
 
 			if ( (pargs.zmq_data != NULL)
@@ -469,6 +666,7 @@ static int run_work(const struct index_args *iargs, Stream *st,
 			char *filename;
 			char *event;
 			int finished = 0;
+			double timestamp;
 
 			profile_start("asapo-fetch");
 			set_last_task(sb->shared->last_task[cookie], "ASAPO fetch");
@@ -477,7 +675,8 @@ static int run_work(const struct index_args *iargs, Stream *st,
 			                                  &pargs.asapo_meta,
 			                                  &filename,
 			                                  &event,
-			                                  &finished);
+			                                  &finished,
+			                                  &timestamp);
 			profile_end("asapo-fetch");
 			if ( pargs.asapo_data != NULL ) {
 				ok = 1;
@@ -489,6 +688,12 @@ static int run_work(const struct index_args *iargs, Stream *st,
 				pargs.filename = filename;
 				pargs.event = event;
 				sb->shared->end_of_stream[cookie] = 0;
+
+				/* How long has the record been waiting? */
+				if ( timestamp > 0.0 ) {
+					age = get_realtime_seconds() - timestamp;
+					if ( age < 0.0 ) age = 0.0;
+				}
 			} else {
 				if ( finished ) {
 					sb->shared->end_of_stream[cookie] = 1;
@@ -498,12 +703,33 @@ static int run_work(const struct index_args *iargs, Stream *st,
 		} else {
 			ok = 1;
 		}
+		pargs.t_fetch_end = get_monotonic_seconds();
+		pargs.t_arrival = pargs.t_fetch_end - age;
+		stats->time_in_stage[STAGE_FETCH] += pargs.t_fetch_end
+		                                     - pargs.t_fetch_start;
+
+		/* Frames skipped over to catch up with the ZMQ stream */
+		if ( n_skipped > 0 ) {
+			stats->n_dropped += n_skipped;
+			n_dropped += n_skipped;
+		}
+
+		if ( ok && catch_up && (age > iargs->latency_budget) ) {
+			free(pargs.zmq_data);
+			free(pargs.asapo_data);
+			free(pargs.asapo_meta);
+			stats->n_dropped++;
+			n_dropped++;
+			ok = 0;
+		}
 
 		if ( ok ) {
-			sb->shared->time_last_start[cookie] = get_monotonic_seconds();
+			sb->shared->time_last_start[cookie] = pargs.t_fetch_end;
 			profile_start("process-image");
+			pargs.n_dropped = n_dropped;
 			process_image(iargs, &pargs, st, cookie, tmpdir, ser,
 			              sb->shared, sb->shared->last_task[cookie]);
+			n_dropped = pargs.n_dropped;
 			profile_end("process-image");
 		}
 
@@ -534,79 +760,277 @@ static ssize_t lwrite(int fd, const char *a)
 }
 
 
-static int pump_chunk(FILE *fh, int ofd)
+static void add_to_histogram(struct latency_histogram *h, double t)
 {
-	int chunk_started = 0;
+	int bin = 0;
 
-	do {
+	if ( t > LATENCY_BIN0 ) bin = floor(4.0*log2(t/LATENCY_BIN0));
+	if ( bin >= LATENCY_NBINS ) bin = LATENCY_NBINS-1;
 
-		char line[1024];
-		char *rval;
+	h->bins[bin]++;
+	h->n++;
+	if ( t > h->max ) h->max = t;
+}
 
-		rval = fgets(line, 1024, fh);
-		if ( rval == NULL ) {
 
-			if ( feof(fh) ) {
-				/* Whoops, connection lost */
-				if ( chunk_started ) {
-					ERROR("EOF during chunk!\n");
-					lwrite(ofd, "Unfinished chunk!\n");
-					lwrite(ofd, STREAM_CHUNK_END_MARKER"\n");
-				} /* else normal end of output */
-				return 1;
-			}
+/* Upper bound of the q-th quantile, in seconds */
+static double histogram_quantile(const struct latency_histogram *h, double q)
+{
+	int i;
+	int total = 0;
 
-			ERROR("fgets() failed: %s\n", strerror(errno));
-			if ( errno != EINTR ) return 1;
+	if ( h->n == 0 ) return NAN;
 
+	for ( i=0; i<LATENCY_NBINS; i++ ) {
+		total += h->bins[i];
+		if ( total >= q*h->n ) {
+			return fmin(LATENCY_BIN0*pow(2.0, (i+1)/4.0), h->max);
 		}
+	}
+	return h->max;
+}
+
 
-		if ( strcmp(line, "FLUSH\n") == 0 ) break;
-		lwrite(ofd, line);
+/* Times: fetch start, fetch end, decoded, peak search, indexed, integrated.
+ * The chunk is being flushed at t_flush. */
+static void add_latency_trace(struct sandbox *sb, const double *t,
+                              double t_flush, char *extra, size_t max)
+{
+	double lat[NUM_LATENCY_STAGES];
+	int i;
 
-		if ( strcmp(line, STREAM_CHUNK_START_MARKER"\n") == 0 ) {
-			chunk_started = 1;
+	lat[LATENCY_FETCH] = t[1] - t[0];
+	lat[LATENCY_DECODE] = t[2] - t[1];
+	lat[LATENCY_PEAKSEARCH] = t[3] - t[2];
+	lat[LATENCY_INDEXING] = t[4] - t[3];
+	lat[LATENCY_INTEGRATION] = t[5] - t[4];
+	lat[LATENCY_FLUSH] = t_flush - t[5];
+	lat[LATENCY_TOTAL] = t_flush - t[0];
+
+	for ( i=0; i<NUM_LATENCY_STAGES; i++ ) {
+		add_to_histogram(&sb->latency[i], lat[i]);
+		if ( sb->iargs->trace_latency > 1 ) {
+			size_t l = strlen(extra);
+			snprintf(extra+l, max-l, "latency_%s = %.3f ms\n",
+			         latency_stage_names[i], lat[i]*1e3);
 		}
-		if ( strcmp(line, STREAM_CHUNK_END_MARKER"\n") == 0 ) break;
+	}
+}
 
-	} while ( 1 );
+
+/* Maximum length of the lines added by the master to each chunk */
+#define MAX_EXTRA_LEN (512)
+
+/* Lines to be added just before the end of the chunk */
+static void chunk_extras(struct sandbox *sb, const struct chunk_info *info,
+                         double t_flush, char *extra)
+{
+	extra[0] = '\0';
+
+	if ( info->n_dropped > 0 ) {
+		snprintf(extra, MAX_EXTRA_LEN,
+		         "frames_dropped_since_last = %i\n", info->n_dropped);
+	}
+
+	if ( info->degraded ) {
+		size_t l = strlen(extra);
+		snprintf(extra+l, MAX_EXTRA_LEN-l,
+		         "latency_budget_exceeded = 1\n");
+	}
+
+	if ( info->have_trace ) {
+		add_latency_trace(sb, info->trace, t_flush, extra,
+		                  MAX_EXTRA_LEN);
+	}
+}
+
+
+/* Whether the 'n' parts in 'iov' end with the chunk end marker */
+static int ends_with_marker(const struct iovec *iov, int n)
+{
+	const char *marker = STREAM_CHUNK_END_MARKER"\n";
+	size_t k = strlen(marker);
+	size_t total = 0;
+	size_t skip, pos;
+	char tmp[64];
+	int i;
+
+	for ( i=0; i<n; i++ ) total += iov[i].iov_len;
+	if ( total < k ) return 0;
+
+	skip = total - k;
+	pos = 0;
+	for ( i=0; i<n; i++ ) {
+		size_t len = iov[i].iov_len;
+		if ( skip >= len ) {
+			skip -= len;
+			continue;
+		}
+		memcpy(tmp+pos, (char *)iov[i].iov_base+skip, len-skip);
+		pos += len-skip;
+		skip = 0;
+	}
+
+	return memcmp(tmp, marker, k) == 0;
+}
+
+
+/* Copies the 'n' parts in 'iov' to 'out', with 'extra' inserted at byte
+ * position 'at'.  Returns the number of parts in 'out', at most n+2 */
+static int insert_iov(const struct iovec *iov, int n, size_t at, char *extra,
+                      struct iovec *out)
+{
+	size_t done = 0;
+	int inserted = 0;
+	int i;
+	int j = 0;
+
+	for ( i=0; i<n; i++ ) {
+		size_t len = iov[i].iov_len;
+		if ( !inserted && (at < done+len) ) {
+			size_t a = at - done;
+			if ( a > 0 ) {
+				out[j].iov_base = iov[i].iov_base;
+				out[j++].iov_len = a;
+			}
+			out[j].iov_base = extra;
+			out[j++].iov_len = strlen(extra);
+			out[j].iov_base = (char *)iov[i].iov_base + a;
+			out[j++].iov_len = len - a;
+			inserted = 1;
+		} else {
+			out[j++] = iov[i];
+		}
+		done += len;
+	}
+
+	if ( !inserted ) {
+		out[j].iov_base = extra;
+		out[j++].iov_len = strlen(extra);
+	}
+
+	return j;
+}
+
+
+static int write_iovs(int ofd, struct iovec *iov, int n_iov)
+{
+	long iov_max = sysconf(_SC_IOV_MAX);
+
+	if ( iov_max <= 0 ) iov_max = 16;
+
+	while ( n_iov > 0 ) {
+
+		ssize_t r;
+
+		r = writev(ofd, iov, (n_iov > iov_max) ? iov_max : n_iov);
+		if ( r < 0 ) {
+			if ( errno == EINTR ) continue;
+			ERROR("Failed to write stream: %s\n", strerror(errno));
+			return 1;
+		}
+
+		/* Skip over whatever was written */
+		while ( (n_iov > 0) && ((size_t)r >= iov[0].iov_len) ) {
+			r -= iov[0].iov_len;
+			iov++;
+			n_iov--;
+		}
+		if ( n_iov > 0 ) {
+			iov[0].iov_base = (char *)iov[0].iov_base + r;
+			iov[0].iov_len -= r;
+		}
+
+	}
 	return 0;
 }
 
 
-/* Add an fd to the list of pipes to be read from */
-static void add_pipe(struct sandbox *sb, int fd)
+/* Adds the records for a chunk to the cell list, if there is one.  This is
+ * done here rather than in the worker, so that the cell list only contains
+ * chunks which are completely in the stream. */
+static void write_cells(struct sandbox *sb, const struct chunk_info *info)
 {
-	int *fds_new;
-	FILE **fhs_new;
-	int slot;
+	int fd = sb->iargs->cell_list_fd;
 
-	fds_new = realloc(sb->fds, (sb->n_read+1)*sizeof(int));
-	if ( fds_new == NULL ) {
-		ERROR("Failed to allocate memory for new pipe.\n");
+	if ( (fd < 0) || (info->n_cells == 0) ) return;
+
+	if ( info->n_cells < 0 ) {
+		ERROR("Too many crystals in one frame for the cell list.\n");
+	} else if ( stream_cells_write(fd, info->cells, info->n_cells) ) {
+		ERROR("Failed to write cell list: %s\n", strerror(errno));
+	} else {
 		return;
 	}
 
-	fhs_new = realloc(sb->fhs, (sb->n_read+1)*sizeof(FILE *));
-	if ( fhs_new == NULL ) {
-		ERROR("Failed to allocate memory for new FH.\n");
-		free(fds_new);
-		return;
+	/* Leave it incomplete, so that it won't be used */
+	ERROR("The cell list will not be completed.\n");
+	close(fd);
+	sb->iargs->cell_list_fd = -1;
+}
+
+
+/* Writes whatever is waiting in the chunk buffer, in one go, and releases
+ * the space.  Returns the number of pieces written.  '*ppartial' will be
+ * set if the last piece was not the end of a chunk. */
+static int write_chunks(struct sandbox *sb, struct im_chunkring *ring,
+                        int ofd, int *ppartial)
+{
+	struct iovec iov[CHUNK_RING_SLOTS*4];
+	char extra[CHUNK_RING_SLOTS][MAX_EXTRA_LEN];
+	int serials[CHUNK_RING_SLOTS];
+	struct chunk_desc desc;
+	struct iovec parts[2];
+	double t_flush;
+	int n = 0;
+	int n_iov = 0;
+	int n_chunks = 0;
+	int np;
+	int i;
+
+	t_flush = get_monotonic_seconds();
+
+	while ( (n < CHUNK_RING_SLOTS)
+	     && (np = im_chunkring_peek(ring, n, &desc, parts)) )
+	{
+		n++;
+		*ppartial = desc.partial;
+
+		if ( !desc.partial ) {
+			write_cells(sb, &desc.info);
+			chunk_extras(sb, &desc.info, t_flush, extra[n_chunks]);
+			serials[n_chunks] = desc.info.serial;
+			if ( (extra[n_chunks][0] != '\0')
+			  && ends_with_marker(parts, np) )
+			{
+				size_t at = desc.len
+				          - strlen(STREAM_CHUNK_END_MARKER"\n");
+				n_iov += insert_iov(parts, np, at,
+				                    extra[n_chunks],
+				                    &iov[n_iov]);
+				n_chunks++;
+				continue;
+			}
+			n_chunks++;
+		}
+
+		for ( i=0; i<np; i++ ) iov[n_iov++] = parts[i];
 	}
 
-	sb->fds = fds_new;
-	sb->fhs = fhs_new;
-	slot = sb->n_read;
+	if ( n == 0 ) return 0;
 
-	sb->fds[slot] = fd;
+	write_iovs(ofd, iov, n_iov);
+	im_chunkring_release(ring, n);
 
-	sb->fhs[slot] = fdopen(fd, "r");
-	if ( sb->fhs[slot] == NULL ) {
-		ERROR("Couldn't fdopen() stream!\n");
-		return;
+	for ( i=0; i<n_chunks; i++ ) {
+		im_checkpoint_chunk_done(sb->checkpoint, serials[i], ofd);
+		if ( sb->event_client != NULL ) {
+			im_eventclient_done(sb->event_client,
+			                    serials[i] - sb->first_serial);
+		}
 	}
 
-	sb->n_read++;
+	return n;
 }
 
 
@@ -614,12 +1038,14 @@ static void remove_pipe(struct sandbox *sb, int d)
 {
 	int i;
 
-	fclose(sb->fhs[d]);
+	close(sb->fds[d]);
+	im_chunkring_free(sb->rings[d]);
 
 	for ( i=d; i<sb->n_read; i++ ) {
 		if ( i < sb->n_read-1 ) {
 			sb->fds[i] = sb->fds[i+1];
-			sb->fhs[i] = sb->fhs[i+1];
+			sb->rings[i] = sb->rings[i+1];
+			sb->closed[i] = sb->closed[i+1];
 		} /* else don't bother */
 	}
 
@@ -629,6 +1055,103 @@ static void remove_pipe(struct sandbox *sb, int d)
 }
 
 
+/* Writes the chunks from pipe number 'd'.  Returns non-zero if the worker
+ * has gone away and all of its chunks have been written.
+ * If another worker's chunk is half written, nothing is done, and the chunks
+ * will be written on a later call.  The master must not wait here for the
+ * rest of a half-written chunk, because that would hold up everything else. */
+static int pump_chunks(struct sandbox *sb, int d, int ofd)
+{
+	struct im_chunkring *ring = sb->rings[d];
+	int partial;
+
+	if ( (sb->stream_owner != NULL) && (sb->stream_owner != ring) ) {
+		return 0;
+	}
+
+	partial = (sb->stream_owner == ring);
+	while ( write_chunks(sb, ring, ofd, &partial) > 0 );
+
+	if ( !partial ) {
+		sb->stream_owner = NULL;
+		return sb->closed[d];
+	}
+
+	if ( !sb->closed[d] ) {
+		/* Come back for the rest later */
+		sb->stream_owner = ring;
+		return 0;
+	}
+
+	/* Whoops, connection lost */
+	ERROR("EOF during chunk!\n");
+	lwrite(ofd, "Unfinished chunk!\n");
+	lwrite(ofd, STREAM_CHUNK_END_MARKER"\n");
+	sb->stream_owner = NULL;
+	return 1;
+}
+
+
+/* Writes everything which can be written from all the chunk buffers, starting
+ * with the one which has a half-written chunk, if any.  Removes the pipes of
+ * workers which have gone away, once everything has been written. */
+static void pump_all_chunks(struct sandbox *sb, int ofd)
+{
+	int i;
+
+	for ( i=0; i<sb->n_read; i++ ) {
+		if ( sb->rings[i] != sb->stream_owner ) continue;
+		if ( pump_chunks(sb, i, ofd) ) remove_pipe(sb, i);
+		break;
+	}
+
+	for ( i=0; i<sb->n_read; i++ ) {
+		if ( pump_chunks(sb, i, ofd) ) {
+			remove_pipe(sb, i);
+			i--;
+		}
+	}
+}
+
+
+/* Add an fd to the list of pipes to be read from */
+static void add_pipe(struct sandbox *sb, int fd, struct im_chunkring *ring)
+{
+	int *fds_new;
+	struct im_chunkring **rings_new;
+	int *closed_new;
+	int slot;
+
+	fds_new = realloc(sb->fds, (sb->n_read+1)*sizeof(int));
+	if ( fds_new == NULL ) {
+		ERROR("Failed to allocate memory for new pipe.\n");
+		return;
+	}
+	sb->fds = fds_new;
+
+	rings_new = realloc(sb->rings,
+	                    (sb->n_read+1)*sizeof(struct im_chunkring *));
+	if ( rings_new == NULL ) {
+		ERROR("Failed to allocate memory for new chunk buffer.\n");
+		return;
+	}
+	sb->rings = rings_new;
+
+	closed_new = realloc(sb->closed, (sb->n_read+1)*sizeof(int));
+	if ( closed_new == NULL ) {
+		ERROR("Failed to allocate memory for new pipe.\n");
+		return;
+	}
+	sb->closed = closed_new;
+
+	slot = sb->n_read;
+	sb->fds[slot] = fd;
+	sb->rings[slot] = ring;
+	sb->closed[slot] = 0;
+	sb->n_read++;
+}
+
+
 static void try_read(struct sandbox *sb)
 {
 	int r, i;
@@ -646,6 +1169,7 @@ static void try_read(struct sandbox *sb)
 
 		int fd;
 
+		if ( sb->closed[i] ) continue;
 		fd = sb->fds[i];
 
 		FD_SET(fd, &fds);
@@ -662,19 +1186,28 @@ static void try_read(struct sandbox *sb)
 		return;
 	}
 
+	/* Clear the doorbells.  The chunks were added to the buffers before
+	 * the corresponding bytes were written to the pipes. */
 	for ( i=0; i<sb->n_read; i++ ) {
 
-		if ( !FD_ISSET(sb->fds[i], &fds) ) {
+		char buf[256];
+		ssize_t n;
+
+		if ( sb->closed[i] || !FD_ISSET(sb->fds[i], &fds) ) {
 			continue;
 		}
 
-		/* If the chunk cannot be read, assume the connection
-		 * is broken and that the process will die soon. */
-		if ( pump_chunk(sb->fhs[i], ofd) ) {
-			remove_pipe(sb, i);
+		/* If the pipe is closed, the worker has finished or died */
+		n = read(sb->fds[i], buf, 256);
+		if ( n == 0 ) sb->closed[i] = 1;
+		if ( (n < 0) && (errno != EINTR) ) {
+			ERROR("read() failed: %s\n", strerror(errno));
+			sb->closed[i] = 1;
 		}
 
 	}
+
+	pump_all_chunks(sb, ofd);
 }
 
 
@@ -682,12 +1215,23 @@ static void start_worker_process(struct sandbox *sb, int slot)
 {
 	pid_t p;
 	int stream_pipe[2];
+	struct im_chunkring *ring;
+
+	ring = im_chunkring_new();
+	if ( ring == NULL ) return;
 
 	if ( pipe(stream_pipe) == - 1 ) {
 		ERROR("pipe() failed!\n");
+		im_chunkring_free(ring);
 		return;
 	}
 
+	/* Don't fork while the lookahead thread is in the middle of
+	 * anything complicated */
+	if ( sb->lookahead != NULL ) {
+		pthread_mutex_lock(&sb->lookahead->expand_lock);
+	}
+
 	pthread_mutex_lock(&sb->shared->queue_lock);
 	sb->shared->pings[slot] = 0;
 	sb->shared->end_of_stream[slot] = 0;
@@ -699,12 +1243,17 @@ static void start_worker_process(struct sandbox *sb, int slot)
 	p = fork();
 	if ( p == -1 ) {
 		ERROR("fork() failed!\n");
+		if ( sb->lookahead != NULL ) {
+			pthread_mutex_unlock(&sb->lookahead->expand_lock);
+		}
+		im_chunkring_free(ring);
 		return;
 	}
 
 	if ( p == 0 ) {
 
 		Stream *st;
+		FILE *fh;
 		struct sigaction sa;
 		int r;
 		char *tmp;
@@ -739,6 +1288,9 @@ static void start_worker_process(struct sandbox *sb, int slot)
 			exit(1);
 	        }
 
+		/* Move to the right CPUs before allocating anything */
+		im_affinity_apply(sb->affinity, slot);
+
 		ll = 64 + strlen(sb->tmpdir);
 		tmp = malloc(ll);
 		if ( tmp == NULL ) {
@@ -765,10 +1317,13 @@ static void start_worker_process(struct sandbox *sb, int slot)
 		/* Free resources which will not be needed by worker */
 		free(sb->pids);
 		for ( i=0; i<sb->n_read; i++ ) {
-			fclose(sb->fhs[i]);
+			close(sb->fds[i]);
+			im_chunkring_free(sb->rings[i]);
 		}
-		free(sb->fhs);
+		free(sb->rings);
 		free(sb->fds);
+		free(sb->closed);
+		close(stream_pipe[0]);
 		free(sb->running);
 		/* Not freed because it's not worth passing them down just for
 		 * this purpose: event list file handle,
@@ -777,9 +1332,13 @@ static void start_worker_process(struct sandbox *sb, int slot)
 		 *               prefix
 		 */
 
-		st = stream_open_fd_for_write(stream_pipe[1], sb->iargs->dtempl);
-		r = run_work(sb->iargs, st, slot, tmp, sb);
+		fh = im_chunkring_open_writer(ring, stream_pipe[1]);
+		if ( fh == NULL ) exit(1);
+		st = stream_open_fh_for_write(fh, sb->iargs->dtempl);
+		if ( st == NULL ) exit(1);
+		r = run_work(sb->iargs, st, ring, slot, tmp, sb);
 		stream_close(st);
+		im_chunkring_free(ring);
 
 		free(tmp);
 
@@ -791,12 +1350,16 @@ static void start_worker_process(struct sandbox *sb, int slot)
 
 	}
 
+	if ( sb->lookahead != NULL ) {
+		pthread_mutex_unlock(&sb->lookahead->expand_lock);
+	}
+
 	/* Parent process gets the 'write' end of the filename pipe
 	 * and the 'read' end of the result pipe. */
 	sb->pids[slot] = p;
 	sb->running[slot] = 1;
 	stamp_response(sb, slot);
-	add_pipe(sb, stream_pipe[0]);
+	add_pipe(sb, stream_pipe[0], ring);
 	close(stream_pipe[1]);
 }
 
@@ -900,12 +1463,76 @@ static int setup_shm(struct sandbox *sb)
 
 
 /* Assumes the caller is already holding queue_lock! */
-static int fill_queue(struct get_pattern_ctx *gpctx, struct sandbox *sb)
+static int least_loaded_worker(struct sandbox *sb)
 {
-	while ( sb->shared->n_events < QUEUE_SIZE ) {
+	int n_owned[MAX_NUM_WORKERS];
+	int i;
+	int best = -1;
+
+	memset(n_owned, 0, sizeof(n_owned));
+	for ( i=0; i<sb->shared->n_events; i++ ) {
+		int owner = sb->shared->queue_owner[i];
+		if ( owner >= 0 ) n_owned[owner]++;
+	}
+
+	/* Start looking after the previous worker, to spread ties around */
+	for ( i=1; i<=sb->n_proc; i++ ) {
+		int w = (sb->locality_worker + i) % sb->n_proc;
+		if ( (best < 0) || (n_owned[w] < n_owned[best]) ) best = w;
+	}
+
+	return best;
+}
+
+
+/* Assumes the caller is already holding queue_lock! */
+static int locality_owner(struct sandbox *sb, const char *filename)
+{
+	if ( (sb->locality_file == NULL)
+	  || (strcmp(sb->locality_file, filename) != 0)
+	  || (sb->locality_count >= sb->locality_run) )
+	{
+		sb->locality_worker = least_loaded_worker(sb);
+		free(sb->locality_file);
+		sb->locality_file = strdup(filename);
+		sb->locality_count = 0;
+	}
+
+	sb->locality_count++;
+	return sb->locality_worker;
+}
+
+
+/* Returns 0 if no event is ready, in which case *pfinished will be set
+ * non-zero if no more events will come */
+static int take_lookahead(struct event_lookahead *la, char **pfilename,
+                          char **pevent, int *pfinished)
+{
+	pthread_mutex_lock(&la->lock);
+	if ( la->n == 0 ) {
+		*pfinished = la->finished;
+		pthread_mutex_unlock(&la->lock);
+		return 0;
+	}
+	*pfilename = la->filenames[la->first];
+	*pevent = la->events[la->first];
+	la->first = (la->first + 1) % EVENT_LOOKAHEAD;
+	la->n--;
+	pthread_cond_signal(&la->not_full);
+	pthread_mutex_unlock(&la->lock);
+	return 1;
+}
+
+
+/* Assumes the caller is already holding queue_lock!
+ * Returns non-zero if there will be no more events. */
+static int fill_queue(struct sandbox *sb)
+{
+	while ( sb->shared->n_events < sb->queue_max ) {
 
 		char *filename;
 		char *evstr;
+		int owner = -1;
 
 		if ( sb->zmq_params != NULL ) {
 			/* These are just semi-meaningful placeholder values to
@@ -922,19 +1549,212 @@ static int fill_queue(struct get_pattern_ctx *gpctx, struct sandbox *sb)
 			evstr = malloc(64);
 			snprintf(evstr, 64, "//%i", sb->serial);
 		} else {
-			if ( !get_pattern(gpctx, &filename, &evstr) ) return 1;
+			int finished;
+			if ( !take_lookahead(sb->lookahead, &filename, &evstr,
+			                     &finished) ) return finished;
+
+			/* Already in the stream from a previous run? */
+			if ( im_checkpoint_is_done(sb->checkpoint, sb->serial) ) {
+				sb->serial++;
+				sb->n_skipped++;
+				free(filename);
+				free(evstr);
+				continue;
+			}
+
+			if ( sb->locality_run > 0 ) {
+				owner = locality_owner(sb, filename);
+			}
 		}
 
 		memset(sb->shared->queue[sb->shared->n_events], 0, MAX_EV_LEN);
+		sb->shared->queue_owner[sb->shared->n_events] = owner;
 		snprintf(sb->shared->queue[sb->shared->n_events++], MAX_EV_LEN,
 		         "%s %s %i", filename, evstr, sb->serial++);
 		sem_post(sb->queue_sem);
 		free(evstr);
+		if ( sb->lookahead != NULL ) free(filename);
 
 	}
 	return 0;
 }
 
+
+static void *lookahead_thread(void *pv)
+{
+	struct event_lookahead *la = pv;
+	sigset_t sigs;
+
+	/* Leave signal handling to the main thread */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGQUIT);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	do {
+
+		char *filename;
+		char *evstr;
+		int r, slot;
+
+		pthread_mutex_lock(&la->lock);
+		while ( (la->n == la->max_n) && !la->stop ) {
+			pthread_cond_wait(&la->not_full, &la->lock);
+		}
+		if ( la->stop ) {
+			pthread_mutex_unlock(&la->lock);
+			break;
+		}
+		pthread_mutex_unlock(&la->lock);
+
+		if ( la->client != NULL ) {
+			r = im_eventclient_next(la->client, &filename, &evstr);
+		} else {
+			pthread_mutex_lock(&la->expand_lock);
+			r = get_pattern(la->gpctx, &filename, &evstr);
+			pthread_mutex_unlock(&la->expand_lock);
+		}
+
+		pthread_mutex_lock(&la->lock);
+		if ( !r ) {
+			la->finished = 1;
+			pthread_mutex_unlock(&la->lock);
+			break;
+		}
+
+		/* The filename belongs to the get_pattern_ctx if the events
+		 * came from expanding it, otherwise it's ours */
+		if ( filename == la->gpctx->filename ) {
+			filename = strdup(filename);
+		}
+
+		slot = (la->first + la->n) % EVENT_LOOKAHEAD;
+		la->filenames[slot] = filename;
+		la->events[slot] = evstr;
+		la->n++;
+		pthread_mutex_unlock(&la->lock);
+
+		/* Keep the shared queue topped up, in case the main thread is
+		 * busy with something else */
+		pthread_mutex_lock(&la->sb->shared->queue_lock);
+		if ( !la->sb->shared->no_more
+		  && (la->sb->shared->n_events < la->sb->queue_max) )
+		{
+			if ( fill_queue(la->sb) ) la->sb->shared->no_more = 1;
+		}
+		pthread_mutex_unlock(&la->sb->shared->queue_lock);
+
+	} while ( 1 );
+
+	/* Pass on the end of the list */
+	pthread_mutex_lock(&la->sb->shared->queue_lock);
+	if ( !la->sb->shared->no_more ) {
+		if ( fill_queue(la->sb) ) la->sb->shared->no_more = 1;
+	}
+	pthread_mutex_unlock(&la->sb->shared->queue_lock);
+
+	return NULL;
+}
+
+
+static struct event_lookahead *start_lookahead(struct sandbox *sb,
+                                               struct get_pattern_ctx *gpctx,
+                                               struct im_eventclient *client,
+                                               int max_n)
+{
+	struct event_lookahead *la;
+
+	la = calloc(1, sizeof(struct event_lookahead));
+	if ( la == NULL ) return NULL;
+
+	la->gpctx = gpctx;
+	la->client = client;
+	la->sb = sb;
+	la->first = 0;
+	la->n = 0;
+	la->max_n = max_n;
+	la->finished = 0;
+	la->stop = 0;
+	pthread_mutex_init(&la->lock, NULL);
+	pthread_mutex_init(&la->expand_lock, NULL);
+	pthread_cond_init(&la->not_full, NULL);
+
+	if ( pthread_create(&la->thread, NULL, lookahead_thread, la) ) {
+		ERROR("Failed to start event list thread.\n");
+		free(la);
+		return NULL;
+	}
+
+	return la;
+}
+
+
+static void stop_lookahead(struct event_lookahead *la)
+{
+	int i;
+
+	if ( la == NULL ) return;
+
+	pthread_mutex_lock(&la->lock);
+	la->stop = 1;
+	pthread_cond_signal(&la->not_full);
+	pthread_mutex_unlock(&la->lock);
+	im_eventclient_cancel(la->client);
+	pthread_join(la->thread, NULL);
+
+	for ( i=0; i<la->n; i++ ) {
+		int slot = (la->first + i) % EVENT_LOOKAHEAD;
+		free(la->filenames[slot]);
+		free(la->events[slot]);
+	}
+
+	pthread_mutex_destroy(&la->lock);
+	pthread_mutex_destroy(&la->expand_lock);
+	pthread_cond_destroy(&la->not_full);
+	free(la);
+}
+
+
+static int next_event_for_server(void *vp, char **pfilename, char **pevent)
+{
+	struct get_pattern_ctx *gpctx = vp;
+
+	if ( !get_pattern(gpctx, pfilename, pevent) ) return 0;
+
+	/* The event server frees the filename */
+	if ( *pfilename == gpctx->filename ) {
+		*pfilename = strdup(*pfilename);
+	}
+	return 1;
+}
+
+
+/* Expand the input list and hand out the events to other indexamajig
+ * processes (see create_sandbox), instead of processing them here.  Returns
+ * non-zero on error. */
+int serve_events(const char *address, FILE *fh, const DataTemplate *dtempl,
+                 int config_basename, const char *prefix)
+{
+	struct get_pattern_ctx gpctx;
+	int r;
+
+	gpctx.fh = fh;
+	gpctx.use_basename = config_basename;
+	gpctx.dtempl = dtempl;
+	gpctx.prefix = prefix;
+	gpctx.filename = NULL;
+	gpctx.events = NULL;
+	gpctx.event_index = 0;
+
+	r = im_eventserver_run(address, next_event_for_server, &gpctx);
+
+	free(gpctx.filename);
+	free(gpctx.events);
+	return r;
+}
+
 volatile sig_atomic_t at_zombies = 0;
 volatile sig_atomic_t at_interrupt = 0;
 volatile sig_atomic_t at_shutdown = 0;
@@ -967,6 +1787,7 @@ static void check_signals(struct sandbox *sb, const char *semname_q,
 
 	if ( at_interrupt ) {
 		sem_unlink(semname_q);
+		im_checkpoint_write(sb->checkpoint, stream_get_fd(sb->stream));
 		exit(0);
 	}
 
@@ -980,6 +1801,31 @@ static void check_signals(struct sandbox *sb, const char *semname_q,
 }
 
 
+/* Add up the workers' statistics.  No locking is needed, because each worker
+ * only ever writes to its own part. */
+static void sum_worker_stats(struct sandbox *sb, struct worker_stats *tot)
+{
+	int i, j;
+
+	memset(tot, 0, sizeof(struct worker_stats));
+	for ( i=0; i<sb->n_proc; i++ ) {
+		const struct worker_stats *w = &sb->shared->stats[i];
+		tot->n_processed += w->n_processed;
+		tot->n_hits += w->n_hits;
+		tot->n_hadcrystals += w->n_hadcrystals;
+		tot->n_crystals += w->n_crystals;
+		tot->n_same_file += w->n_same_file;
+		tot->n_new_file += w->n_new_file;
+		tot->n_stolen += w->n_stolen;
+		tot->n_dropped += w->n_dropped;
+		tot->n_degraded += w->n_degraded;
+		for ( j=0; j<NUM_WORKER_STAGES; j++ ) {
+			tot->time_in_stage[j] += w->time_in_stage[j];
+		}
+	}
+}
+
+
 static void try_status(struct sandbox *sb, int final)
 {
 	int r;
@@ -987,40 +1833,120 @@ static void try_status(struct sandbox *sb, int final)
 	double tNow;
 	double time_this;
 	const char *finalstr;
-	char persec[64];
+	char persec[256];
+	struct worker_stats tot;
 
 	tNow = get_monotonic_seconds();
 	time_this = tNow - sb->t_last_stats;
 	if ( !final && (time_this < 5) ) return;
 
-	n_proc_this = sb->shared->n_processed - sb->n_processed_last_stats;
-
+	/* The lock only stops the status line getting mixed up with output
+	 * from the workers.  If it's busy, try again next time round.  At
+	 * the end, all the workers have gone, but one of them might have
+	 * died while holding the lock, so don't wait for it. */
 	r = pthread_mutex_trylock(&sb->shared->term_lock);
-	if ( r ) return; /* No lock -> don't bother */
+	if ( r && !final ) return;
+
+	sum_worker_stats(sb, &tot);
+	n_proc_this = tot.n_processed - sb->n_processed_last_stats;
 
 	if ( final ) {
 		finalstr = "Final: ";
 		persec[0] = '\0';
 	} else {
 		finalstr = "";
-		snprintf(persec, 64, ", %.1f images/sec",
-		         (double)n_proc_this/time_this);
+		snprintf(persec, 256, ", %.1f images/sec, "
+		         "%.0f%% of worker time waiting for input",
+		         (double)n_proc_this/time_this,
+		         100.0*(tot.time_in_stage[STAGE_WAIT]
+		                - sb->t_waiting_last_stats)
+		               / (sb->n_proc*time_this));
+		if ( sb->iargs->latency_budget > 0.0 ) {
+			size_t l = strlen(persec);
+			snprintf(persec+l, 256-l, ", %i dropped and %i not "
+			         "indexed (late)", tot.n_dropped,
+			         tot.n_degraded);
+		}
+		if ( sb->iargs->trace_latency
+		  && (sb->latency[LATENCY_TOTAL].n > 0) )
+		{
+			const struct latency_histogram *h;
+			size_t l = strlen(persec);
+			h = &sb->latency[LATENCY_TOTAL];
+			snprintf(persec+l, 256-l, ", latency median %.0f ms, "
+			         "99%% %.0f ms",
+			         histogram_quantile(h, 0.5)*1e3,
+			         histogram_quantile(h, 0.99)*1e3);
+		}
 	}
 	STATUS("%s%i images processed, %i hits (%.1f%%), "
 	       "%i indexable (%.1f%% of hits, %.1f%% overall), "
 	       "%i crystals%s.\n",
-	       finalstr, sb->shared->n_processed,
-	       sb->shared->n_hits,
-	       100.0 * sb->shared->n_hits / sb->shared->n_processed,
-	       sb->shared->n_hadcrystals,
-	       100.0 * sb->shared->n_hadcrystals / sb->shared->n_hits,
-	       100.0 * sb->shared->n_hadcrystals / sb->shared->n_processed,
-	       sb->shared->n_crystals, persec);
-
-	sb->n_processed_last_stats = sb->shared->n_processed;
+	       finalstr, tot.n_processed,
+	       tot.n_hits,
+	       100.0 * tot.n_hits / tot.n_processed,
+	       tot.n_hadcrystals,
+	       100.0 * tot.n_hadcrystals / tot.n_hits,
+	       100.0 * tot.n_hadcrystals / tot.n_processed,
+	       tot.n_crystals, persec);
+
+	sb->n_processed_last_stats = tot.n_processed;
 	sb->t_last_stats = tNow;
+	sb->t_waiting_last_stats = tot.time_in_stage[STAGE_WAIT];
 
-	pthread_mutex_unlock(&sb->shared->term_lock);
+	if ( r == 0 ) pthread_mutex_unlock(&sb->shared->term_lock);
+}
+
+
+static void show_worker_time(struct sandbox *sb)
+{
+	struct worker_stats tot;
+	double total = 0.0;
+	char line[512];
+	int i;
+	const char *names[NUM_WORKER_STAGES] = {
+		"waiting", "fetching", "decoding", "peak search",
+		"indexing", "integration", "writing stream"
+	};
+
+	sum_worker_stats(sb, &tot);
+	for ( i=0; i<NUM_WORKER_STAGES; i++ ) {
+		total += tot.time_in_stage[i];
+	}
+	if ( total <= 0.0 ) return;
+
+	line[0] = '\0';
+	for ( i=0; i<NUM_WORKER_STAGES; i++ ) {
+		size_t l = strlen(line);
+		snprintf(line+l, 512-l, "%s %.1f%% %s", (i>0)?",":"",
+		         100.0*tot.time_in_stage[i]/total, names[i]);
+	}
+	STATUS("Worker time:%s.\n", line);
+}
+
+
+static void show_latency_report(struct sandbox *sb)
+{
+	int i;
+
+	if ( sb->latency[LATENCY_TOTAL].n == 0 ) {
+		STATUS("No latency traces were received.\n");
+		return;
+	}
+
+	STATUS("Latencies for %i frames (ms):\n",
+	       sb->latency[LATENCY_TOTAL].n);
+	STATUS("%12s %10s %10s %10s %10s\n",
+	       "Stage", "Median", "95%", "99%", "Max");
+	for ( i=0; i<NUM_LATENCY_STAGES; i++ ) {
+		const struct latency_histogram *h = &sb->latency[i];
+		STATUS("%12s %10.1f %10.1f %10.1f %10.1f\n",
+		       latency_stage_names[i],
+		       histogram_quantile(h, 0.5)*1e3,
+		       histogram_quantile(h, 0.95)*1e3,
+		       histogram_quantile(h, 0.99)*1e3,
+		       h->max*1e3);
+	}
 }
 
 
@@ -1139,7 +2065,10 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
                    Stream *stream, const char *tmpdir, int serial_start,
                    struct im_zmq_params *zmq_params,
                    struct im_asapo_params *asapo_params,
-                   int timeout, int profile)
+                   int timeout, int profile,
+                   struct im_checkpoint *checkpoint,
+                   int locality_run, const char *event_server,
+                   int event_batch, struct im_affinity *affinity)
 {
 	int i;
 	struct sandbox *sb;
@@ -1148,6 +2077,7 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	int r;
 	int allDone = 0;
 	struct get_pattern_ctx gpctx;
+	struct worker_stats tot;
 
 	if ( n_proc > MAX_NUM_WORKERS ) {
 		ERROR("Number of workers (%i) is too large.  Using %i\n",
@@ -1163,9 +2093,12 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 
 	sb->n_processed_last_stats = 0;
 	sb->t_last_stats = get_monotonic_seconds();
+	sb->t_waiting_last_stats = 0.0;
 	sb->n_proc = n_proc;
 	sb->iargs = iargs;
 	sb->serial = serial_start;
+	sb->first_serial = serial_start;
+	sb->queue_max = QUEUE_SIZE;
 	sb->tmpdir = tmpdir;
 	sb->profile = profile;
 	sb->timeout = timeout;
@@ -1189,8 +2122,18 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	}
 
 	sb->fds = NULL;
-	sb->fhs = NULL;
+	sb->rings = NULL;
+	sb->closed = NULL;
+	sb->stream_owner = NULL;
 	sb->stream = stream;
+	sb->checkpoint = checkpoint;
+	sb->t_last_checkpoint = get_monotonic_seconds();
+	sb->n_skipped = 0;
+	sb->locality_run = locality_run;
+	sb->locality_file = NULL;
+	sb->locality_worker = n_proc-1;
+	sb->locality_count = 0;
+	sb->affinity = affinity;
 
 	gpctx.fh = fh;
 	gpctx.use_basename = config_basename;
@@ -1206,10 +2149,6 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 		return 0;
 	}
 
-	sb->shared->n_processed = 0;
-	sb->shared->n_hits = 0;
-	sb->shared->n_hadcrystals = 0;
-	sb->shared->n_crystals = 0;
 	sb->shared->should_shutdown = 0;
 
 	/* Set up semaphore to control work queue */
@@ -1231,10 +2170,15 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 		return 0;
 	}
 
-	/* Fill the queue */
+	/* Fill the queue.  Events from a file list will be added by the
+	 * lookahead thread, once the workers have been started */
 	pthread_mutex_lock(&sb->shared->queue_lock);
 	sb->shared->n_events = 0;
-	sb->shared->no_more = fill_queue(&gpctx, sb);
+	if ( (sb->zmq_params != NULL) || (sb->asapo_params != NULL) ) {
+		sb->shared->no_more = fill_queue(sb);
+	} else {
+		sb->shared->no_more = 0;
+	}
 	pthread_mutex_unlock(&sb->shared->queue_lock);
 
 	/* Fork the right number of times */
@@ -1242,6 +2186,30 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 		start_worker_process(sb, i);
 	}
 
+	if ( (sb->zmq_params == NULL) && (sb->asapo_params == NULL) ) {
+
+		int max_n = EVENT_LOOKAHEAD;
+
+		if ( event_server != NULL ) {
+			sb->event_client = im_eventclient_connect(event_server,
+			                                          event_batch);
+			if ( sb->event_client == NULL ) return 0;
+
+			/* Don't take more events than needed to keep the
+			 * workers busy, so that the other nodes get a share */
+			if ( event_batch < max_n ) max_n = event_batch;
+			sb->queue_max = (event_batch > n_proc) ? event_batch
+			                                       : n_proc;
+			if ( sb->queue_max > QUEUE_SIZE ) {
+				sb->queue_max = QUEUE_SIZE;
+			}
+		}
+
+		sb->lookahead = start_lookahead(sb, &gpctx,
+		                                sb->event_client, max_n);
+		if ( sb->lookahead == NULL ) return 0;
+	}
+
 	/* Set up signal handler to take action if any children die */
 	sa.sa_flags = SA_SIGINFO | SA_NOCLDSTOP | SA_RESTART;
 	sigemptyset(&sa.sa_mask);
@@ -1290,14 +2258,26 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 
 		/* Top up the queue if necessary */
 		pthread_mutex_lock(&sb->shared->queue_lock);
-		if ( !sb->shared->no_more && (sb->shared->n_events < QUEUE_SIZE/2) ) {
-			if ( fill_queue(&gpctx, sb) ) sb->shared->no_more = 1;
+		if ( !sb->shared->no_more
+		  && (sb->shared->n_events < (sb->queue_max+1)/2) )
+		{
+			if ( fill_queue(sb) ) sb->shared->no_more = 1;
 		}
 		pthread_mutex_unlock(&sb->shared->queue_lock);
 
 		/* Update progress */
 		try_status(sb, 0);
 
+		/* Record completed frames */
+		if ( (sb->checkpoint != NULL)
+		  && (get_monotonic_seconds() - sb->t_last_checkpoint
+		        > CHECKPOINT_INTERVAL) )
+		{
+			im_checkpoint_write(sb->checkpoint,
+			                    stream_get_fd(sb->stream));
+			sb->t_last_checkpoint = get_monotonic_seconds();
+		}
+
 		/* Begin exit criterion checking */
 		pthread_mutex_lock(&sb->shared->queue_lock);
 
@@ -1319,6 +2299,11 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 
 	} while ( !allDone );
 
+	stop_lookahead(sb->lookahead);
+	sb->lookahead = NULL;
+	free(gpctx.filename);
+	free(gpctx.events);
+
 	if ( fh != NULL ) {
 		fclose(fh);
 	}
@@ -1345,17 +2330,47 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 
 	sem_unlink(semname_q);
 
+	/* Write anything which is left over from the workers */
+	for ( i=0; i<sb->n_read; i++ ) sb->closed[i] = 1;
+	pump_all_chunks(sb, stream_get_fd(sb->stream));
+
+	/* Only now that everything has been reported finished can the
+	 * connection be closed, otherwise the events would get requeued */
+	im_eventclient_free(sb->event_client);
+
 	for ( i=0; i<sb->n_read; i++ ) {
-		fclose(sb->fhs[i]);
+		close(sb->fds[i]);
+		im_chunkring_free(sb->rings[i]);
 	}
-	free(sb->fhs);
+	free(sb->rings);
 	free(sb->fds);
+	free(sb->closed);
 	free(sb->running);
 	free(sb->last_response);
 	free(sb->pids);
 
 	try_status(sb, 1);
-	if ( sb->shared->n_processed == 0 ) r = 5;
+	show_worker_time(sb);
+	if ( iargs->trace_latency ) show_latency_report(sb);
+	sum_worker_stats(sb, &tot);
+	if ( iargs->latency_budget > 0.0 ) {
+		STATUS("Latency budget: %i frames were dropped, and %i hits "
+		       "were not indexed, because they were too old.\n",
+		       tot.n_dropped, tot.n_degraded);
+	}
+	if ( sb->n_skipped > 0 ) {
+		STATUS("%i frames were skipped because they were already "
+		       "processed.\n", sb->n_skipped);
+	}
+	im_checkpoint_write(sb->checkpoint, stream_get_fd(sb->stream));
+	if ( sb->locality_run > 0 ) {
+		STATUS("File locality: %i frames followed one from the same "
+		       "file in the same worker, %i needed a different file "
+		       "(%i taken from other workers' queues).\n",
+		       tot.n_same_file, tot.n_new_file, tot.n_stolen);
+	}
+	free(sb->locality_file);
+	if ( (tot.n_processed == 0) && (sb->n_skipped == 0) ) r = 5;
 	if ( sb->shared->should_shutdown ) r = 1;
 
 	delete_temporary_folder(sb->tmpdir, n_proc);
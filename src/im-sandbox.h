@@ -44,6 +44,8 @@ struct sb_shm;
 #include "process_image.h"
 #include "im-zmq.h"
 #include "im-asapo.h"
+#include "im-checkpoint.h"
+#include "im-affinity.h"
 
 /* Length of event queue */
 #define QUEUE_SIZE (256)
@@ -58,6 +60,48 @@ struct sb_shm;
 /* Maximum number of workers */
 #define MAX_NUM_WORKERS (1024)
 
+/* Size of a cache line, for keeping the workers' statistics apart */
+#define SB_CACHE_LINE (64)
+
+/* Stages of processing, for which the workers' time is counted */
+enum worker_stage
+{
+	STAGE_WAIT,         /* Waiting for an event from the queue */
+	STAGE_FETCH,        /* Fetching data (ZMQ or ASAP::O) */
+	STAGE_DECODE,       /* Reading or unpacking the image */
+	STAGE_PEAKSEARCH,   /* Filters and peak search */
+	STAGE_INDEXING,     /* Indexing and prediction parameters */
+	STAGE_INTEGRATION,
+	STAGE_STREAM_WRITE,
+	NUM_WORKER_STAGES
+};
+
+/* Statistics for one worker.  These are only ever written by the worker
+ * itself, and the master adds them up without locking.  Each worker's
+ * statistics start on a new cache line, so that workers do not slow each
+ * other down when updating them. */
+struct worker_stats
+{
+	int n_processed;
+	int n_hits;
+	int n_hadcrystals;
+	int n_crystals;
+
+	/* File locality */
+	int n_same_file;
+	int n_new_file;
+	int n_stolen;
+
+	/* Frames which were dropped or only partially processed because of
+	 * the latency budget */
+	int n_dropped;
+	int n_degraded;
+
+	/* Total time, in seconds */
+	double time_in_stage[NUM_WORKER_STAGES];
+
+} __attribute__((aligned(SB_CACHE_LINE)));
+
 struct sb_shm
 {
 	pthread_mutex_t term_lock;
@@ -65,6 +109,7 @@ struct sb_shm
 	pthread_mutex_t queue_lock;
 	int n_events;
 	char queue[QUEUE_SIZE][MAX_EV_LEN];
+	int queue_owner[QUEUE_SIZE];  /* Preferred worker, or -1 for any */
 	int no_more;
 	char last_ev[MAX_NUM_WORKERS][MAX_EV_LEN];
 	char last_task[MAX_NUM_WORKERS][MAX_TASK_LEN];
@@ -73,14 +118,14 @@ struct sb_shm
 	time_t time_last_start[MAX_NUM_WORKERS];
 	int warned_long_running[MAX_NUM_WORKERS];
 
+	struct worker_stats stats[MAX_NUM_WORKERS];
+
 	pthread_mutex_t totals_lock;
-	int n_processed;
-	int n_hits;
-	int n_hadcrystals;
-	int n_crystals;
 	int should_shutdown;
 };
 
+extern double get_monotonic_seconds(void);
+
 extern char *create_tempdir(const char *temp_location);
 
 extern void set_last_task(char *lt, const char *task);
@@ -90,6 +135,13 @@ extern int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
                           const char *tempdir, int serial_start,
                           struct im_zmq_params *zmq_params,
                           struct im_asapo_params *asapo_params,
-                          int timeout, int profile);
+                          int timeout, int profile,
+                          struct im_checkpoint *checkpoint,
+                          int locality_run, const char *event_server,
+                          int event_batch, struct im_affinity *affinity);
+
+extern int serve_events(const char *address, FILE *fh,
+                        const DataTemplate *dtempl, int config_basename,
+                        const char *prefix);
 
 #endif /* IM_SANDBOX_H */
@@ -128,7 +128,11 @@ struct im_zmq *im_zmq_connect(struct im_zmq_params *params)
 }
 
 
-void *im_zmq_fetch(struct im_zmq *z, size_t *pdata_size)
+/* If pn_skipped is not NULL, and we are subscribed rather than requesting
+ * data, any further messages which are already waiting will be received, and
+ * only the newest one will be returned.  The number of messages thrown away
+ * will be added to *pn_skipped. */
+void *im_zmq_fetch(struct im_zmq *z, size_t *pdata_size, int *pn_skipped)
 {
 	int msg_size;
 	void *data_copy;
@@ -161,6 +165,28 @@ void *im_zmq_fetch(struct im_zmq *z, size_t *pdata_size)
 	/* Reply received.  OK to send request again */
 	z->request_sent = 0;
 
+	/* Catch up with the stream, if requested */
+	if ( (pn_skipped != NULL) && (z->request_str == NULL) ) {
+
+		zmq_msg_t next;
+		int next_size;
+
+		do {
+			zmq_msg_init(&next);
+			next_size = zmq_msg_recv(&next, z->socket,
+			                         ZMQ_DONTWAIT);
+			if ( next_size == -1 ) {
+				zmq_msg_close(&next);
+			} else {
+				zmq_msg_move(&z->msg, &next);
+				zmq_msg_close(&next);
+				msg_size = next_size;
+				(*pn_skipped)++;
+			}
+		} while ( next_size != -1 );
+
+	}
+
 	data_copy = malloc(msg_size);
 	if ( data_copy == NULL ) return NULL;
 	memcpy(data_copy, zmq_msg_data(&z->msg), msg_size);
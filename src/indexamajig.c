@@ -67,6 +67,8 @@
 #include "im-sandbox.h"
 #include "im-zmq.h"
 #include "im-asapo.h"
+#include "im-eventserver.h"
+#include "im-affinity.h"
 #include "version.h"
 #include "json-utils.h"
 
@@ -97,6 +99,16 @@ struct indexamajig_arguments
 	char **copy_headers;
 	int n_copy_headers;
 	char *harvest_file;
+	int checkpoint;
+	int resume;
+	int cell_list;
+	int locality_run;
+	char *serve_events;
+	char *event_server;
+	int event_batch;
+	enum cpu_layout cpu_layout;
+	int cpu_groupsize;
+	int cpu_offset;
 
 	struct taketwo_options **taketwo_opts_ptr;
 	struct felix_options **felix_opts_ptr;
@@ -186,6 +198,43 @@ static void write_methods(FILE *fh, const char *name, IndexingPrivate *ipriv)
 }
 
 
+static int parse_compact_pixels(const char *str, PixelStorageType *ptype,
+                                float *pscale)
+{
+	char type[16];
+	float scale = 1.0;
+	int r;
+
+	r = sscanf(str, "%15[^,],%f", type, &scale);
+	if ( r < 1 ) return 1;
+	if ( !(scale > 0.0) ) return 1;
+
+	if ( strcmp(type, "uint16") == 0 ) {
+		*ptype = PIXEL_STORAGE_UINT16;
+	} else if ( strcmp(type, "int32") == 0 ) {
+		*ptype = PIXEL_STORAGE_INT32;
+	} else if ( strcmp(type, "float") == 0 ) {
+		*ptype = PIXEL_STORAGE_FLOAT;
+	} else {
+		return 1;
+	}
+
+	*pscale = scale;
+	return 0;
+}
+
+
+static const char *str_compact_pixels(PixelStorageType type)
+{
+	switch ( type ) {
+		case PIXEL_STORAGE_FLOAT : return "float";
+		case PIXEL_STORAGE_UINT16 : return "uint16";
+		case PIXEL_STORAGE_INT32 : return "int32";
+	}
+	return "unknown";
+}
+
+
 static void write_harvest_file(struct index_args *args,
                                const char *filename,
                                int if_multi, int if_refine, int if_retry,
@@ -201,7 +250,10 @@ static void write_harvest_file(struct index_args *args,
 
 	fprintf(fh, "{\n");
 	fprintf(fh, "  \"input\": {\n");
-	write_float(fh, 0, "highres", args->highres);
+	write_float(fh, 1, "highres", args->highres);
+	write_str(fh, 1, "compact_pixels",
+	          str_compact_pixels(args->compact_pixels));
+	write_float(fh, 0, "compact_pixel_scale", args->compact_scale);
 	fprintf(fh, "  },\n");
 
 	fprintf(fh, "  \"peaksearch\": {\n");
@@ -445,6 +497,100 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->asapo_params.wait_for_stream = 1;
 		break;
 
+		case 222 :
+		if ( parse_compact_pixels(arg, &args->iargs.compact_pixels,
+		                          &args->iargs.compact_scale) )
+		{
+			ERROR("Invalid value for --compact-pixels\n");
+			return EINVAL;
+		}
+		break;
+
+		case 223 :
+		if ( (sscanf(arg, "%d", &args->locality_run) != 1)
+		  || (args->locality_run < 0) )
+		{
+			ERROR("Invalid value for --locality-run\n");
+			return EINVAL;
+		}
+		break;
+
+		case 224 :
+		args->serve_events = strdup(arg);
+		break;
+
+		case 225 :
+		args->event_server = strdup(arg);
+		break;
+
+		case 226 :
+		if ( (sscanf(arg, "%d", &args->event_batch) != 1)
+		  || (args->event_batch < 1) )
+		{
+			ERROR("Invalid value for --event-batch\n");
+			return EINVAL;
+		}
+		break;
+
+		case 227 :
+		if ( args->iargs.trace_latency < 1 ) {
+			args->iargs.trace_latency = 1;
+		}
+		break;
+
+		case 228 :
+		args->iargs.trace_latency = 2;
+		break;
+
+		case 229 :
+		if ( (sscanf(arg, "%lf", &args->iargs.latency_budget) != 1)
+		  || (args->iargs.latency_budget <= 0.0) )
+		{
+			ERROR("Invalid value for --latency-budget\n");
+			return EINVAL;
+		}
+		args->iargs.latency_budget /= 1e3;  /* ms to s */
+		break;
+
+		case 230 :
+		if ( strcmp(arg, "drop") == 0 ) {
+			args->iargs.late_frames = LATE_FRAMES_DROP;
+		} else if ( strcmp(arg, "peaks-only") == 0 ) {
+			args->iargs.late_frames = LATE_FRAMES_PEAKS_ONLY;
+		} else {
+			ERROR("Invalid value for --late-frames (must be 'drop' "
+			      "or 'peaks-only')\n");
+			return EINVAL;
+		}
+		break;
+
+		case 231 :
+		args->cpu_layout = parse_cpu_layout(arg);
+		if ( args->cpu_layout == CPU_LAYOUT_ERROR ) {
+			ERROR("Invalid value for --cpu-pin (must be 'none', "
+			      "'compact', 'scatter' or 'numa')\n");
+			return EINVAL;
+		}
+		break;
+
+		case 232 :
+		if ( (sscanf(arg, "%d", &args->cpu_groupsize) != 1)
+		  || (args->cpu_groupsize < 1) )
+		{
+			ERROR("Invalid value for --cpu-group-size\n");
+			return EINVAL;
+		}
+		break;
+
+		case 233 :
+		if ( (sscanf(arg, "%d", &args->cpu_offset) != 1)
+		  || (args->cpu_offset < 0) )
+		{
+			ERROR("Invalid value for --cpu-offset\n");
+			return EINVAL;
+		}
+		break;
+
 		/* ---------- Peak search ---------- */
 
 		case 't' :
@@ -831,6 +977,18 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->harvest_file = strdup(arg);
 		break;
 
+		case 607 :
+		args->checkpoint = 1;
+		break;
+
+		case 608 :
+		args->resume = 1;
+		break;
+
+		case 609 :
+		args->cell_list = 1;
+		break;
+
 		default :
 		return ARGP_ERR_UNKNOWN;
 
@@ -856,6 +1014,9 @@ int main(int argc, char *argv[])
 	struct fromfile_options *fromfile_opts = NULL;
 	struct asdf_options *asdf_opts = NULL;
 	double wl_from_dt;
+	struct im_checkpoint *checkpoint = NULL;
+	struct im_affinity *affinity = NULL;
+	char *cell_list_stream = NULL;
 
 	/* Defaults for "top level" arguments */
 	args.filename = NULL;
@@ -888,6 +1049,16 @@ int main(int argc, char *argv[])
 	args.copy_headers = NULL;
 	args.n_copy_headers = 0;
 	args.harvest_file = NULL;
+	args.checkpoint = 0;
+	args.resume = 0;
+	args.cell_list = 0;
+	args.locality_run = 0;
+	args.serve_events = NULL;
+	args.event_server = NULL;
+	args.event_batch = EVENTSERVER_DEFAULT_BATCH;
+	args.cpu_layout = CPU_LAYOUT_NONE;
+	args.cpu_groupsize = 0;
+	args.cpu_offset = 0;
 	args.taketwo_opts_ptr = &taketwo_opts;
 	args.felix_opts_ptr = &felix_opts;
 	args.xgandalf_opts_ptr = &xgandalf_opts;
@@ -933,10 +1104,14 @@ int main(int argc, char *argv[])
 	args.iargs.no_revalidate = 0;
 	args.iargs.stream_flags = STREAM_PEAKS | STREAM_REFLECTIONS;
 	args.iargs.stream_nonhits = 1;
+	args.iargs.cell_list_fd = -1;
 	args.iargs.int_diag = INTDIAG_NONE;
 	args.iargs.min_peaks = 0;
 	args.iargs.overpredict = 0;
 	args.iargs.cell_params_only = 0;
+	args.iargs.trace_latency = 0;
+	args.iargs.latency_budget = 0.0;
+	args.iargs.late_frames = LATE_FRAMES_DROP;
 	args.iargs.wait_for_file = 0;
 	args.iargs.ipriv = NULL;  /* No default */
 	args.iargs.int_meth = integration_method("rings-nocen-nosat-nograd", NULL);
@@ -950,6 +1125,8 @@ int main(int argc, char *argv[])
 	args.iargs.clen_estimate = NAN;
 	args.iargs.n_threads = 1;
 	args.iargs.data_format = DATA_SOURCE_TYPE_UNKNOWN;
+	args.iargs.compact_pixels = PIXEL_STORAGE_FLOAT;
+	args.iargs.compact_scale = 1.0;
 
 	argp_program_version_hook = show_version;
 
@@ -999,6 +1176,32 @@ int main(int argc, char *argv[])
 		{"asapo-stream", 220, "str", OPTION_NO_USAGE, "ASAP::O stream name"},
 		{"asapo-wait-for-stream", 221, NULL, OPTION_NO_USAGE,
 		        "Wait for ASAP::O stream to appear"},
+		{"compact-pixels", 222, "type[,scale]", OPTION_NO_USAGE,
+		        "Use compact integer pixel values (uint16 or int32) for "
+		        "peakfinder8 and integration"},
+		{"locality-run", 223, "n", OPTION_NO_USAGE, "Give up to n consecutive "
+		        "frames from the same file to the same worker"},
+		{"serve-events", 224, "addr", OPTION_NO_USAGE, "Hand out events from "
+		        "the input list to other indexamajig processes"},
+		{"event-server", 225, "addr", OPTION_NO_USAGE, "Get events from this "
+		        "event server instead of an input list"},
+		{"event-batch", 226, "n", OPTION_NO_USAGE, "Number of events to get "
+		        "from the event server at once"},
+		{"trace-latency", 227, NULL, OPTION_NO_USAGE, "Report the latency of "
+		        "each processing stage"},
+		{"trace-latency-in-stream", 228, NULL, OPTION_NO_USAGE, "Also write "
+		        "the latencies for each frame into the stream"},
+		{"latency-budget", 229, "ms", OPTION_NO_USAGE, "Skip processing of "
+		        "frames which are older than this"},
+		{"late-frames", 230, "policy", OPTION_NO_USAGE, "What to do with "
+		        "frames which exceed the latency budget (drop or "
+		        "peaks-only)"},
+		{"cpu-pin", 231, "layout", OPTION_NO_USAGE, "Bind workers to CPUs "
+		        "(none, compact, scatter or numa)"},
+		{"cpu-group-size", 232, "n", OPTION_NO_USAGE, "Number of CPUs for "
+		        "each worker"},
+		{"cpu-offset", 233, "n", OPTION_NO_USAGE, "Number of CPUs to leave "
+		        "free at the start"},
 
 		{NULL, 0, 0, OPTION_DOC, "Peak search options:", 3},
 		{"peaks", 301, "method", 0, "Peak search method.  Default: zaef"},
@@ -1096,6 +1299,12 @@ int main(int argc, char *argv[])
 		        "here"},
 		{"harvest-file", 606, "filename", OPTION_NO_USAGE, "Write the actual parameters "
 			"used in JSON format"},
+		{"checkpoint", 607, NULL, OPTION_NO_USAGE, "Record which frames are "
+		        "complete in the stream, for --resume"},
+		{"resume", 608, NULL, OPTION_NO_USAGE, "Append to an existing stream, "
+		        "skipping frames which are already complete"},
+		{"cell-list", 609, NULL, OPTION_NO_USAGE, "Write a list of unit "
+		        "cells alongside the stream, for cell_explorer"},
 
 		{NULL, 0, 0, OPTION_DOC, "More information:", 99},
 
@@ -1120,7 +1329,8 @@ int main(int argc, char *argv[])
 	/* Check for minimal information */
 	if ( (args.filename == NULL)
 	  && (args.zmq_params.addr == NULL)
-	  && (args.asapo_params.endpoint == NULL) ) {
+	  && (args.asapo_params.endpoint == NULL)
+	  && (args.event_server == NULL) ) {
 		ERROR("You need to provide the input filename (use -i)\n");
 		return 1;
 	}
@@ -1128,7 +1338,7 @@ int main(int argc, char *argv[])
 		ERROR("You need to specify the geometry filename (use -g)\n");
 		return 1;
 	}
-	if ( args.outfile == NULL ) {
+	if ( (args.outfile == NULL) && (args.serve_events == NULL) ) {
 		ERROR("You need to specify the output filename (use -o)\n");
 		return 1;
 	}
@@ -1151,6 +1361,22 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if ( (args.event_server != NULL)
+	  && ((args.filename != NULL) || (args.zmq_params.addr != NULL)
+	   || (args.asapo_params.endpoint != NULL)) )
+	{
+		ERROR("--event-server can't be used with --input, --zmq-input "
+		      "or --asapo-endpoint.\n");
+		return 1;
+	}
+
+	if ( (args.serve_events != NULL)
+	  && ((args.filename == NULL) || (args.event_server != NULL)) )
+	{
+		ERROR("--serve-events needs an input list (use -i).\n");
+		return 1;
+	}
+
 	if ( (args.zmq_params.request != NULL) && (args.zmq_params.n_subscriptions > 0) ) {
 		ERROR("The options --zmq-request and --zmq-subscribe are "
 		      "mutually exclusive.\n");
@@ -1189,6 +1415,18 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* Hand out the events, if that's all we have to do */
+	if ( args.serve_events != NULL ) {
+		r = serve_events(args.serve_events, fh, args.iargs.dtempl,
+		                 args.basename, args.prefix);
+		if ( fh != stdin ) fclose(fh);
+		data_template_free(args.iargs.dtempl);
+		free(args.serve_events);
+		free(args.prefix);
+		free(args.filename);
+		return r;
+	}
+
 	/* Add any headers we need to copy */
 	for ( r=0; r<args.n_copy_headers; r++ ) {
 		data_template_add_copy_header(args.iargs.dtempl,
@@ -1348,18 +1586,95 @@ int main(int argc, char *argv[])
 	}
 	free(rn);
 
-	/* Open output stream */
-	st = stream_open_for_write(args.outfile, args.iargs.dtempl);
-	if ( st == NULL ) {
-		ERROR("Failed to open stream '%s'\n", args.outfile);
+	if ( (args.checkpoint || args.resume)
+	  && ((args.zmq_params.addr != NULL)
+	   || (args.asapo_params.endpoint != NULL)) )
+	{
+		ERROR("--checkpoint and --resume can't be used with streamed "
+		      "data.\n");
+		return 1;
+	}
+
+	/* The events given to this process by an event server will be
+	 * different each time */
+	if ( (args.checkpoint || args.resume) && (args.event_server != NULL) ) {
+		ERROR("--checkpoint and --resume can't be used with "
+		      "--event-server.\n");
 		return 1;
 	}
 
-	/* Write audit info */
-	stream_write_commandline_args(st, argc, argv);
-	stream_write_geometry_file(st, args.geom_filename);
-	stream_write_target_cell(st, args.iargs.cell);
-	stream_write_indexing_methods(st, args.indm_str);
+	/* Open output stream */
+	if ( args.resume && file_exists(args.outfile) ) {
+
+		int ofd;
+		char *cfn;
+
+		checkpoint = im_checkpoint_resume(args.outfile,
+		                                  args.serial_start);
+		if ( checkpoint == NULL ) {
+			ERROR("Failed to resume from stream '%s'\n",
+			      args.outfile);
+			return 1;
+		}
+
+		ofd = open(args.outfile, O_WRONLY | O_APPEND);
+		if ( ofd == -1 ) {
+			ERROR("Failed to open stream '%s': %s\n",
+			      args.outfile, strerror(errno));
+			return 1;
+		}
+		st = stream_open_fd_for_write(ofd, args.iargs.dtempl);
+		if ( st == NULL ) {
+			ERROR("Failed to open stream '%s'\n", args.outfile);
+			return 1;
+		}
+
+		/* An old cell list would not match the stream, and a new one
+		 * would only cover the new part */
+		cfn = stream_cells_filename(args.outfile);
+		if ( cfn != NULL ) unlink(cfn);
+		free(cfn);
+
+	} else {
+
+		st = stream_open_for_write(args.outfile, args.iargs.dtempl);
+		if ( st == NULL ) {
+			ERROR("Failed to open stream '%s'\n", args.outfile);
+			return 1;
+		}
+
+		/* Write audit info */
+		stream_write_commandline_args(st, argc, argv);
+		stream_write_geometry_file(st, args.geom_filename);
+		stream_write_target_cell(st, args.iargs.cell);
+		stream_write_indexing_methods(st, args.indm_str);
+
+		if ( args.cell_list ) {
+			struct stat s;
+			if ( (stat(args.outfile, &s) == 0)
+			  && S_ISREG(s.st_mode) )
+			{
+				int fd = stream_cells_open_for_write(args.outfile);
+				args.iargs.cell_list_fd = fd;
+				if ( fd >= 0 ) {
+					cell_list_stream = strdup(args.outfile);
+				}
+			} else {
+				ERROR("Not writing cell list, because the output "
+				      "is not a regular file.\n");
+			}
+		}
+
+		if ( args.checkpoint || args.resume ) {
+			checkpoint = im_checkpoint_new(args.outfile,
+			                               args.serial_start);
+			if ( checkpoint == NULL ) {
+				ERROR("Failed to set up checkpointing\n");
+				return 1;
+			}
+		}
+
+	}
 
 	if ( (args.harvest_file != NULL) && (args.serial_start <= 1) ) {
 		write_harvest_file(&args.iargs, args.harvest_file,
@@ -1380,10 +1695,25 @@ int main(int argc, char *argv[])
 		args.iargs.pf_private = pf8_data;
 	}
 
+	if ( args.cpu_layout != CPU_LAYOUT_NONE ) {
+		if ( args.cpu_groupsize == 0 ) {
+			args.cpu_groupsize = args.iargs.n_threads;
+		}
+		affinity = im_affinity_new(args.cpu_layout, args.n_proc,
+		                           args.cpu_groupsize, args.cpu_offset);
+		if ( affinity == NULL ) {
+			ERROR("Failed to set up worker placement\n");
+			return 1;
+		}
+		im_affinity_report(affinity);
+	}
+
 	r = create_sandbox(&args.iargs, args.n_proc, args.prefix, args.basename,
 	                   fh, st, tmpdir, args.serial_start,
 	                   &args.zmq_params, &args.asapo_params,
-	                   timeout, args.profile);
+	                   timeout, args.profile, checkpoint,
+	                   args.locality_run, args.event_server,
+	                   args.event_batch, affinity);
 
 	if ( pf8_data != NULL ) free_pf8_private_data(pf8_data);
 	if ( detgeom != NULL) detgeom_free(detgeom);
@@ -1393,6 +1723,20 @@ int main(int argc, char *argv[])
 	free(tmpdir);
 	data_template_free(args.iargs.dtempl);
 	stream_close(st);
+	if ( args.iargs.cell_list_fd >= 0 ) {
+		/* If the run did not finish normally, leave the cell list
+		 * incomplete so that it will not be used */
+		if ( r != 0 ) {
+			close(args.iargs.cell_list_fd);
+		} else if ( stream_cells_finish(args.iargs.cell_list_fd,
+		                                cell_list_stream) )
+		{
+			ERROR("Failed to complete cell list\n");
+		}
+	}
+	free(cell_list_stream);
+	im_checkpoint_free(checkpoint);
+	im_affinity_free(affinity);
 	cleanup_indexing(args.iargs.ipriv);
 
 	return r;
@@ -0,0 +1,718 @@
+/*
+ * live_merge.c
+ *
+ * Merge crystals from growing streams, for feedback during an experiment
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include <utils.h>
+#include <reflist-utils.h>
+#include <symmetry.h>
+#include <stream.h>
+#include <reflist.h>
+#include <image.h>
+#include <crystal.h>
+#include <geometry.h>
+#include <cell-utils.h>
+#include <fom.h>
+
+#include "version.h"
+#include "merge-model.h"
+
+
+static void show_help(const char *s)
+{
+	printf("Syntax: %s [options] <stream> [<stream> ...]\n\n", s);
+	printf(
+"Merge crystals from streams which are still being written.\n"
+"\n"
+"  -h, --help                Display this help message.\n"
+"      --version             Print CrystFEL version number and exit.\n"
+"  -i, --input=<filename>    Specify input stream (can be used more than once).\n"
+"  -o, --output=<filename>   Specify output filename for merged intensities\n"
+"                             (default: live.hkl).  Half-datasets will be\n"
+"                             written to <filename>1 and <filename>2.\n"
+"  -y, --symmetry=<sym>      Merge according to point group <sym>.\n"
+"  -p, --pdb=<filename>      Unit cell file, for figures of merit.\n"
+"      --shell-file=<file>   Write figures of merit to <file> (default:\n"
+"                             live_shells.dat).\n"
+"      --interval=<s>        Write the results every <s> seconds (default: 60).\n"
+"\n"
+"      --nshells=<n>         Use <n> resolution shells (default: 10).\n"
+"      --lowres=<n>          Low resolution limit for figures of merit (A).\n"
+"      --highres=<n>         High resolution limit for figures of merit (A).\n"
+"      --no-polarisation     Disable polarisation correction.\n"
+"      --polarisation=<p>    Specify type of polarisation correction.\n"
+"      --min-measurements=<n> Require at least <n> measurements before a\n"
+"                             reflection appears in the output.  Default: 2\n"
+"      --push-res=<n>        Integrate higher than apparent resolution cutoff.\n"
+"\n"
+"The streams will be followed until interrupted with Ctrl-C, when the results\n"
+"will be written one last time.\n"
+);
+}
+
+
+/* A stream which is still being written.  Chunks are only read from 'st' once
+ * they have been completely written, so that the reader never hits the end of
+ * the file. */
+struct live_stream
+{
+	const char *filename;
+	Stream *st;
+	int fd;
+
+	char line[1024];
+	size_t line_len;
+	int have_header;
+	int n_ready;  /* Number of complete chunks not yet read from 'st' */
+};
+
+
+struct live_merge
+{
+	RefList *model;    /* All crystals */
+	RefList *half[2];  /* Alternate crystals */
+	SymOpList *sym;
+	UnitCell *cell;
+	struct polarisation p;
+	double push_res;
+	int min_measurements;
+
+	int n_images;
+	int n_crystals;
+	int n_crystals_written;
+};
+
+
+static volatile sig_atomic_t stop_requested = 0;
+
+
+static void stop_sig(int signum)
+{
+	stop_requested = 1;
+}
+
+
+/* Look at whatever has been added to the stream since the last time */
+static void scan_stream(struct live_stream *ls)
+{
+	if ( ls->fd == -1 ) {
+		ls->fd = open(ls->filename, O_RDONLY);
+		if ( ls->fd == -1 ) return;  /* Not yet */
+	}
+
+	do {
+
+		char buf[65536];
+		ssize_t r;
+		ssize_t i;
+
+		r = read(ls->fd, buf, sizeof(buf));
+		if ( r == -1 ) {
+			if ( errno == EINTR ) continue;
+			ERROR("Failed to read %s: %s\n", ls->filename,
+			      strerror(errno));
+			return;
+		}
+		if ( r == 0 ) return;
+
+		for ( i=0; i<r; i++ ) {
+
+			if ( buf[i] != '\n' ) {
+				/* Very long lines are not interesting here */
+				if ( ls->line_len < sizeof(ls->line)-1 ) {
+					ls->line[ls->line_len++] = buf[i];
+				}
+				continue;
+			}
+
+			ls->line[ls->line_len] = '\0';
+			if ( strcmp(ls->line, STREAM_CHUNK_END_MARKER) == 0 ) {
+				ls->n_ready++;
+			} else if ( strcmp(ls->line,
+			                   STREAM_GEOM_END_MARKER) == 0 )
+			{
+				ls->have_header = 1;
+			}
+			ls->line_len = 0;
+
+		}
+
+	} while ( 1 );
+}
+
+
+static void merge_crystal(struct live_merge *lm, struct image *image,
+                          Crystal *cr)
+{
+	RefList *new_refl;
+
+	new_refl = crystal_get_reflections(cr);
+	if ( new_refl == NULL ) return;
+
+	apply_kpred(1.0/image->lambda, new_refl);
+	polarisation_correction(new_refl, crystal_get_cell(cr), lm->p);
+
+	merge_crystal_into_model(lm->model, lm->half[lm->n_crystals % 2], cr,
+	                         lm->sym, 1.0, -INFINITY, +INFINITY,
+	                         lm->push_res, NULL, NULL);
+
+	lm->n_crystals++;
+}
+
+
+/* Read and merge all the complete chunks which have appeared */
+static int merge_new_chunks(struct live_merge *lm, struct live_stream *ls)
+{
+	int n = 0;
+
+	scan_stream(ls);
+
+	if ( (ls->st == NULL) && ls->have_header ) {
+		ls->st = stream_open_for_read(ls->filename);
+		if ( ls->st == NULL ) {
+			ERROR("Failed to open stream %s\n", ls->filename);
+			ls->have_header = 0;
+			return 0;
+		}
+		STATUS("Following %s\n", ls->filename);
+	}
+	if ( ls->st == NULL ) return 0;
+
+	while ( ls->n_ready > 0 ) {
+
+		struct image *image;
+		int i;
+
+		image = stream_read_chunk(ls->st, STREAM_REFLECTIONS);
+		ls->n_ready--;
+		if ( image == NULL ) continue;
+
+		lm->n_images++;
+		for ( i=0; i<image->n_crystals; i++ ) {
+			merge_crystal(lm, image, image->crystals[i]);
+		}
+		image_free(image);
+		n++;
+
+	}
+
+	return n;
+}
+
+
+static RefList *merged_list(RefList *model, int min_measurements)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	RefList *list;
+
+	list = reflist_new();
+	if ( list == NULL ) return NULL;
+
+	for ( refl = first_refl(model, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *new;
+		int red;
+
+		red = get_redundancy(refl);
+		if ( red < min_measurements ) continue;
+
+		get_indices(refl, &h, &k, &l);
+		new = add_refl(list, h, k, l);
+		set_intensity(new, get_intensity(refl));
+		set_esd_intensity(new, sqrt(get_temp2(refl)/get_temp1(refl))
+		                       / sqrt(red));
+		set_redundancy(new, red);
+	}
+
+	return list;
+}
+
+
+/* Write to a temporary file and then move it into place, so that nothing
+ * else ever sees a half-written file */
+static void write_list(const char *filename, RefList *list, SymOpList *sym)
+{
+	char *tmp;
+
+	tmp = malloc(strlen(filename)+5);
+	if ( tmp == NULL ) return;
+	strcpy(tmp, filename);
+	strcat(tmp, ".tmp");
+
+	if ( write_reflist_2(tmp, list, sym) ) {
+		ERROR("Failed to write %s\n", filename);
+	} else if ( rename(tmp, filename) ) {
+		ERROR("Failed to move %s into place: %s\n", filename,
+		      strerror(errno));
+	}
+
+	free(tmp);
+}
+
+
+static void write_shells(struct live_merge *lm, RefList *all, RefList *half1,
+                         RefList *half2, double rmin_fix, double rmax_fix,
+                         int nshells, const char *shell_file)
+{
+	RefList *all_acc = NULL;
+	RefList *half1_acc = NULL;
+	RefList *half2_acc = NULL;
+	struct fom_shells *shells;
+	struct fom_context *compl_ctx;
+	struct fom_context *cc_ctx;
+	double rmin, rmax;
+	char *tmp;
+	FILE *fh;
+	int i;
+
+	fom_select_reflections(all, &all_acc, lm->cell, lm->sym,
+	                       rmin_fix, rmax_fix, -INFINITY, 0, 0,
+	                       lm->min_measurements);
+	fom_select_reflection_pairs(half1, half2, &half1_acc, &half2_acc,
+	                            lm->cell, lm->sym, 0, rmin_fix, rmax_fix,
+	                            -INFINITY, 0, 0, lm->min_measurements);
+	if ( (all_acc == NULL) || (half1_acc == NULL) || (half2_acc == NULL)
+	  || (num_reflections(all_acc) == 0)
+	  || (num_reflections(half1_acc) == 0) )
+	{
+		reflist_free(all_acc);
+		reflist_free(half1_acc);
+		reflist_free(half2_acc);
+		return;
+	}
+
+	resolution_limits(all_acc, lm->cell, &rmin, &rmax);
+	if ( rmin_fix > 0.0 ) rmin = rmin_fix;
+	if ( rmax_fix > 0.0 ) rmax = rmax_fix;
+
+	shells = fom_make_resolution_shells(rmin, rmax, nshells);
+	if ( shells == NULL ) {
+		reflist_free(all_acc);
+		reflist_free(half1_acc);
+		reflist_free(half2_acc);
+		return;
+	}
+
+	compl_ctx = fom_calculate(all_acc, NULL, lm->cell, shells,
+	                          FOM_COMPLETENESS, 0, lm->sym);
+	cc_ctx = fom_calculate(half1_acc, half2_acc, lm->cell, shells,
+	                       FOM_CC, 1, lm->sym);
+
+	if ( (compl_ctx != NULL) && (cc_ctx != NULL) ) {
+
+		STATUS("%i crystals from %i frames: CC1/2 = %.4f, "
+		       "completeness = %.2f%% (%.2f to %.2f A)\n",
+		       lm->n_crystals, lm->n_images,
+		       fom_overall_value(cc_ctx),
+		       100.0*fom_overall_value(compl_ctx),
+		       1e10/rmin, 1e10/rmax);
+
+		tmp = malloc(strlen(shell_file)+5);
+		if ( tmp != NULL ) {
+			strcpy(tmp, shell_file);
+			strcat(tmp, ".tmp");
+			fh = fopen(tmp, "w");
+		} else {
+			fh = NULL;
+		}
+		if ( fh != NULL ) {
+			fprintf(fh, "Center 1/nm  # refs Possible  Compl"
+			            "     CC1/2    d(A)    Min 1/nm   "
+			            "Max 1/nm\n");
+			for ( i=0; i<nshells; i++ ) {
+				fprintf(fh, "%10.3f %8i %8i %6.2f %9.4f "
+				            "%7.2f  %10.3f %10.3f\n",
+				        fom_shell_centre(shells, i)*1.0e-9,
+				        fom_shell_num_reflections(compl_ctx, i),
+				        fom_shell_num_possible(compl_ctx, i),
+				        100.0*fom_shell_value(compl_ctx, i),
+				        fom_shell_value(cc_ctx, i),
+				        1e10/fom_shell_centre(shells, i),
+				        shells->rmins[i]*1.0e-9,
+				        shells->rmaxs[i]*1.0e-9);
+			}
+			fclose(fh);
+			if ( rename(tmp, shell_file) ) {
+				ERROR("Failed to move %s into place: %s\n",
+				      shell_file, strerror(errno));
+			}
+		} else {
+			ERROR("Couldn't write '%s'\n", shell_file);
+		}
+		free(tmp);
+
+	}
+
+	fom_context_free(compl_ctx);
+	fom_context_free(cc_ctx);
+	fom_shells_free(shells);
+	reflist_free(all_acc);
+	reflist_free(half1_acc);
+	reflist_free(half2_acc);
+}
+
+
+static void write_results(struct live_merge *lm, const char *output,
+                          const char *shell_file, double rmin_fix,
+                          double rmax_fix, int nshells, const char *audit,
+                          int argc, char *argv[])
+{
+	RefList *all;
+	RefList *half[2];
+	char *half_filename;
+	int i;
+
+	all = merged_list(lm->model, lm->min_measurements);
+	half[0] = merged_list(lm->half[0], lm->min_measurements);
+	half[1] = merged_list(lm->half[1], lm->min_measurements);
+	half_filename = malloc(strlen(output)+2);
+	if ( (all == NULL) || (half[0] == NULL) || (half[1] == NULL)
+	  || (half_filename == NULL) )
+	{
+		ERROR("Failed to allocate merged reflection lists\n");
+		reflist_free(all);
+		reflist_free(half[0]);
+		reflist_free(half[1]);
+		free(half_filename);
+		return;
+	}
+
+	reflist_add_command_and_version(all, argc, argv);
+	if ( audit != NULL ) {
+		reflist_add_notes(all, "Audit information from stream:");
+		reflist_add_notes(all, audit);
+	}
+	write_list(output, all, lm->sym);
+
+	for ( i=0; i<2; i++ ) {
+		sprintf(half_filename, "%s%i", output, i+1);
+		reflist_add_command_and_version(half[i], argc, argv);
+		write_list(half_filename, half[i], lm->sym);
+	}
+
+	if ( lm->cell != NULL ) {
+		write_shells(lm, all, half[0], half[1], rmin_fix, rmax_fix,
+		             nshells, shell_file);
+	} else {
+		STATUS("%i crystals from %i frames: %i reflections\n",
+		       lm->n_crystals, lm->n_images, num_reflections(all));
+	}
+
+	lm->n_crystals_written = lm->n_crystals;
+
+	reflist_free(all);
+	reflist_free(half[0]);
+	reflist_free(half[1]);
+	free(half_filename);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int i;
+	char *output = NULL;
+	char *shell_file = NULL;
+	char *sym_str = NULL;
+	char *cellfile = NULL;
+	char *rval;
+	struct live_merge lm;
+	struct live_stream *streams = NULL;
+	int n_streams = 0;
+	int interval = 60;
+	int nshells = 10;
+	double rmin_fix = -1.0;
+	double rmax_fix = -1.0;
+	double t_last_write;
+	char *audit = NULL;
+	struct sigaction sa;
+
+	lm.p.fraction = 1.0;
+	lm.p.angle = 0.0;
+	lm.p.disable = 0;
+	lm.push_res = +INFINITY;
+	lm.min_measurements = 2;
+	lm.cell = NULL;
+	lm.n_images = 0;
+	lm.n_crystals = 0;
+	lm.n_crystals_written = 0;
+
+	/* Long options */
+	const struct option longopts[] = {
+		{"help",               0, NULL,               'h'},
+		{"input",              1, NULL,               'i'},
+		{"output",             1, NULL,               'o'},
+		{"symmetry",           1, NULL,               'y'},
+		{"pdb",                1, NULL,               'p'},
+		{"version",            0, NULL,                2},
+		{"interval",           1, NULL,                3},
+		{"shell-file",         1, NULL,                4},
+		{"nshells",            1, NULL,                5},
+		{"lowres",             1, NULL,                6},
+		{"highres",            1, NULL,                7},
+		{"polarisation",       1, NULL,                8},
+		{"polarization",       1, NULL,                8}, /* compat */
+		{"no-polarisation",    0, NULL,                9},
+		{"no-polarization",    0, NULL,                9}, /* compat */
+		{"min-measurements",   1, NULL,               10},
+		{"push-res",           1, NULL,               11},
+		{0, 0, NULL, 0}
+	};
+
+	/* Short options */
+	while ((c = getopt_long(argc, argv, "hi:o:y:p:",
+	                        longopts, NULL)) != -1) {
+
+		switch (c) {
+
+			case 'h' :
+			show_help(argv[0]);
+			return 0;
+
+			case 'i' :
+			n_streams++;
+			streams = realloc(streams,
+			                  n_streams*sizeof(struct live_stream));
+			if ( streams == NULL ) return 1;
+			streams[n_streams-1].filename = optarg;
+			break;
+
+			case 'o' :
+			output = strdup(optarg);
+			break;
+
+			case 'y' :
+			sym_str = strdup(optarg);
+			break;
+
+			case 'p' :
+			cellfile = strdup(optarg);
+			break;
+
+			case 2 :
+			printf("CrystFEL: %s\n",
+			       crystfel_version_string());
+			printf("%s\n",
+			       crystfel_licence_string());
+			return 0;
+
+			case 3 :
+			interval = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (interval < 1) ) {
+				ERROR("Invalid value for --interval.\n");
+				return 1;
+			}
+			break;
+
+			case 4 :
+			shell_file = strdup(optarg);
+			break;
+
+			case 5 :
+			nshells = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (nshells < 1) ) {
+				ERROR("Invalid value for --nshells.\n");
+				return 1;
+			}
+			break;
+
+			case 6 :
+			rmin_fix = strtod(optarg, &rval);
+			if ( *rval != '\0' ) {
+				ERROR("Invalid value for --lowres.\n");
+				return 1;
+			}
+			rmin_fix = 1e10/rmin_fix;
+			break;
+
+			case 7 :
+			rmax_fix = strtod(optarg, &rval);
+			if ( *rval != '\0' ) {
+				ERROR("Invalid value for --highres.\n");
+				return 1;
+			}
+			rmax_fix = 1e10/rmax_fix;
+			break;
+
+			case 8 :
+			lm.p = parse_polarisation(optarg);
+			break;
+
+			case 9 :
+			lm.p = parse_polarisation("none");
+			break;
+
+			case 10 :
+			lm.min_measurements = strtol(optarg, &rval, 10);
+			if ( *rval != '\0' ) {
+				ERROR("Invalid value for --min-measurements.\n");
+				return 1;
+			}
+			break;
+
+			case 11 :
+			lm.push_res = strtod(optarg, &rval);
+			if ( *rval != '\0' ) {
+				ERROR("Invalid value for --push-res.\n");
+				return 1;
+			}
+			lm.push_res = lm.push_res*1e9;
+			break;
+
+			case '?' :
+			break;
+
+			case 0 :
+			break;
+
+			default :
+			ERROR("Unhandled option '%c'\n", c);
+			break;
+
+		}
+
+	}
+
+	while ( optind < argc ) {
+		n_streams++;
+		streams = realloc(streams, n_streams*sizeof(struct live_stream));
+		if ( streams == NULL ) return 1;
+		streams[n_streams-1].filename = argv[optind++];
+	}
+
+	if ( n_streams == 0 ) {
+		ERROR("Please give at least one input stream filename.\n");
+		return 1;
+	}
+
+	for ( i=0; i<n_streams; i++ ) {
+		streams[i].st = NULL;
+		streams[i].fd = -1;
+		streams[i].line_len = 0;
+		streams[i].have_header = 0;
+		streams[i].n_ready = 0;
+	}
+
+	if ( output == NULL ) output = strdup("live.hkl");
+	if ( shell_file == NULL ) shell_file = strdup("live_shells.dat");
+
+	if ( sym_str == NULL ) sym_str = strdup("1");
+	pointgroup_warning(sym_str);
+	lm.sym = get_pointgroup(sym_str);
+	free(sym_str);
+	if ( lm.sym == NULL ) return 1;
+
+	if ( cellfile != NULL ) {
+		lm.cell = load_cell_from_file(cellfile);
+		if ( lm.cell == NULL ) {
+			ERROR("Failed to load cell from '%s'\n", cellfile);
+			return 1;
+		}
+		free(cellfile);
+	} else {
+		STATUS("No unit cell given, so figures of merit will not be "
+		       "calculated.\n");
+	}
+
+	lm.model = reflist_new();
+	lm.half[0] = reflist_new();
+	lm.half[1] = reflist_new();
+	if ( (lm.model == NULL) || (lm.half[0] == NULL)
+	  || (lm.half[1] == NULL) ) return 1;
+
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = stop_sig;
+	if ( sigaction(SIGINT, &sa, NULL) == -1 ) {
+		ERROR("Failed to set up SIGINT handler\n");
+		return 1;
+	}
+	if ( sigaction(SIGTERM, &sa, NULL) == -1 ) {
+		ERROR("Failed to set up SIGTERM handler\n");
+		return 1;
+	}
+
+	t_last_write = time(NULL);
+	while ( !stop_requested ) {
+
+		int n_new = 0;
+
+		for ( i=0; i<n_streams; i++ ) {
+			n_new += merge_new_chunks(&lm, &streams[i]);
+			if ( (audit == NULL) && (streams[i].st != NULL) ) {
+				audit = stream_audit_info(streams[i].st);
+			}
+		}
+
+		if ( (lm.n_crystals > lm.n_crystals_written)
+		  && (time(NULL) - t_last_write >= interval) )
+		{
+			write_results(&lm, output, shell_file, rmin_fix,
+			              rmax_fix, nshells, audit, argc, argv);
+			t_last_write = time(NULL);
+		}
+
+		if ( n_new == 0 ) sleep(1);
+
+	}
+
+	STATUS("Writing final results.\n");
+	write_results(&lm, output, shell_file, rmin_fix, rmax_fix, nshells,
+	              audit, argc, argv);
+
+	for ( i=0; i<n_streams; i++ ) {
+		if ( streams[i].st != NULL ) stream_close(streams[i].st);
+		if ( streams[i].fd != -1 ) close(streams[i].fd);
+	}
+	free(streams);
+	free(audit);
+	free_symoplist(lm.sym);
+	cell_free(lm.cell);
+	reflist_free(lm.model);
+	reflist_free(lm.half[0]);
+	reflist_free(lm.half[1]);
+	free(output);
+	free(shell_file);
+
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * merge-model.c
+ *
+ * Running averages of intensities, for process_hkl and live_merge
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include <reflist.h>
+#include <crystal.h>
+#include <symmetry.h>
+#include <cell-utils.h>
+
+#include "merge-model.h"
+
+
+void apply_kpred(double k, RefList *list)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		set_kpred(refl, k);
+	}
+}
+
+
+/* Update the running mean and variance.  The sum of weights is kept in
+ * temp1 and the sum of squared deviations in temp2 */
+void add_to_model(RefList *model, signed int h, signed int k, signed int l,
+                  double intensity, double w)
+{
+	Reflection *model_version;
+	double temp, delta, R, mean, M2, sumweight;
+
+	model_version = find_refl(model, h, k, l);
+	if ( model_version == NULL ) {
+		model_version = add_refl(model, h, k, l);
+	}
+
+	mean = get_intensity(model_version);
+	sumweight = get_temp1(model_version);
+	M2 = get_temp2(model_version);
+
+	temp = w + sumweight;
+	delta = intensity - mean;
+	R = delta * w / temp;
+	set_intensity(model_version, mean + R);
+	set_temp2(model_version, M2 + sumweight * delta * R);
+	set_temp1(model_version, temp);
+
+	set_redundancy(model_version, get_redundancy(model_version)+1);
+}
+
+
+/* Add the reflections of 'cr', multiplied by 'scale', to 'model' and also to
+ * 'half' if it isn't NULL.  The k values and polarisation should already
+ * have been taken care of.  If 'merged' isn't NULL, it will be called for
+ * each reflection which was used, with indices in the asymmetric unit. */
+void merge_crystal_into_model(RefList *model, RefList *half, Crystal *cr,
+                              const SymOpList *sym, double scale,
+                              double min_snr, double max_adu,
+                              double push_res,
+                              void (*merged)(signed int h, signed int k,
+                                             signed int l, double intensity,
+                                             void *vp),
+                              void *vp)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	double max_res;
+
+	max_res = push_res + crystal_get_resolution_limit(cr);
+
+	for ( refl = first_refl(crystal_get_reflections(cr), &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		double refl_intensity, refl_sigma;
+		signed int h, k, l;
+		double res;
+
+		refl_intensity = scale * get_intensity(refl);
+		refl_sigma = scale * get_esd_intensity(refl);
+
+		if ( (min_snr > -INFINITY) && isnan(refl_sigma) ) continue;
+		if ( refl_intensity < min_snr * refl_sigma ) continue;
+
+		if ( get_peak(refl) > max_adu ) continue;
+
+		get_indices(refl, &h, &k, &l);
+
+		res = 2.0*resolution(crystal_get_cell(cr), h, k, l);
+		if ( res > max_res ) continue;
+
+		/* Put into the asymmetric unit for the target group */
+		get_asymm(sym, h, k, l, &h, &k, &l);
+
+		add_to_model(model, h, k, l, refl_intensity, 1.0);
+		if ( half != NULL ) {
+			add_to_model(half, h, k, l, refl_intensity, 1.0);
+		}
+
+		if ( merged != NULL ) merged(h, k, l, refl_intensity, vp);
+	}
+}
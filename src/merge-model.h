@@ -0,0 +1,53 @@
+/*
+ * merge-model.h
+ *
+ * Running averages of intensities, for process_hkl and live_merge
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MERGE_MODEL_H
+#define MERGE_MODEL_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <reflist.h>
+#include <crystal.h>
+#include <symmetry.h>
+
+extern void apply_kpred(double k, RefList *list);
+
+extern void add_to_model(RefList *model, signed int h, signed int k,
+                         signed int l, double intensity, double w);
+
+extern void merge_crystal_into_model(RefList *model, RefList *half,
+                                     Crystal *cr, const SymOpList *sym,
+                                     double scale, double min_snr,
+                                     double max_adu, double push_res,
+                                     void (*merged)(signed int h,
+                                                    signed int k,
+                                                    signed int l,
+                                                    double intensity,
+                                                    void *vp),
+                                     void *vp);
+
+#endif /* MERGE_MODEL_H */
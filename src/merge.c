@@ -55,6 +55,8 @@ struct merge_queue_args
 {
 	RefList *full;
 	pthread_rwlock_t full_lock;
+	RefList *half[2];  /* NULL if not needed */
+	pthread_rwlock_t half_lock[2];
 	Crystal **crystals;
 	int n_started;
 	double push_res;
@@ -99,9 +101,11 @@ static int alloc_contribs(struct reflection_contributions *c)
 
 
 /* Find reflection hkl in 'list', creating it if it's not there, under
- * protection of 'lock' and returning a locked reflection */
+ * protection of 'lock' and returning a locked reflection.  If 'track' is
+ * zero, the reflection will not have a contribution list. */
 static Reflection *get_locked_reflection(RefList *list, pthread_rwlock_t *lock,
-                                         signed int h, signed int k, signed  int l)
+                                         signed int h, signed int k, signed  int l,
+                                         int track)
 {
 	Reflection *f;
 
@@ -128,7 +132,11 @@ static Reflection *get_locked_reflection(RefList *list, pthread_rwlock_t *lock,
 			set_temp1(f, 0.0);
 			set_temp2(f, 0.0);
 
-			c = malloc(sizeof(struct reflection_contributions));
+			if ( track ) {
+				c = malloc(sizeof(struct reflection_contributions));
+			} else {
+				c = NULL;
+			}
 			if ( c != NULL ) {
 				c->n_contrib = 0;
 				c->max_contrib = 32;
@@ -160,6 +168,25 @@ static Reflection *get_locked_reflection(RefList *list, pthread_rwlock_t *lock,
 }
 
 
+/* Running mean and variance calculation */
+static void add_to_merge(Reflection *f, double w, double val)
+{
+	double mean, sumweight, M2, temp, delta, R;
+
+	mean = get_intensity(f);
+	sumweight = get_temp1(f);
+	M2 = get_temp2(f);
+
+	temp = w + sumweight;
+	delta = val - mean;
+	R = delta * w / temp;
+	set_intensity(f, mean + R);
+	set_temp2(f, M2 + sumweight * delta * R);
+	set_temp1(f, temp);
+	set_redundancy(f, get_redundancy(f)+1);
+}
+
+
 static void run_merge_job(void *vwargs, int cookie)
 {
 	struct merge_worker_args *wargs = vwargs;
@@ -170,9 +197,13 @@ static void run_merge_job(void *vwargs, int cookie)
 	Reflection *refl;
 	RefListIterator *iter;
 	double G, B;
+	int half;
 
 	wargs->n_reflections = 0;
 
+	/* Odd-numbered crystals go in the first half-dataset */
+	half = (wargs->crystal_number % 2) ? 0 : 1;
+
 	/* If this crystal's scaling was dodgy, it doesn't contribute to the
 	 * merged intensities */
 	if ( crystal_get_user_flag(cr) != 0 ) return;
@@ -186,8 +217,7 @@ static void run_merge_job(void *vwargs, int cookie)
 	{
 		Reflection *f;
 		signed int h, k, l;
-		double mean, sumweight, M2, temp, delta, R;
-		double res, w;
+		double res, w, val;
 		struct reflection_contributions *c;
 
 		if ( get_partiality(refl) < MIN_PART_MERGE ) continue;
@@ -204,48 +234,56 @@ static void run_merge_job(void *vwargs, int cookie)
 		}
 
 		get_indices(refl, &h, &k, &l);
-		f = get_locked_reflection(full, &wargs->qargs->full_lock,
-		                          h, k, l);
-
-		mean = get_intensity(f);
-		sumweight = get_temp1(f);
-		M2 = get_temp2(f);
+		if ( full != NULL ) {
+			f = get_locked_reflection(full,
+			                          &wargs->qargs->full_lock,
+			                          h, k, l, 1);
+		} else {
+			f = NULL;
+		}
 
 		res = resolution(crystal_get_cell(cr), h, k, l);
 
 		if ( 2.0*res > crystal_get_resolution_limit(cr)+push_res ) {
-			unlock_reflection(f);
+			if ( f != NULL ) unlock_reflection(f);
 			continue;
 		}
 
 		/* Reflections count less the more they have to be scaled up */
 		w = get_partiality(refl) / correct_reflection_nopart(1.0, refl, G, B, res);
 
-		/* Running mean and variance calculation */
-		temp = w + sumweight;
 		if ( ln_merge ) {
-			delta = log(correct_reflection(get_intensity(refl), refl, G, B, res)) - mean;
+			val = log(correct_reflection(get_intensity(refl), refl, G, B, res));
 		} else {
-			delta = correct_reflection(get_intensity(refl), refl, G,  B, res) - mean;
+			val = correct_reflection(get_intensity(refl), refl, G,  B, res);
 		}
-		R = delta * w / temp;
-		set_intensity(f, mean + R);
-		set_temp2(f, M2 + sumweight * delta * R);
-		set_temp1(f, temp);
-		set_redundancy(f, get_redundancy(f)+1);
-
-		/* Record this contribution */
-		c = get_contributions(f);
-		if ( c != NULL ) {
-			c->contribs[c->n_contrib] = refl;
-			c->contrib_crystals[c->n_contrib++] = cr;
-			if ( c->n_contrib == c->max_contrib ) {
-				c->max_contrib += 64;
-				alloc_contribs(c);
-			}
-		} /* else, too bad! */
+		if ( f != NULL ) {
 
-		unlock_reflection(f);
+			add_to_merge(f, w, val);
+
+			/* Record this contribution */
+			c = get_contributions(f);
+			if ( c != NULL ) {
+				c->contribs[c->n_contrib] = refl;
+				c->contrib_crystals[c->n_contrib++] = cr;
+				if ( c->n_contrib == c->max_contrib ) {
+					c->max_contrib += 64;
+					alloc_contribs(c);
+				}
+			} /* else, too bad! */
+
+			unlock_reflection(f);
+
+		}
+
+		if ( wargs->qargs->half[half] != NULL ) {
+			Reflection *fh;
+			fh = get_locked_reflection(wargs->qargs->half[half],
+			                           &wargs->qargs->half_lock[half],
+			                           h, k, l, 0);
+			add_to_merge(fh, w, val);
+			unlock_reflection(fh);
+		}
 
 		wargs->n_reflections++;
 
@@ -262,36 +300,14 @@ static void finalise_merge_job(void *vqargs, void *vwargs)
 }
 
 
-RefList *merge_intensities(Crystal **crystals, int n, int n_threads,
-                           int min_meas,
-                           double push_res, int use_weak, int ln_merge)
+/* Calculate ESDs from variances, including only reflections with
+ * enough measurements */
+static RefList *finalise_merge(RefList *full, int min_meas, int ln_merge)
 {
-	RefList *full;
 	RefList *full2;
-	struct merge_queue_args qargs;
 	Reflection *refl;
 	RefListIterator *iter;
 
-	if ( n == 0 ) return NULL;
-
-	full = reflist_new();
-
-	qargs.full = full;
-	qargs.n_started = 0;
-	qargs.crystals = crystals;
-	qargs.push_res = push_res;
-	qargs.use_weak = use_weak;
-	qargs.n_reflections = 0;
-	qargs.ln_merge = ln_merge;
-	pthread_rwlock_init(&qargs.full_lock, NULL);
-
-	run_threads(n_threads, run_merge_job, create_merge_job,
-	            finalise_merge_job, &qargs, n, 0, 0, 0);
-
-	pthread_rwlock_destroy(&qargs.full_lock);
-
-	/* Calculate ESDs from variances, including only reflections with
-	 * enough measurements */
 	full2 = reflist_new();
 	if ( full2 == NULL ) return NULL;
 	for ( refl = first_refl(full, &iter);
@@ -332,9 +348,11 @@ RefList *merge_intensities(Crystal **crystals, int n, int n_threads,
 			/* We do not need the contribution list any more */
 			struct reflection_contributions *c;
 			c = get_contributions(refl);
-			free(c->contribs);
-			free(c->contrib_crystals);
-			free(c);
+			if ( c != NULL ) {
+				free(c->contribs);
+				free(c->contrib_crystals);
+				free(c);
+			}
 
 		}
 	}
@@ -344,6 +362,101 @@ RefList *merge_intensities(Crystal **crystals, int n, int n_threads,
 }
 
 
+/* Does the work of merge_intensities_split() and merge_intensities_halves().
+ * If 'do_full' is zero, only the half-datasets are merged, and the return
+ * value is NULL. */
+static RefList *merge_all(Crystal **crystals, int n, int n_threads,
+                          int min_meas, double push_res, int use_weak,
+                          int ln_merge, int do_full, RefList **half1,
+                          RefList **half2)
+{
+	RefList *full;
+	struct merge_queue_args qargs;
+	int do_halves;
+	int i;
+
+	do_halves = (half1 != NULL) && (half2 != NULL);
+	if ( do_halves ) {
+		*half1 = NULL;
+		*half2 = NULL;
+	}
+
+	if ( n == 0 ) return NULL;
+
+	full = do_full ? reflist_new() : NULL;
+
+	qargs.full = full;
+	qargs.n_started = 0;
+	qargs.crystals = crystals;
+	qargs.push_res = push_res;
+	qargs.use_weak = use_weak;
+	qargs.n_reflections = 0;
+	qargs.ln_merge = ln_merge;
+	pthread_rwlock_init(&qargs.full_lock, NULL);
+	for ( i=0; i<2; i++ ) {
+		if ( do_halves && (n > 1) ) {
+			qargs.half[i] = reflist_new();
+		} else {
+			qargs.half[i] = NULL;
+		}
+		pthread_rwlock_init(&qargs.half_lock[i], NULL);
+	}
+
+	run_threads(n_threads, run_merge_job, create_merge_job,
+	            finalise_merge_job, &qargs, n, 0, 0, 0);
+
+	pthread_rwlock_destroy(&qargs.full_lock);
+	for ( i=0; i<2; i++ ) {
+		pthread_rwlock_destroy(&qargs.half_lock[i]);
+	}
+
+	if ( qargs.half[0] != NULL ) {
+		*half1 = finalise_merge(qargs.half[0], min_meas, ln_merge);
+		*half2 = finalise_merge(qargs.half[1], min_meas, ln_merge);
+	}
+
+	if ( full == NULL ) return NULL;
+	return finalise_merge(full, min_meas, ln_merge);
+}
+
+
+/* Like merge_intensities(), but at the same time merges the odd- and
+ * even-numbered crystals separately, for the two-way split (CC1/2 etc).
+ * The first half-dataset, stored at 'half1', contains crystals 1, 3, 5...,
+ * and the second, stored at 'half2', contains crystals 0, 2, 4...  The
+ * half-datasets do not have contribution lists.  If there are fewer than two
+ * crystals, 'half1' and 'half2' will be set to NULL. */
+RefList *merge_intensities_split(Crystal **crystals, int n, int n_threads,
+                                 int min_meas, double push_res, int use_weak,
+                                 int ln_merge, RefList **half1,
+                                 RefList **half2)
+{
+	return merge_all(crystals, n, n_threads, min_meas, push_res, use_weak,
+	                 ln_merge, 1, half1, half2);
+}
+
+
+/* Like merge_intensities_split(), but only merges the two half-datasets,
+ * for when the full merge isn't needed */
+void merge_intensities_halves(Crystal **crystals, int n, int n_threads,
+                              int min_meas, double push_res, int use_weak,
+                              int ln_merge, RefList **half1, RefList **half2)
+{
+	merge_all(crystals, n, n_threads, min_meas, push_res, use_weak,
+	          ln_merge, 0, half1, half2);
+}
+
+
+RefList *merge_intensities(Crystal **crystals, int n, int n_threads,
+                           int min_meas,
+                           double push_res, int use_weak, int ln_merge)
+{
+	return merge_intensities_split(crystals, n, n_threads, min_meas,
+	                               push_res, use_weak, ln_merge,
+	                               NULL, NULL);
+}
+
+
 /* Correct 'val' (probably an intensity from one pattern, maybe an e.s.d.)
  * for scaling and Lorentz factors but not partiality nor polarisation */
 double correct_reflection_nopart(double val, Reflection *refl, double osf,
@@ -47,6 +47,18 @@ extern RefList *merge_intensities(Crystal **crystals, int n, int n_threads,
                                   int min_meas, double push_res, int use_weak,
                                   int ln_merge);
 
+extern RefList *merge_intensities_split(Crystal **crystals, int n,
+                                        int n_threads, int min_meas,
+                                        double push_res, int use_weak,
+                                        int ln_merge, RefList **half1,
+                                        RefList **half2);
+
+extern void merge_intensities_halves(Crystal **crystals, int n,
+                                     int n_threads, int min_meas,
+                                     double push_res, int use_weak,
+                                     int ln_merge, RefList **half1,
+                                     RefList **half2);
+
 extern double correct_reflection_nopart(double val, Reflection *refl,
                                         double osf, double Bfac, double res);
 
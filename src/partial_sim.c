@@ -85,12 +85,96 @@ static void mess_up_cell(Crystal *cr, double cnoise, gsl_rng *rng)
 }
 
 
+/* Generates random full intensities for every reflection which can appear in
+ * a pattern from 'cell', so that the simulation threads only ever need to
+ * look them up.  The redundancies are set to zero, and will count how many
+ * times each reflection gets used. */
+static RefList *make_random_intensities(UnitCell *cell, const SymOpList *sym,
+                                        double max_q, double full_stddev,
+                                        gsl_rng *rng)
+{
+	RefList *full;
+	double ax, ay, az;
+	double bx, by, bz;
+	double cx, cy, cz;
+	int hmax, kmax, lmax;
+	signed int h, k, l;
+
+	full = reflist_new();
+	if ( full == NULL ) return NULL;
+
+	cell_get_cartesian(cell, &ax, &ay, &az, &bx, &by, &bz, &cx, &cy, &cz);
+	hmax = max_q * modulus(ax, ay, az);
+	kmax = max_q * modulus(bx, by, bz);
+	lmax = max_q * modulus(cx, cy, cz);
+
+	for ( h=-hmax; h<=hmax; h++ ) {
+	for ( k=-kmax; k<=kmax; k++ ) {
+	for ( l=-lmax; l<=lmax; l++ ) {
+
+		Reflection *refl;
+		signed int ha, ka, la;
+
+		if ( forbidden_reflection(cell, h, k, l) ) continue;
+		if ( 2.0*resolution(cell, h, k, l) > max_q ) continue;
+
+		get_asymm(sym, h, k, l, &ha, &ka, &la);
+		if ( find_refl(full, ha, ka, la) != NULL ) continue;
+
+		refl = add_refl(full, ha, ka, la);
+		set_intensity(refl, fabs(gaussian_noise(rng, 0.0, full_stddev)));
+		set_redundancy(refl, 0);
+
+	}
+	}
+	}
+
+	return full;
+}
+
+
+/* Returns a list of the random intensities which were actually used */
+static RefList *used_random_intensities(RefList *full, RefList *extra)
+{
+	RefList *used;
+	Reflection *refl;
+	RefListIterator *iter;
+
+	used = reflist_new();
+	if ( used == NULL ) return NULL;
+
+	for ( refl = first_refl(full, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		if ( get_redundancy(refl) == 0 ) continue;
+		get_indices(refl, &h, &k, &l);
+		copy_data(add_refl(used, h, k, l), refl);
+	}
+
+	for ( refl = first_refl(extra, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		get_indices(refl, &h, &k, &l);
+		copy_data(add_refl(used, h, k, l), refl);
+	}
+
+	return used;
+}
+
+
 /* For each reflection in "partial", fill in what the intensity would be
- * according to "full" */
+ * according to "full".  "full" is not modified (apart from the redundancies),
+ * so it can be read without locking.  If random intensities are being used,
+ * reflections which are not in "full" (which can only happen with a template
+ * stream) are generated and put in "extra", which needs the lock. */
 static void calculate_partials(Crystal *cr,
                                RefList *full, const SymOpList *sym,
                                int random_intensities,
-                               pthread_rwlock_t *full_lock,
+                               RefList *extra, pthread_mutex_t *extra_lock,
                                unsigned long int *n_ref, double *p_hist,
                                double *p_max, double max_q, double full_stddev,
                                double noise_stddev, gsl_rng *rng,
@@ -114,29 +198,25 @@ static void calculate_partials(Crystal *cr,
 		p = get_partiality(refl);
 		L = get_lorentz(refl);
 
-		pthread_rwlock_rdlock(full_lock);
 		rfull = find_refl(full, h, k, l);
-		pthread_rwlock_unlock(full_lock);
 
 		if ( rfull == NULL ) {
 			if ( random_intensities ) {
 
-				pthread_rwlock_wrlock(full_lock);
-
-				/* In the gap between the unlock and the wrlock,
-				 * the reflection might have been created by
-				 * another thread.  So, we must check again */
-				rfull = find_refl(full, h, k, l);
+				pthread_mutex_lock(extra_lock);
+				rfull = find_refl(extra, h, k, l);
 				if ( rfull == NULL ) {
-					rfull = add_refl(full, h, k, l);
+					rfull = add_refl(extra, h, k, l);
 					If = fabs(gaussian_noise(rng, 0.0,
 					                         full_stddev));
 					set_intensity(rfull, If);
 					set_redundancy(rfull, 1);
 				} else {
 					If = get_intensity(rfull);
+					set_redundancy(rfull,
+					               get_redundancy(rfull)+1);
 				}
-				pthread_rwlock_unlock(full_lock);
+				pthread_mutex_unlock(extra_lock);
 
 			} else {
 				set_redundancy(refl, 0);
@@ -173,10 +253,8 @@ static void calculate_partials(Crystal *cr,
 }
 
 
-static void draw_and_write_image(struct image *image,
-                                 const DataTemplate *dtempl,
-                                 RefList *reflections,
-                                 gsl_rng *rng, double background)
+static void draw_image(struct image *image, RefList *reflections,
+                       gsl_rng *rng, double background)
 {
 	Reflection *refl;
 	RefListIterator *iter;
@@ -229,13 +307,123 @@ static void draw_and_write_image(struct image *image,
 
 		image->dp[pn][fs + p->w*ss] += Ip;
 	}
+}
 
-	image_write(image, dtempl, image->filename);
 
-	for ( i=0; i<image->detgeom->n_panels; i++ ) {
-		free(image->dp[i]);
+/* The images are written by a thread of their own, because image_write()
+ * can't be used from several threads at once, and so that the simulation
+ * threads don't have to wait for the disk. */
+struct image_writer
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const DataTemplate *dtempl;
+
+	struct image **queue;
+	int max_queued;
+	int first;
+	int n_queued;
+	int finished;
+};
+
+
+static void *image_writer_thread(void *vp)
+{
+	struct image_writer *w = vp;
+
+	do {
+
+		struct image *image;
+
+		pthread_mutex_lock(&w->lock);
+		while ( (w->n_queued == 0) && !w->finished ) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if ( w->n_queued == 0 ) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		image = w->queue[w->first];
+		w->first = (w->first + 1) % w->max_queued;
+		w->n_queued--;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+
+		image_write(image, w->dtempl, image->filename);
+		image_free(image);
+
+	} while ( 1 );
+
+	return NULL;
+}
+
+
+static struct image_writer *start_image_writer(const DataTemplate *dtempl,
+                                               int max_queued)
+{
+	struct image_writer *w;
+
+	w = malloc(sizeof(struct image_writer));
+	if ( w == NULL ) return NULL;
+
+	w->queue = malloc(max_queued*sizeof(struct image *));
+	if ( w->queue == NULL ) {
+		free(w);
+		return NULL;
+	}
+
+	w->dtempl = dtempl;
+	w->max_queued = max_queued;
+	w->first = 0;
+	w->n_queued = 0;
+	w->finished = 0;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	if ( pthread_create(&w->thread, NULL, image_writer_thread, w) ) {
+		ERROR("Couldn't start image writer thread.\n");
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+		free(w->queue);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+
+/* Hands over the image to the writer, which will free it afterwards.  Waits
+ * if the writer is already too far behind. */
+static void queue_image(struct image_writer *w, struct image *image)
+{
+	pthread_mutex_lock(&w->lock);
+	while ( w->n_queued == w->max_queued ) {
+		pthread_cond_wait(&w->cond, &w->lock);
 	}
-	free(image->dp);
+	w->queue[(w->first + w->n_queued) % w->max_queued] = image;
+	w->n_queued++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+/* Waits for all the queued images to be written */
+static void finish_image_writer(struct image_writer *w)
+{
+	if ( w == NULL ) return;
+
+	pthread_mutex_lock(&w->lock);
+	w->finished = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_join(w->thread, NULL);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	free(w->queue);
+	free(w);
 }
 
 
@@ -280,7 +468,8 @@ static void show_help(const char *s)
 struct partial_sim_queue_args
 {
 	RefList *full;
-	pthread_rwlock_t full_lock;
+	RefList *extra;
+	pthread_mutex_t extra_lock;
 	const DataTemplate *dtempl;
 
 	int n_done;
@@ -300,6 +489,7 @@ struct partial_sim_queue_args
 	double max_q;
 
 	char *image_prefix;
+	struct image_writer *writer;
 
 	/* The overall histogram */
 	double p_hist[NBINS];
@@ -451,17 +641,15 @@ static void run_job(void *vwargs, int cookie)
 
 	calculate_partials(cr, qargs->full,
 	                   qargs->sym, qargs->random_intensities,
-	                   &qargs->full_lock,
+	                   qargs->extra, &qargs->extra_lock,
 	                   wargs->n_ref, wargs->p_hist, wargs->p_max,
 	                   qargs->max_q, qargs->full_stddev,
 	                   qargs->noise_stddev, qargs->rngs[cookie],
 	                   wargs->template_cell, wargs->template_reflist);
 
 	if ( qargs->image_prefix != NULL ) {
-		draw_and_write_image(image, qargs->dtempl,
-		                     crystal_get_reflections(cr),
-		                     qargs->rngs[cookie],
-		                     qargs->background);
+		draw_image(image, crystal_get_reflections(cr),
+		           qargs->rngs[cookie], qargs->background);
 	}
 
 	/* Give a slightly incorrect cell in the stream */
@@ -495,7 +683,11 @@ static void finalise_job(void *vqargs, void *vwargs)
 	qargs->n_done++;
 	progress_bar(qargs->n_done, qargs->n_to_do, "Simulating");
 
-	image_free(wargs->image);
+	if ( qargs->writer != NULL ) {
+		queue_image(qargs->writer, wargs->image);
+	} else {
+		image_free(wargs->image);
+	}
 }
 
 
@@ -759,11 +951,6 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if ( (n_threads > 1) && (image_prefix != NULL) ) {
-		ERROR("Option \"--images\" is incompatible with \"-j\".\n");
-		return 1;
-	}
-
 	/* Load cell */
 	if ( cellfile == NULL ) {
 		ERROR("You need to give a PDB file with the unit cell.\n");
@@ -913,12 +1100,8 @@ int main(int argc, char *argv[])
 		       template);
 	}
 
-	if ( random_intensities ) {
-		full = reflist_new();
-	}
-
-	qargs.full = full;
-	pthread_rwlock_init(&qargs.full_lock, NULL);
+	qargs.extra = reflist_new();
+	pthread_mutex_init(&qargs.extra_lock, NULL);
 	qargs.n_to_do = n;
 	qargs.n_done = 0;
 	qargs.n_started = 0;
@@ -987,12 +1170,33 @@ int main(int argc, char *argv[])
 		qargs.p_max[i] = 0.0;
 	}
 
+	if ( random_intensities ) {
+		full = make_random_intensities(cell, sym, qargs.max_q,
+		                               full_stddev, qargs.rngs[0]);
+		if ( full == NULL ) {
+			ERROR("Failed to generate random intensities.\n");
+			return 1;
+		}
+	}
+	qargs.full = full;
+
+	if ( image_prefix != NULL ) {
+		qargs.writer = start_image_writer(dtempl, 2*n_threads);
+		if ( qargs.writer == NULL ) return 1;
+	} else {
+		qargs.writer = NULL;
+	}
+
 	run_threads(n_threads, run_job, create_job, finalise_job,
 	            &qargs, n, 0, 0, 0);
 
+	finish_image_writer(qargs.writer);
+
 	if ( random_intensities ) {
+		RefList *used = used_random_intensities(full, qargs.extra);
 		STATUS("Writing full intensities to %s\n", save_file);
-		write_reflist_2(save_file, full, sym);
+		write_reflist_2(save_file, used, sym);
+		reflist_free(used);
 	}
 
 	if ( phist_file != NULL ) {
@@ -1048,7 +1252,8 @@ int main(int argc, char *argv[])
 		gsl_rng_free(qargs.rngs[i]);
 	}
 	free(qargs.rngs);
-	pthread_rwlock_destroy(&qargs.full_lock);
+	pthread_mutex_destroy(&qargs.extra_lock);
+	reflist_free(qargs.extra);
 	stream_close(stream);
 	cell_free(cell);
 	data_template_free(dtempl);
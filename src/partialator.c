@@ -168,65 +168,32 @@ static void add_to_csplit(struct custom_split *csplit, const char *id,
 }
 
 
-/* Write two-way split results (i.e. for CC1/2 etc) for this list of crystals */
-static void write_split(Crystal **crystals, int n_crystals, const char *outfile,
-                        int nthreads, PartialityModel pmodel,
-                        int min_measurements, SymOpList *sym, double push_res)
+static int write_merged(const char *filename, RefList *list, SymOpList *sym,
+                        int binary)
 {
-	char tmp[1024];
-	RefList *split;
-	Crystal **crystals1;
-	Crystal **crystals2;
-	int n_crystals1 = 0;
-	int n_crystals2 = 0;
-	int i;
-
-	if ( n_crystals == 0 ) {
-		ERROR("No crystals for split!\n");
-		return;
-	}
-
-	crystals1 = malloc(n_crystals * sizeof(Crystal *));
-	if ( crystals1 == NULL ) return;
-
-	crystals2 = malloc(n_crystals * sizeof(Crystal *));
-	if ( crystals2 == NULL ) return;
+	if ( binary ) return write_reflist_binary(filename, list, sym, NULL);
+	return write_reflist_2(filename, list, sym);
+}
 
 
-	for ( i=0; i<n_crystals; i++ ) {
-		if ( i % 2 ) {
-			crystals1[n_crystals1] = crystals[i];
-			n_crystals1++;
-		} else {
-			crystals2[n_crystals2] = crystals[i];
-			n_crystals2++;
-		}
-	}
-	snprintf(tmp, 1024, "%s1", outfile);
-	split = merge_intensities(crystals1, n_crystals1, nthreads,
-		                  min_measurements, push_res, 1, 0);
+/* Write two-way split results (i.e. for CC1/2 etc), as calculated by
+ * merge_intensities_split() */
+static void write_split(RefList *half1, RefList *half2, const char *outfile,
+                        SymOpList *sym, int binary, int verbose)
+{
+	char tmp[1024];
 
-	if ( split == NULL ) {
+	if ( (half1 == NULL) || (half2 == NULL) ) {
 		ERROR("Not enough crystals for two way split!\n");
-		free(crystals1);
-		free(crystals2);
 		return;
 	}
 
-	STATUS("Writing two-way split to %s ", tmp);
-	write_reflist_2(tmp, split, sym);
-	free_contribs(split);
-	reflist_free(split);
+	snprintf(tmp, 1024, "%s1", outfile);
+	if ( verbose ) STATUS("Writing two-way split to %s ", tmp);
+	write_merged(tmp, half1, sym, binary);
 	snprintf(tmp, 1024, "%s2", outfile);
-	split = merge_intensities(crystals2, n_crystals2, nthreads,
-		                  min_measurements, push_res, 1, 0);
-	STATUS("and %s\n", tmp);
-	write_reflist_2(tmp, split, sym);
-	free_contribs(split);
-	reflist_free(split);
-
-	free(crystals1);
-	free(crystals2);
+	if ( verbose ) STATUS("and %s\n", tmp);
+	write_merged(tmp, half2, sym, binary);
 }
 
 
@@ -257,25 +224,62 @@ static char *insert_into_filename(const char *fn, const char *add)
 }
 
 
-/* Write custom split results (including a two-way split) */
-static void write_custom_split(struct custom_split *csplit, int dsn,
-                               Crystal **crystals, int n_crystals,
-                               PartialityModel pmodel, int min_measurements,
-                               double push_res, SymOpList *sym, int nthreads,
-                               const char *outfile)
+struct csplit_dataset
 {
-	char *tmp;
-	RefList *split;
-	Crystal *crystalsn[n_crystals];
-	int n_crystalsn = 0;
+	const char *name;
+	char *filename;
+	Crystal **crystals;
+	int n_crystals;
+};
+
+
+static void free_datasets(struct csplit_dataset *datasets, int n_datasets)
+{
+	int i;
+	for ( i=0; i<n_datasets; i++ ) {
+		free(datasets[i].filename);
+		free(datasets[i].crystals);
+	}
+	free(datasets);
+}
+
+
+/* Sort the crystals into the custom split datasets, in one pass over the
+ * crystals.  The crystals stay in the same order within each dataset. */
+static struct csplit_dataset *sort_into_datasets(struct custom_split *csplit,
+                                                 Crystal **crystals,
+                                                 int n_crystals,
+                                                 const char *outfile)
+{
+	struct csplit_dataset *datasets;
 	int i;
 
+	datasets = malloc(csplit->n_datasets*sizeof(struct csplit_dataset));
+	if ( datasets == NULL ) return NULL;
+
+	for ( i=0; i<csplit->n_datasets; i++ ) {
+		datasets[i].name = csplit->dataset_names[i];
+		datasets[i].filename = insert_into_filename(outfile,
+		                                            datasets[i].name);
+		datasets[i].crystals = malloc(n_crystals*sizeof(Crystal *));
+		datasets[i].n_crystals = 0;
+	}
+	for ( i=0; i<csplit->n_datasets; i++ ) {
+		if ( (datasets[i].filename == NULL)
+		  || (datasets[i].crystals == NULL) )
+		{
+			free_datasets(datasets, csplit->n_datasets);
+			return NULL;
+		}
+	}
+
 	for ( i=0; i<n_crystals; i++ ) {
 
 		const char *fn;
 		char *evs;
 		char *id;
-		int dsn_crystal;
+		int dsn;
+		struct csplit_dataset *ds;
 
 		fn = crystal_get_image(crystals[i])->filename;
 		evs = crystal_get_image(crystals[i])->ev;
@@ -284,39 +288,166 @@ static void write_custom_split(struct custom_split *csplit, int dsn,
 		id = malloc(strlen(evs)+strlen(fn)+2);
 		if ( id == NULL ) {
 			ERROR("Failed to allocate ID\n");
-			return;
+			free_datasets(datasets, csplit->n_datasets);
+			return NULL;
 		}
 		strcpy(id, fn);
 		strcat(id, " ");
 		strcat(id, evs);
-		dsn_crystal = find_dsn_for_id(csplit, id);
+		dsn = find_dsn_for_id(csplit, id);
 		free(id);
-		if ( dsn == dsn_crystal ) {
-			crystalsn[n_crystalsn] = crystals[i];
-			n_crystalsn++;
-		}
+		if ( dsn < 0 ) continue;
+
+		ds = &datasets[dsn];
+		ds->crystals[ds->n_crystals++] = crystals[i];
 
 	}
 
-	tmp = insert_into_filename(outfile, csplit->dataset_names[dsn]);
+	return datasets;
+}
+
 
-	if ( n_crystalsn == 0 ) {
-		ERROR("Not writing dataset '%s' because it contains no "
-		      "crystals\n", csplit->dataset_names[dsn]);
-		return;
+struct csplit_qargs
+{
+	struct csplit_dataset *datasets;
+	int n_datasets;
+	int next;
+	int n_done;
+	int n_to_do;
+	int min_measurements;
+	double push_res;
+	SymOpList *sym;
+	int nthreads;  /* For each merge */
+	int binary;
+};
+
+
+struct csplit_args
+{
+	struct csplit_qargs *qargs;
+	struct csplit_dataset *ds;
+};
+
+
+static void *get_csplit_task(void *vp)
+{
+	struct csplit_qargs *qargs = vp;
+	struct csplit_args *task;
+
+	/* Skip empty datasets */
+	while ( (qargs->next < qargs->n_datasets)
+	     && (qargs->datasets[qargs->next].n_crystals == 0) )
+	{
+		qargs->next++;
 	}
+	if ( qargs->next >= qargs->n_datasets ) return NULL;
+
+	task = malloc(sizeof(struct csplit_args));
+	if ( task == NULL ) return NULL;
+
+	task->qargs = qargs;
+	task->ds = &qargs->datasets[qargs->next++];
 
-	STATUS("Writing dataset '%s' to %s (%i crystals)\n",
-	       csplit->dataset_names[dsn], tmp, n_crystalsn);
-	split = merge_intensities(crystalsn, n_crystalsn, nthreads,
-		                  min_measurements, push_res, 1, 0);
-	write_reflist_2(tmp, split, sym);
+	return task;
+}
+
+
+static void write_csplit_dataset(void *vp, int cookie)
+{
+	struct csplit_args *args = vp;
+	struct csplit_qargs *qargs = args->qargs;
+	struct csplit_dataset *ds = args->ds;
+	RefList *split;
+	RefList *half1;
+	RefList *half2;
+
+	split = merge_intensities_split(ds->crystals, ds->n_crystals,
+	                                qargs->nthreads,
+	                                qargs->min_measurements,
+	                                qargs->push_res, 1, 0, &half1, &half2);
+	write_merged(ds->filename, split, qargs->sym, qargs->binary);
 	free_contribs(split);
 	reflist_free(split);
 
-	write_split(crystalsn, n_crystalsn, tmp, nthreads, pmodel,
-	            min_measurements, sym, push_res);
-	free(tmp);
+	/* The message for too few crystals was already given */
+	if ( ds->n_crystals > 1 ) {
+		write_split(half1, half2, ds->filename, qargs->sym,
+		            qargs->binary, 0);
+	}
+	reflist_free(half1);
+	reflist_free(half2);
+}
+
+
+static void done_csplit_dataset(void *vqargs, void *vp)
+{
+	struct csplit_qargs *qargs = vqargs;
+	qargs->n_done++;
+	progress_bar(qargs->n_done, qargs->n_to_do, "Writing custom splits");
+	free(vp);
+}
+
+
+/* Write custom split results (including a two-way split) for all the
+ * datasets.  The datasets are merged and written in parallel, but the
+ * results are the same as for merging them one after the other. */
+static void write_custom_splits(struct custom_split *csplit,
+                                Crystal **crystals, int n_crystals,
+                                int min_measurements, double push_res,
+                                SymOpList *sym, int nthreads,
+                                const char *outfile, int binary)
+{
+	struct csplit_dataset *datasets;
+	struct csplit_qargs qargs;
+	int n_nonempty = 0;
+	int i;
+
+	datasets = sort_into_datasets(csplit, crystals, n_crystals, outfile);
+	if ( datasets == NULL ) {
+		ERROR("Failed to sort crystals for custom split\n");
+		return;
+	}
+
+	/* Messages in the same order as if we did it one at a time */
+	for ( i=0; i<csplit->n_datasets; i++ ) {
+		struct csplit_dataset *ds = &datasets[i];
+		if ( ds->n_crystals == 0 ) {
+			ERROR("Not writing dataset '%s' because it contains "
+			      "no crystals\n", ds->name);
+			continue;
+		}
+		STATUS("Writing dataset '%s' to %s (%i crystals)\n",
+		       ds->name, ds->filename, ds->n_crystals);
+		if ( ds->n_crystals > 1 ) {
+			STATUS("Writing two-way split to %s1 and %s2\n",
+			       ds->filename, ds->filename);
+		} else {
+			ERROR("Not enough crystals for two way split!\n");
+		}
+		n_nonempty++;
+	}
+
+	qargs.datasets = datasets;
+	qargs.n_datasets = csplit->n_datasets;
+	qargs.next = 0;
+	qargs.n_done = 0;
+	qargs.n_to_do = n_nonempty;
+	qargs.min_measurements = min_measurements;
+	qargs.push_res = push_res;
+	qargs.sym = sym;
+	qargs.binary = binary;
+
+	/* Share out the threads between the datasets, and use any left over
+	 * within the merges */
+	qargs.nthreads = 1;
+	if ( (n_nonempty > 0) && (nthreads > n_nonempty) ) {
+		qargs.nthreads = nthreads / n_nonempty;
+	}
+
+	run_threads(nthreads, write_csplit_dataset, get_csplit_task,
+	            done_csplit_dataset, &qargs, n_nonempty, 0, 0, 0);
+
+	free_datasets(datasets, csplit->n_datasets);
 }
 
 
@@ -332,6 +463,7 @@ static void show_help(const char *s)
 "  -i, --input=<filename>     Specify the name of the input 'stream'.\n"
 "  -o, --output=<filename>    Output filename.  Default: partialator.hkl.\n"
 "      --output-every-cycle   Write .hkl* and .params files in every cycle.\n"
+"      --binary-output        Write reflection lists in the binary format.\n"
 "  -y, --symmetry=<sym>       Merge according to symmetry <sym>.\n"
 "      --start-after=<n>      Skip <n> crystals at the start of the stream.\n"
 "      --stop-after=<n>       Stop after merging <n> crystals.\n"
@@ -1075,6 +1207,8 @@ int main(int argc, char *argv[])
 	int istream, icmd, icryst, itn;
 	int n_iter = 10;
 	RefList *full;
+	RefList *half1;
+	RefList *half2;
 	int n_images = 0;
 	int n_crystals = 0;
 	int n_crystals_seen = 0;
@@ -1115,6 +1249,7 @@ int main(int argc, char *argv[])
 	double min_res = 0.0;
 	int do_write_logs = 0;
 	int no_deltacchalf = 0;
+	int binary_output = 0;
 	char *harvest_file = NULL;
 	char *log_folder = "pr-logs";
 
@@ -1159,6 +1294,7 @@ int main(int argc, char *argv[])
 		{"output-every-cycle", 0, &output_everycycle,  1},
 		{"no-logs",            0, &no_logs,            1},
 		{"no-deltacchalf",     0, &no_deltacchalf,     1},
+		{"binary-output",      0, &binary_output,      1},
 
 		{0, 0, NULL, 0}
 	};
@@ -1716,6 +1852,9 @@ int main(int argc, char *argv[])
 	/* Iterate */
 	for ( itn=0; itn<n_iter; itn++ ) {
 
+		half1 = NULL;
+		half2 = NULL;
+
 		STATUS("Scaling and refinement cycle %i of %i\n", itn+1, n_iter);
 
 		if ( !no_pr ) {
@@ -1732,8 +1871,8 @@ int main(int argc, char *argv[])
 				scale_all(crystals, n_crystals, nthreads,
 				          scaleflags);
 			}
-			full = merge_intensities(crystals, n_crystals, nthreads,
-			                         min_measurements,
+			full = merge_intensities(crystals, n_crystals,
+			                         nthreads, min_measurements,
 			                         push_res, 1, 0);
 		} /* else full still equals reference */
 
@@ -1753,28 +1892,32 @@ int main(int argc, char *argv[])
 
 			/* Output results */
 			STATUS("Writing overall results to %s\n", tmp);
-			write_reflist_2(tmp, full, sym);
-
-			/* Output split results */
-			write_split(crystals, n_crystals, tmp, nthreads, pmodel,
-			            min_measurements, sym, push_res);
+			write_merged(tmp, full, sym, binary_output);
+
+			/* Output split results.  These need their own merge,
+			 * because they should not include the crystals which
+			 * were just rejected. */
+			merge_intensities_halves(crystals, n_crystals,
+			                         nthreads, min_measurements,
+			                         push_res, 1, 0,
+			                         &half1, &half2);
+			write_split(half1, half2, tmp, sym, binary_output, 1);
+			reflist_free(half1);
+			reflist_free(half2);
 
 			/* Output custom split results */
 			if ( csplit != NULL ) {
-				int j;
-				for ( j=0; j<csplit->n_datasets; j++ ) {
-					write_custom_split(csplit, j, crystals,
-					                   n_crystals, pmodel,
-					                   min_measurements,
-							   push_res, sym,
-					                   nthreads, tmp);
-				}
+				write_custom_splits(csplit, crystals,
+				                    n_crystals,
+				                    min_measurements,
+				                    push_res, sym, nthreads,
+				                    tmp, binary_output);
 			}
 
 		}
 	}
 
-	/* Final merge */
+	/* Final merge, including the two-way split */
 	STATUS("Final merge...\n");
 	if ( reference == NULL ) {
 		free_contribs(full);
@@ -1782,13 +1925,10 @@ int main(int argc, char *argv[])
 		if ( !no_scale ) {
 			scale_all(crystals, n_crystals, nthreads, scaleflags);
 		}
-		full = merge_intensities(crystals, n_crystals, nthreads,
-		                         min_measurements,
-		                         push_res, 1, 0);
-	} else {
-		full = merge_intensities(crystals, n_crystals, nthreads,
-		                         min_measurements, push_res, 1, 0);
 	}
+	full = merge_intensities_split(crystals, n_crystals, nthreads,
+	                               min_measurements, push_res, 1, 0,
+	                               &half1, &half2);
 
 	/* Write final figures of merit (no rejection any more) */
 	show_all_residuals(crystals, n_crystals, full, no_free);
@@ -1806,20 +1946,18 @@ int main(int argc, char *argv[])
 		reflist_add_notes(full, audit_info);
 		free(audit_info);
 	}
-	write_reflist_2(outfile, full, sym);
+	write_merged(outfile, full, sym, binary_output);
 
 	/* Output split results */
-	write_split(crystals, n_crystals, outfile, nthreads, pmodel,
-	            min_measurements, sym, push_res);
+	write_split(half1, half2, outfile, sym, binary_output, 1);
+	reflist_free(half1);
+	reflist_free(half2);
 
 	/* Output custom split results */
 	if ( csplit != NULL ) {
-		int i;
-		for ( i=0; i<csplit->n_datasets; i++ ) {
-			write_custom_split(csplit, i, crystals, n_crystals,
-			                   pmodel, min_measurements, push_res,
-			                   sym, nthreads, outfile);
-		}
+		write_custom_splits(csplit, crystals, n_crystals,
+		                    min_measurements, push_res, sym, nthreads,
+		                    outfile, binary_output);
 	}
 
 	/* Clean up */
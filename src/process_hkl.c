@@ -55,6 +55,7 @@
 #include <cell-utils.h>
 
 #include "version.h"
+#include "merge-model.h"
 
 
 static void show_help(const char *s)
@@ -256,16 +257,30 @@ static double *check_hist_size(int n, double *hist_vals)
 }
 
 
-static void apply_kpred(double k, RefList *list)
+struct hist_data
 {
-	Reflection *refl;
-	RefListIterator *iter;
+	double **vals;
+	int *n;
+	signed int h;
+	signed int k;
+	signed int l;
+};
 
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		set_kpred(refl, k);
+
+static void add_to_hist(signed int h, signed int k, signed int l,
+                        double intensity, void *vp)
+{
+	struct hist_data *hist = vp;
+
+	if ( *hist->vals == NULL ) return;
+	if ( (h != hist->h) || (k != hist->k) || (l != hist->l) ) return;
+
+	*hist->vals = check_hist_size(*hist->n, *hist->vals);
+
+	/* Check again because realloc might have failed */
+	if ( *hist->vals != NULL ) {
+		(*hist->vals)[*hist->n] = intensity;
+		*hist->n += 1;
 	}
 }
 
@@ -278,10 +293,9 @@ static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
                          double push_res, double min_cc, int do_scale,
                          FILE *stat)
 {
-	Reflection *refl;
-	RefListIterator *iter;
 	RefList *new_refl;
 	double scale;
+	struct hist_data hist;
 
 	new_refl = crystal_get_reflections(cr);
 
@@ -309,75 +323,14 @@ static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
 		scale = 1.0;
 	}
 
-	for ( refl = first_refl(crystal_get_reflections(cr), &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		double refl_intensity, refl_sigma, refl_pk;
-		signed int h, k, l;
-		int model_redundancy;
-		Reflection *model_version;
-		double w;
-		double temp, delta, R, mean, M2, sumweight;
-		double res, max_res;
-
-		refl_intensity = scale * get_intensity(refl);
-		refl_sigma = scale * get_esd_intensity(refl);
-		refl_pk = get_peak(refl);
-		w = 1.0;//pow(refl_sigma, -2.0);
-
-		if ( (min_snr > -INFINITY) && isnan(refl_sigma) ) continue;
-		if ( refl_intensity < min_snr * refl_sigma ) continue;
+	hist.vals = hist_vals;
+	hist.n = hist_n;
+	hist.h = hist_h;
+	hist.k = hist_k;
+	hist.l = hist_l;
 
-		if ( refl_pk > max_adu ) continue;
-
-		get_indices(refl, &h, &k, &l);
-
-		max_res = push_res + crystal_get_resolution_limit(cr);
-		res = 2.0*resolution(crystal_get_cell(cr), h, k, l);
-		if ( res > max_res ) continue;
-
-		/* Put into the asymmetric unit for the target group */
-		get_asymm(sym, h, k, l, &h, &k, &l);
-
-		model_version = find_refl(model, h, k, l);
-		if ( model_version == NULL ) {
-			model_version = add_refl(model, h, k, l);
-		}
-
-		mean = get_intensity(model_version);
-		sumweight = get_temp1(model_version);
-		M2 = get_temp2(model_version);
-
-		temp = w + sumweight;
-		delta = refl_intensity - mean;
-		R = delta * w / temp;
-		set_intensity(model_version, mean + R);
-		set_temp2(model_version, M2 + sumweight * delta * R);
-		set_temp1(model_version, temp);
-
-		model_redundancy = get_redundancy(model_version);
-		set_redundancy(model_version, ++model_redundancy);
-
-		if ( *hist_vals != NULL ) {
-
-			if ( (h==hist_h) && (k==hist_k) && (l==hist_l) ) {
-
-				*hist_vals = check_hist_size(*hist_n,
-							     *hist_vals);
-
-				/* Check again because realloc might have
-				 * failed */
-				if ( *hist_vals != NULL ) {
-					(*hist_vals)[*hist_n] = refl_intensity;
-					*hist_n += 1;
-				}
-
-			}
-
-		}
-
-	}
+	merge_crystal_into_model(model, NULL, cr, sym, scale, min_snr, max_adu,
+	                         push_res, add_to_hist, &hist);
 
 	return 0;
 }
@@ -107,7 +107,8 @@ static struct image *file_wait_open_read(const char *filename,
                                          signed int wait_for_file,
                                          int cookie,
                                          int no_image_data,
-                                         int no_mask_data)
+                                         int no_mask_data,
+                                         PixelStorageType compact_type)
 {
 	signed int file_wait_time = wait_for_file;
 	int wait_message_done = 0;
@@ -152,8 +153,9 @@ static struct image *file_wait_open_read(const char *filename,
 		sb_shared->pings[cookie]++;
 
 		profile_start("image-read");
-		image = image_read(dtempl, filename, event,
-		                   no_image_data, no_mask_data);
+		image = image_read_compact(dtempl, filename, event,
+		                           no_image_data, no_mask_data,
+		                           compact_type);
 		profile_end("image-read");
 		if ( image == NULL ) {
 			if ( wait_for_file && !read_retry_done ) {
@@ -174,6 +176,38 @@ static struct image *file_wait_open_read(const char *filename,
 }
 
 
+/* Tell the sandbox master when each stage finished.  Stages which were
+ * skipped are taken to have finished at the same time as the previous one. */
+static void set_latency_trace(struct chunk_info *info,
+                              struct pattern_args *pargs,
+                              double t_decoded, double t_peaks,
+                              double t_indexed, double t_integrated)
+{
+	if ( t_indexed < 0.0 ) t_indexed = t_peaks;
+	if ( t_integrated < 0.0 ) t_integrated = t_indexed;
+
+	info->have_trace = 1;
+	info->trace[0] = pargs->t_fetch_start;
+	info->trace[1] = pargs->t_fetch_end;
+	info->trace[2] = t_decoded;
+	info->trace[3] = t_peaks;
+	info->trace[4] = t_indexed;
+	info->trace[5] = t_integrated;
+}
+
+
+/* Tell the sandbox master that a frame is finished even though there is no
+ * chunk for it, so that it is recorded in the checkpoint */
+static void publish_no_chunk(struct pattern_args *pargs, int serial)
+{
+	struct chunk_info info;
+
+	memset(&info, 0, sizeof(info));
+	info.serial = serial;
+	im_chunkring_publish(pargs->ring, &info);
+}
+
+
 void process_image(const struct index_args *iargs, struct pattern_args *pargs,
                    Stream *st, int cookie, const char *tmpdir,
                    int serial, struct sb_shm *sb_shared,
@@ -185,7 +219,18 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 	int ret;
 	char *rn;
 	float **prefilter;
+	void **prefilter_compact = NULL;
+	PixelStorageType prefilter_compact_type = PIXEL_STORAGE_FLOAT;
+	float prefilter_compact_scale = 1.0;
 	int any_crystals;
+	double t_decoded, t_peaks;
+	double t_indexed = -1.0;
+	double t_integrated = -1.0;
+	double t_write;
+	int too_late;
+	int degraded = 0;
+	struct chunk_info info;
+	struct worker_stats *stats = &sb_shared->stats[cookie];
 
 	if ( pargs->zmq_data != NULL ) {
 
@@ -200,7 +245,10 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		                              iargs->no_image_data,
 		                              iargs->no_mask_data);
 		profile_end("read-zmq-data");
-		if ( image == NULL ) return;
+		if ( image == NULL ) {
+			publish_no_chunk(pargs, serial);
+			return;
+		}
 
 		/* image_read_data_block() will leave the filename/event as
 		 * NULL, because there's no file (duh).  Fill them in now with
@@ -222,7 +270,10 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		                              iargs->no_image_data,
 		                              iargs->no_mask_data);
 		profile_end("read-asapo-data");
-		if ( image == NULL ) return;
+		if ( image == NULL ) {
+			publish_no_chunk(pargs, serial);
+			return;
+		}
 
 		/* image_read_data_block() will leave the filename/event as
 		 * NULL, because there's no file (duh).  Fill them in now with
@@ -238,19 +289,25 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		                            iargs->wait_for_file,
 		                            cookie,
 		                            iargs->no_image_data,
-		                            iargs->no_mask_data);
+		                            iargs->no_mask_data,
+		                            (iargs->compact_scale == 1.0)
+		                              ? iargs->compact_pixels
+		                              : PIXEL_STORAGE_FLOAT);
 		profile_end("file-wait-open-read");
 		if ( image == NULL ) {
 			if ( iargs->wait_for_file != 0 ) {
 				pthread_mutex_lock(&sb_shared->totals_lock);
 				sb_shared->should_shutdown = 1;
 				pthread_mutex_unlock(&sb_shared->totals_lock);
+			} else {
+				publish_no_chunk(pargs, serial);
 			}
 			return;
 		}
 	}
 
 	image->serial = serial;
+	t_decoded = get_monotonic_seconds();
 
 	/* Take snapshot of image before applying horrible noise filters */
 	set_last_task(last_task, "image filter");
@@ -261,6 +318,14 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		profile_start("data-backup");
 		prefilter = backup_image_data(image->dp, image->detgeom);
 		profile_end("data-backup");
+
+		/* The compact copy made when loading the data won't match the
+		 * filtered data, but will be fine again afterwards */
+		prefilter_compact = image->dp_compact;
+		prefilter_compact_type = image->compact_type;
+		prefilter_compact_scale = image->compact_scale;
+		image->dp_compact = NULL;
+		image->compact_type = PIXEL_STORAGE_FLOAT;
 	} else {
 		prefilter = NULL;
 	}
@@ -282,6 +347,18 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 	sb_shared->pings[cookie]++;
 	mark_resolution_range_as_bad(image, iargs->highres, +INFINITY);
 
+	/* Unless the compact copy was made when loading the data: if the data
+	 * can't be represented exactly, this will silently leave everything
+	 * using the float data */
+	if ( (iargs->compact_pixels != PIXEL_STORAGE_FLOAT)
+	  && (image->compact_type == PIXEL_STORAGE_FLOAT) )
+	{
+		profile_start("compact-data");
+		image_make_compact_data(image, iargs->compact_pixels,
+		                        iargs->compact_scale);
+		profile_end("compact-data");
+	}
+
 	sb_shared->pings[cookie]++;
 	profile_start("peak-search");
 	switch ( iargs->peaks ) {
@@ -375,8 +452,25 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		profile_start("restore-filter-backup");
 		restore_image_data(image->dp, image->detgeom, prefilter);
 		profile_end("restore-filter-backup");
+		if ( prefilter_compact != NULL ) {
+			image_free_compact_data(image);
+			image->dp_compact = prefilter_compact;
+			image->compact_type = prefilter_compact_type;
+			image->compact_scale = prefilter_compact_scale;
+		} else if ( iargs->compact_pixels != PIXEL_STORAGE_FLOAT ) {
+			profile_start("compact-data");
+			image_make_compact_data(image, iargs->compact_pixels,
+			                        iargs->compact_scale);
+			profile_end("compact-data");
+		}
 	}
 
+	t_peaks = get_monotonic_seconds();
+
+	/* Is there still time to index this frame? */
+	too_late = (iargs->latency_budget > 0.0)
+	        && (t_peaks - pargs->t_arrival > iargs->latency_budget);
+
 	rn = getcwd(NULL, 0);
 
 	r = chdir(tmpdir);
@@ -405,11 +499,24 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		if ( iargs->stream_nonhits ) {
 			goto streamwrite;
 		} else {
+			publish_no_chunk(pargs, serial);
 			goto out;
 		}
 	}
 	image->hit = 1;
 
+	if ( too_late ) {
+		r = chdir(rn);
+		if ( r ) {
+			ERROR("Failed to chdir: %s\n", strerror(errno));
+			return;
+		}
+		free(rn);
+		stats->n_degraded++;
+		degraded = 1;
+		goto streamwrite;
+	}
+
 	/* Index the pattern */
 	set_last_task(last_task, "indexing");
 	profile_start("index");
@@ -447,6 +554,8 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		}
 	}
 
+	t_indexed = get_monotonic_seconds();
+
 	/* Integrate! */
 	if ( !iargs->cell_params_only ) {
 		set_last_task(last_task, "integration");
@@ -459,16 +568,36 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		                iargs->int_diag_k, iargs->int_diag_l,
 		                &sb_shared->term_lock, iargs->overpredict);
 		profile_end("integration");
+		t_integrated = get_monotonic_seconds();
 	}
 
 streamwrite:
 	set_last_task(last_task, "stream write");
 	profile_start("write-stream");
 	sb_shared->pings[cookie]++;
+	t_write = get_monotonic_seconds();
 	ret = stream_write_chunk(st, image, iargs->stream_flags);
 	if ( ret != 0 ) {
 		ERROR("Error writing stream file.\n");
 	}
+	info.n_cells = 0;
+	if ( iargs->cell_list_fd >= 0 ) {
+		/* The master writes these along with the chunk */
+		info.n_cells = stream_cells_pack(image, info.cells,
+		                                 CHUNK_MAX_CELLS);
+	}
+	info.serial = image->serial;
+	info.have_trace = 0;
+	if ( iargs->trace_latency ) {
+		set_latency_trace(&info, pargs, t_decoded, t_peaks,
+		                  t_indexed, t_integrated);
+	}
+	info.n_dropped = pargs->n_dropped;
+	info.degraded = degraded;
+	pargs->n_dropped = 0;
+	im_chunkring_publish(pargs->ring, &info);
+	stats->time_in_stage[STAGE_STREAM_WRITE] += get_monotonic_seconds()
+	                                            - t_write;
 	profile_end("write-stream");
 
 	int n = 0;
@@ -484,18 +613,26 @@ out:
 	/* Count crystals which are still good */
 	set_last_task(last_task, "process_image finalisation");
 	sb_shared->pings[cookie]++;
-	pthread_mutex_lock(&sb_shared->totals_lock);
 	any_crystals = 0;
 	for ( i=0; i<image->n_crystals; i++ ) {
 		if ( crystal_get_user_flag(image->crystals[i]) == 0 ) {
-			sb_shared->n_crystals++;
+			stats->n_crystals++;
 			any_crystals = 1;
 		}
 	}
-	sb_shared->n_processed++;
-	sb_shared->n_hits += image->hit;
-	sb_shared->n_hadcrystals += any_crystals;
-	pthread_mutex_unlock(&sb_shared->totals_lock);
+	stats->n_processed++;
+	stats->n_hits += image->hit;
+	stats->n_hadcrystals += any_crystals;
+
+	stats->time_in_stage[STAGE_DECODE] += t_decoded - pargs->t_fetch_end;
+	stats->time_in_stage[STAGE_PEAKSEARCH] += t_peaks - t_decoded;
+	if ( t_indexed >= 0.0 ) {
+		stats->time_in_stage[STAGE_INDEXING] += t_indexed - t_peaks;
+	}
+	if ( t_integrated >= 0.0 ) {
+		stats->time_in_stage[STAGE_INTEGRATION] += t_integrated
+		                                           - t_indexed;
+	}
 
 	/* Free image (including detgeom) */
 	image_free(image);
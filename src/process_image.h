@@ -43,10 +43,22 @@ struct index_args;
 
 #include "integration.h"
 #include "im-sandbox.h"
+#include "im-chunkring.h"
 #include "peaks.h"
 #include "image.h"
 
 
+/* What to do with frames which are older than the latency budget */
+enum late_frame_policy
+{
+	LATE_FRAMES_DROP,        /* Don't process frames which are already too
+	                          * old when they arrive, and skip indexing for
+	                          * the others if they become too old */
+	LATE_FRAMES_PEAKS_ONLY,  /* Process all frames, but skip indexing for
+	                          * frames which are too old */
+};
+
+
 /* Information about the indexing process which is common to all patterns */
 struct index_args
 {
@@ -57,6 +69,8 @@ struct index_args
 	int no_mask_data;
 	float highres;
 	DataSourceType data_format;
+	PixelStorageType compact_pixels;
+	float compact_scale;
 
 	/* Peak search */
 	enum peak_search_method peaks;
@@ -113,6 +127,15 @@ struct index_args
 	/* Output */
 	int stream_flags;
 	int stream_nonhits;
+	int cell_list_fd;  /* Used by the sandbox master.  -1 means none */
+
+	/* Latency tracing: 0 = off, 1 = report in sandbox master,
+	 * 2 = also write per-frame latencies into the stream */
+	int trace_latency;
+
+	/* Bounded latency mode */
+	double latency_budget;  /* Seconds, or zero for no limit */
+	enum late_frame_policy late_frames;
 };
 
 
@@ -129,6 +152,21 @@ struct pattern_args
 	char *asapo_data;
 	size_t asapo_data_size;
 	char *asapo_meta;
+
+	/* When the worker started and finished fetching the data */
+	double t_fetch_start;
+	double t_fetch_end;
+
+	/* Estimate of when the frame became available, for checking against
+	 * the latency budget */
+	double t_arrival;
+
+	/* Number of frames dropped by this worker, not yet recorded in the
+	 * stream.  Will be set to zero when written. */
+	int n_dropped;
+
+	/* Where the stream chunk is handed over to the master */
+	struct im_chunkring *ring;
 };
 
 
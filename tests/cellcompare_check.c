@@ -344,6 +344,241 @@ static int test_derivative_lattice_rotation(UnitCell *cref, gsl_rng *rng,
 
 extern IntegerMatrix *reduce_g6(struct g6 g, double epsrel);
 
+
+static int same_rtnl_mtx(RationalMatrix *a, RationalMatrix *b)
+{
+	int i, j;
+
+	if ( (a == NULL) || (b == NULL) ) return a == b;
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			if ( rtnl_cmp(rtnl_mtx_get(a, i, j),
+			              rtnl_mtx_get(b, i, j)) != 0 ) return 0;
+		}
+	}
+	return 1;
+}
+
+
+/* Same as random_int() in cell-utils.c, so that the random choices match */
+static int random_int(int max)
+{
+	int r;
+	int limit = RAND_MAX;
+	while ( limit % max ) limit--;
+	do {
+		r = rand();
+	} while ( r > limit );
+	return rand() % max;
+}
+
+
+/* Does the same as compare_reindexed_cell_parameters, the slow way: the
+ * reduced cell is transformed by each candidate matrix in turn, and the
+ * result compared using compare_cell_parameters.  Returns the
+ * transformation matrix, or NULL if the cells don't match. */
+static RationalMatrix *reindex_slowly(UnitCell *cell_in, UnitCell *reference,
+                                      double *tols)
+{
+	IntegerMatrix *CB;
+	IntegerMatrix *RA;
+	IntegerMatrix *RB;
+	IntegerMatrix *RiB;
+	IntegerMatrix *RiBCB;
+	IntegerMatrix *m;
+	IntegerMatrix *best_m[24];
+	RationalMatrix *CiA;
+	RationalMatrix *CiARA;
+	RationalMatrix *tmp;
+	RationalMatrix *comb;
+	UnitCell *cell;
+	UnitCell *ref_uncentered;
+	UnitCell *cell_reduced;
+	double a, b, c, al, be, ga;
+	double min_dist = +INFINITY;
+	int n_best = 0;
+	int v, s, sel;
+
+	ref_uncentered = uncenter_cell(reference, &CB, NULL);
+	cell = uncenter_cell(cell_in, NULL, &CiA);
+	if ( (ref_uncentered == NULL) || (cell == NULL) ) return NULL;
+
+	RA = reduce_g6(cell_get_G6(cell), 1e-5);
+	RB = reduce_g6(cell_get_G6(ref_uncentered), 1e-5);
+	cell_reduced = cell_transform_intmat(cell, RA);
+	cell_free(cell);
+	cell_free(ref_uncentered);
+
+	RiB = intmat_inverse(RB);
+	RiBCB = intmat_times_intmat(RiB, CB);
+	CiARA = rtnlmtx_times_intmat(CiA, RA);
+	intmat_free(RiB);
+	intmat_free(RB);
+	intmat_free(RA);
+	intmat_free(CB);
+	rtnl_mtx_free(CiA);
+
+	cell_get_parameters(reference, &a, &b, &c, &al, &be, &ga);
+
+	/* All matrices with elements -1, 0 or +1 and determinant +1 */
+	m = intmat_new(3, 3);
+	for ( v=0; v<19683; v++ ) {
+
+		UnitCell *tmpcell;
+		UnitCell *nc;
+		int j;
+		int r = v;
+
+		for ( j=8; j>=0; j-- ) {
+			intmat_set(m, j/3, j%3, (r % 3) - 1);
+			r /= 3;
+		}
+		if ( intmat_det(m) != +1 ) continue;
+
+		tmpcell = cell_transform_intmat(cell_reduced, m);
+		nc = cell_transform_intmat(tmpcell, RiBCB);
+		cell_free(tmpcell);
+
+		if ( compare_cell_parameters(nc, reference, tols) ) {
+
+			double ta, tb, tc, tal, tbe, tga;
+			double dist;
+
+			cell_get_parameters(nc, &ta, &tb, &tc, &tal, &tbe, &tga);
+			dist = fabs(a - ta) + fabs(b - tb) + fabs(c - tc);
+
+			if ( dist < min_dist ) {
+				for ( s=0; s<n_best; s++ ) {
+					intmat_free(best_m[s]);
+				}
+				min_dist = dist;
+				best_m[0] = intmat_copy(m);
+				n_best = 1;
+			} else if ( (dist == min_dist) && (n_best < 24) ) {
+				best_m[n_best++] = intmat_copy(m);
+			}
+
+		}
+
+		cell_free(nc);
+
+	}
+	intmat_free(m);
+	cell_free(cell_reduced);
+
+	comb = NULL;
+	if ( n_best > 0 ) {
+
+		/* Prefer an identity, otherwise choose randomly */
+		sel = (n_best == 1) ? 0 : n_best;
+		for ( s=0; (n_best > 1) && (s<n_best); s++ ) {
+			RationalMatrix *t2;
+			tmp = rtnlmtx_times_intmat(CiARA, best_m[s]);
+			t2 = rtnlmtx_times_intmat(tmp, RiBCB);
+			if ( rtnl_mtx_is_identity(t2) ) sel = s;
+			rtnl_mtx_free(tmp);
+			rtnl_mtx_free(t2);
+		}
+		if ( sel == n_best ) sel = random_int(n_best);
+
+		tmp = rtnlmtx_times_intmat(CiARA, best_m[sel]);
+		comb = rtnlmtx_times_intmat(tmp, RiBCB);
+		rtnl_mtx_free(tmp);
+
+	}
+
+	for ( s=0; s<n_best; s++ ) intmat_free(best_m[s]);
+	rtnl_mtx_free(CiARA);
+	intmat_free(RiBCB);
+	return comb;
+}
+
+
+/* The prepared reference must give exactly the same results as comparing
+ * the transformed cells one by one, including the choice between
+ * equivalent matrices (hence the srand() calls) */
+static int test_prepared_reference(UnitCell *cref, gsl_rng *rng,
+                                   double *tols)
+{
+	PreparedReference *ref;
+	int i;
+	int n_match = 0;
+	int fail = 0;
+
+	ref = prepare_reference_cell(cref);
+	if ( ref == NULL ) return 1;
+
+	for ( i=0; i<40; i++ ) {
+
+		RationalMatrix *tr;
+		RationalMatrix *m1;
+		RationalMatrix *m2 = NULL;
+		UnitCell *cell;
+		UnitCell *cell2;
+		UnitCell *match;
+
+		cell2 = cell_rotate(cref, random_quaternion(rng));
+		if ( cell2 == NULL ) {
+			fail = 1;
+			break;
+		}
+
+		cell = NULL;
+		tr = NULL;
+		do {
+			cell_free(cell);
+			rtnl_mtx_free(tr);
+			if ( i % 2 ) {
+				tr = random_derivative(rng);
+			} else {
+				tr = rtnl_mtx_identity(3);
+			}
+			cell = cell_transform_rational(cell2, tr);
+		} while ( (cell_get_centering(cell) == '?')
+		       || (cell_get_centering(cell) == 'H' ) );  /* See above */
+		cell_free(cell2);
+
+		srand(i);
+		m1 = reindex_slowly(cell, cref, tols);
+		srand(i);
+		match = compare_reindexed_cell_parameters_prepared(cell, ref,
+		                                                   tols, &m2);
+
+		if ( m1 != NULL ) n_match++;
+
+		if ( ((m1 == NULL) != (match == NULL)) || !same_rtnl_mtx(m1, m2) )
+		{
+			ERROR("Prepared reference gives a different result "
+			      "for this cell:\n");
+			cell_print_full(cell);
+			STATUS("Expected:\n");
+			rtnl_mtx_print(m1);
+			STATUS("With prepared reference:\n");
+			rtnl_mtx_print(m2);
+			fail = 1;
+		}
+
+		cell_free(match);
+		rtnl_mtx_free(m1);
+		rtnl_mtx_free(m2);
+		cell_free(cell);
+		rtnl_mtx_free(tr);
+
+		if ( fail ) break;
+
+	}
+
+	if ( !fail && (n_match == 0) ) {
+		ERROR("No cells matched the prepared reference\n");
+		fail = 1;
+	}
+
+	prepared_reference_free(ref);
+	return fail;
+}
+
+
 int main(int argc, char *argv[])
 {
 	UnitCell *cref;
@@ -366,6 +601,7 @@ int main(int argc, char *argv[])
 	fail += test_rotation_and_permutation(cref, rng, tols);
 	fail += test_derivative_lattice(cref, rng, tols);
 	fail += test_derivative_lattice_rotation(cref, rng, tols);
+	fail += test_prepared_reference(cref, rng, tols);
 
 	cell_free(cref);
 	gsl_rng_free(rng);
@@ -0,0 +1,242 @@
+/*
+ * cxi_peaks_check.c
+ *
+ * Check that CXI peak lists can be read while images are loaded from the
+ * same file
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <hdf5.h>
+
+#include <image.h>
+#include <datatemplate.h>
+#include <utils.h>
+
+/* More than one block of peaks (see PEAK_PREFETCH_BLOCK) */
+#define N_EVENTS (150)
+#define W (16)
+#define MAX_PEAKS (8)
+
+#define FILENAME "cxi_peaks_check.cxi"
+
+
+static const char *geom =
+	"adu_per_photon = 1\n"
+	"clen = 0.1\n"
+	"res = 10000\n"
+	"photon_energy = 9000\n"
+	"data = /entry_1/data_1/data\n"
+	"dim0 = %\n"
+	"dim1 = ss\n"
+	"dim2 = fs\n"
+	"peak_list = /entry_1/result_1\n"
+	"peak_list_type = cxi\n"
+	"p0/min_fs = 0\n"
+	"p0/max_fs = 15\n"
+	"p0/min_ss = 0\n"
+	"p0/max_ss = 15\n"
+	"p0/corner_x = -8\n"
+	"p0/corner_y = -8\n"
+	"p0/fs = x\n"
+	"p0/ss = y\n";
+
+
+static int n_peaks(int k)
+{
+	return k % 5;
+}
+
+
+static float peak_x(int k, int p)
+{
+	return (k % 7) + p;
+}
+
+
+static void write_dataset(hid_t fh, const char *path, hid_t type,
+                          int ndims, hsize_t *size, void *vals)
+{
+	hid_t sh, dh;
+	sh = H5Screate_simple(ndims, size, NULL);
+	dh = H5Dcreate2(fh, path, type, sh, H5P_DEFAULT, H5P_DEFAULT,
+	                H5P_DEFAULT);
+	H5Dwrite(dh, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, vals);
+	H5Dclose(dh);
+	H5Sclose(sh);
+}
+
+
+static int write_cxi(void)
+{
+	hid_t fh, gh, lcpl;
+	hsize_t size[3];
+	float *data;
+	int *npk;
+	float *x, *y, *in;
+	int k, p;
+
+	data = malloc(N_EVENTS*W*W*sizeof(float));
+	npk = malloc(N_EVENTS*sizeof(int));
+	x = calloc(N_EVENTS*MAX_PEAKS, sizeof(float));
+	y = calloc(N_EVENTS*MAX_PEAKS, sizeof(float));
+	in = calloc(N_EVENTS*MAX_PEAKS, sizeof(float));
+	if ( (data == NULL) || (npk == NULL) || (x == NULL)
+	  || (y == NULL) || (in == NULL) ) return 1;
+
+	for ( k=0; k<N_EVENTS; k++ ) {
+		for ( p=0; p<W*W; p++ ) {
+			data[k*W*W+p] = k;
+		}
+		npk[k] = n_peaks(k);
+		for ( p=0; p<npk[k]; p++ ) {
+			x[k*MAX_PEAKS+p] = peak_x(k, p);
+			y[k*MAX_PEAKS+p] = p;
+			in[k*MAX_PEAKS+p] = 100*k + p;
+		}
+	}
+
+	fh = H5Fcreate(FILENAME, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	if ( fh < 0 ) return 1;
+
+	lcpl = H5Pcreate(H5P_LINK_CREATE);
+	H5Pset_create_intermediate_group(lcpl, 1);
+	gh = H5Gcreate2(fh, "/entry_1/data_1", lcpl, H5P_DEFAULT, H5P_DEFAULT);
+	H5Gclose(gh);
+	gh = H5Gcreate2(fh, "/entry_1/result_1", lcpl, H5P_DEFAULT,
+	                H5P_DEFAULT);
+	H5Gclose(gh);
+	H5Pclose(lcpl);
+
+	size[0] = N_EVENTS;
+	size[1] = W;
+	size[2] = W;
+	write_dataset(fh, "/entry_1/data_1/data", H5T_NATIVE_FLOAT,
+	              3, size, data);
+	write_dataset(fh, "/entry_1/result_1/nPeaks", H5T_NATIVE_INT,
+	              1, size, npk);
+	size[1] = MAX_PEAKS;
+	write_dataset(fh, "/entry_1/result_1/peakXPosRaw", H5T_NATIVE_FLOAT,
+	              2, size, x);
+	write_dataset(fh, "/entry_1/result_1/peakYPosRaw", H5T_NATIVE_FLOAT,
+	              2, size, y);
+	write_dataset(fh, "/entry_1/result_1/peakTotalIntensity",
+	              H5T_NATIVE_FLOAT, 2, size, in);
+	H5Fclose(fh);
+
+	free(data);
+	free(npk);
+	free(x);
+	free(y);
+	free(in);
+	return 0;
+}
+
+
+static int check_peaks(ImageFeatureList *peaks, int k)
+{
+	int p;
+
+	if ( peaks == NULL ) {
+		ERROR("No peaks for event %i\n", k);
+		return 1;
+	}
+
+	if ( image_feature_count(peaks) != n_peaks(k) ) {
+		ERROR("Wrong number of peaks for event %i: %i instead of %i\n",
+		      k, image_feature_count(peaks), n_peaks(k));
+		return 1;
+	}
+
+	for ( p=0; p<n_peaks(k); p++ ) {
+		struct imagefeature *f = image_get_feature(peaks, p);
+		if ( (f->fs != peak_x(k, p)) || (f->ss != p)
+		  || (f->intensity != 100*k + p) )
+		{
+			ERROR("Peak %i for event %i is wrong: %f,%f %f\n",
+			      p, k, f->fs, f->ss, f->intensity);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	DataTemplate *dtempl;
+	int k;
+	int fail = 0;
+
+	if ( write_cxi() ) {
+		ERROR("Failed to write test file\n");
+		return 1;
+	}
+
+	dtempl = data_template_new_from_string(geom);
+	if ( dtempl == NULL ) {
+		ERROR("Failed to read data template\n");
+		return 1;
+	}
+
+	/* Images and peaks from the same file, one after the other, as
+	 * indexamajig does it */
+	for ( k=0; k<N_EVENTS; k++ ) {
+
+		struct image *image;
+		ImageFeatureList *peaks;
+		char ev[64];
+
+		snprintf(ev, 64, "//%i", k);
+
+		image = image_read(dtempl, FILENAME, ev, 0, 0);
+		if ( image == NULL ) {
+			ERROR("Failed to load image for event %i\n", k);
+			fail = 1;
+			break;
+		}
+		if ( image->dp[0][0] != k ) {
+			ERROR("Wrong image data for event %i: %f\n",
+			      k, image->dp[0][0]);
+			fail = 1;
+		}
+		image_free(image);
+
+		peaks = image_read_peaks(dtempl, FILENAME, ev, 0);
+		if ( check_peaks(peaks, k) ) {
+			fail = 1;
+			image_feature_list_free(peaks);
+			break;
+		}
+		image_feature_list_free(peaks);
+
+	}
+
+	data_template_free(dtempl);
+	unlink(FILENAME);
+
+	if ( !fail ) STATUS("CXI peak lists are OK.\n");
+
+	return fail;
+}
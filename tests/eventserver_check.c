@@ -0,0 +1,199 @@
+/*
+ * eventserver_check.c
+ *
+ * Check that the event server hands out each event exactly once, even if a
+ * client disconnects without finishing its events
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../src/im-eventserver.h"
+
+#define N_EVENTS (1000)
+#define N_CLIENTS (3)
+
+
+static int next_event(void *vp, char **pfilename, char **pevent)
+{
+	int *pn = vp;
+	char tmp[64];
+
+	if ( *pn == N_EVENTS ) return 0;
+
+	snprintf(tmp, 64, "my file%i.h5", *pn / 10);
+	*pfilename = strdup(tmp);
+	snprintf(tmp, 64, "//%i", *pn % 10);
+	*pevent = strdup(tmp);
+	(*pn)++;
+	return 1;
+}
+
+
+static struct im_eventclient *connect_client(const char *address, int batch)
+{
+	struct im_eventclient *c = NULL;
+	int i;
+
+	/* Wait for the server to start */
+	for ( i=0; i<100; i++ ) {
+		c = im_eventclient_connect(address, batch);
+		if ( c != NULL ) break;
+		usleep(50000);
+	}
+	if ( c == NULL ) exit(1);
+	return c;
+}
+
+
+/* Takes some events, then disconnects without finishing them */
+static void run_bad_client(const char *address, int fd)
+{
+	struct im_eventclient *c;
+	char *filename;
+	char *event;
+	int i;
+
+	c = connect_client(address, 5);
+	for ( i=0; i<5; i++ ) {
+		if ( !im_eventclient_next(c, &filename, &event) ) exit(1);
+		free(filename);
+		free(event);
+	}
+	if ( write(fd, "x", 1) != 1 ) exit(1);
+	usleep(200000);
+	im_eventclient_free(c);
+	exit(0);
+}
+
+
+static void run_client(const char *address, int batch, int fd)
+{
+	struct im_eventclient *c;
+	char *filename;
+	char *event;
+	long int k = 0;
+
+	c = connect_client(address, batch);
+
+	while ( im_eventclient_next(c, &filename, &event) ) {
+		int f, e, n;
+		if ( (sscanf(filename, "my file%i.h5", &f) != 1)
+		  || (sscanf(event, "//%i", &e) != 1) )
+		{
+			fprintf(stderr, "Bad event '%s' '%s'\n",
+			        filename, event);
+			exit(1);
+		}
+		n = f*10 + e;
+		if ( write(fd, &n, sizeof(int)) != sizeof(int) ) exit(1);
+		free(filename);
+		free(event);
+		im_eventclient_done(c, k++);
+	}
+
+	im_eventclient_free(c);
+	exit(0);
+}
+
+
+int main(int argc, char *argv[])
+{
+	char address[128];
+	int seen[N_EVENTS];
+	pid_t server, bad, clients[N_CLIENTS];
+	int pfd[2];
+	int sfd[2];
+	char x;
+	int i, n, status;
+	int fail = 0;
+
+	snprintf(address, 128, "unix:/tmp/eventserver_check-%i", getpid());
+
+	server = fork();
+	if ( server == 0 ) {
+		int ev = 0;
+		exit(im_eventserver_run(address, next_event, &ev));
+	}
+
+	/* Let the bad client take its events before the others start */
+	if ( pipe(sfd) ) return 1;
+	bad = fork();
+	if ( bad == 0 ) {
+		close(sfd[0]);
+		run_bad_client(address, sfd[1]);
+	}
+	close(sfd[1]);
+	if ( read(sfd[0], &x, 1) != 1 ) {
+		fprintf(stderr, "Bad client failed\n");
+		fail = 1;
+	}
+	close(sfd[0]);
+
+	if ( pipe(pfd) ) return 1;
+	for ( i=0; i<N_CLIENTS; i++ ) {
+		clients[i] = fork();
+		if ( clients[i] == 0 ) {
+			close(pfd[0]);
+			run_client(address, 1+7*i, pfd[1]);
+		}
+	}
+	close(pfd[1]);
+
+	for ( i=0; i<N_EVENTS; i++ ) seen[i] = 0;
+	while ( read(pfd[0], &n, sizeof(int)) == sizeof(int) ) {
+		if ( (n < 0) || (n >= N_EVENTS) ) {
+			fprintf(stderr, "Invalid event %i\n", n);
+			fail = 1;
+			continue;
+		}
+		seen[n]++;
+	}
+
+	for ( i=0; i<N_CLIENTS; i++ ) {
+		waitpid(clients[i], &status, 0);
+		if ( !WIFEXITED(status) || WEXITSTATUS(status) ) {
+			fprintf(stderr, "Client %i failed\n", i);
+			fail = 1;
+		}
+	}
+	waitpid(bad, &status, 0);
+	waitpid(server, &status, 0);
+	if ( !WIFEXITED(status) || WEXITSTATUS(status) ) {
+		fprintf(stderr, "Server failed\n");
+		fail = 1;
+	}
+
+	for ( i=0; i<N_EVENTS; i++ ) {
+		if ( seen[i] != 1 ) {
+			fprintf(stderr, "Event %i was seen %i times\n",
+			        i, seen[i]);
+			fail = 1;
+		}
+	}
+
+	return fail;
+}
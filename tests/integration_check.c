@@ -94,6 +94,8 @@ int main(int argc, char *argv[])
 	image.bad[0] = malloc(w*h*sizeof(int));
 	memset(image.bad[0], 0, w*h*sizeof(int));
 	image.sat = NULL;
+	image.compact_type = PIXEL_STORAGE_FLOAT;
+	image.dp_compact = NULL;
 
 	image.n_crystals = 0;
 	image.crystals = NULL;
@@ -130,6 +132,31 @@ int main(int argc, char *argv[])
 
 		integrate_rings_once(refl, ic, 0);
 
+		/* Same again, using the compact integer copy of the data */
+		if ( image_make_compact_data(&image, PIXEL_STORAGE_UINT16, 10.0) ) {
+			ERROR("Failed to make compact image data.\n");
+			fail = 1;
+		} else {
+			RefList *list2 = reflist_new();
+			Reflection *refl2 = add_refl(list2, 0, 0, 0);
+			set_detector_pos(refl2, 64, 64);
+			set_panel_number(refl2, 0);
+			integrate_rings_once(refl2, ic, 0);
+			if ( (fabs(get_intensity(refl) - get_intensity(refl2)) > 1e-6)
+			  || (fabs(get_esd_intensity(refl)
+			           - get_esd_intensity(refl2)) > 1e-6) )
+			{
+				ERROR("Compact data gives different result: "
+				      "%f +/- %f vs %f +/- %f\n",
+				      get_intensity(refl), get_esd_intensity(refl),
+				      get_intensity(refl2),
+				      get_esd_intensity(refl2));
+				fail = 1;
+			}
+			image_free_compact_data(&image);
+			reflist_free(list2);
+		}
+
 		cell_free(cell);
 
 		histogram_add_value(hi, get_intensity(refl));
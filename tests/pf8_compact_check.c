@@ -0,0 +1,210 @@
+/*
+ * pf8_compact_check.c
+ *
+ * Check that peakfinder8 gives the same peaks with the compact image data
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <image.h>
+#include <utils.h>
+#include <peaks.h>
+
+
+static ImageFeatureList *find_peaks(struct image *image, int fast_mode)
+{
+	ImageFeatureList *peaks;
+
+	if ( search_peaks_peakfinder8(image, 2048, 200.0, 5.0, 2, 200, 3,
+	                              0, 5000, 1, fast_mode, NULL) )
+	{
+		ERROR("peakfinder8 failed\n");
+		return NULL;
+	}
+
+	peaks = image->features;
+	image->features = NULL;
+	return peaks;
+}
+
+
+static int compare_peaks(ImageFeatureList *a, ImageFeatureList *b,
+                         const char *what)
+{
+	int i;
+
+	if ( (a == NULL) || (b == NULL) ) return 1;
+
+	if ( image_feature_count(a) != image_feature_count(b) ) {
+		ERROR("%s: %i peaks with float data, but %i with compact\n",
+		      what, image_feature_count(a), image_feature_count(b));
+		return 1;
+	}
+
+	for ( i=0; i<image_feature_count(a); i++ ) {
+		struct imagefeature *fa = image_get_feature(a, i);
+		struct imagefeature *fb = image_get_feature(b, i);
+		if ( (fa == NULL) || (fb == NULL) ) continue;
+		if ( (fa->fs != fb->fs) || (fa->ss != fb->ss)
+		  || (fa->pn != fb->pn) || (fa->intensity != fb->intensity) )
+		{
+			ERROR("%s: peak %i differs: %f,%f %f vs %f,%f %f\n",
+			      what, i, fa->fs, fa->ss, fa->intensity,
+			      fb->fs, fb->ss, fb->intensity);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int check_type(struct image *image, PixelStorageType type,
+                      float scale, const char *what)
+{
+	int fast_mode;
+	int fail = 0;
+
+	for ( fast_mode=0; fast_mode<=1; fast_mode++ ) {
+
+		ImageFeatureList *pf, *pc;
+
+		image_free_compact_data(image);
+		pf = find_peaks(image, fast_mode);
+
+		if ( image_make_compact_data(image, type, scale) ) {
+			ERROR("%s: failed to make compact data\n", what);
+			image_feature_list_free(pf);
+			return 1;
+		}
+		pc = find_peaks(image, fast_mode);
+
+		if ( compare_peaks(pf, pc, what) ) fail = 1;
+		if ( image_feature_count(pf) == 0 ) {
+			ERROR("%s: no peaks found\n", what);
+			fail = 1;
+		}
+
+		image_feature_list_free(pf);
+		image_feature_list_free(pc);
+
+	}
+
+	image_free_compact_data(image);
+	return fail;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct image image;
+	const int w = 256;
+	const int h = 256;
+	int fs, ss, i;
+	int fail = 0;
+
+	image.lambda = ph_eV_to_lambda(9000.0);
+	image.features = NULL;
+	image.n_crystals = 0;
+	image.crystals = NULL;
+	image.sat = NULL;
+	image.compact_type = PIXEL_STORAGE_FLOAT;
+	image.dp_compact = NULL;
+	image.compact_scale = 1.0;
+
+	image.detgeom = calloc(1, sizeof(struct detgeom));
+	image.detgeom->n_panels = 1;
+	image.detgeom->panels = calloc(1, sizeof(struct detgeom_panel));
+	image.detgeom->panels[0].name = "panel0";
+	image.detgeom->panels[0].w = w;
+	image.detgeom->panels[0].h = h;
+	image.detgeom->panels[0].fsx = 1.0;
+	image.detgeom->panels[0].fsy = 0.0;
+	image.detgeom->panels[0].fsz = 0.0;
+	image.detgeom->panels[0].ssx = 0.0;
+	image.detgeom->panels[0].ssy = 1.0;
+	image.detgeom->panels[0].ssz = 0.0;
+	image.detgeom->panels[0].cnx = -w/2;
+	image.detgeom->panels[0].cny = -h/2;
+	image.detgeom->panels[0].cnz = 60.0e-3 / 100e-6;
+	image.detgeom->panels[0].pixel_pitch = 100e-6;
+	image.detgeom->panels[0].adu_per_photon = 10;
+	image.detgeom->panels[0].max_adu = +INFINITY;
+
+	image.dp = malloc(sizeof(float *));
+	image.dp[0] = malloc(w*h*sizeof(float));
+	image.bad = malloc(sizeof(int *));
+	image.bad[0] = calloc(w*h, sizeof(int));
+
+	/* Noisy background in units of 10 ADU, with some peaks on top */
+	srand(1);
+	for ( ss=0; ss<h; ss++ ) {
+		for ( fs=0; fs<w; fs++ ) {
+			image.dp[0][fs+w*ss] = 10.0*(rand() % 8);
+		}
+	}
+	for ( i=0; i<40; i++ ) {
+		int pfs = 8 + rand() % (w-16);
+		int pss = 8 + rand() % (h-16);
+		image.dp[0][pfs+w*pss] += 3000.0;
+		image.dp[0][pfs+1+w*pss] += 1500.0;
+		image.dp[0][pfs+w*(pss+1)] += 1500.0;
+		image.dp[0][pfs+1+w*(pss+1)] += 700.0;
+	}
+
+	/* Bad pixels don't need to be representable in the compact data */
+	for ( i=0; i<w; i++ ) {
+		image.dp[0][i+w*100] = NAN;
+		image.bad[0][i+w*100] = 1;
+	}
+
+	fail += check_type(&image, PIXEL_STORAGE_UINT16, 10.0, "uint16");
+	fail += check_type(&image, PIXEL_STORAGE_INT32, 10.0, "int32");
+
+	/* Same again with negative values, only possible with int32 */
+	for ( ss=0; ss<h; ss++ ) {
+		for ( fs=0; fs<w; fs++ ) {
+			if ( image.bad[0][fs+w*ss] ) continue;
+			image.dp[0][fs+w*ss] -= 30.0;
+		}
+	}
+	if ( !image_make_compact_data(&image, PIXEL_STORAGE_UINT16, 10.0) ) {
+		ERROR("Negative values accepted for uint16\n");
+		fail++;
+	}
+	fail += check_type(&image, PIXEL_STORAGE_INT32, 10.0,
+	                   "int32 (negative)");
+
+	free(image.dp[0]);
+	free(image.dp);
+	free(image.bad[0]);
+	free(image.bad);
+	free(image.detgeom->panels);
+	free(image.detgeom);
+
+	if ( !fail ) STATUS("peakfinder8 gives the same peaks with compact "
+	                    "data.\n");
+	return fail ? 1 : 0;
+}
@@ -114,6 +114,8 @@ int main(int argc, char *argv[])
 	image.bad[0] = malloc(w*h*sizeof(int));
 	memset(image.bad[0], 0, w*h*sizeof(int));
 	image.sat = NULL;
+	image.compact_type = PIXEL_STORAGE_FLOAT;
+	image.dp_compact = NULL;
 
 	cell = cell_new();
 	cell_set_lattice_type(cell, L_CUBIC);
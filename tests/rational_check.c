@@ -29,9 +29,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <gsl/gsl_rng.h>
 
 #include <rational.h>
+#include <integer_matrix.h>
 #include <utils.h>
 
 
@@ -163,6 +165,326 @@ static int test_rational_matrix(gsl_rng *rng)
 }
 
 
+static int test_checked(gsl_rng *rng)
+{
+	Rational r1, r2, r3;
+	double rd1, rd2;
+	int fail = 0;
+
+	r1 = gen_rtnl(rng, &rd1, 100);
+	r2 = gen_rtnl(rng, &rd2, 100);
+
+	if ( rtnl_mul_checked(r1, r2, &r3)
+	  || (rtnl_cmp(r3, rtnl_mul(r1, r2)) != 0)
+	  || (fabs(rtnl_as_double(r3) - rd1*rd2) > 0.001) )
+	{
+		ERROR("Checked multiplication failed: %s * %s\n",
+		      rtnl_format(r1), rtnl_format(r2));
+		fail = 1;
+	}
+
+	if ( rtnl_add_checked(r1, r2, &r3)
+	  || (rtnl_cmp(r3, rtnl_add(r1, r2)) != 0)
+	  || (fabs(rtnl_as_double(r3) - (rd1+rd2)) > 0.001) )
+	{
+		ERROR("Checked addition failed: %s + %s\n",
+		      rtnl_format(r1), rtnl_format(r2));
+		fail = 1;
+	}
+
+	return fail;
+}
+
+
+static int test_overflow(void)
+{
+	Rational big = rtnl(LLONG_MAX, 1);
+	Rational ans = rtnl(7, 3);
+	RationalMatrix3 m, m2;
+	int fail = 0;
+
+	if ( !rtnl_mul_checked(big, rtnl(2, 1), &ans) ) {
+		ERROR("Overflow not detected in multiplication\n");
+		fail = 1;
+	}
+	if ( !rtnl_add_checked(big, rtnl(1, 1), &ans) ) {
+		ERROR("Overflow not detected in addition\n");
+		fail = 1;
+	}
+	if ( !rtnl_add_checked(rtnl(1, LLONG_MAX), rtnl(1, LLONG_MAX-1),
+	                       &ans) )
+	{
+		ERROR("Denominator overflow not detected in addition\n");
+		fail = 1;
+	}
+	if ( rtnl_cmp(ans, rtnl(7, 3)) != 0 ) {
+		ERROR("Result changed after overflow: %s\n", rtnl_format(ans));
+		fail = 1;
+	}
+
+	/* Common factors must cancel before they can overflow */
+	if ( rtnl_mul_checked(rtnl(LLONG_MAX, 3), rtnl(3, LLONG_MAX), &ans)
+	  || (rtnl_cmp(ans, rtnl(1, 1)) != 0) )
+	{
+		ERROR("Spurious overflow in multiplication\n");
+		fail = 1;
+	}
+
+	m = rtnl_mtx3_identity();
+	rtnl_mtx3_set(&m, 0, 0, rtnl(LLONG_MAX/2, 1));
+	rtnl_mtx3_set(&m, 1, 1, rtnl(LLONG_MAX/2, 1));
+	m2 = rtnl_mtx3_identity();
+	if ( !rtnl_mtx3_times_rtnl_mtx3(&m, &m, &m2) ) {
+		ERROR("Overflow not detected in matrix multiplication\n");
+		fail = 1;
+	}
+	if ( !rtnl_mtx3_is_identity(&m2) ) {
+		ERROR("Matrix changed after overflow\n");
+		fail = 1;
+	}
+	if ( !rtnl_mtx3_det(&m, &ans) ) {
+		ERROR("Overflow not detected in determinant\n");
+		fail = 1;
+	}
+
+	return fail;
+}
+
+
+static IntegerMatrix3 gen_intmat3(gsl_rng *rng, int sz)
+{
+	IntegerMatrix3 m;
+	int i, j;
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			intmat3_set(&m, i, j,
+			            gsl_rng_uniform_int(rng, 2*sz+1) - sz);
+		}
+	}
+	return m;
+}
+
+
+static signed int intmat3_det_sarrus(IntegerMatrix3 m)
+{
+	return m.v[0][0]*m.v[1][1]*m.v[2][2] + m.v[0][1]*m.v[1][2]*m.v[2][0]
+	     + m.v[0][2]*m.v[1][0]*m.v[2][1] - m.v[0][2]*m.v[1][1]*m.v[2][0]
+	     - m.v[0][0]*m.v[1][2]*m.v[2][1] - m.v[0][1]*m.v[1][0]*m.v[2][2];
+}
+
+
+static int test_intmat3(gsl_rng *rng)
+{
+	IntegerMatrix3 a, b, ab, hab3, u, l, ul, inv;
+	IntegerMatrix *ha, *hb, *hab;
+	signed int hkl[3];
+	signed int ans[3];
+	signed int *hans;
+	int i, j, k;
+	int fail = 0;
+
+	a = gen_intmat3(rng, 3);
+	b = gen_intmat3(rng, 3);
+	ha = intmat_from_intmat3(a);
+	hb = intmat_from_intmat3(b);
+
+	ab = intmat3_times_intmat3(a, b);
+	hab = intmat_times_intmat(ha, hb);
+	intmat3_from_intmat(hab, &hab3);
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			signed int sum = 0;
+			for ( k=0; k<3; k++ ) {
+				sum += intmat_get(ha, i, k)*intmat_get(hb, k, j);
+			}
+			if ( intmat3_get(ab, i, j) != sum ) fail = 1;
+		}
+	}
+	if ( !intmat3_equals(ab, hab3) ) fail = 1;
+	if ( fail ) ERROR("IntegerMatrix3 multiplication failed\n");
+
+	if ( (intmat3_det(a) != intmat3_det_sarrus(a))
+	  || (intmat3_det(a) != intmat_det(ha)) )
+	{
+		ERROR("IntegerMatrix3 determinant failed\n");
+		fail = 1;
+	}
+
+	for ( i=0; i<3; i++ ) {
+		hkl[i] = gsl_rng_uniform_int(rng, 21) - 10;
+	}
+	intmat3_transform_indices(a, hkl, ans);
+	hans = transform_indices(ha, hkl);
+	for ( j=0; j<3; j++ ) {
+		signed int sum = 0;
+		for ( i=0; i<3; i++ ) {
+			sum += intmat_get(ha, i, j)*hkl[i];
+		}
+		if ( (ans[j] != sum) || (hans[j] != sum) ) {
+			ERROR("IntegerMatrix3 index transformation failed\n");
+			fail = 1;
+		}
+	}
+	free(hans);
+
+	/* Unit triangular matrices multiply to give det = +/-1 */
+	u = intmat3_identity();
+	l = intmat3_identity();
+	for ( i=0; i<3; i++ ) {
+		for ( j=i+1; j<3; j++ ) {
+			intmat3_set(&u, i, j, gsl_rng_uniform_int(rng, 7) - 3);
+			intmat3_set(&l, j, i, gsl_rng_uniform_int(rng, 7) - 3);
+		}
+	}
+	intmat3_set(&u, 2, 2, -1);
+	ul = intmat3_times_intmat3(u, l);
+	if ( intmat3_inverse(ul, &inv)
+	  || !intmat3_is_identity(intmat3_times_intmat3(ul, inv)) )
+	{
+		ERROR("IntegerMatrix3 inverse failed\n");
+		fail = 1;
+	}
+	if ( ((intmat3_det(a) != 1) && (intmat3_det(a) != -1))
+	  && !intmat3_inverse(a, &inv) )
+	{
+		ERROR("IntegerMatrix3 inverse accepted det = %i\n",
+		      intmat3_det(a));
+		fail = 1;
+	}
+
+	intmat_free(ha);
+	intmat_free(hb);
+	intmat_free(hab);
+	return fail;
+}
+
+
+static RationalMatrix3 gen_rtnl_mtx3(gsl_rng *rng, int sz)
+{
+	RationalMatrix3 m;
+	int i, j;
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			double d;
+			rtnl_mtx3_set(&m, i, j, gen_rtnl(rng, &d, sz));
+		}
+	}
+	return m;
+}
+
+
+/* Returns non-zero if 'a' and 'b' differ anywhere */
+static int rtnl_mtx3_differ(const RationalMatrix3 *a, const RationalMatrix *b)
+{
+	int i, j;
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			if ( rtnl_cmp(rtnl_mtx3_get(a, i, j),
+			              rtnl_mtx_get(b, i, j)) != 0 ) return 1;
+		}
+	}
+	return 0;
+}
+
+
+static int test_rtnl_mtx3(gsl_rng *rng)
+{
+	RationalMatrix3 a, b, ab, aib, back;
+	IntegerMatrix3 ib;
+	RationalMatrix *ha, *hb, *hab, *haib, *ref;
+	IntegerMatrix *hib;
+	Rational det, refdet;
+	int i, j, k;
+	int fail = 0;
+
+	a = gen_rtnl_mtx3(rng, 5);
+	b = gen_rtnl_mtx3(rng, 5);
+	ib = gen_intmat3(rng, 3);
+	ha = rtnl_mtx_from_rtnl_mtx3(&a);
+	hb = rtnl_mtx_from_rtnl_mtx3(&b);
+	hib = intmat_from_intmat3(ib);
+
+	if ( rtnl_mtx3_from_rtnl_mtx(ha, &back) || rtnl_mtx3_differ(&back, ha) ) {
+		ERROR("RationalMatrix3 conversion failed\n");
+		fail = 1;
+	}
+
+	/* Reference product, one element at a time */
+	ref = rtnl_mtx_new(3, 3);
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			Rational sum = rtnl_zero();
+			for ( k=0; k<3; k++ ) {
+				sum = rtnl_add(sum, rtnl_mul(rtnl_mtx_get(ha, i, k),
+				                             rtnl_mtx_get(hb, k, j)));
+			}
+			rtnl_mtx_set(ref, i, j, sum);
+		}
+	}
+	hab = rtnlmtx_times_rtnlmtx(ha, hb);
+	if ( rtnl_mtx3_times_rtnl_mtx3(&a, &b, &ab)
+	  || rtnl_mtx3_differ(&ab, ref) || rtnl_mtx3_differ(&ab, hab) )
+	{
+		ERROR("RationalMatrix3 multiplication failed\n");
+		fail = 1;
+	}
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			Rational sum = rtnl_zero();
+			for ( k=0; k<3; k++ ) {
+				Rational v = rtnl(intmat_get(hib, k, j), 1);
+				sum = rtnl_add(sum, rtnl_mul(rtnl_mtx_get(ha, i, k),
+				                             v));
+			}
+			rtnl_mtx_set(ref, i, j, sum);
+		}
+	}
+	haib = rtnlmtx_times_intmat(ha, hib);
+	if ( rtnl_mtx3_times_intmat3(&a, ib, &aib)
+	  || rtnl_mtx3_differ(&aib, ref) || rtnl_mtx3_differ(&aib, haib) )
+	{
+		ERROR("RationalMatrix3 * IntegerMatrix3 failed\n");
+		fail = 1;
+	}
+
+	refdet = rtnl_zero();
+	for ( j=0; j<3; j++ ) {
+		Rational p, q;
+		p = rtnl_mul(rtnl_mtx_get(ha, 0, j),
+		             rtnl_mul(rtnl_mtx_get(ha, 1, (j+1)%3),
+		                      rtnl_mtx_get(ha, 2, (j+2)%3)));
+		q = rtnl_mul(rtnl_mtx_get(ha, 0, j),
+		             rtnl_mul(rtnl_mtx_get(ha, 1, (j+2)%3),
+		                      rtnl_mtx_get(ha, 2, (j+1)%3)));
+		refdet = rtnl_add(refdet, rtnl_sub(p, q));
+	}
+	if ( rtnl_mtx3_det(&a, &det) || (rtnl_cmp(det, refdet) != 0)
+	  || (rtnl_cmp(det, rtnl_mtx_det(ha)) != 0) )
+	{
+		ERROR("RationalMatrix3 determinant failed: %s\n",
+		      rtnl_format(det));
+		fail = 1;
+	}
+
+	back = rtnl_mtx3_identity();
+	if ( !rtnl_mtx3_is_identity(&back)
+	  || (rtnl_mtx3_is_identity(&a) != rtnl_mtx_is_identity(ha)) )
+	{
+		ERROR("RationalMatrix3 identity check failed\n");
+		fail = 1;
+	}
+
+	rtnl_mtx_free(ha);
+	rtnl_mtx_free(hb);
+	rtnl_mtx_free(hab);
+	rtnl_mtx_free(haib);
+	rtnl_mtx_free(ref);
+	intmat_free(hib);
+	return fail;
+}
+
+
 int main(int argc, char *argv[])
 {
 	int fail = 0;
@@ -182,6 +504,18 @@ int main(int argc, char *argv[])
 		fail += test_rational_matrix(rng);
 	}
 
+	STATUS("Overflow checking test...\n");
+	for ( i=0; i<1000; i++ ) {
+		fail += test_checked(rng);
+	}
+	fail += test_overflow();
+
+	STATUS("3x3 matrix test...\n");
+	for ( i=0; i<1000; i++ ) {
+		fail += test_intmat3(rng);
+		fail += test_rtnl_mtx3(rng);
+	}
+
 	gsl_rng_free(rng);
 
 	if ( fail != 0 ) return 1;
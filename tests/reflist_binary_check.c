@@ -0,0 +1,264 @@
+/*
+ * reflist_binary_check.c
+ *
+ * Check that reflection lists survive a round trip through the binary format
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <gsl/gsl_rng.h>
+
+#include <reflist.h>
+#include <reflist-utils.h>
+#include <symmetry.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <utils.h>
+
+#define N_REFLS (10000)
+
+
+static RefList *make_list(gsl_rng *rng)
+{
+	RefList *list;
+	int i;
+
+	list = reflist_new();
+
+	for ( i=0; i<N_REFLS; i++ ) {
+
+		Reflection *refl;
+		signed int h, k, l;
+
+		h = gsl_rng_uniform_int(rng, 201) - 100;
+		k = gsl_rng_uniform_int(rng, 201) - 100;
+		l = gsl_rng_uniform_int(rng, 201) - 100;
+		if ( find_refl(list, h, k, l) != NULL ) continue;
+
+		refl = add_refl(list, h, k, l);
+		set_intensity(refl, (gsl_rng_uniform(rng)-0.2) * 1e4);
+		set_esd_intensity(refl, gsl_rng_uniform(rng) * 1e2);
+		set_redundancy(refl, gsl_rng_uniform_int(rng, 100));
+		if ( gsl_rng_uniform(rng) < 0.5 ) {
+			set_phase(refl, (gsl_rng_uniform(rng)-0.5) * 2.0*M_PI);
+		}
+
+	}
+
+	reflist_add_notes(list, "Audit information");
+	reflist_add_notes(list, "Second line of notes");
+
+	return list;
+}
+
+
+/* Returns non-zero if anything in 'a' differs from 'b' */
+static int compare_lists(RefList *a, RefList *b)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	int n = 0;
+	int fail = 0;
+
+	for ( refl = first_refl(a, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *refl2;
+		double ph, ph2;
+		int have_phase, have_phase2;
+
+		/* Reflections with redundancy 0 should not have been written */
+		if ( get_redundancy(refl) == 0 ) continue;
+		n++;
+
+		get_indices(refl, &h, &k, &l);
+		refl2 = find_refl(b, h, k, l);
+		if ( refl2 == NULL ) {
+			ERROR("%i %i %i is missing\n", h, k, l);
+			fail = 1;
+			continue;
+		}
+
+		ph = get_phase(refl, &have_phase);
+		ph2 = get_phase(refl2, &have_phase2);
+
+		if ( (get_intensity(refl) != get_intensity(refl2))
+		  || (get_esd_intensity(refl) != get_esd_intensity(refl2))
+		  || (get_redundancy(refl) != get_redundancy(refl2))
+		  || (have_phase != have_phase2)
+		  || (have_phase && (ph != ph2)) )
+		{
+			ERROR("%i %i %i is different\n", h, k, l);
+			fail = 1;
+		}
+	}
+
+	if ( n != num_reflections(b) ) {
+		ERROR("Wrong number of reflections: %i instead of %i\n",
+		      num_reflections(b), n);
+		fail = 1;
+	}
+
+	if ( strcmp(reflist_get_notes(a), reflist_get_notes(b)) != 0 ) {
+		ERROR("Notes are different: '%s'\n", reflist_get_notes(b));
+		fail = 1;
+	}
+
+	return fail;
+}
+
+
+int main(int argc, char *argv[])
+{
+	gsl_rng *rng;
+	RefList *list;
+	RefList *list2;
+	SymOpList *sym;
+	UnitCell *cell;
+	UnitCell *cell2 = NULL;
+	char *sym_str = NULL;
+	double a, b, c, al, be, ga;
+	int fail = 0;
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	list = make_list(rng);
+	gsl_rng_free(rng);
+
+	sym = get_pointgroup("2/m_uab");
+	cell = cell_new_from_parameters(5.1e-9, 6.2e-9, 7.3e-9,
+	                                deg2rad(90.0), deg2rad(101.5),
+	                                deg2rad(90.0));
+	cell_set_lattice_type(cell, L_MONOCLINIC);
+	cell_set_centering(cell, 'C');
+	cell_set_unique_axis(cell, 'b');
+
+	/* With symmetry and unit cell */
+	if ( write_reflist_binary("reflist_binary_check.hklb", list,
+	                          sym, cell) )
+	{
+		ERROR("Failed to write binary reflection list\n");
+		return 1;
+	}
+
+	list2 = read_reflections_3("reflist_binary_check.hklb",
+	                           &sym_str, &cell2);
+	if ( list2 == NULL ) {
+		ERROR("Failed to read binary reflection list\n");
+		return 1;
+	}
+	fail |= compare_lists(list, list2);
+	reflist_free(list2);
+
+	if ( (sym_str == NULL) || (strcmp(sym_str, "2/m_uab") != 0) ) {
+		ERROR("Wrong symmetry: %s\n", sym_str);
+		fail = 1;
+	}
+	free(sym_str);
+
+	if ( cell2 == NULL ) {
+		ERROR("Unit cell not read\n");
+		fail = 1;
+	} else {
+		cell_get_parameters(cell2, &a, &b, &c, &al, &be, &ga);
+		if ( (fabs(a - 5.1e-9) > 1e-15) || (fabs(b - 6.2e-9) > 1e-15)
+		  || (fabs(c - 7.3e-9) > 1e-15)
+		  || (fabs(be - deg2rad(101.5)) > 1e-9)
+		  || (cell_get_lattice_type(cell2) != L_MONOCLINIC)
+		  || (cell_get_centering(cell2) != 'C')
+		  || (cell_get_unique_axis(cell2) != 'b') )
+		{
+			ERROR("Unit cell is different\n");
+			cell_print(cell2);
+			fail = 1;
+		}
+		cell_free(cell2);
+	}
+
+	/* Without either, and read back via the usual route */
+	if ( write_reflist_binary("reflist_binary_check.hklb", list,
+	                          NULL, NULL) )
+	{
+		ERROR("Failed to write binary reflection list\n");
+		return 1;
+	}
+
+	list2 = read_reflections_2("reflist_binary_check.hklb", &sym_str);
+	if ( list2 == NULL ) {
+		ERROR("Failed to read binary reflection list\n");
+		return 1;
+	}
+	fail |= compare_lists(list, list2);
+	reflist_free(list2);
+	if ( strcmp(sym_str, "unknown") != 0 ) {
+		ERROR("Wrong symmetry: %s\n", sym_str);
+		fail = 1;
+	}
+	free(sym_str);
+
+	/* Truncated file must be rejected, not read past the end */
+	if ( truncate("reflist_binary_check.hklb", N_REFLS*10) ) {
+		ERROR("Failed to truncate binary reflection list\n");
+		return 1;
+	}
+	list2 = read_reflections("reflist_binary_check.hklb");
+	if ( list2 != NULL ) {
+		ERROR("Truncated binary reflection list was accepted\n");
+		reflist_free(list2);
+		fail = 1;
+	}
+
+	/* Empty list */
+	list2 = reflist_new();
+	reflist_add_notes(list2, "Nothing here");
+	write_reflist_binary("reflist_binary_check.hklb", list2, sym, NULL);
+	reflist_free(list2);
+	list2 = read_reflections("reflist_binary_check.hklb");
+	if ( (list2 == NULL) || (num_reflections(list2) != 0) ) {
+		ERROR("Failed to read empty binary reflection list\n");
+		fail = 1;
+	}
+	reflist_free(list2);
+
+	/* The text format must still be recognised */
+	write_reflist_2("reflist_binary_check.hkl", list, sym);
+	list2 = read_reflections("reflist_binary_check.hkl");
+	if ( (list2 == NULL) || (num_reflections(list2) == 0) ) {
+		ERROR("Failed to read text reflection list\n");
+		fail = 1;
+	}
+	reflist_free(list2);
+
+	unlink("reflist_binary_check.hklb");
+	unlink("reflist_binary_check.hkl");
+	reflist_free(list);
+	free_symoplist(sym);
+	cell_free(cell);
+
+	if ( !fail ) STATUS("Binary reflection lists are OK.\n");
+
+	return fail;
+}
@@ -0,0 +1,171 @@
+/*
+ * stream_cells_check.c
+ *
+ * Check that the cell list written alongside a stream can be read back
+ *
+ * Copyright © 2023 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <image.h>
+#include <stream.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <crystal.h>
+#include <utils.h>
+
+#define STREAM_FILENAME "stream_cells_check.stream"
+
+
+static void touch_stream(const char *text)
+{
+	FILE *fh = fopen(STREAM_FILENAME, "a");
+	fputs(text, fh);
+	fclose(fh);
+}
+
+
+static void free_cells(UnitCell **cells, IndexingMethod *indms, int n)
+{
+	int i;
+	for ( i=0; i<n; i++ ) cell_free(cells[i]);
+	free(cells);
+	free(indms);
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct image image;
+	Crystal *crystals[2];
+	UnitCell *cell;
+	UnitCell **cells;
+	IndexingMethod *indms;
+	int n_cells, n_chunks;
+	double a, b, c, al, be, ga;
+	unsigned char buf[3*STREAM_CELLS_RECORD_SIZE];
+	char *fn;
+	int fd;
+	int n;
+	int fail = 0;
+
+	unlink(STREAM_FILENAME);
+	touch_stream("Not really a stream\n");
+
+	cell = cell_new_from_parameters(5.1e-9, 6.2e-9, 7.3e-9,
+	                                deg2rad(90.0), deg2rad(101.5),
+	                                deg2rad(90.0));
+	cell_set_lattice_type(cell, L_MONOCLINIC);
+	cell_set_centering(cell, 'C');
+	cell_set_unique_axis(cell, 'b');
+
+	crystals[0] = crystal_new();
+	crystal_set_cell(crystals[0], cell);
+	crystals[1] = crystal_new();
+	crystal_set_cell(crystals[1], cell_new_from_cell(cell));
+	image.crystals = crystals;
+	image.indexed_by = INDEXING_MOSFLM | INDEXING_USE_LATTICE_TYPE;
+
+	fd = stream_cells_open_for_write(STREAM_FILENAME);
+	if ( fd < 0 ) {
+		ERROR("Failed to open cell list\n");
+		return 1;
+	}
+
+	/* One chunk with two crystals, one without any */
+	image.n_crystals = 2;
+	n = stream_cells_pack(&image, buf, 3);
+	fail |= stream_cells_write(fd, buf, n);
+	image.n_crystals = 0;
+	n = stream_cells_pack(&image, buf, 3);
+	fail |= stream_cells_write(fd, buf, n);
+
+	/* Must not be used before it's complete */
+	if ( stream_cells_read(STREAM_FILENAME, &cells, &indms,
+	                       &n_cells, &n_chunks) == 0 )
+	{
+		ERROR("Incomplete cell list was accepted\n");
+		free_cells(cells, indms, n_cells);
+		fail = 1;
+	}
+
+	fail |= stream_cells_finish(fd, STREAM_FILENAME);
+
+	if ( stream_cells_read(STREAM_FILENAME, &cells, &indms,
+	                       &n_cells, &n_chunks) )
+	{
+		ERROR("Failed to read cell list\n");
+		fail = 1;
+	} else {
+		if ( (n_cells != 2) || (n_chunks != 2) ) {
+			ERROR("Wrong numbers: %i cells, %i chunks\n",
+			      n_cells, n_chunks);
+			fail = 1;
+		}
+		if ( n_cells > 1 ) {
+			cell_get_parameters(cells[1], &a, &b, &c,
+			                    &al, &be, &ga);
+			if ( (fabs(a - 5.1e-9) > 1e-15)
+			  || (fabs(c - 7.3e-9) > 1e-15)
+			  || (fabs(be - deg2rad(101.5)) > 1e-9)
+			  || (cell_get_lattice_type(cells[1]) != L_MONOCLINIC)
+			  || (cell_get_centering(cells[1]) != 'C')
+			  || (cell_get_unique_axis(cells[1]) != 'b')
+			  || (indms[1] != image.indexed_by) )
+			{
+				ERROR("Unit cell is different\n");
+				fail = 1;
+			}
+		}
+		free_cells(cells, indms, n_cells);
+	}
+
+	/* Not enough space for the crystals */
+	image.n_crystals = 2;
+	if ( stream_cells_pack(&image, buf, 2) != -1 ) {
+		ERROR("Records did not fit, but no error\n");
+		fail = 1;
+	}
+
+	/* Must not be used after the stream has changed */
+	touch_stream("More stuff\n");
+	if ( stream_cells_read(STREAM_FILENAME, &cells, &indms,
+	                       &n_cells, &n_chunks) == 0 )
+	{
+		ERROR("Out of date cell list was accepted\n");
+		free_cells(cells, indms, n_cells);
+		fail = 1;
+	}
+
+	fn = stream_cells_filename(STREAM_FILENAME);
+	unlink(fn);
+	free(fn);
+	unlink(STREAM_FILENAME);
+	crystal_free(crystals[0]);
+	crystal_free(crystals[1]);
+
+	if ( !fail ) STATUS("Cell lists are OK.\n");
+
+	return fail;
+}